@@ -14,10 +14,28 @@
 
 #include "enma_config.h"
 #include "sidfpolicy.h"
+#include "dnscache.h"
+#include "dnsshmcache.h"
+#include "dnsresolvpool.h"
+#include "sidfrecordcache.h"
+#include "sidfresultcache.h"
+#include "sidfrequestpool.h"
+#include "freelist.h"
+#include "enma_worker.h"
 
 #define ENMA_MILTER_NAME "enma"
 
 extern EnmaConfig *g_enma_config;
 extern SidfPolicy *g_sidf_policy;
+extern DnsCache *g_dns_cache;
+extern DnsShmCache *g_dns_shm_cache;
+extern DnsResolverPool *g_dns_resolver_pool;
+extern DnsRefresher *g_dns_refresher;
+extern SidfRecordCache *g_sidf_record_cache;
+extern SidfResultCache *g_sidf_result_cache;
+extern SidfRequestPool *g_sidf_request_pool;
+extern FreeList *g_enma_mfi_ctx_pool;
+extern EnmaWorkerPool *g_enma_worker_pool;
+extern EnmaWorkerPool *g_enma_spf_early_pool;
 
 #endif
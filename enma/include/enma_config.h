@@ -35,9 +35,29 @@ typedef struct EnmaConfig {
     // authresult
     int spf_auth;               //boolean
     int spf_explog;             //boolean
+    int spf_early;              //boolean
+    int spf_prefetch;
+    int spf_timeout;
     int sidf_auth;              //boolean
     int sidf_explog;            //boolean
     const char *authresult_identifier;
+    // dnscache
+    int dnscache_memory;
+    int dnscache_grace;
+    int dnscache_negative_ttl;
+    const char *dnscache_snapshot_file;
+    int dnscache_snapshot_interval;
+    const char *dnscache_shm_name;
+    int dnscache_shm_memory;
+    int dnscache_records;
+    int dnscache_flatten_include;   //boolean
+    int dnscache_results;
+    // worker
+    int worker_threads;
+    int worker_queue;
+    int worker_overflow_tempfail;   //boolean
+    int worker_early_threads;
+    int worker_early_queue;
 } EnmaConfig;
 
 extern bool EnmaConfig_setConfig(EnmaConfig *self, int argc, char **argv);
@@ -18,11 +18,13 @@
 
 #include "intarray.h"
 #include "inetmailbox.h"
-#include "mailheaders.h"
+#include "memarena.h"
+#include "sidfpra.h"
 #include "dnsresolv.h"
 #include "sidf.h"
 #include "sidfrequest.h"
 #include "authresult.h"
+#include "enma_sidf.h"
 
 typedef struct EnmaMfiCtx {
     // for connections
@@ -32,11 +34,13 @@ typedef struct EnmaMfiCtx {
     _SOCK_ADDR *hostaddr;
     DnsResolver *resolver;
     // for message
+    MemArena *arena;            // メッセージ毎の値を切り出し, EnmaMfiCtx_reset() でまとめて破棄する
     char *raw_envfrom;
     char *qid;
     InetMailbox *envfrom;
-    MailHeaders *headers;
+    SidfPraScanner *pra_scanner;
     AuthResult *authresult;
+    EnmaSpfEarly *spf_early;    // MAIL FROM で開始した SPF 評価, 開始していなければ NULL
     // Authentication-Results ヘッダを削るためのメンバ
     int authhdr_count;          // 遭遇した Authentication-Results ヘッダの数
     IntArray *delauthhdr;       // 何個目の Authentication-Results ヘッダを削るか
@@ -45,5 +49,7 @@ typedef struct EnmaMfiCtx {
 extern EnmaMfiCtx *EnmaMfiCtx_new(void);
 extern void EnmaMfiCtx_reset(EnmaMfiCtx *self);
 extern void EnmaMfiCtx_free(EnmaMfiCtx *self);
+extern EnmaMfiCtx *EnmaMfiCtx_acquire(void);
+extern void EnmaMfiCtx_release(EnmaMfiCtx *self);
 
 #endif
@@ -16,17 +16,37 @@
 #include <sys/socket.h>
 
 #include "inetmailbox.h"
-#include "mailheaders.h"
+#include "sidfpra.h"
 #include "dnsresolv.h"
+#include "dnsresolvpool.h"
+#include "dnscache.h"
 #include "sidfpolicy.h"
+#include "sidfrequestpool.h"
 #include "authresult.h"
 
-extern bool EnmaSpf_evaluate(SidfPolicy *policy, DnsResolver *resolver, AuthResult *authresult,
+#include "enma_worker.h"
+
+struct EnmaSpfEarly;
+typedef struct EnmaSpfEarly EnmaSpfEarly;
+
+extern bool EnmaSpf_evaluate(SidfPolicy *policy, SidfRequestPool *request_pool,
+                             DnsResolver *resolver, AuthResult *authresult,
                              const struct sockaddr *hostaddr, const char *ipaddr,
                              const char *helohost, const char *raw_envfrom,
                              const InetMailbox *envfrom, bool explog);
-extern bool EnmaSidf_evaluate(SidfPolicy *policy, DnsResolver *resolver, AuthResult *authresult,
+extern EnmaSpfEarly *EnmaSpf_start(EnmaWorkerPool *worker_pool, SidfPolicy *policy,
+                                   SidfRequestPool *request_pool, DnsResolverPool *resolver_pool,
+                                   DnsCache *cache, const struct sockaddr *hostaddr,
+                                   const char *helohost, const InetMailbox *envfrom,
+                                   const char *qid);
+extern bool EnmaSpf_collect(EnmaSpfEarly *self, DnsResolver **resolver, AuthResult *authresult,
+                            const char *ipaddr, const char *helohost, const char *raw_envfrom,
+                            const InetMailbox *envfrom, bool explog);
+extern void EnmaSpf_discard(EnmaSpfEarly *self);
+extern bool EnmaSidf_evaluate(SidfPolicy *policy, SidfRequestPool *request_pool,
+                              DnsResolver *resolver, AuthResult *authresult,
                               const struct sockaddr *hostaddr, const char *ipaddr,
-                              const char *helohost, const MailHeaders *headers, bool explog);
+                              const char *helohost, const SidfPraScanner *pra_scanner,
+                              bool explog);
 
 #endif
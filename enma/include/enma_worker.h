@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __ENMA_WORKER_H__
+#define __ENMA_WORKER_H__
+
+#include <stdbool.h>
+
+struct EnmaWorkerPool;
+typedef struct EnmaWorkerPool EnmaWorkerPool;
+
+typedef void (*EnmaWorkerFunc) (void *arg);
+
+/**
+ * ワーカースレッドに渡す仕事. 呼び出し側で確保し, EnmaWorkerPool_wait() が戻るまで,
+ * または EnmaWorkerPool_detach() で切り離すまで保持すること.
+ */
+typedef struct EnmaWorkerJob {
+    EnmaWorkerFunc func;
+    void *arg;
+    EnmaWorkerFunc release;     // 切り離した仕事の後始末, 切り離していなければ NULL
+    bool done;                  // EnmaWorkerPool のロックで保護する
+} EnmaWorkerJob;
+
+extern EnmaWorkerPool *EnmaWorkerPool_new(unsigned int thread_num, unsigned int queue_size);
+extern void EnmaWorkerPool_free(EnmaWorkerPool *self);
+extern bool EnmaWorkerPool_submit(EnmaWorkerPool *self, EnmaWorkerJob *job, EnmaWorkerFunc func,
+                                  void *arg);
+extern void EnmaWorkerPool_wait(EnmaWorkerPool *self, EnmaWorkerJob *job);
+extern bool EnmaWorkerPool_detach(EnmaWorkerPool *self, EnmaWorkerJob *job,
+                                  EnmaWorkerFunc release);
+
+#endif
@@ -16,16 +16,30 @@ RCSID("$Id: enma.c 160 2008-07-07 08:33:00Z takahiko $");
 #include <assert.h>
 #include <sysexits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <syslog.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <libmilter/mfapi.h>
 
 #include "loghandler.h"
 #include "sidfpolicy.h"
+#include "dnscache.h"
+#include "dnsshmcache.h"
+#include "dnsresolvpool.h"
+#include "sidfrecordcache.h"
+#include "sidfresultcache.h"
+#include "sidfrequestpool.h"
+#include "freelist.h"
 
 #include "consolehandler.h"
 #include "enma_config.h"
 #include "enma_mfi.h"
+#include "enma_mfi_ctx.h"
+#include "enma_worker.h"
 #include "daemonize.h"
 #include "enma.h"
 
@@ -33,6 +47,27 @@ RCSID("$Id: enma.c 160 2008-07-07 08:33:00Z takahiko $");
 // グローバル変数を定義
 SidfPolicy *g_sidf_policy = NULL;   // sidfのポリシーオブジェクトの記憶
 EnmaConfig *g_enma_config = NULL;   // enmaの設定情報を記憶
+DnsCache *g_dns_cache = NULL;   // スレッド間で共有するDNSキャッシュ
+DnsShmCache *g_dns_shm_cache = NULL;    // 同じホストの他のenmaプロセスと共有するDNSキャッシュ
+DnsResolverPool *g_dns_resolver_pool = NULL;    // コネクション間で使い回すDNSリゾルバ
+DnsRefresher *g_dns_refresher = NULL;   // 期限切れのDNSキャッシュを更新するスレッド
+SidfRecordCache *g_sidf_record_cache = NULL;    // スレッド間で共有するパース済みSPFレコードのキャッシュ
+SidfResultCache *g_sidf_result_cache = NULL;    // スレッド間で共有するSPF/SIDFの評価結果のキャッシュ
+SidfRequestPool *g_sidf_request_pool = NULL;    // 評価間で使い回すSidfRequest
+FreeList *g_enma_mfi_ctx_pool = NULL;   // コネクション間で使い回すEnmaMfiCtx
+EnmaWorkerPool *g_enma_worker_pool = NULL;  // EOMでのSPF/SIDFの評価を受け持つスレッド, 無効の場合はNULL
+EnmaWorkerPool *g_enma_spf_early_pool = NULL;   // MAIL FROMで開始したSPFの評価を受け持つスレッド, 無効の場合はNULL
+
+// プールに保持するオブジェクトの最大数, これを越えて返却されたものは解放する
+#define ENMA_SIDF_REQUEST_POOL_CAPACITY 256
+#define ENMA_MFI_CTX_POOL_CAPACITY 256
+
+// DNSキャッシュのスナップショットを定期的に書き出すスレッド
+static pthread_t g_snapshot_thread;
+static bool g_snapshot_running = false;
+static bool g_snapshot_stopped = false;
+static pthread_mutex_t g_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_snapshot_cond = PTHREAD_COND_INITIALIZER;
 
 
 /**
@@ -88,6 +123,12 @@ sidf_init(void)
     }
     g_sidf_policy->lookup_spf_rr = false;
     g_sidf_policy->lookup_exp = false;
+    if (0 < g_enma_config->spf_prefetch) {
+        g_sidf_policy->prefetch_directives = (unsigned int) g_enma_config->spf_prefetch;
+    }
+    if (0 < g_enma_config->spf_timeout) {
+        g_sidf_policy->eval_timeout = (unsigned int) g_enma_config->spf_timeout;
+    }
 
     if (SIDF_STAT_OK !=
         SidfPolicy_setCheckingDomain(g_sidf_policy, g_enma_config->authresult_identifier)) {
@@ -98,6 +139,295 @@ sidf_init(void)
 }
 
 
+/**
+ * DNSキャッシュのスナップショットを読み書きするか
+ * 
+ * @return
+ */
+static bool
+dnscache_snapshot_enabled(void)
+{
+    return NULL != g_dns_cache && NULL != g_enma_config->dnscache_snapshot_file
+        && '\0' != g_enma_config->dnscache_snapshot_file[0];
+}
+
+
+/**
+ * DNSキャッシュの初期化
+ * 
+ * @return
+ */
+static int
+dnscache_init(void)
+{
+    g_dns_resolver_pool = DnsResolverPool_new();
+    if (NULL == g_dns_resolver_pool) {
+        return EX_OSERR;
+    }
+
+    // 0 以下の場合はキャッシュを使わない
+    if (0 < g_enma_config->dnscache_memory) {
+        g_dns_cache = DnsCache_new((size_t) g_enma_config->dnscache_memory * 1024 * 1024);
+        if (NULL == g_dns_cache) {
+            return EX_OSERR;
+        }
+        // 共有メモリ上のキャッシュは fork 後の子プロセスにも引き継がれる
+        if (NULL != g_enma_config->dnscache_shm_name
+            && '\0' != g_enma_config->dnscache_shm_name[0]
+            && 0 < g_enma_config->dnscache_shm_memory) {
+            g_dns_shm_cache =
+                DnsShmCache_open(g_enma_config->dnscache_shm_name,
+                                 (size_t) g_enma_config->dnscache_shm_memory * 1024 * 1024);
+            if (NULL == g_dns_shm_cache) {
+                LogError("DnsShmCache_open failed: name=%s, error=%s",
+                         g_enma_config->dnscache_shm_name, strerror(errno));
+                return EX_OSERR;
+            }
+            DnsCache_setShared(g_dns_cache, g_dns_shm_cache);
+        }
+        // 猶予期間中は期限切れの応答を返しつつ裏で更新する
+        if (0 < g_enma_config->dnscache_grace) {
+            DnsCache_setGrace(g_dns_cache, (unsigned long) g_enma_config->dnscache_grace);
+        }
+        // 指定された場合のみ, SOA を含まない否定応答も短い期間だけキャッシュする
+        if (0 <= g_enma_config->dnscache_negative_ttl) {
+            DnsCache_setNegativeTtl(g_dns_cache,
+                                    (unsigned long) g_enma_config->dnscache_negative_ttl);
+        }
+    }
+
+    if (0 < g_enma_config->dnscache_records) {
+        g_sidf_record_cache = SidfRecordCache_new((size_t) g_enma_config->dnscache_records);
+        if (NULL == g_sidf_record_cache) {
+            return EX_OSERR;
+        }
+        g_sidf_policy->record_cache = g_sidf_record_cache;
+        g_sidf_policy->flatten_include = g_enma_config->dnscache_flatten_include;
+    }
+
+    if (0 < g_enma_config->dnscache_results) {
+        g_sidf_result_cache = SidfResultCache_new((size_t) g_enma_config->dnscache_results);
+        if (NULL == g_sidf_result_cache) {
+            return EX_OSERR;
+        }
+        g_sidf_policy->result_cache = g_sidf_result_cache;
+    }
+
+    return 0;
+}
+
+
+/**
+ * コネクションのコンテキストとSidfRequestを使い回すプールの初期化
+ * 
+ * @return
+ */
+static int
+pool_init(void)
+{
+    g_sidf_request_pool = SidfRequestPool_new(ENMA_SIDF_REQUEST_POOL_CAPACITY);
+    if (NULL == g_sidf_request_pool) {
+        return EX_OSERR;
+    }
+    g_enma_mfi_ctx_pool = FreeList_new(ENMA_MFI_CTX_POOL_CAPACITY);
+    if (NULL == g_enma_mfi_ctx_pool) {
+        return EX_OSERR;
+    }
+    return 0;
+}
+
+
+/**
+ * プールに残っているオブジェクトの解放
+ * EnmaMfiCtx は DNS リゾルバを返却するので, DnsResolverPool より先に解放すること
+ */
+static void
+pool_cleanup(void)
+{
+    if (NULL != g_enma_mfi_ctx_pool) {
+        EnmaMfiCtx *enma_mfi_ctx;
+        while (NULL != (enma_mfi_ctx = (EnmaMfiCtx *) FreeList_pop(g_enma_mfi_ctx_pool))) {
+            EnmaMfiCtx_free(enma_mfi_ctx);
+        }
+        FreeList_free(g_enma_mfi_ctx_pool);
+        g_enma_mfi_ctx_pool = NULL;
+    }
+    SidfRequestPool_free(g_sidf_request_pool);
+    g_sidf_request_pool = NULL;
+}
+
+
+/**
+ * 評価を受け持つワーカースレッドの起動
+ * fork するとスレッドは引き継がれないので, daemonize_init の後に呼ぶこと
+ * MAIL FROM で開始した SPF の評価は EOM の評価から待たれるので, 同じスレッドで処理すると
+ * 待ち合わせで詰まる. 別のワーカープールで受け持つ.
+ * 
+ * @return
+ */
+static int
+worker_start(void)
+{
+    if (g_enma_config->spf_auth && g_enma_config->spf_early) {
+        if (g_enma_config->worker_early_threads <= 0 || g_enma_config->worker_early_queue <= 0) {
+            LogError
+                ("worker.early_threads and worker.early_queue must be positive: worker.early_threads=%d, worker.early_queue=%d",
+                 g_enma_config->worker_early_threads, g_enma_config->worker_early_queue);
+            return EX_CONFIG;
+        }
+        g_enma_spf_early_pool =
+            EnmaWorkerPool_new((unsigned int) g_enma_config->worker_early_threads,
+                               (unsigned int) g_enma_config->worker_early_queue);
+        if (NULL == g_enma_spf_early_pool) {
+            return EX_OSERR;
+        }
+    }
+    // 0 以下の場合は libmilter のスレッドで評価する
+    if (g_enma_config->worker_threads <= 0) {
+        return 0;
+    }
+    if (g_enma_config->worker_queue <= 0) {
+        LogError("worker.queue must be positive: worker.queue=%d", g_enma_config->worker_queue);
+        return EX_CONFIG;
+    }
+    g_enma_worker_pool =
+        EnmaWorkerPool_new((unsigned int) g_enma_config->worker_threads,
+                           (unsigned int) g_enma_config->worker_queue);
+    if (NULL == g_enma_worker_pool) {
+        return EX_OSERR;
+    }
+    return 0;
+}
+
+
+/**
+ * ワーカースレッドの停止
+ * 待ち行列に残っている評価は済ませてから停止する
+ */
+static void
+worker_stop(void)
+{
+    EnmaWorkerPool_free(g_enma_worker_pool);
+    g_enma_worker_pool = NULL;
+    // EOM の評価が MAIL FROM で開始した評価を待つことがあるので, 後に止める
+    EnmaWorkerPool_free(g_enma_spf_early_pool);
+    g_enma_spf_early_pool = NULL;
+}
+
+
+/**
+ * DNSキャッシュのスナップショットの書き出し
+ */
+static void
+dnscache_save(void)
+{
+    long entry_num = DnsCache_save(g_dns_cache, g_enma_config->dnscache_snapshot_file);
+    if (0 <= entry_num) {
+        LogDebug("DNS cache snapshot saved: file=%s, entries=%ld",
+                 g_enma_config->dnscache_snapshot_file, entry_num);
+    } else {
+        LogWarning("DNS cache snapshot save failed: file=%s, error=%s",
+                   g_enma_config->dnscache_snapshot_file, strerror(errno));
+    }
+}
+
+
+/**
+ * dnscache.snapshot_interval 毎にスナップショットを書き出すスレッドのメインループ
+ * 
+ * @param arg
+ * @return
+ */
+static void *
+dnscache_snapshot_main(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&g_snapshot_lock);
+    while (!g_snapshot_stopped) {
+        struct timespec deadline;
+        deadline.tv_sec = time(NULL) + g_enma_config->dnscache_snapshot_interval;
+        deadline.tv_nsec = 0;
+        while (!g_snapshot_stopped
+               && ETIMEDOUT != pthread_cond_timedwait(&g_snapshot_cond, &g_snapshot_lock,
+                                                      &deadline));
+        if (g_snapshot_stopped) {
+            break;
+        }
+        pthread_mutex_unlock(&g_snapshot_lock);
+        dnscache_save();
+        pthread_mutex_lock(&g_snapshot_lock);
+    }
+    pthread_mutex_unlock(&g_snapshot_lock);
+    return NULL;
+}
+
+
+/**
+ * DNSキャッシュを扱うスレッドの起動
+ * fork するとスレッドは引き継がれないので, デーモン化した後に呼ぶこと
+ * 
+ * @return
+ */
+static int
+dnscache_start(void)
+{
+    // 前回の終了時に書き出したスナップショットがあれば読み込む.
+    // 書き出しと同じユーザーで所有者を確かめるよう, setuid した後に読み込む
+    if (dnscache_snapshot_enabled()) {
+        long entry_num = DnsCache_load(g_dns_cache, g_enma_config->dnscache_snapshot_file);
+        if (0 <= entry_num) {
+            LogInfo("DNS cache snapshot loaded: file=%s, entries=%ld",
+                    g_enma_config->dnscache_snapshot_file, entry_num);
+        } else if (ENOENT != errno) {
+            LogWarning("DNS cache snapshot load failed: file=%s, error=%s",
+                       g_enma_config->dnscache_snapshot_file, strerror(errno));
+        }
+    }
+
+    if (NULL != g_dns_cache && 0 < g_enma_config->dnscache_grace) {
+        g_dns_refresher = DnsRefresher_start(g_dns_cache);
+        if (NULL == g_dns_refresher) {
+            return EX_OSERR;
+        }
+    }
+
+    if (dnscache_snapshot_enabled() && 0 < g_enma_config->dnscache_snapshot_interval) {
+        int ret = pthread_create(&g_snapshot_thread, NULL, dnscache_snapshot_main, NULL);
+        if (0 != ret) {
+            LogError("pthread_create failed: error=%s", strerror(ret));
+            return EX_OSERR;
+        }
+        g_snapshot_running = true;
+    }
+
+    return 0;
+}
+
+
+/**
+ * DNSキャッシュを扱うスレッドの停止
+ * スナップショットの書き出しが有効なら, 最後にもう一度書き出す
+ */
+static void
+dnscache_stop(void)
+{
+    if (g_snapshot_running) {
+        pthread_mutex_lock(&g_snapshot_lock);
+        g_snapshot_stopped = true;
+        pthread_cond_signal(&g_snapshot_cond);
+        pthread_mutex_unlock(&g_snapshot_lock);
+        (void) pthread_join(g_snapshot_thread, NULL);
+        g_snapshot_running = false;
+    }
+    DnsRefresher_stop(g_dns_refresher);
+    g_dns_refresher = NULL;
+
+    if (dnscache_snapshot_enabled()) {
+        dnscache_save();
+    }
+}
+
+
 /**
  * メイン
  * 
@@ -124,6 +454,16 @@ main(int argc, char **argv)
         ConsoleError("enma starting up failed: error=sidf_init failed");
         exit(result);
     }
+    // DNSキャッシュを初期化
+    if (0 != (result = dnscache_init())) {
+        ConsoleError("enma starting up failed: error=dnscache_init failed");
+        exit(result);
+    }
+    // プールを初期化
+    if (0 != (result = pool_init())) {
+        ConsoleError("enma starting up failed: error=pool_init failed");
+        exit(result);
+    }
     // milterを初期化
     if (!EnmaMfi_init
         (g_enma_config->milter_socket, g_enma_config->milter_timeout,
@@ -139,16 +479,34 @@ main(int argc, char **argv)
         LogError("enma starting up failed: error=daemonize_init failed");
         exit(EX_OSERR);
     }
+    // DNSキャッシュを扱うスレッドを起動
+    if (0 != (result = dnscache_start())) {
+        LogError("enma starting up failed: error=dnscache_start failed");
+        exit(result);
+    }
+    // 評価を受け持つスレッドを起動
+    if (0 != (result = worker_start())) {
+        LogError("enma starting up failed: error=worker_start failed");
+        exit(result);
+    }
 
     LogInfo("enma starting up");
     int smfi_return_val = smfi_main();
     LogInfo("enma shutting down: result=%d", smfi_return_val);
+    worker_stop();
+    dnscache_stop();
 
     if (!daemonize_finally(g_enma_config->milter_pidfile)) {
         LogError("daemonize_finally failed");
         exit(EX_OSERR);
     }
 
+    pool_cleanup();
+    SidfResultCache_free(g_sidf_result_cache);
+    SidfRecordCache_free(g_sidf_record_cache);
+    DnsCache_free(g_dns_cache);
+    DnsShmCache_close(g_dns_shm_cache);
+    DnsResolverPool_free(g_dns_resolver_pool);
     SidfPolicy_free(g_sidf_policy);
     EnmaConfig_free(g_enma_config);
 
@@ -62,6 +62,12 @@ static ConfigEntry ConfigEntry_table[] = {
         "enable SPF authentication (true or false)"},
     {"spf.explog", CONFIGTYPE_BOOLEAN, "true", offsetof(EnmaConfig, spf_explog),
         "record explanation of SPF (true or false)"},
+    {"spf.early", CONFIGTYPE_BOOLEAN, "false", offsetof(EnmaConfig, spf_early),
+        "start SPF authentication at MAIL FROM and collect the result at end of message (true or false)"},
+    {"spf.prefetch", CONFIGTYPE_INTEGER, "0", offsetof(EnmaConfig, spf_prefetch),
+        "number of DNS-bound SPF/Sender ID mechanisms whose queries are sent ahead in parallel, 0 to disable"},
+    {"spf.timeout", CONFIGTYPE_INTEGER, "0", offsetof(EnmaConfig, spf_timeout),
+        "time limit of each SPF/Sender ID evaluation, after which the result is temperror, 0 for no limit (seconds)"},
     // sidf
     {"sidf.auth", CONFIGTYPE_BOOLEAN, "true", offsetof(EnmaConfig, sidf_auth),
         "enalbe SIDF authentication (true or false)"},
@@ -70,6 +76,38 @@ static ConfigEntry ConfigEntry_table[] = {
     // authresult
     {"authresult.identifier", CONFIGTYPE_STRING, "localhost", offsetof(EnmaConfig, authresult_identifier),
         "identifier of Authentication-Results header"},
+    // dnscache
+    {"dnscache.memory", CONFIGTYPE_INTEGER, "16", offsetof(EnmaConfig, dnscache_memory),
+        "memory limit of DNS answer cache shared among threads, 0 to disable (megabytes)"},
+    {"dnscache.grace", CONFIGTYPE_INTEGER, "0", offsetof(EnmaConfig, dnscache_grace),
+        "period to keep serving expired DNS answers while they are refreshed in background, 0 to disable (seconds)"},
+    {"dnscache.negative_ttl", CONFIGTYPE_INTEGER, "0", offsetof(EnmaConfig, dnscache_negative_ttl),
+        "period to cache negative DNS answers without SOA record, 0 to disable (seconds)"},
+    {"dnscache.snapshot_file", CONFIGTYPE_STRING, NULL, offsetof(EnmaConfig, dnscache_snapshot_file),
+        "file to save DNS answer cache at shutdown and load at startup, empty to disable (filename)"},
+    {"dnscache.snapshot_interval", CONFIGTYPE_INTEGER, "0", offsetof(EnmaConfig, dnscache_snapshot_interval),
+        "interval to save DNS answer cache snapshot while running, 0 to save only at shutdown (seconds)"},
+    {"dnscache.shm_name", CONFIGTYPE_STRING, NULL, offsetof(EnmaConfig, dnscache_shm_name),
+        "name of POSIX shared memory to share DNS answers among enma processes on the host, empty to disable (e.g. /enma-dnscache)"},
+    {"dnscache.shm_memory", CONFIGTYPE_INTEGER, "16", offsetof(EnmaConfig, dnscache_shm_memory),
+        "size of POSIX shared memory created for dnscache.shm_name (megabytes)"},
+    {"dnscache.records", CONFIGTYPE_INTEGER, "1024", offsetof(EnmaConfig, dnscache_records),
+        "number of parsed SPF/Sender ID records cached for the DNS TTL, 0 to disable"},
+    {"dnscache.flatten_include", CONFIGTYPE_BOOLEAN, "false", offsetof(EnmaConfig, dnscache_flatten_include),
+        "evaluate macro-free include trees in memory using cached records (true or false)"},
+    {"dnscache.results", CONFIGTYPE_INTEGER, "0", offsetof(EnmaConfig, dnscache_results),
+        "number of SPF/Sender ID results cached per client address and domain, 0 to disable"},
+    // worker
+    {"worker.threads", CONFIGTYPE_INTEGER, "0", offsetof(EnmaConfig, worker_threads),
+        "number of threads evaluating SPF/Sender ID at end of message, 0 to evaluate in libmilter threads"},
+    {"worker.queue", CONFIGTYPE_INTEGER, "64", offsetof(EnmaConfig, worker_queue),
+        "number of messages allowed to wait for a worker thread"},
+    {"worker.overflow_tempfail", CONFIGTYPE_BOOLEAN, "true", offsetof(EnmaConfig, worker_overflow_tempfail),
+        "tempfail messages arriving while the worker queue is full, false to pass them without Authentication-Results header (true or false)"},
+    {"worker.early_threads", CONFIGTYPE_INTEGER, "8", offsetof(EnmaConfig, worker_early_threads),
+        "number of threads evaluating SPF started at MAIL FROM (spf.early)"},
+    {"worker.early_queue", CONFIGTYPE_INTEGER, "64", offsetof(EnmaConfig, worker_early_queue),
+        "number of SPF evaluations started at MAIL FROM allowed to wait for a thread, the rest are evaluated at end of message"},
     {NULL, 0, NULL, 0, NULL}
 };
 
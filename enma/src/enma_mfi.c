@@ -31,9 +31,9 @@ RCSID("$Id$");
 #include "sidfpolicy.h"
 #include "sidfrequest.h"
 #include "sidfenum.h"
-#include "mailheaders.h"
 #include "intarray.h"
 #include "xskip.h"
+#include "memarena.h"
 #include "authresult.h"
 
 #include "enma.h"
@@ -41,6 +41,7 @@ RCSID("$Id$");
 #include "enma_config.h"
 #include "enma_sidf.h"
 #include "enma_mfi_ctx.h"
+#include "enma_worker.h"
 
 #define UNKNOWN_HOSTNAME "(unknown)"
 #define UNKNOWN_QID "(unknown)"
@@ -117,22 +118,34 @@ EnmaMfi_init(char *socket, int timeout, int loglevel)
  * @return 正常終了の場合は true, エラーが発生した場合は false.
  */
 static bool
-EnmaMfi_sidf_eom(const EnmaMfiCtx *enma_mfi_ctx, const SidfRecordScope scope)
+EnmaMfi_sidf_eom(EnmaMfiCtx *enma_mfi_ctx, const SidfRecordScope scope)
 {
     switch (scope) {
     case SIDF_RECORD_SCOPE_SPF1:
-        if (!EnmaSpf_evaluate
-            (g_sidf_policy, enma_mfi_ctx->resolver, enma_mfi_ctx->authresult,
-             enma_mfi_ctx->hostaddr, enma_mfi_ctx->ipaddr, enma_mfi_ctx->helohost,
-             enma_mfi_ctx->raw_envfrom, enma_mfi_ctx->envfrom, g_enma_config->spf_explog)) {
+        if (NULL != enma_mfi_ctx->spf_early) {
+            // MAIL FROM で開始した評価の結果を回収する
+            EnmaSpfEarly *spf_early = enma_mfi_ctx->spf_early;
+            enma_mfi_ctx->spf_early = NULL;
+            // SPF の評価で得た応答を SIDF の評価で使えるよう, resolver を入れ替える
+            if (!EnmaSpf_collect
+                (spf_early, &(enma_mfi_ctx->resolver), enma_mfi_ctx->authresult,
+                 enma_mfi_ctx->ipaddr, enma_mfi_ctx->helohost, enma_mfi_ctx->raw_envfrom,
+                 enma_mfi_ctx->envfrom, g_enma_config->spf_explog)) {
+                return false;
+            }
+        } else if (!EnmaSpf_evaluate
+            (g_sidf_policy, g_sidf_request_pool, enma_mfi_ctx->resolver,
+             enma_mfi_ctx->authresult, enma_mfi_ctx->hostaddr, enma_mfi_ctx->ipaddr,
+             enma_mfi_ctx->helohost, enma_mfi_ctx->raw_envfrom, enma_mfi_ctx->envfrom,
+             g_enma_config->spf_explog)) {
             return false;
         }
         break;
     case SIDF_RECORD_SCOPE_SPF2_PRA:
         if (!EnmaSidf_evaluate
-            (g_sidf_policy, enma_mfi_ctx->resolver, enma_mfi_ctx->authresult,
-             enma_mfi_ctx->hostaddr, enma_mfi_ctx->ipaddr, enma_mfi_ctx->helohost,
-             enma_mfi_ctx->headers, g_enma_config->sidf_explog)) {
+            (g_sidf_policy, g_sidf_request_pool, enma_mfi_ctx->resolver,
+             enma_mfi_ctx->authresult, enma_mfi_ctx->hostaddr, enma_mfi_ctx->ipaddr,
+             enma_mfi_ctx->helohost, enma_mfi_ctx->pra_scanner, g_enma_config->sidf_explog)) {
             return false;
         }
         break;
@@ -144,6 +157,52 @@ EnmaMfi_sidf_eom(const EnmaMfiCtx *enma_mfi_ctx, const SidfRecordScope scope)
 }
 
 
+/**
+ * 設定に従って SPF と SIDF の評価をおこない, 結果を Authentication-Results ヘッダに付加する.
+ * @return 正常終了の場合は true, エラーが発生した場合は false.
+ */
+static bool
+EnmaMfi_authenticate(EnmaMfiCtx *enma_mfi_ctx)
+{
+    // SPF
+    if (g_enma_config->spf_auth && !EnmaMfi_sidf_eom(enma_mfi_ctx, SIDF_RECORD_SCOPE_SPF1)) {
+        return false;
+    }
+    // SIDF
+    if (g_enma_config->sidf_auth && !EnmaMfi_sidf_eom(enma_mfi_ctx, SIDF_RECORD_SCOPE_SPF2_PRA)) {
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * ワーカースレッドに渡す評価の状態
+ */
+typedef struct EnmaMfiAuthJob {
+    EnmaWorkerJob worker;
+    EnmaMfiCtx *enma_mfi_ctx;
+    bool result;
+} EnmaMfiAuthJob;
+
+
+/**
+ * ワーカースレッドで EnmaMfi_authenticate() を呼び出す.
+ * 
+ * @param arg EnmaMfiAuthJob
+ */
+static void
+EnmaMfi_authenticateJob(void *arg)
+{
+    EnmaMfiAuthJob *job = (EnmaMfiAuthJob *) arg;
+
+    // ワーカースレッドのログにも qid を付ける
+    (void) LogHandler_setPrefix(job->enma_mfi_ctx->qid);
+    job->result = EnmaMfi_authenticate(job->enma_mfi_ctx);
+    (void) LogHandler_setPrefix(NULL);
+}
+
+
 /**
  * SMFI_TEMPFAIL時の処理
  */
@@ -300,13 +359,13 @@ ipaddrdup(const char *hostname, const _SOCK_ADDR *hostaddr)
 
 
 static char *
-qiddup(const char *qid)
+qiddup(MemArena *arena, const char *qid)
 {
     if (NULL == qid) {
         LogWarning("failed to get qid: set qid=%s", UNKNOWN_QID);
-        return strdup(UNKNOWN_QID);
+        return MemArena_strdup(arena, UNKNOWN_QID);
     } else {
-        return strdup(qid);
+        return MemArena_strdup(arena, qid);
     }
 }
 
@@ -316,7 +375,7 @@ EnmaMfi_set_qid(SMFICTX *ctx, EnmaMfiCtx *enma_mfi_ctx)
 {
     assert(NULL != enma_mfi_ctx);
 
-    enma_mfi_ctx->qid = qiddup(smfi_getsymval(ctx, "{i}"));
+    enma_mfi_ctx->qid = qiddup(enma_mfi_ctx->arena, smfi_getsymval(ctx, "{i}"));
     if (NULL == enma_mfi_ctx->qid) {
         LogError("qiddup failed: error=%s", strerror(errno));
         return false;
@@ -343,9 +402,9 @@ mfi_connect(SMFICTX *ctx, char *hostname, _SOCK_ADDR *hostaddr)
 {
     LogDebug("hostname=%s", NNSTR(hostname));
 
-    EnmaMfiCtx *enma_mfi_ctx = EnmaMfiCtx_new();
+    EnmaMfiCtx *enma_mfi_ctx = EnmaMfiCtx_acquire();
     if (NULL == enma_mfi_ctx) {
-        LogError("EnmaMfiCtx_new failed: hostname=%s, error=%s", NNSTR(hostname), strerror(errno));
+        LogError("EnmaMfiCtx_acquire failed: hostname=%s, error=%s", NNSTR(hostname), strerror(errno));
         return SMFIS_TEMPFAIL;
     }
     // hostname
@@ -435,32 +494,41 @@ mfi_envfrom(SMFICTX *ctx, char **argv)
         }
     }
     // envfrom を記憶
-    enma_mfi_ctx->raw_envfrom = strdup(envfrom);
+    enma_mfi_ctx->raw_envfrom = MemArena_strdup(enma_mfi_ctx->arena, envfrom);
     if (NULL == enma_mfi_ctx->raw_envfrom) {
-        LogError("strdup failed: error=%s", strerror(errno));
+        LogError("MemArena_strdup failed: error=%s", strerror(errno));
         return EnmaMfi_tempfail(enma_mfi_ctx);
     }
     char *mailaddr_tail = STRTAIL(enma_mfi_ctx->raw_envfrom);
     const char *nextp, *errptr;
     enma_mfi_ctx->envfrom =
-        InetMailbox_buildSendmailReversePath(enma_mfi_ctx->raw_envfrom, mailaddr_tail, &nextp,
-                                             &errptr);
+        InetMailbox_buildSendmailReversePathInArena(enma_mfi_ctx->arena,
+                                                    enma_mfi_ctx->raw_envfrom, mailaddr_tail,
+                                                    &nextp, &errptr);
     if (NULL != enma_mfi_ctx->envfrom) {
         XSkip_fws(nextp, mailaddr_tail, &nextp);
         if (nextp < mailaddr_tail) {
             LogNotice("envfrom=%s", enma_mfi_ctx->raw_envfrom);
-            InetMailbox_free(enma_mfi_ctx->envfrom);
+            // arena から切り出しているので解放しない
             enma_mfi_ctx->envfrom = NULL;
         }
     } else {
         // parse失敗
         if (NULL == errptr) {
-            LogError("InetMailbox_buildSendmailReversePath: error=%s", strerror(errno));
+            LogError("InetMailbox_buildSendmailReversePathInArena: error=%s", strerror(errno));
             return EnmaMfi_tempfail(enma_mfi_ctx);
         } else {
             LogNotice("parse failed: envfrom=%s", enma_mfi_ctx->raw_envfrom);
         }
     }
+    // 設定により SPF の評価をここで開始し, DNS の応答待ちをメッセージの転送と並行させる.
+    // 開始できなかった場合は EOM で評価する.
+    if (NULL != g_enma_spf_early_pool) {
+        enma_mfi_ctx->spf_early =
+            EnmaSpf_start(g_enma_spf_early_pool, g_sidf_policy, g_sidf_request_pool,
+                          g_dns_resolver_pool, g_dns_cache, enma_mfi_ctx->hostaddr,
+                          enma_mfi_ctx->helohost, enma_mfi_ctx->envfrom, enma_mfi_ctx->qid);
+    }
 
     return SMFIS_CONTINUE;
 }
@@ -496,14 +564,15 @@ mfi_header(SMFICTX *ctx, char *headerf, char *headerv)
             LogDebug("fraud AuthResultHeader: [No.%d] %s", enma_mfi_ctx->authhdr_count, headerv);
         }
     }
-    // SIDFが有効の場合ヘッダを格納する
-    if (g_enma_config->sidf_auth) {
-        int pos = MailHeaders_append(enma_mfi_ctx->headers, headerf, headerv);
-        if (pos < 0) {
-            LogError("MailHeaders_append failed: headerf=%s, headerv=%s", NNSTR(headerf),
-                     NNSTR(headerv));
-            return EnmaMfi_tempfail(enma_mfi_ctx);
-        }
+    // SIDFが有効の場合, ヘッダを受け取る度にPRAの候補を更新する
+    // PRAに関係しないヘッダは渡さず, 位置だけが意味を持つヘッダは値を複製させない
+    bool need_value;
+    if (g_enma_config->sidf_auth && SidfPra_isRelevantHeader(headerf, &need_value)
+        && !SidfPraScanner_feed(enma_mfi_ctx->pra_scanner, headerf,
+                                need_value ? headerv : "")) {
+        LogError("SidfPraScanner_feed failed: headerf=%s, headerv=%s", NNSTR(headerf),
+                 NNSTR(headerv));
+        return EnmaMfi_tempfail(enma_mfi_ctx);
     }
 
     return SMFIS_CONTINUE;
@@ -548,13 +617,35 @@ mfi_eom(SMFICTX *ctx)
     if (!appended_stat) {
         return EnmaMfi_tempfail(enma_mfi_ctx);
     }
-    // SPF
-    if (g_enma_config->spf_auth && !EnmaMfi_sidf_eom(enma_mfi_ctx, SIDF_RECORD_SCOPE_SPF1)) {
-        return EnmaMfi_tempfail(enma_mfi_ctx);
-    }
-    // SIDF
-    if (g_enma_config->sidf_auth && !EnmaMfi_sidf_eom(enma_mfi_ctx, SIDF_RECORD_SCOPE_SPF2_PRA)) {
-        return EnmaMfi_tempfail(enma_mfi_ctx);
+    // SPF, SIDF
+    if (NULL == g_enma_worker_pool) {
+        if (!EnmaMfi_authenticate(enma_mfi_ctx)) {
+            return EnmaMfi_tempfail(enma_mfi_ctx);
+        }
+    } else {
+        // 評価はワーカースレッドに任せ, 同時に評価するメッセージの数を抑える
+        EnmaMfiAuthJob job;
+        job.enma_mfi_ctx = enma_mfi_ctx;
+        job.result = false;
+        if (!EnmaWorkerPool_submit
+            (g_enma_worker_pool, &job.worker, EnmaMfi_authenticateJob, &job)) {
+            // 待ち行列が一杯なので, DNS の応答を待たずにすぐ返す.
+            // MAIL FROM で開始した SPF の評価も EnmaMfiCtx_reset() で評価スレッドに委ねるので待たない
+            if (g_enma_config->worker_overflow_tempfail) {
+                LogWarning("worker queue full, message tempfailed: ipaddr=%s",
+                           enma_mfi_ctx->ipaddr);
+                return EnmaMfi_tempfail(enma_mfi_ctx);
+            }
+            LogWarning("worker queue full, Authentication-Results header not added: ipaddr=%s",
+                       enma_mfi_ctx->ipaddr);
+            EnmaMfiCtx_reset(enma_mfi_ctx);
+            (void) LogHandler_setPrefix(NULL);
+            return SMFIS_CONTINUE;
+        }
+        EnmaWorkerPool_wait(g_enma_worker_pool, &job.worker);
+        if (!job.result) {
+            return EnmaMfi_tempfail(enma_mfi_ctx);
+        }
     }
     // Authentication-Results ヘッダをメッセージの先頭に挿入
     if (EOK != AuthResult_status(enma_mfi_ctx->authresult)) {
@@ -609,7 +700,7 @@ mfi_close(SMFICTX *ctx)
 
     EnmaMfiCtx *enma_mfi_ctx = smfi_getpriv(ctx);
     if (NULL != enma_mfi_ctx) {
-        EnmaMfiCtx_free(enma_mfi_ctx);
+        EnmaMfiCtx_release(enma_mfi_ctx);
         if (MI_FAILURE == smfi_setpriv(ctx, NULL)) {
             LogError("smfi_setpriv failed");
         }
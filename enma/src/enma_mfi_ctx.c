@@ -18,12 +18,62 @@ RCSID("$Id: enma_mfi_ctx.c 207 2008-07-17 11:46:23Z tsuruda $");
 
 #include "ptrop.h"
 #include "intarray.h"
-#include "mailheaders.h"
+#include "memarena.h"
+#include "freelist.h"
+#include "sidfpra.h"
 #include "authresult.h"
 #include "sidf.h"
 
+#include "enma.h"
 #include "enma_mfi_ctx.h"
 
+// メッセージ毎の値を切り出す arena の大きさ, 通常のメッセージではこれに収まる
+#define ENMA_MFI_CTX_ARENA_SIZE 4096
+
+/**
+ * コネクションで使う DNS リゾルバを借りる
+ * 
+ * @param self
+ * @return
+ */
+static bool
+EnmaMfiCtx_acquireResolvers(EnmaMfiCtx *self)
+{
+    self->resolver = DnsResolverPool_acquire(g_dns_resolver_pool);
+    if (NULL == self->resolver) {
+        return false;
+    }
+    DnsResolver_setCache(self->resolver, g_dns_cache);
+    // SPF と SIDF の評価で同じ問い合わせを繰り返さないよう, メッセージ毎に応答を残しておく
+    DnsResolver_setRetainAnswers(self->resolver, true);
+    return true;
+}
+
+
+/**
+ * SMTPコネクション毎に開放する処理
+ * 
+ * @param self
+ */
+static void
+EnmaMfiCtx_releaseConnection(EnmaMfiCtx *self)
+{
+    // 評価スレッドに委ね, 終了は待たない
+    if (NULL != self->spf_early) {
+        EnmaSpf_discard(self->spf_early);
+        self->spf_early = NULL;
+    }
+    PTRINIT(self->hostname);
+    PTRINIT(self->helohost);
+    PTRINIT(self->ipaddr);
+    PTRINIT(self->hostaddr);
+    if (NULL != self->resolver) {
+        DnsResolverPool_release(g_dns_resolver_pool, self->resolver);
+        self->resolver = NULL;
+    }
+}
+
+
 /**
  * libmilterで利用するコンテキストの初期化
  */
@@ -40,22 +90,26 @@ EnmaMfiCtx_new(void)
     self->helohost = NULL;
     self->ipaddr = NULL;
     self->hostaddr = NULL;
-    self->resolver = DnsResolver_new();
-    if (NULL == self->resolver) {
+    if (!EnmaMfiCtx_acquireResolvers(self)) {
         goto error_free;
     }
 
+    self->arena = MemArena_new(ENMA_MFI_CTX_ARENA_SIZE);
+    if (NULL == self->arena) {
+        goto error_free;
+    }
     self->raw_envfrom = NULL;
     self->qid = NULL;
     self->envfrom = NULL;
-    self->headers = MailHeaders_new(0);
-    if (NULL == self->headers) {
+    self->pra_scanner = SidfPraScanner_new(self->arena);
+    if (NULL == self->pra_scanner) {
         goto error_free;
     }
     self->authresult = AuthResult_new();
     if (NULL == self->authresult) {
         goto error_free;
     }
+    self->spf_early = NULL;
 
     self->authhdr_count = 0;
     self->delauthhdr = IntArray_new(0);
@@ -81,14 +135,19 @@ EnmaMfiCtx_reset(EnmaMfiCtx *self)
 {
     assert(NULL != self);
 
-    PTRINIT(self->raw_envfrom);
-    PTRINIT(self->qid);
-    if (NULL != self->envfrom) {
-        InetMailbox_free(self->envfrom);
-        self->envfrom = NULL;
+    // EOM まで進まなかったトランザクションの評価は評価スレッドに委ね, 終了は待たない
+    if (NULL != self->spf_early) {
+        EnmaSpf_discard(self->spf_early);
+        self->spf_early = NULL;
+    }
+    if (NULL != self->resolver) {
+        DnsResolver_resetAnswers(self->resolver);
     }
-    if (NULL != self->headers) {
-        MailHeaders_reset(self->headers);
+    self->raw_envfrom = NULL;
+    self->qid = NULL;
+    self->envfrom = NULL;
+    if (NULL != self->pra_scanner) {
+        SidfPraScanner_reset(self->pra_scanner);
     }
     if (NULL != self->authresult) {
         AuthResult_reset(self->authresult);
@@ -98,6 +157,10 @@ EnmaMfiCtx_reset(EnmaMfiCtx *self)
     if (NULL != self->delauthhdr) {
         IntArray_reset(self->delauthhdr);
     }
+    // 上で参照を捨てたメッセージ毎の値をまとめて破棄する
+    if (NULL != self->arena) {
+        MemArena_reset(self->arena);
+    }
 }
 
 
@@ -111,21 +174,10 @@ EnmaMfiCtx_free(EnmaMfiCtx *self)
 {
     assert(NULL != self);
 
-    free(self->hostname);
-    free(self->helohost);
-    free(self->ipaddr);
-    free(self->hostaddr);
-    if (NULL != self->resolver) {
-        DnsResolver_free(self->resolver);
-    }
+    EnmaMfiCtx_releaseConnection(self);
 
-    free(self->raw_envfrom);
-    free(self->qid);
-    if (NULL != self->envfrom) {
-        InetMailbox_free(self->envfrom);
-    }
-    if (NULL != self->headers) {
-        MailHeaders_free(self->headers);
+    if (NULL != self->pra_scanner) {
+        SidfPraScanner_free(self->pra_scanner);
     }
     if (NULL != self->authresult) {
         AuthResult_free(self->authresult);
@@ -134,5 +186,49 @@ EnmaMfiCtx_free(EnmaMfiCtx *self)
     if (NULL != self->delauthhdr) {
         IntArray_free(self->delauthhdr);
     }
+    // raw_envfrom, qid, envfrom は arena と共に解放される
+    if (NULL != self->arena) {
+        MemArena_free(self->arena);
+    }
     free(self);
 }
+
+
+/**
+ * プールからコンテキストを取り出す. プールが空の場合は新たに構築する.
+ * 
+ * @return
+ */
+EnmaMfiCtx *
+EnmaMfiCtx_acquire(void)
+{
+    EnmaMfiCtx *self = (EnmaMfiCtx *) FreeList_pop(g_enma_mfi_ctx_pool);
+    if (NULL == self) {
+        return EnmaMfiCtx_new();
+    }
+    if (!EnmaMfiCtx_acquireResolvers(self)) {
+        EnmaMfiCtx_free(self);
+        return NULL;
+    }
+    return self;
+}
+
+
+/**
+ * コネクションの終了したコンテキストを初期化してプールに戻す.
+ * プールが一杯の場合は解放する.
+ * 
+ * @param self
+ */
+void
+EnmaMfiCtx_release(EnmaMfiCtx *self)
+{
+    assert(NULL != self);
+
+    EnmaMfiCtx_reset(self);
+    // DNS リゾルバは resolv.conf の更新を反映できるよう DnsResolverPool に返す
+    EnmaMfiCtx_releaseConnection(self);
+    if (!FreeList_push(g_enma_mfi_ctx_pool, self)) {
+        EnmaMfiCtx_free(self);
+    }
+}
@@ -19,16 +19,35 @@ RCSID("$Id: enma_sidf.c 323 2008-08-11 04:08:26Z takahiko $");
 
 #include "loghandler.h"
 #include "authresult.h"
-#include "mailheaders.h"
 #include "dnsresolv.h"
+#include "dnsresolvpool.h"
+#include "dnscache.h"
 #include "sidf.h"
 #include "sidfpra.h"
 #include "sidfenum.h"
 #include "sidfpolicy.h"
 #include "sidfrequest.h"
+#include "sidfrequestpool.h"
 
 #include "enma_sidf.h"
 
+/**
+ * MAIL FROM の時点で開始した SPF 評価の状態.
+ * 評価はワーカープールのスレッドでおこない, 結果は EOM で回収する.
+ * トランザクションが EOM まで進まなかった場合は評価スレッドに委ね, 評価が終わった時点で解放させる.
+ * そのため, 評価に使う resolver と request も含めて他のオブジェクトとは共有しない.
+ */
+struct EnmaSpfEarly {
+    EnmaWorkerJob job;
+    EnmaWorkerPool *worker_pool;
+    DnsResolverPool *resolver_pool; // resolver の返却先
+    DnsResolver *resolver;
+    SidfRequestPool *request_pool;  // request の返却先
+    SidfRequest *request;
+    char *qid;                  // スレッドのログに付ける prefix, 不明な場合は NULL
+    SidfScore score;
+};
+
 
 /**
  * 必要なパラメーターが揃わず SPF 評価をスキップした場合は "permerror"
@@ -55,17 +74,16 @@ EnmaSidfBase_appendPermError(AuthResult *authresult, const char *method)
 /**
  * select PRA Header
  * 
- * @param headers
+ * @param pra_scanner
  * @param pra_header
  * @param pra_mailbox
  * @return 
  */
 static bool
-EnmaSidf_setPRAHeader(const MailHeaders *headers, const char **pra_header,
+EnmaSidf_setPRAHeader(const SidfPraScanner *pra_scanner, const char **pra_header,
                       InetMailbox **pra_mailbox)
 {
-    int pra_index;
-    if (!SidfPra_extract(headers, &pra_index, pra_mailbox)) {
+    if (!SidfPraScanner_extract(pra_scanner, pra_header, pra_mailbox)) {
         return false;
     }
 
@@ -74,7 +92,6 @@ EnmaSidf_setPRAHeader(const MailHeaders *headers, const char **pra_header,
         return true;
     }
 
-    MailHeaders_get(headers, pra_index, pra_header, NULL);
     LogDebug("SIDF-PRA-Header: field=%s, mailbox=%s@%s", *pra_header,
              InetMailbox_getLocalPart(*pra_mailbox), InetMailbox_getDomain(*pra_mailbox));
 
@@ -164,6 +181,7 @@ EnmaSidf_prepare(SidfRequest *request, const struct sockaddr *hostaddr, const ch
  * SPF append score
  * 
  * @param request
+ * @param score
  * @param authresult
  * @param ipaddr
  * @param helohost
@@ -173,9 +191,9 @@ EnmaSidf_prepare(SidfRequest *request, const struct sockaddr *hostaddr, const ch
  * @return 
  */
 static bool
-EnmaSpf_appendScore(SidfRequest *request, AuthResult *authresult, const char *ipaddr,
-                    const char *helohost, const char *raw_envfrom, const InetMailbox *envfrom,
-                    bool explog)
+EnmaSpf_appendScore(SidfRequest *request, SidfScore score, AuthResult *authresult,
+                    const char *ipaddr, const char *helohost, const char *raw_envfrom,
+                    const InetMailbox *envfrom, bool explog)
 {
     assert(NULL != request);
     assert(NULL != authresult);
@@ -183,7 +201,6 @@ EnmaSpf_appendScore(SidfRequest *request, AuthResult *authresult, const char *ip
     assert(NULL != helohost);
     assert(NULL != raw_envfrom);
 
-    SidfScore score = SidfRequest_eval(request, SIDF_RECORD_SCOPE_SPF1);
     if (SIDF_SCORE_SYSERROR == score || SIDF_SCORE_NULL == score) {
         LogWarning("SidfRequest_eval failed: score=0x%x", score);
         return false;
@@ -270,6 +287,7 @@ EnmaSidf_appendScore(SidfRequest *request, AuthResult *authresult, const char *i
  * SPF evalute
  * 
  * @param policy
+ * @param request_pool
  * @param resolver
  * @param authresult
  * @param hostaddr
@@ -281,9 +299,10 @@ EnmaSidf_appendScore(SidfRequest *request, AuthResult *authresult, const char *i
  * @return 
  */
 bool
-EnmaSpf_evaluate(SidfPolicy *policy, DnsResolver *resolver, AuthResult *authresult,
-                 const struct sockaddr *hostaddr, const char *ipaddr, const char *helohost,
-                 const char *raw_envfrom, const InetMailbox *envfrom, bool explog)
+EnmaSpf_evaluate(SidfPolicy *policy, SidfRequestPool *request_pool, DnsResolver *resolver,
+                 AuthResult *authresult, const struct sockaddr *hostaddr, const char *ipaddr,
+                 const char *helohost, const char *raw_envfrom, const InetMailbox *envfrom,
+                 bool explog)
 {
     assert(NULL != policy);
     assert(NULL != resolver);
@@ -300,7 +319,7 @@ EnmaSpf_evaluate(SidfPolicy *policy, DnsResolver *resolver, AuthResult *authresu
         return true;
     }
 
-    SidfRequest *request = SidfRequest_new(policy, resolver);
+    SidfRequest *request = SidfRequestPool_acquire(request_pool, policy, resolver);
     if (NULL == request) {
         LogNoResource();
         return false;
@@ -310,43 +329,220 @@ EnmaSpf_evaluate(SidfPolicy *policy, DnsResolver *resolver, AuthResult *authresu
         goto cleanup;
     }
     // evaluation
-    if (!EnmaSpf_appendScore(request, authresult, ipaddr, helohost, raw_envfrom, envfrom, explog)) {
+    SidfScore score = SidfRequest_eval(request, SIDF_RECORD_SCOPE_SPF1);
+    if (!EnmaSpf_appendScore
+        (request, score, authresult, ipaddr, helohost, raw_envfrom, envfrom, explog)) {
         goto cleanup;
     }
 
-    SidfRequest_free(request);
+    SidfRequestPool_release(request_pool, request);
     return true;
 
   cleanup:
-    SidfRequest_free(request);
+    SidfRequestPool_release(request_pool, request);
     return false;
 }
 
 
+static void
+EnmaSpfEarly_free(EnmaSpfEarly *self)
+{
+    // request は resolver を参照しているので先に返却する
+    if (NULL != self->request) {
+        SidfRequestPool_release(self->request_pool, self->request);
+    }
+    if (NULL != self->resolver) {
+        DnsResolverPool_release(self->resolver_pool, self->resolver);
+    }
+    free(self->qid);
+    free(self);
+}
+
+
+/**
+ * EnmaSpf_discard() で手放した評価が終わった時点で, ワーカースレッドから呼ばれる.
+ */
+static void
+EnmaSpfEarly_release(void *arg)
+{
+    EnmaSpfEarly_free((EnmaSpfEarly *) arg);
+}
+
+
+static void
+EnmaSpfEarly_main(void *arg)
+{
+    EnmaSpfEarly *self = (EnmaSpfEarly *) arg;
+
+    if (NULL != self->qid) {
+        (void) LogHandler_setPrefix(self->qid);
+    }
+    self->score = SidfRequest_eval(self->request, SIDF_RECORD_SCOPE_SPF1);
+    (void) LogHandler_setPrefix(NULL);
+}
+
+
+/**
+ * SPF の評価をワーカープールで開始する.
+ * 評価に必要な値は全て複製し, resolver も resolver_pool から専用のものを借りるので,
+ * 呼び出し後に引数を解放してもかまわない.
+ * ワーカープールの待ち行列が一杯の場合は開始しない.
+ * 
+ * @param worker_pool
+ * @param policy
+ * @param request_pool
+ * @param resolver_pool 評価に使う resolver の借用元
+ * @param cache resolver に設定する DNS キャッシュ (maybe NULL)
+ * @param hostaddr
+ * @param helohost
+ * @param envfrom
+ * @param qid ログに付ける prefix (maybe NULL)
+ * @return 評価を開始した場合はそのハンドル, 開始できなかった場合は NULL.
+ *         NULL の場合は EnmaSpf_evaluate() で評価すること.
+ */
+EnmaSpfEarly *
+EnmaSpf_start(EnmaWorkerPool *worker_pool, SidfPolicy *policy, SidfRequestPool *request_pool,
+              DnsResolverPool *resolver_pool, DnsCache *cache, const struct sockaddr *hostaddr,
+              const char *helohost, const InetMailbox *envfrom, const char *qid)
+{
+    assert(NULL != worker_pool);
+    assert(NULL != policy);
+    assert(NULL != resolver_pool);
+    assert(NULL != hostaddr);
+
+    // HELO がない場合は EOM で permerror を付ける
+    if (NULL == helohost) {
+        return NULL;
+    }
+
+    EnmaSpfEarly *self = (EnmaSpfEarly *) malloc(sizeof(EnmaSpfEarly));
+    if (NULL == self) {
+        LogNoResource();
+        return NULL;
+    }
+    memset(self, 0, sizeof(EnmaSpfEarly));
+    self->score = SIDF_SCORE_NULL;
+    self->worker_pool = worker_pool;
+    self->resolver_pool = resolver_pool;
+    self->request_pool = request_pool;
+
+    if (NULL != qid && NULL == (self->qid = strdup(qid))) {
+        LogNoResource();
+        goto cleanup;
+    }
+    self->resolver = DnsResolverPool_acquire(resolver_pool);
+    if (NULL == self->resolver) {
+        LogNoResource();
+        goto cleanup;
+    }
+    DnsResolver_setCache(self->resolver, cache);
+    // SIDF の評価で同じ問い合わせを繰り返さないよう, 応答を残しておく
+    DnsResolver_setRetainAnswers(self->resolver, true);
+    self->request = SidfRequestPool_acquire(request_pool, policy, self->resolver);
+    if (NULL == self->request) {
+        LogNoResource();
+        goto cleanup;
+    }
+    if (!EnmaSpf_prepare(self->request, hostaddr, helohost, envfrom)) {
+        goto cleanup;
+    }
+
+    if (!EnmaWorkerPool_submit(worker_pool, &(self->job), EnmaSpfEarly_main, self)) {
+        LogDebug("early SPF worker queue full, evaluating at end of message");
+        goto cleanup;
+    }
+
+    return self;
+
+  cleanup:
+    EnmaSpfEarly_free(self);
+    return NULL;
+}
+
+
+/**
+ * EnmaSpf_start() で開始した評価の終了を待ち, Authentication-Results ヘッダに結果を付加する.
+ * 評価で得た DNS の応答を後の評価で使えるよう, *resolver を評価に使った resolver と入れ替え,
+ * 元の *resolver は resolver_pool に返却する. self は解放される.
+ * 
+ * @param self
+ * @param resolver
+ * @param authresult
+ * @param ipaddr
+ * @param helohost
+ * @param raw_envfrom
+ * @param envfrom
+ * @param explog
+ * @return 
+ */
+bool
+EnmaSpf_collect(EnmaSpfEarly *self, DnsResolver **resolver, AuthResult *authresult,
+                const char *ipaddr, const char *helohost, const char *raw_envfrom,
+                const InetMailbox *envfrom, bool explog)
+{
+    assert(NULL != self);
+    assert(NULL != resolver);
+    assert(NULL != authresult);
+    assert(NULL != ipaddr);
+    assert(NULL != helohost);
+    assert(NULL != raw_envfrom);
+
+    EnmaWorkerPool_wait(self->worker_pool, &(self->job));
+    bool appended = EnmaSpf_appendScore(self->request, self->score, authresult, ipaddr,
+                                        helohost, raw_envfrom, envfrom, explog);
+    SidfRequestPool_release(self->request_pool, self->request);
+    self->request = NULL;
+    DnsResolver *used = self->resolver;
+    self->resolver = *resolver;
+    *resolver = used;
+    EnmaSpfEarly_free(self);
+    return appended;
+}
+
+
+/**
+ * EnmaSpf_start() で開始した評価の結果を捨てる.
+ * 評価を途中で止めることはせず, 終わっていなければ評価スレッドに委ねて終わるのを待たずに戻る.
+ * self は評価が終わった時点で解放される.
+ * 
+ * @param self
+ */
+void
+EnmaSpf_discard(EnmaSpfEarly *self)
+{
+    assert(NULL != self);
+
+    if (!EnmaWorkerPool_detach(self->worker_pool, &(self->job), EnmaSpfEarly_release)) {
+        EnmaSpfEarly_free(self);
+    }
+}
+
+
 /**
  * SIDF evalute
  * 
  * @param policy
+ * @param request_pool
  * @param resolver
  * @param authresult
  * @param hostaddr
  * @param ipaddr
  * @param helohost
- * @param headers
+ * @param pra_scanner
  * @param explog
  * @return 
  */
 bool
-EnmaSidf_evaluate(SidfPolicy *policy, DnsResolver *resolver, AuthResult *authresult,
-                  const struct sockaddr *hostaddr, const char *ipaddr, const char *helohost,
-                  const MailHeaders *headers, bool explog)
+EnmaSidf_evaluate(SidfPolicy *policy, SidfRequestPool *request_pool, DnsResolver *resolver,
+                  AuthResult *authresult, const struct sockaddr *hostaddr, const char *ipaddr,
+                  const char *helohost, const SidfPraScanner *pra_scanner, bool explog)
 {
     assert(NULL != policy);
     assert(NULL != resolver);
     assert(NULL != authresult);
     assert(NULL != hostaddr);
     assert(NULL != ipaddr);
-    assert(NULL != headers);
+    assert(NULL != pra_scanner);
 
     // %{h} マクロの展開に使われる可能性があるので, HELO の値は必ずセットする.
     // Sender がセットされていれば HELO で SPF/SIDF の評価がおこなわれることはない.
@@ -358,7 +554,7 @@ EnmaSidf_evaluate(SidfPolicy *policy, DnsResolver *resolver, AuthResult *authres
     // lookup PRA header
     const char *pra_header = NULL;
     InetMailbox *pra_mailbox = NULL;
-    if (!EnmaSidf_setPRAHeader(headers, &pra_header, &pra_mailbox)) {
+    if (!EnmaSidf_setPRAHeader(pra_scanner, &pra_header, &pra_mailbox)) {
         return false;
     }
     if (NULL == pra_mailbox) {
@@ -366,7 +562,7 @@ EnmaSidf_evaluate(SidfPolicy *policy, DnsResolver *resolver, AuthResult *authres
         return true;
     }
 
-    SidfRequest *request = SidfRequest_new(policy, resolver);
+    SidfRequest *request = SidfRequestPool_acquire(request_pool, policy, resolver);
     if (NULL == request) {
         LogNoResource();
         return false;
@@ -380,12 +576,12 @@ EnmaSidf_evaluate(SidfPolicy *policy, DnsResolver *resolver, AuthResult *authres
         goto cleanup;
     }
 
-    SidfRequest_free(request);
+    SidfRequestPool_release(request_pool, request);
     InetMailbox_free(pra_mailbox);
     return true;
 
   cleanup:
-    SidfRequest_free(request);
+    SidfRequestPool_release(request_pool, request);
     InetMailbox_free(pra_mailbox);
     return false;
 }
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * 決まった数のスレッドで仕事を処理するワーカープール.
+ * 待ち行列の長さにも上限を設け, 一杯の場合は EnmaWorkerPool_submit() が即座に失敗する.
+ * 同時に処理する仕事の数はスレッド数, 処理を待つ仕事の数は待ち行列の長さを越えない.
+ */
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "loghandler.h"
+
+#include "enma_worker.h"
+
+struct EnmaWorkerPool {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      // 待ち行列に仕事が入った, または停止を指示した
+    pthread_cond_t finished;    // 仕事が終わった
+    EnmaWorkerJob **queue;      // 処理を待つ仕事のリングバッファ
+    unsigned int queue_size;
+    unsigned int queue_head;    // 次に取り出す位置
+    unsigned int queue_num;     // 処理を待っている仕事の数
+    bool stopping;
+    pthread_t *thread;
+    unsigned int thread_num;    // 起動したスレッドの数
+};
+
+
+static void *
+EnmaWorkerPool_main(void *arg)
+{
+    EnmaWorkerPool *self = (EnmaWorkerPool *) arg;
+
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        while (0 == self->queue_num && !self->stopping) {
+            pthread_cond_wait(&self->queued, &self->lock);
+        }
+        // 停止を指示されても, 待っている仕事は全て処理してから終了する
+        if (0 == self->queue_num) {
+            break;
+        }
+        EnmaWorkerJob *job = self->queue[self->queue_head];
+        self->queue_head = (self->queue_head + 1) % self->queue_size;
+        --(self->queue_num);
+        pthread_mutex_unlock(&self->lock);
+
+        job->func(job->arg);
+
+        pthread_mutex_lock(&self->lock);
+        if (NULL != job->release) {
+            // 待つ者はいないので, 仕事の後始末もこのスレッドでおこなう
+            EnmaWorkerFunc release = job->release;
+            void *release_arg = job->arg;
+            pthread_mutex_unlock(&self->lock);
+            release(release_arg);
+            pthread_mutex_lock(&self->lock);
+            continue;
+        }
+        job->done = true;
+        pthread_cond_broadcast(&self->finished);
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    return NULL;
+}
+
+
+/**
+ * 仕事を待ち行列に入れる.
+ * 
+ * @param self
+ * @param job 仕事の状態を保持する領域, EnmaWorkerPool_wait() が戻るまで保持すること
+ * @param func ワーカースレッドで呼び出す関数
+ * @param arg func に渡す引数
+ * @return 待ち行列に入れた場合は true, 待ち行列が一杯または停止中の場合は false
+ */
+bool
+EnmaWorkerPool_submit(EnmaWorkerPool *self, EnmaWorkerJob *job, EnmaWorkerFunc func, void *arg)
+{
+    assert(NULL != self);
+    assert(NULL != job);
+    assert(NULL != func);
+
+    job->func = func;
+    job->arg = arg;
+    job->release = NULL;
+    job->done = false;
+
+    pthread_mutex_lock(&self->lock);
+    if (self->stopping || self->queue_size <= self->queue_num) {
+        pthread_mutex_unlock(&self->lock);
+        return false;
+    }
+    self->queue[(self->queue_head + self->queue_num) % self->queue_size] = job;
+    ++(self->queue_num);
+    pthread_cond_signal(&self->queued);
+    pthread_mutex_unlock(&self->lock);
+
+    return true;
+}
+
+
+/**
+ * EnmaWorkerPool_submit() で待ち行列に入れた仕事が終わるのを待つ.
+ * 
+ * @param self
+ * @param job
+ */
+void
+EnmaWorkerPool_wait(EnmaWorkerPool *self, EnmaWorkerJob *job)
+{
+    assert(NULL != self);
+    assert(NULL != job);
+
+    pthread_mutex_lock(&self->lock);
+    while (!job->done) {
+        pthread_cond_wait(&self->finished, &self->lock);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+
+/**
+ * EnmaWorkerPool_submit() で待ち行列に入れた仕事の終了を待たずに手放す.
+ * 仕事が終わっていなければ, 終わった時点でワーカースレッドが release(arg) を呼ぶ.
+ * 
+ * @param self
+ * @param job
+ * @param release 仕事の後始末をおこなう関数
+ * @return 切り離した場合は true, 既に仕事が終わっていた場合は false.
+ *         false の場合は release は呼ばれないので, 呼び出し側で後始末すること.
+ */
+bool
+EnmaWorkerPool_detach(EnmaWorkerPool *self, EnmaWorkerJob *job, EnmaWorkerFunc release)
+{
+    assert(NULL != self);
+    assert(NULL != job);
+    assert(NULL != release);
+
+    pthread_mutex_lock(&self->lock);
+    bool detached = !job->done;
+    if (detached) {
+        job->release = release;
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    return detached;
+}
+
+
+/**
+ * ワーカースレッドを停止して EnmaWorkerPool オブジェクトを解放する.
+ * 待ち行列に残っている仕事は処理してから停止する.
+ * 
+ * @param self
+ */
+void
+EnmaWorkerPool_free(EnmaWorkerPool *self)
+{
+    if (NULL == self) {
+        return;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    self->stopping = true;
+    pthread_cond_broadcast(&self->queued);
+    pthread_mutex_unlock(&self->lock);
+    for (unsigned int n = 0; n < self->thread_num; ++n) {
+        (void) pthread_join(self->thread[n], NULL);
+    }
+
+    free(self->thread);
+    free(self->queue);
+    pthread_cond_destroy(&self->finished);
+    pthread_cond_destroy(&self->queued);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+}
+
+
+/**
+ * EnmaWorkerPool オブジェクトを構築し, ワーカースレッドを起動する.
+ * 
+ * @param thread_num ワーカースレッドの数
+ * @param queue_size 処理を待つ仕事の最大数
+ * @return 構築した EnmaWorkerPool オブジェクト, 失敗した場合は NULL
+ */
+EnmaWorkerPool *
+EnmaWorkerPool_new(unsigned int thread_num, unsigned int queue_size)
+{
+    assert(0 < thread_num);
+    assert(0 < queue_size);
+
+    EnmaWorkerPool *self = (EnmaWorkerPool *) malloc(sizeof(EnmaWorkerPool));
+    if (NULL == self) {
+        return NULL;
+    }
+    memset(self, 0, sizeof(EnmaWorkerPool));
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->queued, NULL);
+    pthread_cond_init(&self->finished, NULL);
+
+    self->queue = (EnmaWorkerJob **) malloc(queue_size * sizeof(EnmaWorkerJob *));
+    self->thread = (pthread_t *) malloc(thread_num * sizeof(pthread_t));
+    if (NULL == self->queue || NULL == self->thread) {
+        goto error_free;
+    }
+    self->queue_size = queue_size;
+    self->queue_head = 0;
+    self->queue_num = 0;
+    self->stopping = false;
+
+    for (self->thread_num = 0; self->thread_num < thread_num; ++(self->thread_num)) {
+        int ret = pthread_create(&(self->thread[self->thread_num]), NULL, EnmaWorkerPool_main,
+                                 self);
+        if (0 != ret) {
+            LogError("pthread_create failed: error=%s", strerror(ret));
+            goto error_free;
+        }
+    }
+
+    return self;
+
+  error_free:
+    EnmaWorkerPool_free(self);
+    return NULL;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * MAIL FROM で開始した SPF 評価を, ワーカースレッドが塞がっている間に手放しても待たされないこと,
+ * 待ち行列が一杯の場合は開始せずにすぐ戻ることを確かめる.
+ * 評価結果はキャッシュから返すので, DNS の問い合わせはおこなわない.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "unittest.h"
+#include "loghandler.h"
+#include "sidfpolicy.h"
+#include "sidfresultcache.h"
+#include "sidfrequestpool.h"
+#include "dnsresolvpool.h"
+#include "authresult.h"
+#include "enma_worker.h"
+#include "enma_sidf.h"
+
+// 待たされた場合に止まったままにならないよう, この秒数で打ち切る
+#define TEST_TIMEOUT 10
+
+#define TEST_HELO "mx.example.com"
+
+static pthread_mutex_t test_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t test_cond = PTHREAD_COND_INITIALIZER;
+static bool test_blocker_started = false;
+static bool test_blocker_released = false;
+static bool test_blocker_finished = false;
+
+static SidfPolicy *test_policy = NULL;
+static SidfRequestPool *test_request_pool = NULL;
+static DnsResolverPool *test_resolver_pool = NULL;
+static struct sockaddr_in test_hostaddr;
+
+/*
+ * 解放されるまでワーカースレッドを塞ぐ仕事.
+ */
+static void
+Test_blocker(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&test_lock);
+    test_blocker_started = true;
+    pthread_cond_broadcast(&test_cond);
+    while (!test_blocker_released) {
+        pthread_cond_wait(&test_cond, &test_lock);
+    }   // end while
+    test_blocker_finished = true;
+    pthread_mutex_unlock(&test_lock);
+}   // end function : Test_blocker
+
+static EnmaSpfEarly *
+Test_start(EnmaWorkerPool *worker_pool)
+{
+    return EnmaSpf_start(worker_pool, test_policy, test_request_pool, test_resolver_pool, NULL,
+                         (const struct sockaddr *) &test_hostaddr, TEST_HELO, NULL, "TESTQID");
+}   // end function : Test_start
+
+/*
+ * ワーカースレッドを塞いだ状態で, 待ち行列に入った評価を手放す.
+ */
+static void
+Test_discardWhileBusy(void)
+{
+    EnmaWorkerPool *worker_pool = EnmaWorkerPool_new(1, 1);
+    UNITTEST_CHECK(NULL != worker_pool);
+
+    EnmaWorkerJob blocker;
+    UNITTEST_CHECK(EnmaWorkerPool_submit(worker_pool, &blocker, Test_blocker, NULL));
+    pthread_mutex_lock(&test_lock);
+    while (!test_blocker_started) {
+        pthread_cond_wait(&test_cond, &test_lock);
+    }   // end while
+    pthread_mutex_unlock(&test_lock);
+
+    // スレッドは塞がっているが, 待ち行列には入る
+    EnmaSpfEarly *spf_early = Test_start(worker_pool);
+    UNITTEST_CHECK(NULL != spf_early);
+
+    // 待ち行列が一杯なので開始しない. EOM で評価することになる
+    UNITTEST_CHECK(NULL == Test_start(worker_pool));
+    EnmaWorkerJob overflow;
+    UNITTEST_CHECK(!EnmaWorkerPool_submit(worker_pool, &overflow, Test_blocker, NULL));
+
+    // 評価はまだ始まってもいないが, 手放すのは待たされない
+    if (NULL != spf_early) {
+        EnmaSpf_discard(spf_early);
+    }   // end if
+    pthread_mutex_lock(&test_lock);
+    UNITTEST_CHECK(!test_blocker_finished);
+    test_blocker_released = true;
+    pthread_cond_broadcast(&test_cond);
+    pthread_mutex_unlock(&test_lock);
+
+    // 手放した評価は評価スレッドが終わらせて解放する
+    EnmaWorkerPool_free(worker_pool);
+    UNITTEST_CHECK(test_blocker_finished);
+}   // end function : Test_discardWhileBusy
+
+/*
+ * 評価を回収すると結果が付加され, 評価に使った resolver と入れ替わる.
+ */
+static void
+Test_collect(void)
+{
+    EnmaWorkerPool *worker_pool = EnmaWorkerPool_new(1, 1);
+    UNITTEST_CHECK(NULL != worker_pool);
+    AuthResult *authresult = AuthResult_new();
+    UNITTEST_CHECK(NULL != authresult);
+    DnsResolver *resolver = DnsResolverPool_acquire(test_resolver_pool);
+    UNITTEST_CHECK(NULL != resolver);
+
+    EnmaSpfEarly *spf_early = Test_start(worker_pool);
+    UNITTEST_CHECK(NULL != spf_early);
+    if (NULL != spf_early && NULL != resolver) {
+        DnsResolver *orig_resolver = resolver;
+        UNITTEST_CHECK(EnmaSpf_collect(spf_early, &resolver, authresult, "192.0.2.1", TEST_HELO,
+                                       "<>", NULL, false));
+        UNITTEST_CHECK(NULL != resolver && orig_resolver != resolver);
+        const char *field = AuthResult_getFieldBody(authresult);
+        UNITTEST_CHECK(NULL != field && NULL != strstr(field, "spf=pass"));
+    }   // end if
+
+    if (NULL != resolver) {
+        DnsResolverPool_release(test_resolver_pool, resolver);
+    }   // end if
+    AuthResult_free(authresult);
+    EnmaWorkerPool_free(worker_pool);
+}   // end function : Test_collect
+
+int
+main(void)
+{
+    alarm(TEST_TIMEOUT);
+    LogHandler_init();
+
+    memset(&test_hostaddr, 0, sizeof(test_hostaddr));
+    test_hostaddr.sin_family = AF_INET;
+    UNITTEST_CHECK(1 == inet_pton(AF_INET, "192.0.2.1", &test_hostaddr.sin_addr));
+
+    test_policy = SidfPolicy_new();
+    SidfResultCache *result_cache = SidfResultCache_new(16);
+    test_request_pool = SidfRequestPool_new(4);
+    test_resolver_pool = DnsResolverPool_new();
+    UNITTEST_CHECK(NULL != test_policy && NULL != result_cache && NULL != test_request_pool
+                   && NULL != test_resolver_pool);
+    // HELO での評価結果をキャッシュに置いておく
+    SidfResultCache_store(result_cache, SIDF_RECORD_SCOPE_SPF1, AF_INET,
+                          &test_hostaddr.sin_addr, NULL, TEST_HELO, SIDF_SCORE_PASS, NULL, 300);
+    test_policy->result_cache = result_cache;
+
+    Test_discardWhileBusy();
+    Test_collect();
+
+    DnsResolverPool_free(test_resolver_pool);
+    SidfRequestPool_free(test_request_pool);
+    SidfPolicy_free(test_policy);
+    SidfResultCache_free(result_cache);
+    return UNITTEST_RESULT();
+}   // end function : main
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * EnmaWorkerPool が待ち行列の長さを越える仕事を受け付けずにすぐ戻ること,
+ * 受け付けた仕事を順に処理すること, 切り離した仕事の後始末をワーカースレッドがおこなうこと,
+ * 停止する際に待ち行列に残った仕事を処理することを確かめる.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "unittest.h"
+#include "loghandler.h"
+#include "enma_worker.h"
+
+// 待たされた場合に止まったままにならないよう, この秒数で打ち切る
+#define TEST_TIMEOUT 10
+
+#define TEST_QUEUE_SIZE 3
+
+static pthread_mutex_t test_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t test_cond = PTHREAD_COND_INITIALIZER;
+static bool test_blocker_started = false;
+static bool test_blocker_released = false;
+
+static int test_order[TEST_QUEUE_SIZE + 1];
+static int test_order_num = 0;
+static int test_release_num = 0;
+
+/*
+ * 解放されるまでワーカースレッドを塞ぐ仕事.
+ */
+static void
+Test_blocker(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&test_lock);
+    test_blocker_started = true;
+    pthread_cond_broadcast(&test_cond);
+    while (!test_blocker_released) {
+        pthread_cond_wait(&test_cond, &test_lock);
+    }   // end while
+    pthread_mutex_unlock(&test_lock);
+}   // end function : Test_blocker
+
+/*
+ * ワーカースレッドを Test_blocker で塞ぎ, 処理が始まるまで待つ.
+ */
+static void
+Test_block(EnmaWorkerPool *pool, EnmaWorkerJob *blocker)
+{
+    pthread_mutex_lock(&test_lock);
+    test_blocker_started = false;
+    test_blocker_released = false;
+    pthread_mutex_unlock(&test_lock);
+    UNITTEST_CHECK(EnmaWorkerPool_submit(pool, blocker, Test_blocker, NULL));
+    pthread_mutex_lock(&test_lock);
+    while (!test_blocker_started) {
+        pthread_cond_wait(&test_cond, &test_lock);
+    }   // end while
+    pthread_mutex_unlock(&test_lock);
+}   // end function : Test_block
+
+static void
+Test_unblock(void)
+{
+    pthread_mutex_lock(&test_lock);
+    test_blocker_released = true;
+    pthread_cond_broadcast(&test_cond);
+    pthread_mutex_unlock(&test_lock);
+}   // end function : Test_unblock
+
+/*
+ * 処理された順番を記録する仕事.
+ */
+static void
+Test_record(void *arg)
+{
+    pthread_mutex_lock(&test_lock);
+    if (test_order_num < TEST_QUEUE_SIZE + 1) {
+        test_order[test_order_num] = *(int *) arg;
+    }   // end if
+    ++test_order_num;
+    pthread_mutex_unlock(&test_lock);
+}   // end function : Test_record
+
+static void
+Test_resetOrder(void)
+{
+    pthread_mutex_lock(&test_lock);
+    test_order_num = 0;
+    test_release_num = 0;
+    pthread_mutex_unlock(&test_lock);
+}   // end function : Test_resetOrder
+
+/*
+ * ワーカースレッドが塞がっている間は待ち行列の長さまで受け付け, それを越えるとすぐに失敗する.
+ * 塞がりが解けると, 受け付けた順に処理する.
+ */
+static void
+Test_queueFull(void)
+{
+    EnmaWorkerPool *pool = EnmaWorkerPool_new(1, TEST_QUEUE_SIZE);
+    UNITTEST_CHECK(NULL != pool);
+    if (NULL == pool) {
+        return;
+    }   // end if
+    Test_resetOrder();
+
+    EnmaWorkerJob blocker;
+    Test_block(pool, &blocker);
+    // 処理中の仕事は待ち行列の長さに含まない
+    EnmaWorkerJob jobs[TEST_QUEUE_SIZE];
+    int values[TEST_QUEUE_SIZE + 1];
+    for (int n = 0; n < TEST_QUEUE_SIZE; ++n) {
+        values[n] = n;
+        UNITTEST_CHECK(EnmaWorkerPool_submit(pool, &jobs[n], Test_record, &values[n]));
+    }   // end for
+    EnmaWorkerJob overflow;
+    values[TEST_QUEUE_SIZE] = TEST_QUEUE_SIZE;
+    UNITTEST_CHECK(!EnmaWorkerPool_submit(pool, &overflow, Test_record, &values[TEST_QUEUE_SIZE]));
+    UNITTEST_CHECK(!EnmaWorkerPool_submit(pool, &overflow, Test_record, &values[TEST_QUEUE_SIZE]));
+    pthread_mutex_lock(&test_lock);
+    UNITTEST_CHECK(0 == test_order_num);
+    pthread_mutex_unlock(&test_lock);
+
+    Test_unblock();
+    EnmaWorkerPool_wait(pool, &blocker);
+    for (int n = 0; n < TEST_QUEUE_SIZE; ++n) {
+        EnmaWorkerPool_wait(pool, &jobs[n]);
+        UNITTEST_CHECK(jobs[n].done);
+    }   // end for
+    // 受け付けなかった仕事は処理しない
+    pthread_mutex_lock(&test_lock);
+    UNITTEST_CHECK(TEST_QUEUE_SIZE == test_order_num);
+    for (int n = 0; n < TEST_QUEUE_SIZE; ++n) {
+        UNITTEST_CHECK(n == test_order[n]);
+    }   // end for
+    pthread_mutex_unlock(&test_lock);
+
+    // 待ち行列が空けば再び受け付ける. 先頭の位置が一巡しても順番は崩れない
+    Test_resetOrder();
+    Test_block(pool, &blocker);
+    for (int n = 0; n < TEST_QUEUE_SIZE; ++n) {
+        UNITTEST_CHECK(EnmaWorkerPool_submit(pool, &jobs[n], Test_record, &values[n]));
+    }   // end for
+    UNITTEST_CHECK(!EnmaWorkerPool_submit(pool, &overflow, Test_record, &values[TEST_QUEUE_SIZE]));
+    Test_unblock();
+    for (int n = 0; n < TEST_QUEUE_SIZE; ++n) {
+        EnmaWorkerPool_wait(pool, &jobs[n]);
+    }   // end for
+    pthread_mutex_lock(&test_lock);
+    UNITTEST_CHECK(TEST_QUEUE_SIZE == test_order_num);
+    for (int n = 0; n < TEST_QUEUE_SIZE; ++n) {
+        UNITTEST_CHECK(n == test_order[n]);
+    }   // end for
+    pthread_mutex_unlock(&test_lock);
+    EnmaWorkerPool_wait(pool, &blocker);
+    EnmaWorkerPool_free(pool);
+}   // end function : Test_queueFull
+
+typedef struct TestDetached {
+    int value;                  // Test_record() が参照するので先頭に置く
+    EnmaWorkerJob job;
+} TestDetached;
+
+static void
+Test_release(void *arg)
+{
+    pthread_mutex_lock(&test_lock);
+    ++test_release_num;
+    pthread_mutex_unlock(&test_lock);
+    // 仕事の状態を保持する領域ごと解放する
+    free(arg);
+}   // end function : Test_release
+
+/*
+ * 終わっていない仕事は切り離せ, ワーカースレッドが処理した後に後始末をおこなう.
+ * 既に終わった仕事は切り離せず, 後始末は呼び出し側でおこなう.
+ */
+static void
+Test_detach(void)
+{
+    EnmaWorkerPool *pool = EnmaWorkerPool_new(1, TEST_QUEUE_SIZE);
+    UNITTEST_CHECK(NULL != pool);
+    if (NULL == pool) {
+        return;
+    }   // end if
+    Test_resetOrder();
+
+    EnmaWorkerJob blocker;
+    Test_block(pool, &blocker);
+    TestDetached *detached = (TestDetached *) malloc(sizeof(TestDetached));
+    UNITTEST_CHECK(NULL != detached);
+    if (NULL == detached) {
+        Test_unblock();
+        EnmaWorkerPool_free(pool);
+        return;
+    }   // end if
+    detached->value = 1;
+    UNITTEST_CHECK(EnmaWorkerPool_submit(pool, &detached->job, Test_record, detached));
+    UNITTEST_CHECK(EnmaWorkerPool_detach(pool, &detached->job, Test_release));
+    pthread_mutex_lock(&test_lock);
+    UNITTEST_CHECK(0 == test_release_num);
+    pthread_mutex_unlock(&test_lock);
+
+    // 切り離した仕事の後に受け付けた仕事が終われば, 後始末も済んでいる
+    EnmaWorkerJob job;
+    int value = 2;
+    UNITTEST_CHECK(EnmaWorkerPool_submit(pool, &job, Test_record, &value));
+    Test_unblock();
+    EnmaWorkerPool_wait(pool, &job);
+    pthread_mutex_lock(&test_lock);
+    UNITTEST_CHECK(2 == test_order_num && 1 == test_order[0] && 2 == test_order[1]);
+    UNITTEST_CHECK(1 == test_release_num);
+    pthread_mutex_unlock(&test_lock);
+
+    // 既に終わった仕事
+    UNITTEST_CHECK(!EnmaWorkerPool_detach(pool, &job, Test_release));
+    EnmaWorkerPool_wait(pool, &blocker);
+    EnmaWorkerPool_free(pool);
+    pthread_mutex_lock(&test_lock);
+    UNITTEST_CHECK(1 == test_release_num);
+    pthread_mutex_unlock(&test_lock);
+}   // end function : Test_detach
+
+/*
+ * 停止する際は, 待ち行列に残っている仕事を処理してからスレッドを終了する.
+ */
+static void
+Test_freeDrains(void)
+{
+    EnmaWorkerPool *pool = EnmaWorkerPool_new(2, TEST_QUEUE_SIZE);
+    UNITTEST_CHECK(NULL != pool);
+    if (NULL == pool) {
+        return;
+    }   // end if
+    Test_resetOrder();
+
+    EnmaWorkerJob blockers[2];
+    Test_block(pool, &blockers[0]);
+    // 2 つ目のスレッドも同じ仕事で塞ぐ
+    pthread_mutex_lock(&test_lock);
+    test_blocker_started = false;
+    pthread_mutex_unlock(&test_lock);
+    UNITTEST_CHECK(EnmaWorkerPool_submit(pool, &blockers[1], Test_blocker, NULL));
+    pthread_mutex_lock(&test_lock);
+    while (!test_blocker_started) {
+        pthread_cond_wait(&test_cond, &test_lock);
+    }   // end while
+    pthread_mutex_unlock(&test_lock);
+
+    for (int n = 0; n < TEST_QUEUE_SIZE; ++n) {
+        TestDetached *detached = (TestDetached *) malloc(sizeof(TestDetached));
+        UNITTEST_CHECK(NULL != detached);
+        if (NULL == detached) {
+            continue;
+        }   // end if
+        detached->value = n;
+        UNITTEST_CHECK(EnmaWorkerPool_submit(pool, &detached->job, Test_record, detached));
+        UNITTEST_CHECK(EnmaWorkerPool_detach(pool, &detached->job, Test_release));
+    }   // end for
+    EnmaWorkerJob overflow;
+    int value = TEST_QUEUE_SIZE;
+    UNITTEST_CHECK(!EnmaWorkerPool_submit(pool, &overflow, Test_record, &value));
+
+    Test_unblock();
+    EnmaWorkerPool_free(pool);
+    pthread_mutex_lock(&test_lock);
+    UNITTEST_CHECK(TEST_QUEUE_SIZE == test_order_num);
+    UNITTEST_CHECK(TEST_QUEUE_SIZE == test_release_num);
+    pthread_mutex_unlock(&test_lock);
+}   // end function : Test_freeDrains
+
+int
+main(void)
+{
+    alarm(TEST_TIMEOUT);
+    LogHandler_init();
+
+    Test_queueFull();
+    Test_detach();
+    Test_freeDrains();
+    return UNITTEST_RESULT();
+}   // end function : main
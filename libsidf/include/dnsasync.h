@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DNSASYNC_H__
+#define __DNSASYNC_H__
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <resolv.h>
+#include <arpa/nameser.h>
+
+struct DnsAsync;
+typedef struct DnsAsync DnsAsync;
+
+/*
+ * 問い合わせが完了した際に呼ばれる関数.
+ * stat が NETDB_SUCCESS の場合は msg, msglen に応答メッセージが渡される.
+ * それ以外 (タイムアウトなど) の場合は msg は NULL.
+ */
+typedef void (*DnsAsyncCallback) (void *arg, const char *domain, int rrtype, int stat,
+                                  const unsigned char *msg, int msglen);
+
+extern DnsAsync *DnsAsync_new(struct __res_state *resolver);
+extern void DnsAsync_free(DnsAsync *self);
+extern void DnsAsync_setTimeout(DnsAsync *self, unsigned int timeout_msec, unsigned int retry);
+extern int DnsAsync_submit(DnsAsync *self, const char *domain, int rrtype,
+                           DnsAsyncCallback callback, void *arg);
+extern int DnsAsync_dispatch(DnsAsync *self, int wait_msec);
+extern size_t DnsAsync_getQueryCount(const DnsAsync *self);
+
+#endif /* __DNSASYNC_H__ */
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DNSCACHE_H__
+#define __DNSCACHE_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "dnsshmcache.h"
+
+struct DnsCache;
+typedef struct DnsCache DnsCache;
+struct DnsCacheFlight;
+typedef struct DnsCacheFlight DnsCacheFlight;
+
+// DnsCache_joinFlight() の戻り値
+#define DNSCACHE_FLIGHT_LEAD (-1)   // 呼び出し側が問い合わせる
+#define DNSCACHE_FLIGHT_FAILED (-2) // 先行する問い合わせが失敗した
+
+extern DnsCache *DnsCache_new(size_t memory_limit);
+extern void DnsCache_free(DnsCache *self);
+extern int DnsCache_lookup(DnsCache *self, const char *domain, int rrtype, unsigned char *buf,
+                           size_t buflen, unsigned long *ttl);
+extern void DnsCache_store(DnsCache *self, const char *domain, int rrtype,
+                           const unsigned char *msg, size_t msglen, unsigned long ttl);
+extern int DnsCache_joinFlight(DnsCache *self, const char *domain, int rrtype, unsigned char *buf,
+                               size_t buflen, DnsCacheFlight **flight, int *stat,
+                               int64_t timeout_msec);
+extern void DnsCache_landFlight(DnsCache *self, DnsCacheFlight *flight, int stat,
+                                const unsigned char *msg, int msglen);
+extern void DnsCache_setGrace(DnsCache *self, unsigned long grace);
+extern void DnsCache_setNegativeTtl(DnsCache *self, unsigned long negative_ttl);
+extern unsigned long DnsCache_getNegativeTtl(const DnsCache *self);
+extern bool DnsCache_takeRefresh(DnsCache *self, char *domain, size_t domainlen, int *rrtype);
+extern void DnsCache_endRefresh(DnsCache *self, const char *domain, int rrtype);
+extern void DnsCache_stopRefresh(DnsCache *self);
+extern long DnsCache_save(DnsCache *self, const char *path);
+extern long DnsCache_load(DnsCache *self, const char *path);
+extern void DnsCache_setShared(DnsCache *self, DnsShmCache *shared);
+
+#endif /* __DNSCACHE_H__ */
@@ -13,16 +13,38 @@
 #define __DNSRESOLV_H__
 
 #include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <netinet/in.h>
 #include <netinet/in_systm.h>
 #include <netinet/ip.h>
 #include <resolv.h>
 #include <arpa/nameser.h>
 
+#include "ptrarray.h"
+#include "xbuffer.h"
+#include "memarena.h"
+#include "dnscache.h"
+#include "dnsasync.h"
+
 #ifndef NS_MAXMSG
 #define NS_MAXMSG NS_PACKETSZ
 #endif
 
+// 遅延モードで, 応答がまだ手元にないことを表す (netdb.h の h_errno と重ならない値)
+#define DNS_STAT_PENDING (-2)
+
+// DnsResolver_prefetch() で一度に並行に問い合わせる数の上限
+#define DNSRESOLV_PREFETCH_MAXNUM 32
+
+struct DnsResolver;
+
+// DnsResolver_prefetch() で並行に問い合わせている問い合わせ
+typedef struct DnsPrefetchQuery {
+    struct DnsResolver *resolver;
+    DnsCacheFlight *flight;     // 他のスレッドを待たせている場合の DnsCache_joinFlight() のハンドル
+} DnsPrefetchQuery;
+
 typedef struct DnsResolver {
     struct __res_state resolver;
     ns_msg msghanlde;
@@ -30,10 +52,48 @@ typedef struct DnsResolver {
     int resolv_errno;
     int msglen;
     unsigned char msgbuf[NS_MAXMSG];
+    DnsCache *cache;
+    bool deferred;
+    bool retain_answers;        // 問い合わせた応答を answers に残しておくか
+    unsigned long deferred_count;   // DNS_STAT_PENDING を返した回数
+    unsigned long transient_count;  // TRY_AGAIN, NO_RECOVERY, NETDB_INTERNAL を返した回数
+    PtrArray *answers;
+    MemArena *answer_arena;     // answers に残しておく応答の置き場所
+    unsigned long ttl;          // 直前に成功した問い合わせの応答の TTL
+    unsigned long min_ttl;      // DnsResolver_resetMinTtl() 以降に参照した応答の TTL の最小値
+    unsigned long pool_generation;  // DnsResolverPool で構築した際の resolv.conf の世代
+    XBuffer *txt_arena;         // DnsResolver_viewTxt() などが返す文字列の置き場所
+    XBuffer *name_arena;        // DnsResolver_viewMx() などが返すドメイン名の置き場所
+    PtrArray *prefetched;       // DnsResolver_prefetch() で得た応答
+    DnsAsync *fanout;           // DnsResolver_prefetch() で並行に問い合わせるためのスタブリゾルバ
+    DnsPrefetchQuery prefetch_query[DNSRESOLV_PREFETCH_MAXNUM];
+    int64_t deadline;           // CLOCK_MONOTONIC 基準の問い合わせの期限 (ミリ秒), 0 の場合は期限なし
 } DnsResolver;
 
+// DnsResolver_prefetch() に渡す問い合わせ
+typedef struct DnsQuestion {
+    const char *domain;
+    int rrtype;
+} DnsQuestion;
+
+/*
+ * DnsResolver_view*() で得た応答の各 RR の内容 (NULL 終端した文字列) を順に取り出すためのカーソル.
+ * 文字列は DnsResolver が保持する領域にあり, TXT (SPF) は次に同じ DnsResolver で
+ * DnsResolver_viewTxt() または DnsResolver_viewSpf() を, ドメイン名は次に
+ * DnsResolver_viewMx() または DnsResolver_viewPtr() を呼ぶまで有効.
+ * 構造体をコピーすれば先頭から取り出し直せる.
+ */
+typedef struct DnsRrView {
+    size_t num;                 // RR の数
+    const char *next;           // 次に返す文字列
+    const char *tail;
+} DnsRrView;
+
 typedef struct DnsResponse DnsResponse;
 
+struct DnsRefresher;
+typedef struct DnsRefresher DnsRefresher;
+
 typedef struct DnsAResponse {
     size_t num;
     struct in_addr addr[];
@@ -69,6 +129,23 @@ typedef struct DnsMxResponse {
 
 extern DnsResolver *DnsResolver_new(void);
 extern void DnsResolver_free(DnsResolver *self);
+extern void DnsResolver_setCache(DnsResolver *self, DnsCache *cache);
+extern void DnsResolver_setDeferred(DnsResolver *self, bool deferred);
+extern void DnsResolver_setRetainAnswers(DnsResolver *self, bool retain_answers);
+extern int DnsResolver_feedAnswer(DnsResolver *self, const char *domain, int rrtype, int stat,
+                                  const unsigned char *msg, int msglen);
+extern bool DnsResolver_takePendingQuery(DnsResolver *self, const char **domain, int *rrtype);
+extern unsigned long DnsResolver_getDeferredCount(const DnsResolver *self);
+extern unsigned long DnsResolver_getTransientCount(const DnsResolver *self);
+extern unsigned long DnsResolver_getTtl(const DnsResolver *self);
+extern void DnsResolver_resetMinTtl(DnsResolver *self);
+extern unsigned long DnsResolver_getMinTtl(const DnsResolver *self);
+extern void DnsResolver_resetAnswers(DnsResolver *self);
+extern size_t DnsResolver_prefetch(DnsResolver *self, const DnsQuestion *questions, size_t num);
+extern void DnsResolver_resetPrefetch(DnsResolver *self);
+extern void DnsResolver_reset(DnsResolver *self);
+extern void DnsResolver_setDeadline(DnsResolver *self, unsigned long timeout_msec);
+extern bool DnsResolver_isExpired(const DnsResolver *self);
 
 extern void DnsAResponse_free(DnsAResponse *self);
 extern void DnsAaaaResponse_free(DnsAaaaResponse *self);
@@ -85,8 +162,17 @@ extern int DnsResolver_lookupSpf(DnsResolver *self, const char *domain, DnsSpfRe
 extern int DnsResolver_lookupPtr(DnsResolver *self, int af, const void *addr,
                                  DnsPtrResponse **resp);
 
+extern int DnsResolver_viewMx(DnsResolver *self, const char *domain, DnsRrView *view);
+extern int DnsResolver_viewTxt(DnsResolver *self, const char *domain, DnsRrView *view);
+extern int DnsResolver_viewSpf(DnsResolver *self, const char *domain, DnsRrView *view);
+extern int DnsResolver_viewPtr(DnsResolver *self, int af, const void *addr, DnsRrView *view);
+extern const char *DnsRrView_next(DnsRrView *view);
+
 extern const char *DnsResolver_getErrorString(DnsResolver *self);
 
+extern DnsRefresher *DnsRefresher_start(DnsCache *cache);
+extern void DnsRefresher_stop(DnsRefresher *self);
+
 #define DNS_IP4_REVENT_SUFFIX "in-addr.arpa."
 #define DNS_IP6_REVENT_SUFFIX "ip6.arpa."
 
@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DNSRESOLVPOOL_H__
+#define __DNSRESOLVPOOL_H__
+
+#include "dnsresolv.h"
+
+struct DnsResolverPool;
+typedef struct DnsResolverPool DnsResolverPool;
+
+extern DnsResolverPool *DnsResolverPool_new(void);
+extern void DnsResolverPool_free(DnsResolverPool *self);
+extern DnsResolver *DnsResolverPool_acquire(DnsResolverPool *self);
+extern void DnsResolverPool_release(DnsResolverPool *self, DnsResolver *resolver);
+
+#endif /* __DNSRESOLVPOOL_H__ */
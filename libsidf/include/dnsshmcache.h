@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DNSSHMCACHE_H__
+#define __DNSSHMCACHE_H__
+
+#include <sys/types.h>
+
+struct DnsShmCache;
+typedef struct DnsShmCache DnsShmCache;
+
+extern DnsShmCache *DnsShmCache_open(const char *name, size_t memory_limit);
+extern void DnsShmCache_close(DnsShmCache *self);
+extern int DnsShmCache_lookup(DnsShmCache *self, const char *key, size_t keylen, int rrtype,
+                              unsigned char *buf, size_t buflen, unsigned long *ttl);
+extern void DnsShmCache_store(DnsShmCache *self, const char *key, size_t keylen, int rrtype,
+                              const unsigned char *msg, size_t msglen, unsigned long ttl);
+
+#endif /* __DNSSHMCACHE_H__ */
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __FREELIST_H__
+#define __FREELIST_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct FreeList;
+typedef struct FreeList FreeList;
+
+extern FreeList *FreeList_new(size_t capacity);
+extern void FreeList_free(FreeList *self);
+extern bool FreeList_push(FreeList *self, void *obj);
+extern void *FreeList_pop(FreeList *self);
+
+#endif /* __FREELIST_H__ */
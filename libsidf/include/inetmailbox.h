@@ -14,6 +14,7 @@
 
 #include <stdbool.h>
 #include "xbuffer.h"
+#include "memarena.h"
 
 struct InetMailbox;
 typedef struct InetMailbox InetMailbox;
@@ -44,5 +45,9 @@ extern InetMailbox *InetMailbox_buildSendmailPath(const char *head, const char *
                                                   const char **nextp, const char **errptr);
 extern InetMailbox *InetMailbox_buildSendmailReversePath(const char *head, const char *tail,
                                                          const char **nextp, const char **errptr);
+extern InetMailbox *InetMailbox_buildSendmailReversePathInArena(MemArena *arena, const char *head,
+                                                                const char *tail,
+                                                                const char **nextp,
+                                                                const char **errptr);
 
 #endif /* __INET_MAILBOX_H__ */
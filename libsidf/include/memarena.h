@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __MEMARENA_H__
+#define __MEMARENA_H__
+
+#include <sys/types.h>
+
+struct MemArena;
+typedef struct MemArena MemArena;
+
+extern MemArena *MemArena_new(size_t chunk_size);
+extern void MemArena_free(MemArena *self);
+extern void MemArena_reset(MemArena *self);
+extern void *MemArena_alloc(MemArena *self, size_t size);
+extern char *MemArena_strdup(MemArena *self, const char *s);
+
+#endif /* __MEMARENA_H__ */
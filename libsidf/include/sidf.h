@@ -30,6 +30,7 @@ typedef enum SidfStat {
     SIDF_STAT_DNS_HOST_NOT_FOUND,
     SIDF_STAT_DNS_TRY_AGAIN,
     SIDF_STAT_DNS_NO_RECOVERY,
+    SIDF_STAT_DNS_PENDING,      // エラーではないが, DNS の応答待ちで評価を中断した
 } SidfStat;
 
 typedef enum SidfRecordScope {
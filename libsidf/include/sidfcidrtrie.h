@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __SIDFCIDRTRIE_H__
+#define __SIDFCIDRTRIE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct SidfCidrTrie;
+typedef struct SidfCidrTrie SidfCidrTrie;
+
+extern SidfCidrTrie *SidfCidrTrie_new(unsigned int addrbits);
+extern void SidfCidrTrie_free(SidfCidrTrie *self);
+extern bool SidfCidrTrie_insert(SidfCidrTrie *self, const void *prefix, unsigned int prefixlen,
+                                unsigned int value);
+extern int SidfCidrTrie_lookup(const SidfCidrTrie *self, const void *addr);
+
+#endif /* __SIDFCIDRTRIE_H__ */
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __SIDFINCLUDETREE_H__
+#define __SIDFINCLUDETREE_H__
+
+#include <sys/types.h>
+#include "ptrarray.h"
+#include "strarray.h"
+
+struct SidfRecord;
+
+typedef struct SidfIncludeNode {
+    struct SidfRecord *record;  // ノードが保持する参照
+    struct SidfIncludeNode **child; // directive と同じ添字, include メカニズム以外は NULL
+    char domain[];
+} SidfIncludeNode;
+
+typedef struct SidfIncludeTree {
+    // 参照カウント. SidfRecordCache に格納された木は複数のリクエストから共有される.
+    unsigned int refcount;
+    SidfIncludeNode *root;
+    PtrArray *node;             // 木に含まれる全てのノード
+    StrArray *domain;           // 木に含まれる全てのドメイン名, ループの検出に使う
+    unsigned int include_num;   // 木に含まれる include メカニズムの数
+    unsigned long ttl;          // 木を構成するレコードの TTL の最小値
+} SidfIncludeTree;
+
+extern SidfIncludeTree *SidfIncludeTree_new(void);
+extern void SidfIncludeTree_free(SidfIncludeTree *self);
+extern SidfIncludeTree *SidfIncludeTree_ref(SidfIncludeTree *self);
+extern SidfIncludeNode *SidfIncludeTree_addNode(SidfIncludeTree *self, const char *domain,
+                                                struct SidfRecord *record);
+
+#endif /* __SIDFINCLUDETREE_H__ */
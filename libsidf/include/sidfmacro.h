@@ -20,5 +20,6 @@ extern SidfStat SidfMacro_parseDomainSpec(const SidfRequest *request, const char
                                           const char *tail, const char **nextp, XBuffer *xbuf);
 extern SidfStat SidfMacro_parseExplainString(const SidfRequest *request, const char *head,
                                              const char *tail, const char **nextp, XBuffer *xbuf);
+extern bool SidfMacro_hasSenderOrTimeMacro(const char *head, const char *tail);
 
 #endif /* __SIDFMACRO_H__ */
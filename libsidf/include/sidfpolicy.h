@@ -14,6 +14,10 @@
 
 #include <stdbool.h>
 #include "sidf.h"
+#include "sidfrecordcache.h"
+#include "sidfresultcache.h"
+
+struct SidfRecord;
 
 typedef struct SidfPolicy {
     // SPF RR (type 99) を引くか
@@ -27,6 +31,9 @@ typedef struct SidfPolicy {
     // SPFレコード中のどのメカニズムにもマッチしなかった場合, Neutral を返す前にこのレコードの評価を挟む
     // 評価されるタイミングは redirect modifier が存在しなかった場合
     char *local_policy;
+    // local_policy を SidfPolicy_setLocalPolicyDirectives() の時点でパースしたもの.
+    // マクロを含む場合はリクエスト毎に展開する必要があるので NULL.
+    struct SidfRecord *local_policy_record;
     // local_policy によって "Fail" になった場合に使用する explanation を設定する. マクロ使用可.
     char *local_policy_explanation;
     // 1回のSPF評価で許容するDNSルックアップを伴うメカニズムの最大数, RFC4408 では 10 と定めている
@@ -42,6 +49,21 @@ typedef struct SidfPolicy {
     SidfScore overwrite_all_directive_score;
     // "+all" を評価したらログに記録する.
     bool logging_plus_all_directive;
+    // パース済みレコードのキャッシュ, NULL の場合はキャッシュしない. SidfPolicy は所有しない.
+    SidfRecordCache *record_cache;
+    // マクロを含まない include の木を解決済みの状態で record_cache に保持し, DNS を引かずに評価する.
+    // record_cache が NULL の場合は無効.
+    bool flatten_include;
+    // 評価結果のキャッシュ, NULL の場合はキャッシュしない. SidfPolicy は所有しない.
+    // 評価結果は SidfPolicy の設定に依存するので, 他の SidfPolicy と共有してはならない.
+    SidfResultCache *result_cache;
+    // DNS ルックアップを伴う directive を評価する前に, 後続の directive の問い合わせを
+    // まとめて並行に送っておく数. 0 の場合は先読みしない.
+    // 先読みするのは include, a, mx, exists メカニズムのうち, domain-spec がマクロを含まないもののみ.
+    unsigned int prefetch_directives;
+    // 1回の評価にかける時間の上限 (秒). 0 の場合は制限しない.
+    // 上限に近づくと DNS の問い合わせ毎のタイムアウトを縮め, 過ぎた時点で TempError を返す.
+    unsigned int eval_timeout;
 } SidfPolicy;
 
 extern SidfPolicy *SidfPolicy_new(void);
@@ -15,8 +15,19 @@
 #include <stdbool.h>
 #include "inetmailbox.h"
 #include "mailheaders.h"
+#include "memarena.h"
+
+struct SidfPraScanner;
+typedef struct SidfPraScanner SidfPraScanner;
 
 extern bool SidfPra_extract(const MailHeaders *headers, int *pra_index, InetMailbox **pra_mailbox);
+extern bool SidfPra_isRelevantHeader(const char *headerf, bool *need_value);
+extern SidfPraScanner *SidfPraScanner_new(MemArena *arena);
+extern void SidfPraScanner_free(SidfPraScanner *self);
+extern void SidfPraScanner_reset(SidfPraScanner *self);
+extern bool SidfPraScanner_feed(SidfPraScanner *self, const char *headerf, const char *headerv);
+extern bool SidfPraScanner_extract(const SidfPraScanner *self, const char **pra_header,
+                                   InetMailbox **pra_mailbox);
 
 #define SIDF_PRA_RESENT_SENDER_HEADER "Resent-Sender"
 #define SIDF_PRA_RESENT_FROM_HEADER "Resent-From"
@@ -20,6 +20,7 @@
 #include "xbuffer.h"
 #include "sidf.h"
 #include "sidfrequest.h"
+#include "sidfcidrtrie.h"
 
 typedef enum SidfTermCidrOption {
     SIDF_TERM_CIDR_OPTION_NONE,
@@ -52,8 +53,18 @@ typedef struct SidfTerm {
     // DNS query を投げるための 253 文字以下に丸めたドメイン.
     // param.domain 内のどこかへの参照を保持し, 通常は先頭を指す.
     const char *querydomain;
+    // domain-spec がマクロを含む場合は true. その場合 querydomain はリクエストに依存する.
+    bool involve_macro;
 } SidfTerm;
 
+// 連続する ip4/ip6 メカニズムをまとめて評価するための trie
+typedef struct SidfCidrRun {
+    unsigned int begin;         // 先頭の directive の番号
+    unsigned int end;           // 末尾の directive の次の番号
+    SidfCidrTrie *trie4;        // ip4 メカニズムが含まれない場合は NULL
+    SidfCidrTrie *trie6;        // ip6 メカニズムが含まれない場合は NULL
+} SidfCidrRun;
+
 typedef struct SidfRecord {
     // マクロを展開してから保持する選択をしたので, リクエストに依存するのは避けられない
     const SidfRequest *request;
@@ -65,12 +76,19 @@ typedef struct SidfRecord {
         SidfTerm *exp;
     } modifiers;
     // PtrArray *modifiers;
+    // 参照カウント. SidfRecordCache に格納されたレコードは複数のリクエストから共有される.
+    unsigned int refcount;
+    // directives 中の連続する ip4/ip6 メカニズムを trie にまとめたもの, directive の順に並ぶ
+    SidfCidrRun *cidr_run;
+    unsigned int cidr_run_num;
 } SidfRecord;
 
 extern SidfStat SidfRecord_build(const SidfRequest *request, SidfRecordScope scope,
                                  const char *record_head, const char *record_tail,
                                  SidfRecord **recordobj);
 extern void SidfRecord_free(SidfRecord *self);
+extern SidfRecord *SidfRecord_ref(SidfRecord *self);
+extern bool SidfRecord_isMacroFree(const char *record_head, const char *record_tail);
 extern SidfStat SidfRecord_getSidfScope(const char *record_head, const char *record_tail,
                                         SidfRecordScope *scope, const char **scope_tail);
 
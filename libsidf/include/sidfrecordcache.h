@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __SIDFRECORDCACHE_H__
+#define __SIDFRECORDCACHE_H__
+
+#include <sys/types.h>
+#include "sidf.h"
+
+struct SidfRecord;
+struct SidfIncludeTree;
+struct SidfRecordCache;
+typedef struct SidfRecordCache SidfRecordCache;
+
+extern SidfRecordCache *SidfRecordCache_new(size_t entry_limit);
+extern void SidfRecordCache_free(SidfRecordCache *self);
+extern struct SidfRecord *SidfRecordCache_lookup(SidfRecordCache *self, const char *domain,
+                                                 SidfRecordScope scope, unsigned long *ttl);
+extern void SidfRecordCache_store(SidfRecordCache *self, const char *domain,
+                                  SidfRecordScope scope, struct SidfRecord *record,
+                                  unsigned long ttl);
+extern struct SidfIncludeTree *SidfRecordCache_lookupTree(SidfRecordCache *self,
+                                                          const char *domain,
+                                                          SidfRecordScope scope,
+                                                          unsigned long *ttl);
+extern void SidfRecordCache_storeTree(SidfRecordCache *self, const char *domain,
+                                      SidfRecordScope scope, struct SidfIncludeTree *tree);
+
+#endif /* __SIDFRECORDCACHE_H__ */
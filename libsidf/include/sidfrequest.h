@@ -26,6 +26,9 @@
 #include "sidf.h"
 #include "sidfpolicy.h"
 
+struct SidfFrame;
+typedef struct SidfFrame SidfFrame;
+
 typedef struct SidfRequest {
     const SidfPolicy *policy;
     SidfRecordScope scope;      // SPF / SIDF
@@ -45,6 +48,12 @@ typedef struct SidfRequest {
     XBuffer *xbuf;
     DnsResolver *resolver;      // DNS リゾルバへの参照
     char *explanation;          // fail 時の explanation
+    bool sender_dependent;      // 送信者のローカルパートや時刻に依存するマクロを展開した場合は true
+    unsigned long transient_count;  // 評価を開始した時点でリゾルバが一時的なエラーを返していた回数
+    unsigned long min_ttl;      // 評価中に参照したキャッシュの残りの有効期間の最小値, DNS の応答の TTL は DnsResolver が数える
+    SidfFrame *frame;           // 評価スタック
+    unsigned int frame_num;     // 評価スタックに積まれているフレームの数
+    unsigned int frame_capacity;    // 評価スタックに確保済みのフレームの数
 } SidfRequest;
 
 extern SidfRequest *SidfRequest_new(const SidfPolicy *policy, DnsResolver *resolver);
@@ -52,6 +61,8 @@ extern void SidfRequest_reset(SidfRequest *self);
 extern void SidfRequest_free(SidfRequest *self);
 extern const char *SidfRequest_getDomain(const SidfRequest *self);
 extern SidfScore SidfRequest_eval(SidfRequest *self, SidfRecordScope scope);
+extern SidfStat SidfRequest_start(SidfRequest *self, SidfRecordScope scope, SidfScore *score);
+extern SidfStat SidfRequest_resume(SidfRequest *self, SidfScore *score);
 extern bool SidfRequest_setSender(SidfRequest *self, const InetMailbox *sender);
 extern bool SidfRequest_setHeloDomain(SidfRequest *self, const char *domain);
 extern bool SidfRequest_setIpAddr(SidfRequest *self, int af, const struct sockaddr *addr);
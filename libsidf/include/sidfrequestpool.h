@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __SIDFREQUESTPOOL_H__
+#define __SIDFREQUESTPOOL_H__
+
+#include <sys/types.h>
+#include "dnsresolv.h"
+#include "sidfpolicy.h"
+#include "sidfrequest.h"
+
+struct SidfRequestPool;
+typedef struct SidfRequestPool SidfRequestPool;
+
+extern SidfRequestPool *SidfRequestPool_new(size_t capacity);
+extern void SidfRequestPool_free(SidfRequestPool *self);
+extern SidfRequest *SidfRequestPool_acquire(SidfRequestPool *self, const SidfPolicy *policy,
+                                            DnsResolver *resolver);
+extern void SidfRequestPool_release(SidfRequestPool *self, SidfRequest *request);
+
+#endif /* __SIDFREQUESTPOOL_H__ */
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __SIDFRESULTCACHE_H__
+#define __SIDFRESULTCACHE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "sidf.h"
+
+struct SidfResultCache;
+typedef struct SidfResultCache SidfResultCache;
+
+extern SidfResultCache *SidfResultCache_new(size_t entry_limit);
+extern void SidfResultCache_free(SidfResultCache *self);
+extern bool SidfResultCache_lookup(SidfResultCache *self, SidfRecordScope scope, int af,
+                                   const void *addr, const char *domain, const char *helo,
+                                   SidfScore *score, char **explanation);
+extern void SidfResultCache_store(SidfResultCache *self, SidfRecordScope scope, int af,
+                                  const void *addr, const char *domain, const char *helo,
+                                  SidfScore score, const char *explanation, unsigned long ttl);
+
+#endif /* __SIDFRESULTCACHE_H__ */
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "cacheutil.h"
+
+#define CACHEUTIL_FNV_OFFSET 2166136261U
+#define CACHEUTIL_FNV_PRIME 16777619U
+
+/**
+ * キャッシュの有効期限の基準にする CLOCK_MONOTONIC の秒数を返す.
+ * 秒単位で十分なので, 使えれば安価な CLOCK_MONOTONIC_COARSE を使う.
+ */
+time_t
+CacheUtil_now(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    if (0 == clock_gettime(CLOCK_MONOTONIC_COARSE, &ts)) {
+        return ts.tv_sec;
+    }   // end if
+#endif
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}   // end function : CacheUtil_now
+
+/**
+ * ドメイン名からキャッシュのキーを作る. 小文字に揃え, 末尾の '.' を取り除く.
+ * @return キーの長さ, buflen に収まらない場合は -1.
+ */
+int
+CacheUtil_normalizeDomain(const char *domain, char *buf, size_t buflen)
+{
+    size_t len = strlen(domain);
+    if (0 < len && '.' == domain[len - 1]) {
+        --len;
+    }   // end if
+    if (buflen <= len) {
+        return -1;
+    }   // end if
+    for (size_t n = 0; n < len; ++n) {
+        buf[n] = tolower((unsigned char) domain[n]);
+    }   // end for
+    buf[len] = '\0';
+    return (int) len;
+}   // end function : CacheUtil_normalizeDomain
+
+/**
+ * FNV-1a
+ * DnsShmCache では全てのプロセスで同じ値になる必要があるので, 実行毎に変わる種は使わない.
+ */
+uint32_t
+CacheUtil_hash(const void *key, size_t keylen)
+{
+    const unsigned char *p = (const unsigned char *) key;
+    uint32_t hash = CACHEUTIL_FNV_OFFSET;
+    for (size_t n = 0; n < keylen; ++n) {
+        hash ^= p[n];
+        hash *= CACHEUTIL_FNV_PRIME;
+    }   // end for
+    return hash;
+}   // end function : CacheUtil_hash
+
+/**
+ * キーに RR タイプやスコープを加えたものの FNV-1a ハッシュ値を返す.
+ */
+uint32_t
+CacheUtil_hashTyped(const char *key, size_t keylen, uint32_t type)
+{
+    uint32_t hash = CacheUtil_hash(key, keylen);
+    hash ^= type;
+    hash *= CACHEUTIL_FNV_PRIME;
+    return hash;
+}   // end function : CacheUtil_hashTyped
+
+/**
+ * 節を LRU リストから外す.
+ */
+void
+CacheLru_unlink(CacheLru *lru, CacheLruLink *link)
+{
+    if (NULL != link->prev) {
+        link->prev->next = link->next;
+    } else {
+        lru->head = link->next;
+    }   // end if
+    if (NULL != link->next) {
+        link->next->prev = link->prev;
+    } else {
+        lru->tail = link->prev;
+    }   // end if
+    link->prev = link->next = NULL;
+}   // end function : CacheLru_unlink
+
+/**
+ * 節を LRU リストの先頭 (最近参照されたもの) に加える.
+ */
+void
+CacheLru_push(CacheLru *lru, CacheLruLink *link)
+{
+    link->prev = NULL;
+    link->next = lru->head;
+    if (NULL != lru->head) {
+        lru->head->prev = link;
+    } else {
+        lru->tail = link;
+    }   // end if
+    lru->head = link;
+}   // end function : CacheLru_push
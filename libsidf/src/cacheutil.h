@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * DnsCache, DnsShmCache, SidfRecordCache, SidfResultCache が共通に使う内部用の部品.
+ * libsidf の外には公開しない.
+ */
+
+#ifndef __CACHEUTIL_H__
+#define __CACHEUTIL_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * LRU リストの節. エントリの構造体の先頭に置き, CACHELRU_ENTRY() でエントリに戻す.
+ */
+typedef struct CacheLruLink {
+    struct CacheLruLink *prev;
+    struct CacheLruLink *next;
+} CacheLruLink;
+
+typedef struct CacheLru {
+    CacheLruLink *head;         // 最近参照されたもの
+    CacheLruLink *tail;         // 次に追い出されるもの
+} CacheLru;
+
+#define CACHELRU_ENTRY(type, link) ((type *) (link))
+
+extern time_t CacheUtil_now(void);
+extern int CacheUtil_normalizeDomain(const char *domain, char *buf, size_t buflen);
+extern uint32_t CacheUtil_hash(const void *key, size_t keylen);
+extern uint32_t CacheUtil_hashTyped(const char *key, size_t keylen, uint32_t type);
+extern void CacheLru_unlink(CacheLru *lru, CacheLruLink *link);
+extern void CacheLru_push(CacheLru *lru, CacheLruLink *link);
+
+#endif /* __CACHEUTIL_H__ */
@@ -0,0 +1,793 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * ノンブロッキングな DNS スタブリゾルバ.
+ * 一連の問い合わせを始める際に, 借りた res_state のネームサーバ毎に UDP ソケットを 1 つ開き,
+ * 多数の問い合わせをクエリ ID で多重化して 1 つの poll() ループで処理する.
+ * 偽装された応答を受け入れにくくするため, クエリ ID は暗号論的に安全な乱数で選び,
+ * ソケットは乱数で選んだ送信元ポートに bind して, 全ての問い合わせが完了した時点で閉じる.
+ * 問い合わせ毎にタイムアウトを持ち, タイムアウトした場合は次のネームサーバへ再送する.
+ * 切り詰められた応答を受け取った問い合わせは, 同じネームサーバに TCP で問い合わせ直す.
+ * TCP の問い合わせもノンブロッキングでおこない, 同じ poll() ループで処理する.
+ * 問い合わせの完了はコールバック関数で通知する.
+ * DnsAsync オブジェクトはスレッド間で共有できない. 1 つのスレッドから使用すること.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <resolv.h>
+#ifdef HAVE_SYS_RANDOM_H
+# include <sys/random.h>
+#endif
+
+#include "posixaux.h"
+#include "dnsasync.h"
+
+#ifndef NS_MAXMSG
+#define NS_MAXMSG NS_PACKETSZ
+#endif
+
+#define DNSASYNC_ID_BUCKETS 256
+#define DNSASYNC_TCP_MAXNUM 16  // 同時に TCP で問い合わせる数の上限
+#define DNSASYNC_RANDOM_POOL 32 // まとめて取得しておく乱数 (16 ビット) の数
+#define DNSASYNC_PORT_MIN 1024  // 送信元ポートに使う範囲の下限
+#define DNSASYNC_BIND_RETRY 8   // 乱数で選んだポートが使用中だった場合に選び直す回数
+
+typedef struct DnsAsyncQuery {
+    struct DnsAsyncQuery *id_next;
+    struct DnsAsyncQuery *timer_prev;
+    struct DnsAsyncQuery *timer_next;
+    uint64_t deadline;          // CLOCK_MONOTONIC 基準のタイムアウト時刻 (ミリ秒)
+    unsigned int attempt;       // これまでに送信した回数
+    unsigned int server;        // 直近の送信先ネームサーバ
+    unsigned int tried;         // これまでに送信したネームサーバのビットマスク
+    int tcp_fd;                 // TCP で問い合わせている場合のソケット, それ以外は -1
+    bool tcp_sending;           // TCP で問い合わせを送信中か (偽の場合は応答を受信中)
+    size_t tcp_done;            // TCP で送信済み, または受信済みのバイト数
+    unsigned char *tcp_buf;     // TCP で送受信するメッセージ (先頭 2 バイトは長さ)
+    DnsAsyncCallback callback;
+    void *arg;
+    int rrtype;
+    unsigned short id;
+    int querylen;
+    unsigned char query[NS_PACKETSZ];
+    char domain[];
+} DnsAsyncQuery;
+
+typedef struct DnsAsyncServer {
+    int fd;                     // 問い合わせ中でない場合は -1
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} DnsAsyncServer;
+
+struct DnsAsync {
+    struct __res_state *resolver;   // 借りているだけなので解放しない
+    DnsAsyncServer server[MAXNS];
+    struct pollfd pollfds[MAXNS + DNSASYNC_TCP_MAXNUM];
+    unsigned int server_num;
+    DnsAsyncQuery *tcp_query[DNSASYNC_TCP_MAXNUM];  // TCP で問い合わせ中の問い合わせ
+    unsigned int tcp_num;
+    unsigned int timeout_msec;
+    unsigned int retry;
+    bool server_open;           // ネームサーバ毎のソケットを開いているか
+    unsigned int random_left;   // random_pool の未使用の数
+    uint16_t random_pool[DNSASYNC_RANDOM_POOL];
+    size_t query_num;
+    DnsAsyncQuery *id_bucket[DNSASYNC_ID_BUCKETS];
+    /*
+     * タイムアウト待ちの問い合わせのリスト.
+     * タイムアウトまでの時間は全ての問い合わせで等しいので, 送信順に末尾に繋いでいけば
+     * 常にタイムアウト時刻の昇順に並ぶ.
+     */
+    DnsAsyncQuery *timer_head;
+    DnsAsyncQuery *timer_tail;
+    unsigned char recvbuf[NS_MAXMSG];
+};
+
+static uint64_t
+DnsAsync_now(void)
+{
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}   // end function : DnsAsync_now
+
+static DnsAsyncQuery *
+DnsAsync_findQuery(DnsAsync *self, unsigned short id)
+{
+    for (DnsAsyncQuery *q = self->id_bucket[id % DNSASYNC_ID_BUCKETS]; NULL != q; q = q->id_next) {
+        if (q->id == id) {
+            return q;
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function : DnsAsync_findQuery
+
+/*
+ * buf を暗号論的に安全な乱数で埋める.
+ * @return 成功した場合は 0, 乱数が得られなかった場合は -1.
+ */
+static int
+DnsAsync_fillRandom(void *buf, size_t buflen)
+{
+#ifdef HAVE_ARC4RANDOM_BUF
+    arc4random_buf(buf, buflen);
+    return 0;
+#else
+# ifdef HAVE_GETRANDOM
+    // 256 バイト以下の要求は途中で打ち切られない
+    ssize_t randlen;
+    SKIP_EINTR(randlen = getrandom(buf, buflen, 0));
+    if ((ssize_t) buflen == randlen) {
+        return 0;
+    }   // end if
+    if (ENOSYS != errno) {
+        return -1;
+    }   // end if
+    // カーネルが getrandom() に対応していない場合は /dev/urandom から読む
+# endif
+    int fd;
+    SKIP_EINTR(fd = open("/dev/urandom", O_RDONLY));
+    if (0 > fd) {
+        return -1;
+    }   // end if
+    unsigned char *p = (unsigned char *) buf;
+    size_t done = 0;
+    while (done < buflen) {
+        ssize_t readlen;
+        SKIP_EINTR(readlen = read(fd, p + done, buflen - done));
+        if (0 >= readlen) {
+            close(fd);
+            return -1;
+        }   // end if
+        done += readlen;
+    }   // end while
+    close(fd);
+    return 0;
+#endif
+}   // end function : DnsAsync_fillRandom
+
+/*
+ * 16 ビットの乱数を返す. 呼び出しの度にシステムコールを発行しないよう, まとめて取得しておく.
+ * @return 成功した場合は 0, 乱数が得られなかった場合は -1.
+ */
+static int
+DnsAsync_random(DnsAsync *self, uint16_t *value)
+{
+    if (0 == self->random_left) {
+        if (0 > DnsAsync_fillRandom(self->random_pool, sizeof(self->random_pool))) {
+            return -1;
+        }   // end if
+        self->random_left = DNSASYNC_RANDOM_POOL;
+    }   // end if
+    *value = self->random_pool[--(self->random_left)];
+    self->random_pool[self->random_left] = 0;
+    return 0;
+}   // end function : DnsAsync_random
+
+/*
+ * 使用中でないクエリ ID を乱数で選ぶ.
+ * @return 成功した場合は 0, 乱数が得られなかった場合は -1.
+ */
+static int
+DnsAsync_nextId(DnsAsync *self, unsigned short *id)
+{
+    while (true) {
+        uint16_t value;
+        if (0 > DnsAsync_random(self, &value)) {
+            return -1;
+        }   // end if
+        if (NULL == DnsAsync_findQuery(self, value)) {
+            *id = value;
+            return 0;
+        }   // end if
+    }   // end while
+}   // end function : DnsAsync_nextId
+
+static void
+DnsAsync_unlinkTimer(DnsAsync *self, DnsAsyncQuery *q)
+{
+    if (NULL == q->timer_prev && self->timer_head != q) {
+        // タイムアウト待ちのリストに繋がっていない
+        return;
+    }   // end if
+    if (NULL != q->timer_prev) {
+        q->timer_prev->timer_next = q->timer_next;
+    } else {
+        self->timer_head = q->timer_next;
+    }   // end if
+    if (NULL != q->timer_next) {
+        q->timer_next->timer_prev = q->timer_prev;
+    } else {
+        self->timer_tail = q->timer_prev;
+    }   // end if
+    q->timer_prev = q->timer_next = NULL;
+}   // end function : DnsAsync_unlinkTimer
+
+static void
+DnsAsync_unlinkId(DnsAsync *self, DnsAsyncQuery *q)
+{
+    for (DnsAsyncQuery **pp = &(self->id_bucket[q->id % DNSASYNC_ID_BUCKETS]); NULL != *pp;
+         pp = &((*pp)->id_next)) {
+        if (*pp == q) {
+            *pp = q->id_next;
+            break;
+        }   // end if
+    }   // end for
+}   // end function : DnsAsync_unlinkId
+
+/*
+ * 問い合わせをタイムアウト待ちのリストの末尾に繋ぐ.
+ */
+static void
+DnsAsync_linkTimer(DnsAsync *self, DnsAsyncQuery *q)
+{
+    q->deadline = DnsAsync_now() + self->timeout_msec;
+    q->timer_next = NULL;
+    q->timer_prev = self->timer_tail;
+    if (NULL != self->timer_tail) {
+        self->timer_tail->timer_next = q;
+    } else {
+        self->timer_head = q;
+    }   // end if
+    self->timer_tail = q;
+}   // end function : DnsAsync_linkTimer
+
+/*
+ * 問い合わせを q->server に送信し, タイムアウト待ちのリストの末尾に繋ぐ.
+ * 送信に失敗した場合もタイムアウトを待って再送するので, エラーは無視する.
+ */
+static void
+DnsAsync_send(DnsAsync *self, DnsAsyncQuery *q)
+{
+    ++(q->attempt);
+    q->tried |= 1U << q->server;
+    (void) send(self->server[q->server].fd, q->query, q->querylen, 0);
+    DnsAsync_linkTimer(self, q);
+}   // end function : DnsAsync_send
+
+/*
+ * TCP での問い合わせをやめ, ソケットを閉じる. 受信した応答を参照できるように tcp_buf は残す.
+ */
+static void
+DnsAsync_closeTcp(DnsAsync *self, DnsAsyncQuery *q)
+{
+    if (0 > q->tcp_fd) {
+        return;
+    }   // end if
+    for (unsigned int n = 0; n < self->tcp_num; ++n) {
+        if (self->tcp_query[n] == q) {
+            self->tcp_query[n] = self->tcp_query[--(self->tcp_num)];
+            break;
+        }   // end if
+    }   // end for
+    close(q->tcp_fd);
+    q->tcp_fd = -1;
+}   // end function : DnsAsync_closeTcp
+
+/*
+ * 問い合わせを完了させ, コールバック関数を呼ぶ.
+ * コールバック関数の中から DnsAsync_submit() を呼んでも構わないように,
+ * 管理構造から外してから呼び出す.
+ */
+static void
+DnsAsync_complete(DnsAsync *self, DnsAsyncQuery *q, int stat, const unsigned char *msg,
+                  int msglen)
+{
+    DnsAsync_unlinkTimer(self, q);
+    DnsAsync_unlinkId(self, q);
+    DnsAsync_closeTcp(self, q);
+    --(self->query_num);
+    q->callback(q->arg, q->domain, q->rrtype, stat, msg, msglen);
+    free(q->tcp_buf);
+    free(q);
+}   // end function : DnsAsync_complete
+
+static bool
+DnsAsync_isSameName(const char *name1, const char *name2)
+{
+    size_t len1 = strlen(name1);
+    size_t len2 = strlen(name2);
+    if (0 < len1 && '.' == name1[len1 - 1]) {
+        --len1;
+    }   // end if
+    if (0 < len2 && '.' == name2[len2 - 1]) {
+        --len2;
+    }   // end if
+    return (len1 == len2 && 0 == strncasecmp(name1, name2, len1)) ? true : false;
+}   // end function : DnsAsync_isSameName
+
+/*
+ * 受信したメッセージが問い合わせに対する応答であるか, question section を比較して確認する.
+ */
+static bool
+DnsAsync_isResponseOf(const DnsAsyncQuery *q, const unsigned char *msg, int msglen)
+{
+    ns_msg msghandle;
+    ns_rr rr;
+    if (0 > ns_initparse(msg, msglen, &msghandle) || 0 == ns_msg_getflag(msghandle, ns_f_qr)
+        || 1 != ns_msg_count(msghandle, ns_s_qd)
+        || 0 != ns_parserr(&msghandle, ns_s_qd, 0, &rr)) {
+        return false;
+    }   // end if
+    return (q->rrtype == (int) ns_rr_type(rr) && ns_c_in == ns_rr_class(rr)
+            && DnsAsync_isSameName(q->domain, ns_rr_name(rr))) ? true : false;
+}   // end function : DnsAsync_isResponseOf
+
+/*
+ * 切り詰められた応答を受け取った問い合わせを, 応答を返したネームサーバに TCP で問い合わせ直す.
+ * ソケットの接続はノンブロッキングでおこない, 以降の送受信は DnsAsync_handleTcp() でおこなう.
+ */
+static void
+DnsAsync_startTcp(DnsAsync *self, DnsAsyncQuery *q, unsigned int server)
+{
+    if (DNSASYNC_TCP_MAXNUM <= self->tcp_num) {
+        goto fail;
+    }   // end if
+    q->tcp_buf = (unsigned char *) malloc(NS_INT16SZ + NS_MAXMSG);
+    if (NULL == q->tcp_buf) {
+        goto fail;
+    }   // end if
+    const struct sockaddr *addr = (const struct sockaddr *) &(self->server[server].addr);
+    q->tcp_fd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (0 > q->tcp_fd) {
+        goto fail;
+    }   // end if
+    self->tcp_query[(self->tcp_num)++] = q;
+    (void) fcntl(q->tcp_fd, F_SETFD, FD_CLOEXEC);
+    if (0 > fcntl(q->tcp_fd, F_SETFL, fcntl(q->tcp_fd, F_GETFL) | O_NONBLOCK)
+        || (0 > connect(q->tcp_fd, addr, self->server[server].addrlen)
+            && EINPROGRESS != errno)) {
+        goto fail;
+    }   // end if
+    ns_put16((unsigned int) q->querylen, q->tcp_buf);
+    memcpy(q->tcp_buf + NS_INT16SZ, q->query, q->querylen);
+    q->tcp_sending = true;
+    q->tcp_done = 0;
+    q->server = server;
+    DnsAsync_unlinkTimer(self, q);
+    DnsAsync_linkTimer(self, q);
+    return;
+
+  fail:
+    DnsAsync_complete(self, q, TRY_AGAIN, NULL, 0);
+}   // end function : DnsAsync_startTcp
+
+/*
+ * TCP で問い合わせ中のソケットが読み書き可能になった際に, 送信または受信を進める.
+ * 応答を受け取り終えるか, エラーが発生した場合は問い合わせを完了させる.
+ */
+static void
+DnsAsync_handleTcp(DnsAsync *self, DnsAsyncQuery *q, short revents)
+{
+    ssize_t iolen;
+    if (q->tcp_sending) {
+        if (0 != (revents & (POLLERR | POLLHUP))) {
+            goto fail;
+        }   // end if
+        size_t total = NS_INT16SZ + q->querylen;
+        SKIP_EINTR(iolen = send(q->tcp_fd, q->tcp_buf + q->tcp_done, total - q->tcp_done,
+                                MSG_NOSIGNAL));
+        if (0 > iolen) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                return;
+            }   // end if
+            goto fail;
+        }   // end if
+        q->tcp_done += iolen;
+        if (q->tcp_done == total) {
+            q->tcp_sending = false;
+            q->tcp_done = 0;
+        }   // end if
+        return;
+    }   // end if
+
+    // 先頭 2 バイトの長さを受け取ってから, メッセージの残りを受け取る
+    size_t total = (q->tcp_done < NS_INT16SZ) ? NS_INT16SZ : NS_INT16SZ + ns_get16(q->tcp_buf);
+    SKIP_EINTR(iolen = recv(q->tcp_fd, q->tcp_buf + q->tcp_done, total - q->tcp_done, 0));
+    if (0 > iolen) {
+        if (EAGAIN == errno || EWOULDBLOCK == errno) {
+            return;
+        }   // end if
+        goto fail;
+    }   // end if
+    if (0 == iolen) {
+        goto fail;
+    }   // end if
+    q->tcp_done += iolen;
+    if (q->tcp_done == NS_INT16SZ && ns_get16(q->tcp_buf) < NS_HFIXEDSZ) {
+        goto fail;
+    }   // end if
+    if (NS_INT16SZ < q->tcp_done && q->tcp_done == NS_INT16SZ + ns_get16(q->tcp_buf)) {
+        const unsigned char *msg = q->tcp_buf + NS_INT16SZ;
+        int msglen = (int) ns_get16(q->tcp_buf);
+        if (q->id != ns_get16(msg) || !DnsAsync_isResponseOf(q, msg, msglen)) {
+            goto fail;
+        }   // end if
+        DnsAsync_complete(self, q, NETDB_SUCCESS, msg, msglen);
+    }   // end if
+    return;
+
+  fail:
+    DnsAsync_complete(self, q, TRY_AGAIN, NULL, 0);
+}   // end function : DnsAsync_handleTcp
+
+static void
+DnsAsync_handleResponse(DnsAsync *self, unsigned int server, int msglen)
+{
+    if (msglen < NS_HFIXEDSZ) {
+        return;
+    }   // end if
+    DnsAsyncQuery *q = DnsAsync_findQuery(self, ns_get16(self->recvbuf));
+    if (NULL == q || 0 == (q->tried & (1U << server)) || 0 <= q->tcp_fd
+        || !DnsAsync_isResponseOf(q, self->recvbuf, msglen)) {
+        /*
+         * 既に完了した問い合わせに対する応答か, 送信していないネームサーバからの偽装された応答.
+         * 再送した後に届いた, 以前に送信したネームサーバからの応答は受け付ける.
+         */
+        return;
+    }   // end if
+    if (((HEADER *) self->recvbuf)->tc) {
+        // 切り詰められた応答を受け取った場合は TCP で問い合わせ直す
+        DnsAsync_startTcp(self, q, server);
+        return;
+    }   // end if
+    DnsAsync_complete(self, q, NETDB_SUCCESS, self->recvbuf, msglen);
+}   // end function : DnsAsync_handleResponse
+
+static void
+DnsAsync_handleTimeout(DnsAsync *self, uint64_t now)
+{
+    while (NULL != self->timer_head && self->timer_head->deadline <= now) {
+        DnsAsyncQuery *q = self->timer_head;
+        DnsAsync_unlinkTimer(self, q);
+        if (0 <= q->tcp_fd) {
+            DnsAsync_complete(self, q, TRY_AGAIN, NULL, 0);
+        } else if (q->attempt < self->retry * self->server_num) {
+            // 次のネームサーバに再送する
+            q->server = (q->server + 1) % self->server_num;
+            DnsAsync_send(self, q);
+        } else {
+            DnsAsync_complete(self, q, TRY_AGAIN, NULL, 0);
+        }   // end if
+    }   // end while
+}   // end function : DnsAsync_handleTimeout
+
+/*
+ * 乱数で選んだ送信元ポートに bind し, ネームサーバに connect した UDP ソケットを返す.
+ * 選んだポートが使用中であれば選び直し, 一定回数失敗した場合はカーネルにポートを選ばせる.
+ * @return ソケット, 失敗した場合は -1.
+ */
+static int
+DnsAsync_openSocket(DnsAsync *self, const DnsAsyncServer *server)
+{
+    const struct sockaddr *addr = (const struct sockaddr *) &(server->addr);
+    int fd = socket(addr->sa_family, SOCK_DGRAM, 0);
+    if (0 > fd) {
+        return -1;
+    }   // end if
+    (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (0 > fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+        goto fail;
+    }   // end if
+    for (int n = 0; n < DNSASYNC_BIND_RETRY; ++n) {
+        uint16_t value;
+        if (0 > DnsAsync_random(self, &value)) {
+            goto fail;
+        }   // end if
+        in_port_t port = htons(DNSASYNC_PORT_MIN + value % (65536 - DNSASYNC_PORT_MIN));
+        struct sockaddr_storage local;
+        memset(&local, 0, sizeof(local));
+        local.ss_family = addr->sa_family;
+        if (AF_INET6 == addr->sa_family) {
+            ((struct sockaddr_in6 *) &local)->sin6_port = port;
+        } else {
+            ((struct sockaddr_in *) &local)->sin_port = port;
+        }   // end if
+        if (0 == bind(fd, (const struct sockaddr *) &local, server->addrlen)) {
+            break;
+        }   // end if
+        if (EADDRINUSE != errno) {
+            goto fail;
+        }   // end if
+    }   // end for
+    if (0 > connect(fd, addr, server->addrlen)) {
+        goto fail;
+    }   // end if
+    return fd;
+
+  fail:
+    close(fd);
+    return -1;
+}   // end function : DnsAsync_openSocket
+
+/*
+ * 一連の問い合わせを始める際に, ネームサーバ毎のソケットを開く.
+ * 開けなかったネームサーバへの送信は失敗し, タイムアウトを待って次のネームサーバに再送される.
+ * @return 1 つ以上のソケットを開けた場合は true, 全て失敗した場合は false (errno がセットされる).
+ */
+static bool
+DnsAsync_openServers(DnsAsync *self)
+{
+    int save_errno = 0;
+    bool opened = false;
+    for (unsigned int n = 0; n < self->server_num; ++n) {
+        self->server[n].fd = DnsAsync_openSocket(self, &(self->server[n]));
+        self->pollfds[n].fd = self->server[n].fd;
+        if (0 <= self->server[n].fd) {
+            opened = true;
+        } else if (0 == save_errno) {
+            save_errno = errno;
+        }   // end if
+    }   // end for
+    self->server_open = opened;
+    if (!opened) {
+        errno = save_errno;
+    }   // end if
+    return opened;
+}   // end function : DnsAsync_openServers
+
+/*
+ * ネームサーバ毎のソケットを閉じる. 以降に届いた応答は受け取らない.
+ */
+static void
+DnsAsync_closeServers(DnsAsync *self)
+{
+    for (unsigned int n = 0; n < self->server_num; ++n) {
+        if (0 <= self->server[n].fd) {
+            close(self->server[n].fd);
+            self->server[n].fd = -1;
+        }   // end if
+        self->pollfds[n].fd = -1;
+    }   // end for
+    self->server_open = false;
+}   // end function : DnsAsync_closeServers
+
+/**
+ * 問い合わせを開始する.
+ * 問い合わせが完了 (タイムアウトを含む) すると DnsAsync_dispatch() の中から callback が呼ばれる.
+ * @return 成功した場合は 0, 失敗した場合は -1 (errno がセットされる).
+ */
+int
+DnsAsync_submit(DnsAsync *self, const char *domain, int rrtype, DnsAsyncCallback callback,
+                void *arg)
+{
+    assert(NULL != self);
+    assert(NULL != domain);
+    assert(NULL != callback);
+
+    size_t domainlen = strlen(domain);
+    if (NS_MAXDNAME <= domainlen) {
+        errno = EINVAL;
+        return -1;
+    }   // end if
+    DnsAsyncQuery *q = (DnsAsyncQuery *) malloc(sizeof(DnsAsyncQuery) + domainlen + 1);
+    if (NULL == q) {
+        return -1;
+    }   // end if
+    memset(q, 0, sizeof(DnsAsyncQuery));
+    memcpy(q->domain, domain, domainlen + 1);
+    q->querylen = res_nmkquery(self->resolver, ns_o_query, domain, ns_c_in, rrtype, NULL, 0, NULL,
+                               q->query, sizeof(q->query));
+    if (0 > q->querylen) {
+        free(q);
+        errno = EINVAL;
+        return -1;
+    }   // end if
+    if ((!self->server_open && !DnsAsync_openServers(self)) || 0 > DnsAsync_nextId(self, &q->id)) {
+        int save_errno = errno;
+        if (0 == self->query_num) {
+            DnsAsync_closeServers(self);
+        }   // end if
+        free(q);
+        errno = save_errno;
+        return -1;
+    }   // end if
+    ns_put16(q->id, q->query);
+    q->rrtype = rrtype;
+    q->callback = callback;
+    q->arg = arg;
+    q->server = 0;
+    q->tcp_fd = -1;
+    q->id_next = self->id_bucket[q->id % DNSASYNC_ID_BUCKETS];
+    self->id_bucket[q->id % DNSASYNC_ID_BUCKETS] = q;
+    ++(self->query_num);
+    DnsAsync_send(self, q);
+    return 0;
+}   // end function : DnsAsync_submit
+
+/**
+ * 応答の受信とタイムアウトの処理をおこなう.
+ * 応答の到着かタイムアウトを最大 wait_msec ミリ秒待ち, 完了した問い合わせのコールバック関数を呼ぶ.
+ * @param wait_msec 待ち時間の上限 (ミリ秒). 負の値の場合は次のタイムアウトまで待つ.
+ * @return 未完了の問い合わせの数, poll() が失敗した場合は -1.
+ */
+int
+DnsAsync_dispatch(DnsAsync *self, int wait_msec)
+{
+    assert(NULL != self);
+    if (0 == self->query_num) {
+        DnsAsync_closeServers(self);
+        return 0;
+    }   // end if
+
+    uint64_t now = DnsAsync_now();
+    int timeout = (self->timer_head->deadline <= now) ? 0 : (int) (self->timer_head->deadline - now);
+    if (0 <= wait_msec && wait_msec < timeout) {
+        timeout = wait_msec;
+    }   // end if
+    unsigned int tcp_num = self->tcp_num;
+    for (unsigned int n = 0; n < tcp_num; ++n) {
+        struct pollfd *pfd = &(self->pollfds[self->server_num + n]);
+        pfd->fd = self->tcp_query[n]->tcp_fd;
+        pfd->events = self->tcp_query[n]->tcp_sending ? POLLOUT : POLLIN;
+        pfd->revents = 0;
+    }   // end for
+    int poll_stat;
+    SKIP_EINTR(poll_stat = poll(self->pollfds, self->server_num + tcp_num, timeout));
+    if (0 > poll_stat) {
+        return -1;
+    }   // end if
+
+    /*
+     * TCP の問い合わせは完了すると末尾のものと入れ替えて外すので, 末尾から処理する.
+     * UDP の応答を処理すると TCP の問い合わせが増えうるので, 先に処理しておく.
+     */
+    for (unsigned int n = tcp_num; 0 < poll_stat && 0 < n; --n) {
+        short revents = self->pollfds[self->server_num + n - 1].revents;
+        if (0 != revents) {
+            DnsAsync_handleTcp(self, self->tcp_query[n - 1], revents);
+        }   // end if
+    }   // end for
+    for (unsigned int n = 0; 0 < poll_stat && n < self->server_num; ++n) {
+        if (0 == (self->pollfds[n].revents & POLLIN)) {
+            continue;
+        }   // end if
+        while (true) {
+            ssize_t recvlen = recv(self->server[n].fd, self->recvbuf, sizeof(self->recvbuf), 0);
+            if (0 > recvlen) {
+                break;
+            }   // end if
+            DnsAsync_handleResponse(self, n, (int) recvlen);
+        }   // end while
+    }   // end for
+    DnsAsync_handleTimeout(self, DnsAsync_now());
+    if (0 == self->query_num) {
+        // 一連の問い合わせが完了したので, 次は別の送信元ポートを使う
+        DnsAsync_closeServers(self);
+    }   // end if
+    return (int) self->query_num;
+}   // end function : DnsAsync_dispatch
+
+/**
+ * 未完了の問い合わせの数を返す.
+ */
+size_t
+DnsAsync_getQueryCount(const DnsAsync *self)
+{
+    assert(NULL != self);
+    return self->query_num;
+}   // end function : DnsAsync_getQueryCount
+
+/**
+ * 1回の送信あたりのタイムアウトと, ネームサーバ 1 つあたりの送信回数を設定する.
+ * 既定値は resolv.conf の timeout, attempts に従う.
+ */
+void
+DnsAsync_setTimeout(DnsAsync *self, unsigned int timeout_msec, unsigned int retry)
+{
+    assert(NULL != self);
+    self->timeout_msec = timeout_msec;
+    self->retry = (0 < retry) ? retry : 1;
+}   // end function : DnsAsync_setTimeout
+
+/**
+ * DnsAsync オブジェクトを解放する.
+ * 未完了の問い合わせはコールバック関数を呼ばずに破棄する.
+ */
+void
+DnsAsync_free(DnsAsync *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    for (size_t n = 0; n < DNSASYNC_ID_BUCKETS; ++n) {
+        DnsAsyncQuery *q = self->id_bucket[n];
+        while (NULL != q) {
+            DnsAsyncQuery *next = q->id_next;
+            DnsAsync_closeTcp(self, q);
+            free(q->tcp_buf);
+            free(q);
+            q = next;
+        }   // end while
+    }   // end for
+    DnsAsync_closeServers(self);
+    free(self);
+}   // end function : DnsAsync_free
+
+static void
+DnsAsync_addServer(DnsAsync *self, const struct sockaddr *addr, socklen_t addrlen)
+{
+    DnsAsyncServer *server = &(self->server[self->server_num]);
+    memcpy(&(server->addr), addr, addrlen);
+    server->addrlen = addrlen;
+    server->fd = -1;
+    self->pollfds[self->server_num].fd = -1;
+    self->pollfds[self->server_num].events = POLLIN;
+    ++(self->server_num);
+}   // end function : DnsAsync_addServer
+
+/**
+ * DnsAsync オブジェクトを構築する.
+ * 問い合わせ先のネームサーバ, タイムアウト, 再送回数は res_ninit() 済みの resolver に従い,
+ * 問い合わせメッセージも resolver を使って組み立てる. resolver は DnsAsync オブジェクトを
+ * 解放するまで有効でなければならず, 同じスレッドからのみ使うこと.
+ * ソケットは問い合わせを始める際に開くので, 問い合わせていない間はファイル記述子を消費しない.
+ */
+DnsAsync *
+DnsAsync_new(struct __res_state *resolver)
+{
+    assert(NULL != resolver);
+    DnsAsync *self = (DnsAsync *) malloc(sizeof(DnsAsync));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DnsAsync));
+    self->resolver = resolver;
+
+    for (int n = 0; n < resolver->nscount && n < MAXNS; ++n) {
+        if (AF_INET == resolver->nsaddr_list[n].sin_family) {
+            DnsAsync_addServer(self, (const struct sockaddr *) &(resolver->nsaddr_list[n]),
+                               sizeof(struct sockaddr_in));
+#ifdef __GLIBC__
+        } else if (NULL != resolver->_u._ext.nsaddrs[n]) {
+            // glibc は IPv6 のネームサーバを拡張領域に保持している
+            DnsAsync_addServer(self, (const struct sockaddr *) resolver->_u._ext.nsaddrs[n],
+                               sizeof(struct sockaddr_in6));
+#endif
+        }   // end if
+    }   // end for
+    if (0 == self->server_num) {
+        // ネームサーバの指定がない場合は libresolv と同様にローカルホストを使う
+        struct sockaddr_in loopback;
+        memset(&loopback, 0, sizeof(loopback));
+        loopback.sin_family = AF_INET;
+        loopback.sin_port = htons(NS_DEFAULTPORT);
+        loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        DnsAsync_addServer(self, (const struct sockaddr *) &loopback, sizeof(loopback));
+    }   // end if
+
+    DnsAsync_setTimeout(self, resolver->retrans * 1000, resolver->retry);
+    return self;
+}   // end function : DnsAsync_new
@@ -0,0 +1,974 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * プロセス内の全 DnsResolver で共有する DNS 応答キャッシュ.
+ * ロック競合を避けるため (ドメイン名, RR タイプ) のハッシュ値でシャードに分割し,
+ * シャード毎に mutex, 固定長のハッシュバケット, LRU リストを持つ.
+ * 応答メッセージは wire format のまま保持し, ヒット時はコピーを返すだけなので
+ * 有効期限の判定 (vDSO 経由の clock_gettime) を含めシステムコールは発生しない.
+ * また, 複数のスレッドが同時に同じ問い合わせをおこなおうとした場合は, 最初のスレッドだけが
+ * 問い合わせ, 残りのスレッドはその応答を待って受け取る (DnsCache_joinFlight()).
+ * 猶予期間 (DnsCache_setGrace()) を設定した場合, 有効期限の切れたエントリも猶予期間の間は
+ * TTL 0 として返し続け, 更新の依頼を 1 つだけ積む. 依頼は DnsCache_takeRefresh() で取り出し,
+ * 別のスレッドで問い合わせて格納し直す (DnsRefresher).
+ * 再起動をまたいでエントリを引き継ぐため, 有効なエントリをファイルに書き出し (DnsCache_save()),
+ * 起動時に読み込む (DnsCache_load()) ことができる.
+ * 共有メモリ上のキャッシュ (DnsShmCache) を設定した場合は, ミスした時にそちらも引き,
+ * 格納したエントリはそちらにも格納するので, 同じホストの他のプロセスと応答を共有できる.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/nameser.h>
+
+#ifndef HAVE_STRLCPY
+# include "strlcpy.h"
+#endif
+
+#include "posixaux.h"
+#include "cacheutil.h"
+#include "xbuffer.h"
+#include "dnsshmcache.h"
+#include "dnscache.h"
+
+#define DNSCACHE_SHARD_NUM 16   // 2 の冪であること
+#define DNSCACHE_SHARD_BITS 4
+#define DNSCACHE_MAX_TTL 86400  // これより長い TTL は切り詰める
+#define DNSCACHE_DEFAULT_NEGATIVE_TTL 0    // SOA を含まない否定応答をキャッシュする秒数の既定値
+#define DNSCACHE_ENTRY_AVGSIZE 512  // バケット数の見積もりに使うエントリの平均サイズ
+#define DNSCACHE_MIN_BUCKETS 64
+#define DNSCACHE_REFRESH_MAXNUM 1024    // 積んでおける更新の依頼の数の上限
+
+typedef struct DnsCacheEntry {
+    CacheLruLink lru;           // 先頭に置くこと
+    struct DnsCacheEntry *hash_next;
+    uint32_t hash;
+    int rrtype;
+    time_t expire;              // CLOCK_MONOTONIC 基準の有効期限 (秒)
+    bool refreshing;            // 期限切れ後の更新を依頼済みか
+    size_t entry_size;          // メモリ使用量の計算に使う, このエントリ全体のサイズ
+    size_t msglen;
+    size_t keylen;
+    unsigned char data[];       // 応答メッセージ (msglen バイト) の後に NULL 終端のキーが続く
+} DnsCacheEntry;
+
+/*
+ * 応答待ちの問い合わせ. 問い合わせをおこなうスレッドが DnsCache_landFlight() で
+ * 結果を設定するまで, 同じ問い合わせをしようとした他のスレッドは cond で待つ.
+ */
+struct DnsCacheFlight {
+    struct DnsCacheFlight *next;
+    uint32_t hash;
+    int rrtype;
+    unsigned int waiter_num;    // 結果を待っているスレッドの数
+    bool landed;
+    int stat;                   // 問い合わせの結果 (netdb.h の h_errno の値)
+    unsigned char *msg;         // stat が NETDB_SUCCESS で, 待っているスレッドがいた場合のみ
+    int msglen;
+    pthread_cond_t cond;
+    size_t keylen;
+    char key[];
+};
+
+typedef struct DnsCacheShard {
+    pthread_mutex_t lock;
+    DnsCacheFlight *flight;     // 応答待ちの問い合わせ
+    DnsCacheEntry **bucket;
+    size_t bucket_mask;
+    CacheLru lru;
+    size_t memory_used;
+    size_t memory_limit;
+} __attribute__ ((aligned(64))) DnsCacheShard;
+
+// 期限切れのエントリの更新の依頼
+typedef struct DnsCacheRefresh {
+    struct DnsCacheRefresh *next;
+    int rrtype;
+    char key[];
+} DnsCacheRefresh;
+
+struct DnsCache {
+    DnsCacheShard shard[DNSCACHE_SHARD_NUM];
+    unsigned long grace;        // 期限切れのエントリを返し続ける秒数
+    unsigned long negative_ttl; // SOA を含まない否定応答をキャッシュする秒数
+    pthread_mutex_t refresh_lock;
+    pthread_cond_t refresh_cond;
+    DnsCacheRefresh *refresh_head;
+    DnsCacheRefresh *refresh_tail;
+    size_t refresh_num;
+    bool refresh_stopped;       // DnsCache_stopRefresh() が呼ばれたか
+    DnsShmCache *shared;        // 他のプロセスと共有するキャッシュ, 使わない場合は NULL
+};
+
+static DnsCacheShard *
+DnsCache_getShard(DnsCache *self, uint32_t hash)
+{
+    return &(self->shard[hash & (DNSCACHE_SHARD_NUM - 1)]);
+}   // end function : DnsCache_getShard
+
+static DnsCacheEntry **
+DnsCacheShard_getBucket(DnsCacheShard *shard, uint32_t hash)
+{
+    return &(shard->bucket[(hash >> DNSCACHE_SHARD_BITS) & shard->bucket_mask]);
+}   // end function : DnsCacheShard_getBucket
+
+/*
+ * エントリをハッシュチェーンと LRU リストから外して解放する.
+ * シャードのロックを保持した状態で呼ぶこと.
+ */
+static void
+DnsCacheShard_removeEntry(DnsCacheShard *shard, DnsCacheEntry *entry)
+{
+    for (DnsCacheEntry **pp = DnsCacheShard_getBucket(shard, entry->hash); NULL != *pp;
+         pp = &((*pp)->hash_next)) {
+        if (*pp == entry) {
+            *pp = entry->hash_next;
+            break;
+        }   // end if
+    }   // end for
+    CacheLru_unlink(&shard->lru, &entry->lru);
+    shard->memory_used -= entry->entry_size;
+    free(entry);
+}   // end function : DnsCacheShard_removeEntry
+
+/*
+ * シャードのロックを保持した状態で呼ぶこと.
+ */
+static DnsCacheEntry *
+DnsCacheShard_findEntry(DnsCacheShard *shard, uint32_t hash, const char *key, size_t keylen,
+                        int rrtype)
+{
+    for (DnsCacheEntry *entry = *DnsCacheShard_getBucket(shard, hash); NULL != entry;
+         entry = entry->hash_next) {
+        if (entry->hash == hash && entry->rrtype == rrtype && entry->keylen == keylen
+            && 0 == memcmp(entry->data + entry->msglen, key, keylen)) {
+            return entry;
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function : DnsCacheShard_findEntry
+
+/*
+ * 期限切れのエントリの更新の依頼を積む.
+ * @return 依頼を積んだ場合は true, 積めなかった場合は false.
+ */
+static bool
+DnsCache_requestRefresh(DnsCache *self, const char *key, size_t keylen, int rrtype)
+{
+    DnsCacheRefresh *refresh = NULL;
+    pthread_mutex_lock(&self->refresh_lock);
+    if (self->refresh_stopped || DNSCACHE_REFRESH_MAXNUM <= self->refresh_num) {
+        goto unlock;
+    }   // end if
+    refresh = (DnsCacheRefresh *) malloc(sizeof(DnsCacheRefresh) + keylen + 1);
+    if (NULL == refresh) {
+        goto unlock;
+    }   // end if
+    refresh->next = NULL;
+    refresh->rrtype = rrtype;
+    memcpy(refresh->key, key, keylen);
+    refresh->key[keylen] = '\0';
+    if (NULL != self->refresh_tail) {
+        self->refresh_tail->next = refresh;
+    } else {
+        self->refresh_head = refresh;
+    }   // end if
+    self->refresh_tail = refresh;
+    ++(self->refresh_num);
+    pthread_cond_signal(&self->refresh_cond);
+
+  unlock:
+    pthread_mutex_unlock(&self->refresh_lock);
+    return NULL != refresh;
+}   // end function : DnsCache_requestRefresh
+
+/*
+ * 正規化済みのキーでエントリをプロセス内のキャッシュに格納する.
+ * 同じキーのエントリが既に存在する場合は置き換える.
+ * メモリの上限を越える場合は LRU リストの末尾から追い出す.
+ */
+static void
+DnsCache_insert(DnsCache *self, const char *key, size_t keylen, uint32_t hash, int rrtype,
+                const unsigned char *msg, size_t msglen, unsigned long ttl)
+{
+    DnsCacheShard *shard = DnsCache_getShard(self, hash);
+
+    size_t entry_size = sizeof(DnsCacheEntry) + msglen + keylen + 1;
+    if (shard->memory_limit < entry_size) {
+        return;
+    }   // end if
+    // 確保とコピーはロックの外で済ませる
+    DnsCacheEntry *newentry = (DnsCacheEntry *) malloc(entry_size);
+    if (NULL == newentry) {
+        return;
+    }   // end if
+    memset(newentry, 0, sizeof(DnsCacheEntry));
+    newentry->hash = hash;
+    newentry->rrtype = rrtype;
+    newentry->expire = CacheUtil_now() + (time_t) (DNSCACHE_MAX_TTL < ttl ? DNSCACHE_MAX_TTL : ttl);
+    newentry->entry_size = entry_size;
+    newentry->msglen = msglen;
+    newentry->keylen = keylen;
+    memcpy(newentry->data, msg, msglen);
+    memcpy(newentry->data + msglen, key, keylen + 1);
+
+    pthread_mutex_lock(&shard->lock);
+    DnsCacheEntry *oldentry = DnsCacheShard_findEntry(shard, hash, key, keylen, rrtype);
+    if (NULL != oldentry) {
+        DnsCacheShard_removeEntry(shard, oldentry);
+    }   // end if
+    while (shard->memory_limit < shard->memory_used + entry_size && NULL != shard->lru.tail) {
+        DnsCacheShard_removeEntry(shard, CACHELRU_ENTRY(DnsCacheEntry, shard->lru.tail));
+    }   // end while
+    DnsCacheEntry **bucket = DnsCacheShard_getBucket(shard, hash);
+    newentry->hash_next = *bucket;
+    *bucket = newentry;
+    CacheLru_push(&shard->lru, &newentry->lru);
+    shard->memory_used += entry_size;
+    pthread_mutex_unlock(&shard->lock);
+}   // end function : DnsCache_insert
+
+/**
+ * キャッシュを引く.
+ * 猶予期間中のエントリは, 更新を依頼した上で期限切れの応答を返す.
+ * @param buf ヒットした場合に応答メッセージをコピーするバッファ
+ * @param ttl ヒットした場合にエントリが期限切れになるまでの秒数を受け取る. NULL の場合は受け取らない.
+ *            猶予期間中のエントリの場合は 0.
+ * @return ヒットした場合は buf にコピーした応答メッセージの長さ, ヒットしなかった場合は -1.
+ */
+int
+DnsCache_lookup(DnsCache *self, const char *domain, int rrtype, unsigned char *buf,
+                size_t buflen, unsigned long *ttl)
+{
+    assert(NULL != self);
+    char key[NS_MAXDNAME];
+    int keylen = CacheUtil_normalizeDomain(domain, key, sizeof(key));
+    if (keylen < 0) {
+        return -1;
+    }   // end if
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) rrtype);
+    DnsCacheShard *shard = DnsCache_getShard(self, hash);
+    time_t now = CacheUtil_now();
+    int msglen = -1;
+
+    pthread_mutex_lock(&shard->lock);
+    DnsCacheEntry *entry = DnsCacheShard_findEntry(shard, hash, key, keylen, rrtype);
+    if (NULL != entry) {
+        if (entry->expire + (time_t) self->grace <= now) {
+            DnsCacheShard_removeEntry(shard, entry);
+        } else if (entry->msglen <= buflen) {
+            memcpy(buf, entry->data, entry->msglen);
+            msglen = (int) entry->msglen;
+            if (entry->expire <= now) {
+                // 猶予期間中. 期限切れの応答を返し, 更新は他のスレッドに任せる
+                if (!entry->refreshing) {
+                    entry->refreshing = DnsCache_requestRefresh(self, key, keylen, rrtype);
+                }   // end if
+                if (NULL != ttl) {
+                    *ttl = 0;
+                }   // end if
+            } else if (NULL != ttl) {
+                *ttl = (unsigned long) (entry->expire - now);
+            }   // end if
+            CacheLru_unlink(&shard->lru, &entry->lru);
+            CacheLru_push(&shard->lru, &entry->lru);
+        }   // end if
+    }   // end if
+    pthread_mutex_unlock(&shard->lock);
+
+    if (0 > msglen && NULL != self->shared) {
+        // 他のプロセスが格納した応答があれば, 次からはプロセス内で引けるようにする
+        unsigned long shared_ttl;
+        msglen = DnsShmCache_lookup(self->shared, key, keylen, rrtype, buf, buflen, &shared_ttl);
+        if (0 <= msglen) {
+            DnsCache_insert(self, key, keylen, hash, rrtype, buf, msglen, shared_ttl);
+            if (NULL != ttl) {
+                *ttl = shared_ttl;
+            }   // end if
+        }   // end if
+    }   // end if
+    return msglen;
+}   // end function : DnsCache_lookup
+
+/**
+ * 応答メッセージをキャッシュに格納する.
+ * 同じキーのエントリが既に存在する場合は置き換える.
+ * メモリの上限を越える場合は LRU リストの末尾から追い出す.
+ * @param ttl キャッシュしておく秒数. 0 の場合は何もしない.
+ */
+void
+DnsCache_store(DnsCache *self, const char *domain, int rrtype, const unsigned char *msg,
+               size_t msglen, unsigned long ttl)
+{
+    assert(NULL != self);
+    if (0 == ttl) {
+        return;
+    }   // end if
+    char key[NS_MAXDNAME];
+    int keylen = CacheUtil_normalizeDomain(domain, key, sizeof(key));
+    if (keylen < 0) {
+        return;
+    }   // end if
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) rrtype);
+    DnsCache_insert(self, key, keylen, hash, rrtype, msg, msglen, ttl);
+    if (NULL != self->shared) {
+        DnsShmCache_store(self->shared, key, keylen, rrtype, msg, msglen, ttl);
+    }   // end if
+}   // end function : DnsCache_store
+
+/*
+ * 応答待ちの問い合わせの結果を受け取ったスレッドが, 最後の 1 つであれば解放する.
+ * シャードのロックを保持した状態で呼ぶこと.
+ */
+static void
+DnsCacheFlight_leave(DnsCacheFlight *flight)
+{
+    if (0 < --(flight->waiter_num)) {
+        return;
+    }   // end if
+    pthread_cond_destroy(&flight->cond);
+    free(flight->msg);
+    free(flight);
+}   // end function : DnsCacheFlight_leave
+
+/*
+ * 現在から msec ミリ秒後の CLOCK_MONOTONIC 基準の時刻を返す.
+ */
+static void
+DnsCache_getAbsTime(int64_t msec, struct timespec *abstime)
+{
+    (void) clock_gettime(CLOCK_MONOTONIC, abstime);
+    abstime->tv_sec += (time_t) (msec / 1000);
+    abstime->tv_nsec += (long) (msec % 1000) * 1000000;
+    if (1000000000 <= abstime->tv_nsec) {
+        ++(abstime->tv_sec);
+        abstime->tv_nsec -= 1000000000;
+    }   // end if
+}   // end function : DnsCache_getAbsTime
+
+/**
+ * 同じ問い合わせを他のスレッドがおこなっている最中であれば, その結果を待って受け取る.
+ * 待つのは timeout_msec までで, 過ぎた場合は待つのをやめて TRY_AGAIN として扱う.
+ * おこなわれていなければ, 呼び出し側が問い合わせることを登録する.
+ * この場合, 呼び出し側は問い合わせの結果をキャッシュに格納してから
+ * 必ず DnsCache_landFlight() を呼ばなければならない.
+ * 登録の直前に他のスレッドがキャッシュに格納した応答があれば, それを返す.
+ * @param buf 他のスレッドの応答を受け取った場合に応答メッセージをコピーするバッファ
+ * @param flight DNSCACHE_FLIGHT_LEAD を返した場合に, DnsCache_landFlight() に渡すハンドルを受け取る.
+ * @param stat DNSCACHE_FLIGHT_FAILED を返した場合に, 先行する問い合わせの結果 (h_errno の値) を受け取る.
+ *             待つのをやめた場合は TRY_AGAIN (errno に ETIMEDOUT がセットされる).
+ * @param timeout_msec 他のスレッドの問い合わせを待つ時間の上限 (ミリ秒). INT64_MAX の場合は制限しない.
+ * @return 他のスレッドの応答を受け取った場合は buf にコピーした応答メッセージの長さ,
+ *         呼び出し側が問い合わせるべき場合は DNSCACHE_FLIGHT_LEAD,
+ *         他のスレッドの問い合わせが失敗した場合は DNSCACHE_FLIGHT_FAILED.
+ */
+int
+DnsCache_joinFlight(DnsCache *self, const char *domain, int rrtype, unsigned char *buf,
+                    size_t buflen, DnsCacheFlight **flight, int *stat, int64_t timeout_msec)
+{
+    assert(NULL != self);
+    assert(NULL != flight);
+    assert(NULL != stat);
+    *flight = NULL;
+    char key[NS_MAXDNAME];
+    int keylen = CacheUtil_normalizeDomain(domain, key, sizeof(key));
+    if (keylen < 0) {
+        // キャッシュできない名前なので, 合流させずに各自で問い合わせる
+        return DNSCACHE_FLIGHT_LEAD;
+    }   // end if
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) rrtype);
+    DnsCacheShard *shard = DnsCache_getShard(self, hash);
+    int msglen = DNSCACHE_FLIGHT_LEAD;
+
+    pthread_mutex_lock(&shard->lock);
+    DnsCacheEntry *entry = DnsCacheShard_findEntry(shard, hash, key, keylen, rrtype);
+    if (NULL != entry && CacheUtil_now() < entry->expire && entry->msglen <= buflen) {
+        // DnsCache_lookup() の後に他のスレッドが格納した
+        memcpy(buf, entry->data, entry->msglen);
+        msglen = (int) entry->msglen;
+        goto unlock;
+    }   // end if
+
+    DnsCacheFlight *current = shard->flight;
+    for (; NULL != current; current = current->next) {
+        if (current->hash == hash && current->rrtype == rrtype && current->keylen == (size_t) keylen
+            && 0 == memcmp(current->key, key, keylen)) {
+            break;
+        }   // end if
+    }   // end for
+    if (NULL != current) {
+        struct timespec abstime;
+        if (INT64_MAX != timeout_msec) {
+            DnsCache_getAbsTime(0 < timeout_msec ? timeout_msec : 0, &abstime);
+        }   // end if
+        ++(current->waiter_num);
+        while (!current->landed) {
+            if (INT64_MAX == timeout_msec) {
+                pthread_cond_wait(&current->cond, &shard->lock);
+            } else if (ETIMEDOUT ==
+                       pthread_cond_timedwait(&current->cond, &shard->lock, &abstime)) {
+                break;
+            }   // end if
+        }   // end while
+        if (!current->landed) {
+            // 先行する問い合わせは残したまま, 待つのをやめる
+            *stat = TRY_AGAIN;
+            msglen = DNSCACHE_FLIGHT_FAILED;
+            DnsCacheFlight_leave(current);
+            pthread_mutex_unlock(&shard->lock);
+            errno = ETIMEDOUT;
+            return msglen;
+        }   // end if
+        if (NETDB_SUCCESS == current->stat && NULL != current->msg
+            && (size_t) current->msglen <= buflen) {
+            memcpy(buf, current->msg, current->msglen);
+            msglen = current->msglen;
+        } else {
+            *stat = (NETDB_SUCCESS == current->stat) ? NETDB_INTERNAL : current->stat;
+            msglen = DNSCACHE_FLIGHT_FAILED;
+        }   // end if
+        DnsCacheFlight_leave(current);
+        goto unlock;
+    }   // end if
+
+    // 問い合わせる側として登録する. 確保に失敗した場合は登録せずに問い合わせさせる
+    DnsCacheFlight *newflight = (DnsCacheFlight *) malloc(sizeof(DnsCacheFlight) + keylen + 1);
+    if (NULL != newflight) {
+        memset(newflight, 0, sizeof(DnsCacheFlight));
+        // 待つ側の期限は CLOCK_MONOTONIC 基準で指定する
+        pthread_condattr_t condattr;
+        bool cond_ok = (0 == pthread_condattr_init(&condattr));
+        if (cond_ok) {
+            (void) pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+            cond_ok = (0 == pthread_cond_init(&newflight->cond, &condattr));
+            (void) pthread_condattr_destroy(&condattr);
+        }   // end if
+        if (!cond_ok) {
+            free(newflight);
+            goto unlock;
+        }   // end if
+        newflight->hash = hash;
+        newflight->rrtype = rrtype;
+        newflight->waiter_num = 1;  // 問い合わせるスレッド自身
+        newflight->landed = false;
+        newflight->stat = NETDB_SUCCESS;
+        newflight->msg = NULL;
+        newflight->msglen = 0;
+        newflight->keylen = keylen;
+        memcpy(newflight->key, key, keylen + 1);
+        newflight->next = shard->flight;
+        shard->flight = newflight;
+        *flight = newflight;
+    }   // end if
+
+  unlock:
+    pthread_mutex_unlock(&shard->lock);
+    return msglen;
+}   // end function : DnsCache_joinFlight
+
+/**
+ * DnsCache_joinFlight() で登録した問い合わせの結果を, 待っているスレッドに渡す.
+ * @param flight DnsCache_joinFlight() で受け取ったハンドル. NULL の場合は何もしない.
+ * @param stat 問い合わせの結果 (h_errno の値). NETDB_SUCCESS の場合は msg, msglen に応答メッセージを渡す.
+ */
+void
+DnsCache_landFlight(DnsCache *self, DnsCacheFlight *flight, int stat, const unsigned char *msg,
+                    int msglen)
+{
+    if (NULL == flight) {
+        return;
+    }   // end if
+    assert(NULL != self);
+    DnsCacheShard *shard = DnsCache_getShard(self, flight->hash);
+
+    pthread_mutex_lock(&shard->lock);
+    for (DnsCacheFlight **pp = &(shard->flight); NULL != *pp; pp = &((*pp)->next)) {
+        if (*pp == flight) {
+            *pp = flight->next;
+            break;
+        }   // end if
+    }   // end for
+    flight->stat = stat;
+    if (NETDB_SUCCESS == stat && 1 < flight->waiter_num) {
+        // 待っているスレッドがいる場合のみコピーする. 失敗した場合は待っている側で NETDB_INTERNAL になる
+        flight->msg = (unsigned char *) malloc(msglen);
+        if (NULL != flight->msg) {
+            memcpy(flight->msg, msg, msglen);
+            flight->msglen = msglen;
+        }   // end if
+    }   // end if
+    flight->landed = true;
+    pthread_cond_broadcast(&flight->cond);
+    DnsCacheFlight_leave(flight);
+    pthread_mutex_unlock(&shard->lock);
+}   // end function : DnsCache_landFlight
+
+/**
+ * 有効期限の切れたエントリを返し続ける猶予期間を設定する.
+ * 猶予期間中のエントリを引くと, DnsCache_takeRefresh() で取り出せる更新の依頼が積まれるので,
+ * 猶予期間を設定する場合は依頼を処理するスレッド (DnsRefresher) を動かしておくこと.
+ * @param grace 猶予期間 (秒). 0 の場合は期限切れのエントリを返さない.
+ */
+void
+DnsCache_setGrace(DnsCache *self, unsigned long grace)
+{
+    assert(NULL != self);
+    self->grace = (DNSCACHE_MAX_TTL < grace) ? DNSCACHE_MAX_TTL : grace;
+}   // end function : DnsCache_setGrace
+
+/**
+ * authority section に SOA レコードを含まない否定応答 (NXDOMAIN, NODATA) をキャッシュする秒数を設定する.
+ * 既定では [RFC2308] 5. に従いキャッシュしない.
+ * 毎回問い合わせ直すのを避けたい場合に限り, 短い期間だけ保持するよう指定できる.
+ * @param negative_ttl 保持する秒数. 0 の場合はキャッシュしない.
+ */
+void
+DnsCache_setNegativeTtl(DnsCache *self, unsigned long negative_ttl)
+{
+    assert(NULL != self);
+    self->negative_ttl = (DNSCACHE_MAX_TTL < negative_ttl) ? DNSCACHE_MAX_TTL : negative_ttl;
+}   // end function : DnsCache_setNegativeTtl
+
+/**
+ * DnsCache_setNegativeTtl() で設定した秒数を返す.
+ */
+unsigned long
+DnsCache_getNegativeTtl(const DnsCache *self)
+{
+    assert(NULL != self);
+    return self->negative_ttl;
+}   // end function : DnsCache_getNegativeTtl
+
+/**
+ * 期限切れのエントリの更新の依頼を 1 つ取り出す. 依頼がない場合は積まれるまで待つ.
+ * 取り出した依頼を処理し終えたら, 問い合わせの成否に関わらず DnsCache_endRefresh() を呼ぶこと.
+ * @param domain 更新するドメイン名を受け取るバッファ
+ * @param rrtype 更新する RR タイプを受け取る.
+ * @return 依頼を取り出した場合は true, DnsCache_stopRefresh() が呼ばれた場合は false.
+ */
+bool
+DnsCache_takeRefresh(DnsCache *self, char *domain, size_t domainlen, int *rrtype)
+{
+    assert(NULL != self);
+    assert(NULL != domain);
+    assert(NULL != rrtype);
+
+    pthread_mutex_lock(&self->refresh_lock);
+    while (!self->refresh_stopped && NULL == self->refresh_head) {
+        pthread_cond_wait(&self->refresh_cond, &self->refresh_lock);
+    }   // end while
+    DnsCacheRefresh *refresh = NULL;
+    if (!self->refresh_stopped) {
+        refresh = self->refresh_head;
+        self->refresh_head = refresh->next;
+        if (NULL == self->refresh_head) {
+            self->refresh_tail = NULL;
+        }   // end if
+        --(self->refresh_num);
+    }   // end if
+    pthread_mutex_unlock(&self->refresh_lock);
+
+    if (NULL == refresh) {
+        return false;
+    }   // end if
+    strlcpy(domain, refresh->key, domainlen);
+    *rrtype = refresh->rrtype;
+    free(refresh);
+    return true;
+}   // end function : DnsCache_takeRefresh
+
+/**
+ * DnsCache_takeRefresh() で取り出した依頼の処理を終える.
+ * 更新に失敗してエントリが期限切れのまま残っている場合は, 次に引かれた際に改めて依頼を積む.
+ */
+void
+DnsCache_endRefresh(DnsCache *self, const char *domain, int rrtype)
+{
+    assert(NULL != self);
+    char key[NS_MAXDNAME];
+    int keylen = CacheUtil_normalizeDomain(domain, key, sizeof(key));
+    if (keylen < 0) {
+        return;
+    }   // end if
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) rrtype);
+    DnsCacheShard *shard = DnsCache_getShard(self, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    DnsCacheEntry *entry = DnsCacheShard_findEntry(shard, hash, key, keylen, rrtype);
+    if (NULL != entry) {
+        entry->refreshing = false;
+    }   // end if
+    pthread_mutex_unlock(&shard->lock);
+}   // end function : DnsCache_endRefresh
+
+/**
+ * DnsCache_takeRefresh() で待っているスレッドを起こし, 以降は依頼を積まないようにする.
+ * 積まれていた依頼は DnsCache_free() で破棄する.
+ */
+void
+DnsCache_stopRefresh(DnsCache *self)
+{
+    assert(NULL != self);
+    pthread_mutex_lock(&self->refresh_lock);
+    self->refresh_stopped = true;
+    pthread_cond_broadcast(&self->refresh_cond);
+    pthread_mutex_unlock(&self->refresh_lock);
+}   // end function : DnsCache_stopRefresh
+
+/*
+ * スナップショットファイルの形式.
+ * ヘッダに続き, エントリ毎に DnsCacheSnapshotEntry, キー (NULL 終端なし), 応答メッセージを並べ,
+ * 次のエントリが 8 バイト境界から始まるように詰め物をする.
+ * 同じホストで読み書きすることを前提に, 数値はホストのバイトオーダーのまま書き出す.
+ */
+#define DNSCACHE_SNAPSHOT_MAGIC 0x444e5343U /* "DNSC" */
+#define DNSCACHE_SNAPSHOT_VERSION 1
+#define DNSCACHE_SNAPSHOT_ALIGN(len) (((len) + 7) & ~((size_t) 7))
+
+typedef struct DnsCacheSnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t entry_num;
+    int64_t saved_at;           // 書き出した時刻 (time(2) の値)
+} DnsCacheSnapshotHeader;
+
+typedef struct DnsCacheSnapshotEntry {
+    int32_t rrtype;
+    uint32_t ttl;               // 書き出した時点での有効期限までの秒数
+    uint32_t keylen;
+    uint32_t msglen;
+} DnsCacheSnapshotEntry;
+
+static bool
+DnsCache_writeAll(int fd, const void *buf, size_t buflen)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+    while (0 < buflen) {
+        ssize_t written;
+        SKIP_EINTR(written = write(fd, p, buflen));
+        if (0 > written) {
+            return false;
+        }   // end if
+        p += written;
+        buflen -= written;
+    }   // end while
+    return true;
+}   // end function : DnsCache_writeAll
+
+/*
+ * シャードの有効なエントリを, 参照されていない順にスナップショットの形式で buf に書き出す.
+ * ファイルへの書き込みでシャードのロックを長く保持しないように, 一旦メモリ上にコピーする.
+ * @return 書き出したエントリの数, メモリの確保に失敗した場合は -1.
+ */
+static long
+DnsCacheShard_serialize(DnsCacheShard *shard, time_t now, XBuffer *buf)
+{
+    static const unsigned char padding[8] = { 0 };
+    long entry_num = 0;
+    XBuffer_reset(buf);
+    pthread_mutex_lock(&shard->lock);
+    for (CacheLruLink *link = shard->lru.tail; NULL != link; link = link->prev) {
+        DnsCacheEntry *entry = CACHELRU_ENTRY(DnsCacheEntry, link);
+        if (entry->expire <= now) {
+            continue;
+        }   // end if
+        DnsCacheSnapshotEntry header;
+        header.rrtype = entry->rrtype;
+        header.ttl = (uint32_t) (entry->expire - now);
+        header.keylen = (uint32_t) entry->keylen;
+        header.msglen = (uint32_t) entry->msglen;
+        size_t len = sizeof(header) + entry->keylen + entry->msglen;
+        (void) XBuffer_appendBytes(buf, &header, sizeof(header));
+        (void) XBuffer_appendBytes(buf, entry->data + entry->msglen, entry->keylen);
+        (void) XBuffer_appendBytes(buf, entry->data, entry->msglen);
+        (void) XBuffer_appendBytes(buf, padding, DNSCACHE_SNAPSHOT_ALIGN(len) - len);
+        ++entry_num;
+    }   // end for
+    pthread_mutex_unlock(&shard->lock);
+    return (0 == XBuffer_status(buf)) ? entry_num : -1;
+}   // end function : DnsCacheShard_serialize
+
+/**
+ * キャッシュの有効なエントリをスナップショットファイルに書き出す.
+ * 同じディレクトリに一時ファイルを作って書き出してから rename(2) で置き換えるので,
+ * 書き出しの途中で中断しても以前のスナップショットは壊れない.
+ * @return 成功した場合は書き出したエントリの数, 失敗した場合は -1 (errno がセットされる).
+ */
+long
+DnsCache_save(DnsCache *self, const char *path)
+{
+    assert(NULL != self);
+    assert(NULL != path);
+
+    size_t pathlen = strlen(path);
+    char *tmppath = (char *) malloc(pathlen + sizeof(".XXXXXX"));
+    XBuffer *buf = XBuffer_new(0);
+    int fd = -1;
+    long entry_num = -1;
+    if (NULL == tmppath || NULL == buf) {
+        errno = ENOMEM;
+        goto cleanup;
+    }   // end if
+    memcpy(tmppath, path, pathlen);
+    memcpy(tmppath + pathlen, ".XXXXXX", sizeof(".XXXXXX"));
+    fd = mkstemp(tmppath);
+    if (0 > fd) {
+        goto cleanup;
+    }   // end if
+
+    DnsCacheSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DNSCACHE_SNAPSHOT_MAGIC;
+    header.version = DNSCACHE_SNAPSHOT_VERSION;
+    header.saved_at = (int64_t) time(NULL);
+    if (!DnsCache_writeAll(fd, &header, sizeof(header))) {
+        goto unlink;
+    }   // end if
+    time_t now = CacheUtil_now();
+    for (size_t n = 0; n < DNSCACHE_SHARD_NUM; ++n) {
+        long shard_entry_num = DnsCacheShard_serialize(&(self->shard[n]), now, buf);
+        if (0 > shard_entry_num) {
+            errno = ENOMEM;
+            goto unlink;
+        }   // end if
+        if (!DnsCache_writeAll(fd, XBuffer_getBytes(buf), XBuffer_getSize(buf))) {
+            goto unlink;
+        }   // end if
+        header.entry_num += shard_entry_num;
+    }   // end for
+    // エントリの数は書き出し終えてから確定する
+    if (sizeof(header) != pwrite(fd, &header, sizeof(header), 0) || 0 != fsync(fd)) {
+        goto unlink;
+    }   // end if
+    int close_stat = close(fd);
+    fd = -1;
+    if (0 != close_stat) {
+        goto unlink;
+    }   // end if
+    if (0 != rename(tmppath, path)) {
+        goto unlink;
+    }   // end if
+    entry_num = (long) header.entry_num;
+    goto cleanup;
+
+  unlink:;
+    int save_errno = errno;
+    // 失敗した場合も記述子は閉じてから一時ファイルを消す
+    if (0 <= fd) {
+        (void) close(fd);
+        fd = -1;
+    }   // end if
+    (void) unlink(tmppath);
+    errno = save_errno;
+
+  cleanup:
+    if (0 <= fd) {
+        (void) close(fd);
+    }   // end if
+    if (NULL != buf) {
+        XBuffer_free(buf);
+    }   // end if
+    free(tmppath);
+    return entry_num;
+}   // end function : DnsCache_save
+
+/**
+ * DnsCache_save() で書き出したスナップショットファイルを読み込み, エントリをキャッシュに格納する.
+ * 各エントリの TTL は書き出してから経過した時間だけ差し引き, 期限切れになったものは捨てる.
+ * ファイルは mmap(2) して読み込み, 壊れている部分があればそこで読み込みを打ち切る.
+ * 実効ユーザー以外が所有するファイルや, グループや他のユーザーが書き込めるファイルは読み込まない.
+ * @return 成功した場合は格納したエントリの数, ファイルを読めなかった場合は -1 (errno がセットされる).
+ */
+long
+DnsCache_load(DnsCache *self, const char *path)
+{
+    assert(NULL != self);
+    assert(NULL != path);
+
+    int fd;
+    SKIP_EINTR(fd = open(path, O_RDONLY));
+    if (0 > fd) {
+        return -1;
+    }   // end if
+    struct stat st;
+    if (0 != fstat(fd, &st)) {
+        int save_errno = errno;
+        (void) close(fd);
+        errno = save_errno;
+        return -1;
+    }   // end if
+    // 読み込んだ応答はそのまま問い合わせの結果として使うので, 他のユーザーが書き換えられるものは使わない
+    if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || 0 != (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        (void) close(fd);
+        errno = EACCES;
+        return -1;
+    }   // end if
+    if ((off_t) sizeof(DnsCacheSnapshotHeader) > st.st_size) {
+        (void) close(fd);
+        errno = EINVAL;
+        return -1;
+    }   // end if
+    size_t maplen = (size_t) st.st_size;
+    const unsigned char *map =
+        (const unsigned char *) mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+    int save_errno = errno;
+    (void) close(fd);
+    if (MAP_FAILED == map) {
+        errno = save_errno;
+        return -1;
+    }   // end if
+
+    long entry_num = -1;
+    DnsCacheSnapshotHeader header;
+    memcpy(&header, map, sizeof(header));
+    if (DNSCACHE_SNAPSHOT_MAGIC != header.magic || DNSCACHE_SNAPSHOT_VERSION != header.version) {
+        errno = EINVAL;
+        goto cleanup;
+    }   // end if
+    int64_t elapsed = (int64_t) time(NULL) - header.saved_at;
+    if (elapsed < 0) {
+        elapsed = 0;
+    }   // end if
+
+    entry_num = 0;
+    size_t offset = sizeof(header);
+    for (uint64_t n = 0; n < header.entry_num; ++n) {
+        DnsCacheSnapshotEntry entry;
+        if (maplen - offset < sizeof(entry)) {
+            break;
+        }   // end if
+        memcpy(&entry, map + offset, sizeof(entry));
+        size_t len = sizeof(entry) + (size_t) entry.keylen + (size_t) entry.msglen;
+        if (NS_MAXDNAME <= entry.keylen || UINT16_MAX < entry.msglen || maplen - offset < len) {
+            break;
+        }   // end if
+        if (elapsed < (int64_t) entry.ttl) {
+            char key[NS_MAXDNAME];
+            memcpy(key, map + offset + sizeof(entry), entry.keylen);
+            key[entry.keylen] = '\0';
+            DnsCache_store(self, key, entry.rrtype, map + offset + sizeof(entry) + entry.keylen,
+                           entry.msglen, (unsigned long) (entry.ttl - elapsed));
+            ++entry_num;
+        }   // end if
+        offset += DNSCACHE_SNAPSHOT_ALIGN(len);
+        if (maplen < offset) {
+            break;
+        }   // end if
+    }   // end for
+
+  cleanup:
+    (void) munmap((void *) map, maplen);
+    return entry_num;
+}   // end function : DnsCache_load
+
+void
+DnsCache_free(DnsCache *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    for (size_t n = 0; n < DNSCACHE_SHARD_NUM; ++n) {
+        DnsCacheShard *shard = &(self->shard[n]);
+        CacheLruLink *link = shard->lru.head;
+        while (NULL != link) {
+            CacheLruLink *next = link->next;
+            free(CACHELRU_ENTRY(DnsCacheEntry, link));
+            link = next;
+        }   // end while
+        free(shard->bucket);
+        pthread_mutex_destroy(&shard->lock);
+    }   // end for
+    while (NULL != self->refresh_head) {
+        DnsCacheRefresh *next = self->refresh_head->next;
+        free(self->refresh_head);
+        self->refresh_head = next;
+    }   // end while
+    pthread_cond_destroy(&self->refresh_cond);
+    pthread_mutex_destroy(&self->refresh_lock);
+    free(self);
+}   // end function : DnsCache_free
+
+/**
+ * 他のプロセスと共有するキャッシュを設定する.
+ * shared は DnsCache オブジェクトより後に閉じること.
+ * @param shared NULL の場合は共有しない.
+ */
+void
+DnsCache_setShared(DnsCache *self, DnsShmCache *shared)
+{
+    assert(NULL != self);
+    self->shared = shared;
+}   // end function : DnsCache_setShared
+
+/**
+ * DnsCache オブジェクトを構築する.
+ * @param memory_limit キャッシュが使用するメモリの上限 (バイト). シャード毎に均等に割り当てる.
+ */
+DnsCache *
+DnsCache_new(size_t memory_limit)
+{
+    DnsCache *self = NULL;
+    if (0 != posix_memalign((void **) &self, 64, sizeof(DnsCache))) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DnsCache));
+
+    size_t shard_limit = memory_limit / DNSCACHE_SHARD_NUM;
+    size_t bucket_num = DNSCACHE_MIN_BUCKETS;
+    while (bucket_num * DNSCACHE_ENTRY_AVGSIZE < shard_limit) {
+        bucket_num <<= 1;
+    }   // end while
+    for (size_t n = 0; n < DNSCACHE_SHARD_NUM; ++n) {
+        pthread_mutex_init(&(self->shard[n].lock), NULL);
+    }   // end for
+    pthread_mutex_init(&self->refresh_lock, NULL);
+    pthread_cond_init(&self->refresh_cond, NULL);
+    self->grace = 0;
+    self->negative_ttl = DNSCACHE_DEFAULT_NEGATIVE_TTL;
+    self->refresh_head = self->refresh_tail = NULL;
+    self->refresh_num = 0;
+    self->refresh_stopped = false;
+    for (size_t n = 0; n < DNSCACHE_SHARD_NUM; ++n) {
+        DnsCacheShard *shard = &(self->shard[n]);
+        shard->memory_limit = shard_limit;
+        shard->bucket_mask = bucket_num - 1;
+        shard->bucket = (DnsCacheEntry **) calloc(bucket_num, sizeof(DnsCacheEntry *));
+        if (NULL == shard->bucket) {
+            goto cleanup;
+        }   // end if
+    }   // end for
+    return self;
+
+  cleanup:
+    DnsCache_free(self);
+    return NULL;
+}   // end function : DnsCache_new
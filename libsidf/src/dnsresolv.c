@@ -19,25 +19,145 @@ RCSID("$Id: dnsresolv.c 349 2008-08-13 15:56:16Z takahiko $");
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <netinet/in.h>
 #include <netinet/in_systm.h>
 #include <netinet/ip.h>
 #include <netdb.h>
 #include <resolv.h>
+#include <strings.h>
 
 #ifndef HAVE_STRLCPY
 # include "strlcpy.h"
 #endif
 
+#include "memarena.h"
 #include "dnsresolv.h"
 
+// answer_arena のチャンクの大きさ, 1 通のメールの評価で残す応答は通常これに収まる
+#define DNSRESOLV_ANSWER_ARENA_SIZE 8192
+
+/*
+ * DnsResolver_feedAnswer() で与えられた応答, 遅延モードで応答待ちの問い合わせ,
+ * DnsResolver_setRetainAnswers() により残しておいた応答, または DnsResolver_prefetch() で得た応答.
+ */
+typedef struct DnsAnswer {
+    int rrtype;
+    int stat;                   // DNS_STAT_PENDING の間は応答待ち
+    bool dispatched;            // DnsResolver_takePendingQuery() で取り出し済みか
+    bool in_arena;              // answer_arena から切り出したもの. msg も含めて個別には解放しない
+    int msglen;
+    unsigned char *msg;         // stat が NETDB_SUCCESS の場合のみ
+    unsigned long ttl;          // 再び参照した際に DnsResolver_getTtl() で返す値
+    unsigned long response_ttl; // 再び参照した際に DnsResolver_getMinTtl() に反映する値
+    char domain[];
+} DnsAnswer;
+
+static void
+DnsAnswer_free(void *element)
+{
+    DnsAnswer *self = (DnsAnswer *) element;
+    if (self->in_arena) {
+        return;
+    }   // end if
+    free(self->msg);
+    free(self);
+}   // end function : DnsAnswer_free
+
+static DnsAnswer *
+DnsAnswer_new(const char *domain, int rrtype)
+{
+    size_t domainlen = strlen(domain);
+    DnsAnswer *self = (DnsAnswer *) malloc(sizeof(DnsAnswer) + domainlen + 1);
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DnsAnswer));
+    memcpy(self->domain, domain, domainlen + 1);
+    self->rrtype = rrtype;
+    self->stat = DNS_STAT_PENDING;
+    self->dispatched = false;
+    self->in_arena = false;
+    self->msg = NULL;
+    self->msglen = 0;
+    self->ttl = 0;
+    self->response_ttl = 0;
+    return self;
+}   // end function : DnsAnswer_new
+
+/*
+ * 末尾の '.' の有無と大文字小文字の違いを無視してドメイン名を比較する.
+ */
+static bool
+DnsResolver_isSameName(const char *name1, const char *name2)
+{
+    size_t len1 = strlen(name1);
+    size_t len2 = strlen(name2);
+    if (0 < len1 && '.' == name1[len1 - 1]) {
+        --len1;
+    }   // end if
+    if (0 < len2 && '.' == name2[len2 - 1]) {
+        --len2;
+    }   // end if
+    return (len1 == len2 && 0 == strncasecmp(name1, name2, len1)) ? true : false;
+}   // end function : DnsResolver_isSameName
+
+static DnsAnswer *
+DnsResolver_findAnswer(const PtrArray *answers, const char *domain, int rrtype)
+{
+    size_t answer_num = PtrArray_getCount(answers);
+    for (size_t n = 0; n < answer_num; ++n) {
+        DnsAnswer *answer = PtrArray_get(answers, n);
+        if (answer->rrtype == rrtype && DnsResolver_isSameName(answer->domain, domain)) {
+            return answer;
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function : DnsResolver_findAnswer
+
+/*
+ * DnsResolver_prefetch() で並行に問い合わせている途中の問い合わせを, 応答を待たずに破棄する.
+ * 合流して待っている他のスレッドには TRY_AGAIN を渡す.
+ */
+static void
+DnsResolver_abortPrefetch(DnsResolver *self)
+{
+    DnsAsync_free(self->fanout);
+    self->fanout = NULL;
+    for (size_t n = 0; n < DNSRESOLV_PREFETCH_MAXNUM; ++n) {
+        if (NULL != self->prefetch_query[n].flight) {
+            DnsCache_landFlight(self->cache, self->prefetch_query[n].flight, TRY_AGAIN, NULL, 0);
+            self->prefetch_query[n].flight = NULL;
+        }   // end if
+    }   // end for
+}   // end function : DnsResolver_abortPrefetch
+
 void
 DnsResolver_free(DnsResolver *self)
 {
     assert(NULL != self);
+    if (NULL != self->answers) {
+        PtrArray_free(self->answers);
+    }   // end if
+    if (NULL != self->prefetched) {
+        PtrArray_free(self->prefetched);
+    }   // end if
+    if (NULL != self->answer_arena) {
+        MemArena_free(self->answer_arena);
+    }   // end if
+    DnsResolver_abortPrefetch(self);
+    if (NULL != self->txt_arena) {
+        XBuffer_free(self->txt_arena);
+    }   // end if
+    if (NULL != self->name_arena) {
+        XBuffer_free(self->name_arena);
+    }   // end if
     res_nclose(&self->resolver);
     /*
      * glibc-2.4.0 以降ならば
@@ -60,6 +180,36 @@ DnsResolver_new(void)
     if (NETDB_SUCCESS != res_ninit(&self->resolver)) {
         goto cleanup;
     }   // end if
+    self->answers = PtrArray_new(0, DnsAnswer_free);
+    if (NULL == self->answers) {
+        goto cleanup;
+    }   // end if
+    self->prefetched = PtrArray_new(0, DnsAnswer_free);
+    if (NULL == self->prefetched) {
+        goto cleanup;
+    }   // end if
+    self->answer_arena = MemArena_new(DNSRESOLV_ANSWER_ARENA_SIZE);
+    if (NULL == self->answer_arena) {
+        goto cleanup;
+    }   // end if
+    self->txt_arena = XBuffer_new(NS_PACKETSZ);
+    if (NULL == self->txt_arena) {
+        goto cleanup;
+    }   // end if
+    self->name_arena = XBuffer_new(NS_PACKETSZ);
+    if (NULL == self->name_arena) {
+        goto cleanup;
+    }   // end if
+    self->fanout = NULL;
+    self->deadline = 0;
+    self->cache = NULL;
+    self->deferred = false;
+    self->retain_answers = false;
+    self->deferred_count = 0;
+    self->transient_count = 0;
+    self->ttl = 0;
+    self->min_ttl = ULONG_MAX;
+    self->pool_generation = 0;
     self->resolv_errno = 0;
     self->resolv_h_errno = NETDB_SUCCESS;
     return self;
@@ -69,6 +219,183 @@ DnsResolver_new(void)
     return NULL;
 }   // end function : DnsResolver_init
 
+/**
+ * 応答のキャッシュに使う DnsCache オブジェクトを設定する.
+ * DnsCache オブジェクトは複数の DnsResolver で共有できる.
+ * @param cache NULL の場合はキャッシュを使わない.
+ */
+void
+DnsResolver_setCache(DnsResolver *self, DnsCache *cache)
+{
+    assert(NULL != self);
+    self->cache = cache;
+}   // end function : DnsResolver_setCache
+
+/**
+ * 遅延モードを設定する.
+ * 遅延モードでは, DnsResolver_feedAnswer() で与えられた応答とキャッシュだけを参照し,
+ * 手元にない応答は問い合わせずに DNS_STAT_PENDING を返す.
+ * 応答待ちの問い合わせは DnsResolver_takePendingQuery() で取り出し,
+ * 応答が得られたら DnsResolver_feedAnswer() で与える.
+ */
+void
+DnsResolver_setDeferred(DnsResolver *self, bool deferred)
+{
+    assert(NULL != self);
+    self->deferred = deferred;
+}   // end function : DnsResolver_setDeferred
+
+/**
+ * 問い合わせで得た応答を DnsResolver_resetAnswers() を呼ぶまで手元に残しておくかを設定する.
+ * 1 通のメッセージに対する SPF と Sender ID の評価のように, 同じ問い合わせを繰り返す
+ * 一連の評価で DnsResolver を共有する場合に, 2 回目以降の問い合わせをキャッシュや
+ * ネットワークに出さずに済ませるために使う.
+ * 応答メッセージが得られなかった問い合わせ (タイムアウトなど) は残さない.
+ */
+void
+DnsResolver_setRetainAnswers(DnsResolver *self, bool retain_answers)
+{
+    assert(NULL != self);
+    self->retain_answers = retain_answers;
+}   // end function : DnsResolver_setRetainAnswers
+
+/**
+ * DNS_STAT_PENDING を返した回数を返す.
+ * 呼び出しの前後で比較することで, 応答待ちの問い合わせに遭遇したかを判断できる.
+ */
+unsigned long
+DnsResolver_getDeferredCount(const DnsResolver *self)
+{
+    assert(NULL != self);
+    return self->deferred_count;
+}   // end function : DnsResolver_getDeferredCount
+
+/**
+ * 一時的なエラー (TRY_AGAIN, NO_RECOVERY, NETDB_INTERNAL) を返した回数を返す.
+ * 呼び出しの前後で比較することで, 問い合わせ直せば結果が変わりうるエラーに遭遇したかを判断できる.
+ */
+unsigned long
+DnsResolver_getTransientCount(const DnsResolver *self)
+{
+    assert(NULL != self);
+    return self->transient_count;
+}   // end function : DnsResolver_getTransientCount
+
+/**
+ * 直前に成功した問い合わせの応答の TTL (answer section の TTL の最小値) を返す.
+ * 応答がキャッシュから得られたものだった場合は, キャッシュの期限が切れるまでの秒数を返す.
+ */
+unsigned long
+DnsResolver_getTtl(const DnsResolver *self)
+{
+    assert(NULL != self);
+    return self->ttl;
+}   // end function : DnsResolver_getTtl
+
+/**
+ * DnsResolver_getMinTtl() で返す TTL の最小値をリセットする.
+ */
+void
+DnsResolver_resetMinTtl(DnsResolver *self)
+{
+    assert(NULL != self);
+    self->min_ttl = ULONG_MAX;
+}   // end function : DnsResolver_resetMinTtl
+
+/**
+ * DnsResolver_resetMinTtl() 以降に参照した応答の TTL の最小値を返す.
+ * 否定応答は SOA に従ってキャッシュできる秒数, 問い合わせに失敗した場合は 0 として扱う.
+ * 応答待ち (DNS_STAT_PENDING) は数えない.
+ * @return 1 つも応答を参照していない場合は ULONG_MAX.
+ */
+unsigned long
+DnsResolver_getMinTtl(const DnsResolver *self)
+{
+    assert(NULL != self);
+    return self->min_ttl;
+}   // end function : DnsResolver_getMinTtl
+
+static void
+DnsResolver_updateMinTtl(DnsResolver *self, unsigned long ttl)
+{
+    if (ttl < self->min_ttl) {
+        self->min_ttl = ttl;
+    }   // end if
+}   // end function : DnsResolver_updateMinTtl
+
+/**
+ * 応答待ちの問い合わせを 1 つ取り出す.
+ * 一度取り出した問い合わせは, 応答が与えられるまで再び取り出されることはない.
+ * @param domain 問い合わせるドメイン名を受け取る. DnsResolver_resetAnswers() を呼ぶまで有効.
+ * @return 応答待ちの問い合わせがあった場合は true, なかった場合は false.
+ */
+bool
+DnsResolver_takePendingQuery(DnsResolver *self, const char **domain, int *rrtype)
+{
+    assert(NULL != self);
+    size_t answer_num = PtrArray_getCount(self->answers);
+    for (size_t n = 0; n < answer_num; ++n) {
+        DnsAnswer *answer = PtrArray_get(self->answers, n);
+        if (DNS_STAT_PENDING == answer->stat && !answer->dispatched) {
+            answer->dispatched = true;
+            *domain = answer->domain;
+            *rrtype = answer->rrtype;
+            return true;
+        }   // end if
+    }   // end for
+    return false;
+}   // end function : DnsResolver_takePendingQuery
+
+/**
+ * DnsResolver_feedAnswer() で与えた応答と, 応答待ちの問い合わせを全て破棄する.
+ * DnsResolver_prefetch() で得た応答も破棄する.
+ */
+void
+DnsResolver_resetAnswers(DnsResolver *self)
+{
+    assert(NULL != self);
+    PtrArray_reset(self->answers);
+    PtrArray_reset(self->prefetched);
+    // answers から参照されなくなってから破棄する
+    MemArena_reset(self->answer_arena);
+}   // end function : DnsResolver_resetAnswers
+
+/**
+ * DnsResolver_prefetch() で得た応答を全て破棄する.
+ */
+void
+DnsResolver_resetPrefetch(DnsResolver *self)
+{
+    assert(NULL != self);
+    PtrArray_reset(self->prefetched);
+}   // end function : DnsResolver_resetPrefetch
+
+/**
+ * DnsResolver を構築した直後の状態に戻す.
+ * 設定 (キャッシュ, 遅延モード, 期限など), 手元の応答, 応答待ちの問い合わせ, エラーを全て破棄する.
+ * DnsResolverPool に返却して別の評価で使い回す前に呼ぶ.
+ */
+void
+DnsResolver_reset(DnsResolver *self)
+{
+    assert(NULL != self);
+    // 並行問い合わせの途中で返却された場合, 応答待ちの問い合わせを次の利用者に持ち越さない
+    if (NULL != self->fanout && 0 < DnsAsync_getQueryCount(self->fanout)) {
+        DnsResolver_abortPrefetch(self);
+    }   // end if
+    self->cache = NULL;
+    self->deferred = false;
+    self->retain_answers = false;
+    self->deferred_count = 0;
+    self->transient_count = 0;
+    self->deadline = 0;
+    DnsResolver_resetAnswers(self);
+    self->ttl = 0;
+    self->min_ttl = ULONG_MAX;
+    self->resolv_errno = 0;
+    self->resolv_h_errno = NETDB_SUCCESS;
+}   // end function : DnsResolver_reset
+
 void
 DnsAResponse_free(DnsAResponse *self)
 {
@@ -142,18 +469,503 @@ DnsResolver_setError(DnsResolver *self, int res_h_errno)
 {
     self->resolv_h_errno = res_h_errno;
     self->resolv_errno = errno;
+    switch (res_h_errno) {
+    case NETDB_INTERNAL:
+    case TRY_AGAIN:
+    case NO_RECOVERY:
+        ++(self->transient_count);
+        break;
+    default:
+        break;
+    }   // end switch
     return res_h_errno; // 呼び出し側の便宜のため
 }   // end function : DnsResolver_setError
 
 const char *
 DnsResolver_getErrorString(DnsResolver *self)
 {
+    if (DNS_STAT_PENDING == self->resolv_h_errno) {
+        return "Answer pending";
+    }   // end if
     return (NETDB_INTERNAL == self->resolv_h_errno)
         ? strerror(self->resolv_errno) : hstrerror(self->resolv_h_errno);
 }   // end function : DnsResolver_getErrorString
 
+/*
+ * answer section に含まれる RR の TTL の最小値を返す.
+ */
+static unsigned long
+DnsResolver_getAnswerTtl(ns_msg *msghandle)
+{
+    unsigned long minttl = 0;
+    size_t msg_count = ns_msg_count(*msghandle, ns_s_an);
+    for (size_t n = 0; n < msg_count; ++n) {
+        ns_rr rr;
+        if (0 != ns_parserr(msghandle, ns_s_an, n, &rr)) {
+            return 0;
+        }   // end if
+        if (0 == n || ns_rr_ttl(rr) < minttl) {
+            minttl = ns_rr_ttl(rr);
+        }   // end if
+    }   // end for
+    return minttl;
+}   // end function : DnsResolver_getAnswerTtl
+
+/*
+ * 否定応答 (NXDOMAIN, NODATA) をキャッシュしておく秒数を返す.
+ * [RFC2308] 5.
+ * authority section に含まれる SOA レコードの TTL と MINIMUM フィールドのうち小さい方を使う.
+ * @param default_ttl SOA レコードが見つからない場合に返す秒数.
+ */
+static unsigned long
+DnsResolver_getNegativeTtl(ns_msg *msghandle, unsigned long default_ttl)
+{
+    size_t msg_count = ns_msg_count(*msghandle, ns_s_ns);
+    for (size_t n = 0; n < msg_count; ++n) {
+        ns_rr rr;
+        if (0 != ns_parserr(msghandle, ns_s_ns, n, &rr)) {
+            return default_ttl;
+        }   // end if
+        if (ns_t_soa != ns_rr_type(rr)) {
+            continue;
+        }   // end if
+        // MNAME, RNAME を読み飛ばすと SERIAL, REFRESH, RETRY, EXPIRE, MINIMUM が続く
+        const unsigned char *rdata = ns_rr_rdata(rr);
+        const unsigned char *rdata_tail = ns_rr_rdata(rr) + ns_rr_rdlen(rr);
+        if (0 > ns_name_skip(&rdata, rdata_tail) || 0 > ns_name_skip(&rdata, rdata_tail)
+            || rdata_tail < rdata + 5 * NS_INT32SZ) {
+            return 0;
+        }   // end if
+        unsigned long minimum = ns_get32(rdata + 4 * NS_INT32SZ);
+        return (ns_rr_ttl(rr) < minimum) ? ns_rr_ttl(rr) : minimum;
+    }   // end for
+    return default_ttl;
+}   // end function : DnsResolver_getNegativeTtl
+
+/*
+ * 応答メッセージの RCODE と answer section から, 問い合わせの結果を netdb.h の h_errno の値で返す.
+ */
+static int
+DnsResolver_getResponseStat(ns_msg *msghandle)
+{
+    int rcode_flag = ns_msg_getflag(*msghandle, ns_f_rcode);
+    if (ns_r_noerror == rcode_flag) {
+        return (0 < ns_msg_count(*msghandle, ns_s_an)) ? NETDB_SUCCESS : NO_DATA;
+    }   // end if
+    return DnsResolver_rcode2statcode(rcode_flag);
+}   // end function : DnsResolver_getResponseStat
+
+/*
+ * 応答メッセージをキャッシュしてよい秒数を返す.
+ * 成功した応答は answer section の TTL, NXDOMAIN と NODATA は SOA の MINIMUM フィールドに従う.
+ * SOA を含まない NXDOMAIN と NODATA はキャッシュに設定した秒数 (キャッシュがなければ 0).
+ * それ以外のエラーは 0.
+ */
+static unsigned long
+DnsResolver_getResponseTtl(const DnsResolver *self, ns_msg *msghandle)
+{
+    switch (DnsResolver_getResponseStat(msghandle)) {
+    case NETDB_SUCCESS:
+        return DnsResolver_getAnswerTtl(msghandle);
+    case HOST_NOT_FOUND:
+    case NO_DATA:
+        return DnsResolver_getNegativeTtl(msghandle, (NULL != self->cache)
+                                          ? DnsCache_getNegativeTtl(self->cache) : 0);
+    default:
+        return 0;
+    }   // end switch
+}   // end function : DnsResolver_getResponseTtl
+
+/*
+ * 応答メッセージをキャッシュに格納する.
+ * 成功した応答は answer section の TTL に従って, NXDOMAIN と NODATA は SOA の
+ * MINIMUM フィールドに従ってキャッシュする. それ以外のエラーはキャッシュしない.
+ */
+static void
+DnsResolver_storeCache(DnsResolver *self, const char *domain, int rrtype, ns_msg *msghandle,
+                       const unsigned char *msg, int msglen)
+{
+    if (NULL == self->cache) {
+        return;
+    }   // end if
+    DnsCache_store(self->cache, domain, rrtype, msg, msglen,
+                   DnsResolver_getResponseTtl(self, msghandle));
+}   // end function : DnsResolver_storeCache
+
+/*
+ * 問い合わせの結果を answer に格納し, 成功した応答はキャッシュにも格納する.
+ */
+static int
+DnsResolver_fillAnswer(DnsResolver *self, DnsAnswer *answer, int stat, const unsigned char *msg,
+                       int msglen)
+{
+    if (!answer->in_arena) {
+        free(answer->msg);
+    }   // end if
+    answer->msg = NULL;
+    answer->msglen = 0;
+
+    ns_msg msghandle;
+    if (NETDB_SUCCESS == stat && NULL != msg && 0 == ns_initparse(msg, msglen, &msghandle)) {
+        answer->msg = answer->in_arena
+            ? (unsigned char *) MemArena_alloc(self->answer_arena, msglen)
+            : (unsigned char *) malloc(msglen);
+        if (NULL == answer->msg) {
+            answer->stat = NETDB_INTERNAL;
+            return NETDB_INTERNAL;
+        }   // end if
+        memcpy(answer->msg, msg, msglen);
+        answer->msglen = msglen;
+        answer->stat = NETDB_SUCCESS;
+        answer->ttl = DnsResolver_getAnswerTtl(&msghandle);
+        answer->response_ttl = DnsResolver_getResponseTtl(self, &msghandle);
+        DnsResolver_storeCache(self, answer->domain, answer->rrtype, &msghandle, msg, msglen);
+    } else {
+        answer->stat = (NETDB_SUCCESS == stat) ? NO_RECOVERY : stat;
+    }   // end if
+    return NETDB_SUCCESS;
+}   // end function : DnsResolver_fillAnswer
+
+/**
+ * 外部 (DnsAsync など) で得た応答を与える.
+ * 以降同じ問い合わせに対してはこの応答を使う. キャッシュが設定されている場合はキャッシュにも格納する.
+ * @param stat 問い合わせの結果. NETDB_SUCCESS の場合は msg, msglen に応答メッセージを渡す.
+ *             それ以外の場合は問い合わせ自体が失敗したとみなし, msg は参照しない.
+ * @return 成功した場合は NETDB_SUCCESS, メモリの確保に失敗した場合は NETDB_INTERNAL.
+ */
+int
+DnsResolver_feedAnswer(DnsResolver *self, const char *domain, int rrtype, int stat,
+                       const unsigned char *msg, int msglen)
+{
+    assert(NULL != self);
+    assert(NULL != domain);
+
+    DnsAnswer *answer = DnsResolver_findAnswer(self->answers, domain, rrtype);
+    if (NULL == answer) {
+        answer = DnsAnswer_new(domain, rrtype);
+        if (NULL == answer) {
+            return NETDB_INTERNAL;
+        }   // end if
+        if (0 > PtrArray_append(self->answers, answer)) {
+            DnsAnswer_free(answer);
+            return NETDB_INTERNAL;
+        }   // end if
+    }   // end if
+    return DnsResolver_fillAnswer(self, answer, stat, msg, msglen);
+}   // end function : DnsResolver_feedAnswer
+
+/*
+ * 応答メッセージを answers に残す. メモリの確保に失敗した場合は何もしない.
+ * 問い合わせ毎に呼ばれるので, 応答は answer_arena に複製し,
+ * DnsResolver_resetAnswers() でまとめて破棄する.
+ * 再び参照した際に応答の RR の TTL から計算し直すと, キャッシュの残りの有効期間や
+ * 猶予期間中の応答の TTL 0 が失われるので, 最初に参照した時点の TTL を一緒に残す.
+ * @param ttl DnsResolver_getTtl() で返す値
+ * @param response_ttl DnsResolver_getMinTtl() に反映する値
+ */
+static void
+DnsResolver_retainAnswer(DnsResolver *self, const char *domain, int rrtype,
+                         const unsigned char *msg, int msglen, unsigned long ttl,
+                         unsigned long response_ttl)
+{
+    size_t domainlen = strlen(domain);
+    DnsAnswer *answer =
+        (DnsAnswer *) MemArena_alloc(self->answer_arena, sizeof(DnsAnswer) + domainlen + 1);
+    unsigned char *answer_msg = (unsigned char *) MemArena_alloc(self->answer_arena, msglen);
+    if (NULL == answer || NULL == answer_msg) {
+        return;
+    }   // end if
+    memset(answer, 0, sizeof(DnsAnswer));
+    memcpy(answer->domain, domain, domainlen + 1);
+    memcpy(answer_msg, msg, msglen);
+    answer->rrtype = rrtype;
+    answer->in_arena = true;
+    answer->msg = answer_msg;
+    answer->msglen = msglen;
+    answer->stat = NETDB_SUCCESS;
+    answer->ttl = ttl;
+    answer->response_ttl = response_ttl;
+    (void) PtrArray_append(self->answers, answer);
+}   // end function : DnsResolver_retainAnswer
+
+static void
+DnsResolver_prefetchCallback(void *arg, const char *domain, int rrtype, int stat,
+                             const unsigned char *msg, int msglen)
+{
+    DnsPrefetchQuery *query = (DnsPrefetchQuery *) arg;
+    DnsResolver *self = query->resolver;
+    DnsAnswer *answer = DnsAnswer_new(domain, rrtype);
+    if (NULL == answer) {
+        goto land;
+    }   // end if
+    if (0 > PtrArray_append(self->prefetched, answer)) {
+        DnsAnswer_free(answer);
+        goto land;
+    }   // end if
+    if (NETDB_SUCCESS != DnsResolver_fillAnswer(self, answer, stat, msg, msglen)) {
+        // 手元に応答がないことにして, 後で改めて問い合わせる
+        PtrArray_unappend(self->prefetched);
+    }   // end if
+
+  land:
+    // キャッシュに格納してから待っているスレッドに渡す
+    DnsCache_landFlight(self->cache, query->flight, stat, msg, msglen);
+    query->flight = NULL;
+}   // end function : DnsResolver_prefetchCallback
+
+static int64_t
+DnsResolver_nowMsec(void)
+{
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}   // end function : DnsResolver_nowMsec
+
+/**
+ * 以降の問い合わせの期限を設定する.
+ * 期限を過ぎるとネットワークへの問い合わせはおこなわずに TRY_AGAIN を返し,
+ * 期限が近づくと問い合わせ毎のタイムアウトと再送回数を残り時間に収まるように縮める.
+ * 手元にある応答やキャッシュは期限を過ぎても参照する.
+ * @param timeout_msec 現在からの期限 (ミリ秒). 0 の場合は期限を設けない.
+ */
+void
+DnsResolver_setDeadline(DnsResolver *self, unsigned long timeout_msec)
+{
+    assert(NULL != self);
+    self->deadline = (0 < timeout_msec) ? DnsResolver_nowMsec() + (int64_t) timeout_msec : 0;
+}   // end function : DnsResolver_setDeadline
+
+/*
+ * 期限までの残り時間 (ミリ秒) を返す. 期限を過ぎている場合は 0 以下, 期限がない場合は INT64_MAX.
+ */
+static int64_t
+DnsResolver_getRemainingTime(const DnsResolver *self)
+{
+    return (0 == self->deadline) ? INT64_MAX : self->deadline - DnsResolver_nowMsec();
+}   // end function : DnsResolver_getRemainingTime
+
+/**
+ * DnsResolver_setDeadline() で設定した期限を過ぎているかを調べる.
+ */
+bool
+DnsResolver_isExpired(const DnsResolver *self)
+{
+    assert(NULL != self);
+    return DnsResolver_getRemainingTime(self) <= 0;
+}   // end function : DnsResolver_isExpired
+
+/*
+ * 問い合わせの応答が既に手元 (DnsResolver_feedAnswer() などで与えられた応答,
+ * DnsResolver_prefetch() で得た応答, キャッシュ) にあるかを調べる.
+ */
+static bool
+DnsResolver_hasAnswer(DnsResolver *self, const char *domain, int rrtype)
+{
+    if (NULL != DnsResolver_findAnswer(self->answers, domain, rrtype)
+        || NULL != DnsResolver_findAnswer(self->prefetched, domain, rrtype)) {
+        return true;
+    }   // end if
+    // msgbuf は DnsResolver の各メソッドの呼び出しの間では参照されないので作業領域に使える
+    return NULL != self->cache
+        && 0 <= DnsCache_lookup(self->cache, domain, rrtype, self->msgbuf, NS_MAXMSG, NULL);
+}   // end function : DnsResolver_hasAnswer
+
+/*
+ * questions[n] を問い合わせる必要があるかを調べる.
+ * 同じ問い合わせが重複している場合は最初の 1 つだけを問い合わせる.
+ */
+static bool
+DnsResolver_needPrefetch(DnsResolver *self, const DnsQuestion *questions, size_t n)
+{
+    for (size_t m = 0; m < n; ++m) {
+        if (questions[m].rrtype == questions[n].rrtype
+            && DnsResolver_isSameName(questions[m].domain, questions[n].domain)) {
+            return false;
+        }   // end if
+    }   // end for
+    return !DnsResolver_hasAnswer(self, questions[n].domain, questions[n].rrtype);
+}   // end function : DnsResolver_needPrefetch
+
+/**
+ * 複数の問い合わせを並行におこない, 応答を手元に用意しておく.
+ * 以降の DnsResolver_lookup*(), DnsResolver_view*() は, 用意した応答をネットワークに
+ * 問い合わせずに使う. 既に応答が手元かキャッシュにある問い合わせは送らない.
+ * 問い合わせが 1 つしか残らない場合は, 通常の問い合わせと変わらないので何もしない.
+ * 並行に問い合わせるのは先頭の DNSRESOLV_PREFETCH_MAXNUM 個までで, 残りは後で 1 つずつ問い合わせる.
+ * キャッシュを使う場合, 並行に送る問い合わせも他のスレッドの同じ問い合わせと合流させる.
+ * 他のスレッドが問い合わせている最中のものは送らず, 後で 1 つずつ問い合わせる際にその応答を待つ.
+ * タイムアウトなどの失敗も結果として用意し, 以降の参照ではその失敗を返す.
+ * 遅延モードの場合は問い合わせずに全てを応答待ちとして記録するので,
+ * DnsResolver_takePendingQuery() で一度に取り出せる.
+ * 用意した応答は DnsResolver_resetPrefetch() か DnsResolver_resetAnswers() を呼ぶまで保持する.
+ * @return 送った (遅延モードの場合は応答待ちとして記録した) 問い合わせの数.
+ */
+size_t
+DnsResolver_prefetch(DnsResolver *self, const DnsQuestion *questions, size_t num)
+{
+    assert(NULL != self);
+    assert(NULL != questions || 0 == num);
+
+    size_t sent_num = 0;
+    if (self->deferred) {
+        for (size_t n = 0; n < num; ++n) {
+            if (!DnsResolver_needPrefetch(self, questions, n)) {
+                continue;
+            }   // end if
+            DnsAnswer *answer = DnsAnswer_new(questions[n].domain, questions[n].rrtype);
+            if (NULL == answer) {
+                break;
+            }   // end if
+            if (0 > PtrArray_append(self->answers, answer)) {
+                DnsAnswer_free(answer);
+                break;
+            }   // end if
+            ++sent_num;
+        }   // end for
+        return sent_num;
+    }   // end if
+
+    if (DNSRESOLV_PREFETCH_MAXNUM < num) {
+        num = DNSRESOLV_PREFETCH_MAXNUM;
+    }   // end if
+    size_t need_num = 0;
+    for (size_t n = 0; n < num; ++n) {
+        if (DnsResolver_needPrefetch(self, questions, n)) {
+            ++need_num;
+        }   // end if
+    }   // end for
+
+    if (need_num < 2) {
+        return 0;
+    }   // end if
+    if (NULL == self->fanout) {
+        // ネームサーバは resolv.conf の更新に追従する DnsResolverPool の res_ninit() の結果に従う
+        self->fanout = DnsAsync_new(&self->resolver);
+        if (NULL == self->fanout) {
+            return 0;
+        }   // end if
+    }   // end if
+    for (size_t n = 0; n < num; ++n) {
+        if (!DnsResolver_needPrefetch(self, questions, n)) {
+            continue;
+        }   // end if
+        DnsPrefetchQuery *query = &(self->prefetch_query[n]);
+        query->resolver = self;
+        query->flight = NULL;
+        if (NULL != self->cache) {
+            // 待たずに確かめるだけなので, 他のスレッドが問い合わせている最中であれば送らない
+            int flight_stat;
+            if (DNSCACHE_FLIGHT_LEAD !=
+                DnsCache_joinFlight(self->cache, questions[n].domain, questions[n].rrtype,
+                                    self->msgbuf, NS_MAXMSG, &query->flight, &flight_stat, 0)) {
+                continue;
+            }   // end if
+        }   // end if
+        if (0 == DnsAsync_submit(self->fanout, questions[n].domain, questions[n].rrtype,
+                                 DnsResolver_prefetchCallback, query)) {
+            ++sent_num;
+        } else {
+            DnsCache_landFlight(self->cache, query->flight, TRY_AGAIN, NULL, 0);
+            query->flight = NULL;
+        }   // end if
+    }   // end for
+    int pending_num;
+    int64_t remaining;
+    while (0 < (remaining = DnsResolver_getRemainingTime(self))
+           && 0 < (pending_num = DnsAsync_dispatch(self->fanout,
+                                                   (INT_MAX < remaining) ? -1 : (int) remaining)));
+    if (0 >= remaining || 0 > pending_num) {
+        DnsResolver_abortPrefetch(self);
+    }   // end if
+    return sent_num;
+}   // end function : DnsResolver_prefetch
+
+/*
+ * res_nsend() が失敗した際の errno を netdb.h の h_errno の値に変換する.
+ * リゾルバが h_errno の値をセットしていればそれを使う.
+ */
+static int
+DnsResolver_mapSendError(DnsResolver *self)
+{
+    if (NETDB_SUCCESS != self->resolver.res_h_errno) {
+        return self->resolver.res_h_errno;
+    }   // end if
+    switch (errno) {
+    case ETIMEDOUT:
+    case ECONNREFUSED:
+    case EAGAIN:
+    case EINTR:
+        // 一時的にネームサーバから応答が得られなかった
+        return TRY_AGAIN;
+    case ESRCH:
+        // 問い合わせるネームサーバが設定されていない
+        return NO_RECOVERY;
+    default:
+        return NETDB_INTERNAL;
+    }   // end switch
+}   // end function : DnsResolver_mapSendError
+
+/*
+ * キャッシュなどを参照せずにネームサーバに問い合わせ, 応答を msgbuf に受け取って解析する.
+ * @return 応答を受け取った場合は NETDB_SUCCESS (応答の RCODE は問わない),
+ *         問い合わせを組み立てられなかった場合や応答が壊れていた場合, ネームサーバが
+ *         設定されていない場合は NO_RECOVERY, 応答が得られなかった場合は TRY_AGAIN,
+ *         それ以外のシステムエラーは NETDB_INTERNAL.
+ */
+static int
+DnsResolver_send(DnsResolver *self, const char *domain, int rrtype)
+{
+    unsigned char querybuf[NS_PACKETSZ];
+    int querylen = res_nmkquery(&self->resolver, ns_o_query, domain, ns_c_in, rrtype, NULL, 0,
+                                NULL, querybuf, sizeof(querybuf));
+    if (0 > querylen) {
+        return NO_RECOVERY;
+    }   // end if
+    int64_t remaining = DnsResolver_getRemainingTime(self);
+    if (0 >= remaining) {
+        errno = ETIMEDOUT;
+        return TRY_AGAIN;
+    }   // end if
+    /*
+     * res_nsend() は最悪でおよそ retrans * retry * nscount 秒かかるので,
+     * 期限までの残り時間に収まるように再送回数, 次いでタイムアウトを縮める.
+     * 秒単位でしか指定できないので, 最後の 1 秒未満は超過しうる.
+     */
+    int retrans = self->resolver.retrans;
+    int retry = self->resolver.retry;
+    if (INT64_MAX != remaining) {
+        int nscount = (0 < self->resolver.nscount) ? self->resolver.nscount : 1;
+        int budget = (int) ((MIN(remaining, (int64_t) INT_MAX) + 999) / 1000);
+        if (budget < retrans * retry * nscount) {
+            self->resolver.retry = MAX(1, budget / (retrans * nscount));
+            if (1 == self->resolver.retry) {
+                self->resolver.retrans = MAX(1, MIN(retrans, budget / nscount));
+            }   // end if
+        }   // end if
+    }   // end if
+    self->resolver.res_h_errno = NETDB_SUCCESS;
+    self->msglen = res_nsend(&self->resolver, querybuf, querylen, self->msgbuf, NS_MAXMSG);
+    self->resolver.retrans = retrans;
+    self->resolver.retry = retry;
+    if (0 > self->msglen) {
+        return DnsResolver_mapSendError(self);
+    }   // end if
+    if (NS_MAXMSG < self->msglen) {
+        // 切り詰められている
+        self->msglen = NS_MAXMSG;
+    }   // end if
+    if (0 > ns_initparse(self->msgbuf, self->msglen, &self->msghanlde)) {
+        return NO_RECOVERY;
+    }   // end if
+    return NETDB_SUCCESS;
+}   // end function : DnsResolver_send
+
 /*
  * クエリを投げる.
+ * DnsResolver_feedAnswer() で与えられた応答, DnsResolver_prefetch() で得た応答, キャッシュの順に参照し,
+ * いずれにもない場合のみ問い合わせる.
+ * 遅延モードの場合は問い合わせずに応答待ちとして記録し, DNS_STAT_PENDING を返す.
+ * 否定応答をキャッシュするため res_nquery() ではなく res_nsend() で応答メッセージ自体を受け取る.
  * @return
  */
 static int
@@ -162,25 +974,123 @@ DnsResolver_query(DnsResolver *self, const char *domain, int rrtype)
     self->resolver.res_h_errno = 0;
     self->resolv_errno = 0;
     self->resolv_h_errno = NETDB_SUCCESS;
-    self->msglen = res_nquery(&self->resolver, domain, ns_c_in, rrtype, self->msgbuf, NS_MAXMSG);
-    if (0 > self->msglen) {
-        goto queryfail;
+    self->ttl = 0;
+
+    DnsAnswer *answer = DnsResolver_findAnswer(self->answers, domain, rrtype);
+    if (NULL == answer) {
+        answer = DnsResolver_findAnswer(self->prefetched, domain, rrtype);
+        if (NULL != answer && NETDB_SUCCESS == answer->stat && self->retain_answers) {
+            DnsResolver_retainAnswer(self, domain, rrtype, answer->msg, answer->msglen,
+                                     answer->ttl, answer->response_ttl);
+        }   // end if
     }   // end if
-    if (0 > ns_initparse(self->msgbuf, self->msglen, &self->msghanlde)) {
-        self->resolver.res_h_errno = NO_RECOVERY;
-        goto queryfail;
+    if (NULL != answer) {
+        switch (answer->stat) {
+        case NETDB_SUCCESS:
+            memcpy(self->msgbuf, answer->msg, answer->msglen);
+            self->msglen = answer->msglen;
+            if (0 > ns_initparse(self->msgbuf, self->msglen, &self->msghanlde)) {
+                DnsResolver_updateMinTtl(self, 0);
+                return DnsResolver_setError(self, NO_RECOVERY);
+            }   // end if
+            // 最初に参照した時点の TTL に従う
+            self->ttl = answer->ttl;
+            DnsResolver_updateMinTtl(self, answer->response_ttl);
+            goto evaluate;
+        case DNS_STAT_PENDING:
+            ++(self->deferred_count);
+            return DnsResolver_setError(self, DNS_STAT_PENDING);
+        default:
+            DnsResolver_updateMinTtl(self, 0);
+            return DnsResolver_setError(self, answer->stat);
+        }   // end switch
+    }   // end if
+
+    if (NULL != self->cache) {
+        unsigned long cache_ttl;
+        self->msglen =
+            DnsCache_lookup(self->cache, domain, rrtype, self->msgbuf, NS_MAXMSG, &cache_ttl);
+        if (0 <= self->msglen) {
+            if (0 > ns_initparse(self->msgbuf, self->msglen, &self->msghanlde)) {
+                DnsResolver_updateMinTtl(self, 0);
+                return DnsResolver_setError(self, NO_RECOVERY);
+            }   // end if
+            // 否定応答の場合もキャッシュの残りの有効期間に従う
+            self->ttl = cache_ttl;
+            DnsResolver_updateMinTtl(self, cache_ttl);
+            if (self->retain_answers) {
+                DnsResolver_retainAnswer(self, domain, rrtype, self->msgbuf, self->msglen,
+                                         cache_ttl, cache_ttl);
+            }   // end if
+            goto evaluate;
+        }   // end if
     }   // end if
 
-    int rcode_flag = ns_msg_getflag(self->msghanlde, ns_f_rcode);
-    if (rcode_flag != ns_r_noerror) {
-        self->resolver.res_h_errno = DnsResolver_rcode2statcode(rcode_flag);
-        goto queryfail;
+    if (self->deferred) {
+        answer = DnsAnswer_new(domain, rrtype);
+        if (NULL == answer) {
+            return DnsResolver_setError(self, NETDB_INTERNAL);
+        }   // end if
+        if (0 > PtrArray_append(self->answers, answer)) {
+            DnsAnswer_free(answer);
+            return DnsResolver_setError(self, NETDB_INTERNAL);
+        }   // end if
+        ++(self->deferred_count);
+        return DnsResolver_setError(self, DNS_STAT_PENDING);
     }   // end if
 
-    return NETDB_SUCCESS;
+    if (DnsResolver_isExpired(self)) {
+        // 他のスレッドの問い合わせも待たない
+        errno = ETIMEDOUT;
+        DnsResolver_updateMinTtl(self, 0);
+        return DnsResolver_setError(self, TRY_AGAIN);
+    }   // end if
+
+    // 他のスレッドが同じ問い合わせをおこなっている最中であれば, その応答を待って受け取る
+    DnsCacheFlight *flight = NULL;
+    if (NULL != self->cache) {
+        int flight_stat = NETDB_SUCCESS;
+        self->msglen =
+            DnsCache_joinFlight(self->cache, domain, rrtype, self->msgbuf, NS_MAXMSG, &flight,
+                                &flight_stat, DnsResolver_getRemainingTime(self));
+        if (0 <= self->msglen) {
+            goto parse;
+        } else if (DNSCACHE_FLIGHT_FAILED == self->msglen) {
+            DnsResolver_updateMinTtl(self, 0);
+            return DnsResolver_setError(self, flight_stat);
+        }   // end if
+    }   // end if
+
+    int send_stat = DnsResolver_send(self, domain, rrtype);
+    if (NETDB_SUCCESS != send_stat) {
+        DnsCache_landFlight(self->cache, flight, send_stat, NULL, 0);
+        DnsResolver_updateMinTtl(self, 0);
+        return DnsResolver_setError(self, send_stat);
+    }   // end if
+    DnsResolver_storeCache(self, domain, rrtype, &self->msghanlde, self->msgbuf, self->msglen);
+    // キャッシュに格納してから待っているスレッドに渡す
+    DnsCache_landFlight(self->cache, flight, NETDB_SUCCESS, self->msgbuf, self->msglen);
+    goto retain;
+
+  parse:
+    if (0 > ns_initparse(self->msgbuf, self->msglen, &self->msghanlde)) {
+        DnsResolver_updateMinTtl(self, 0);
+        return DnsResolver_setError(self, NO_RECOVERY);
+    }   // end if
 
-  queryfail:
-    return DnsResolver_setError(self, self->resolver.res_h_errno);
+  retain:;
+    unsigned long response_ttl = DnsResolver_getResponseTtl(self, &self->msghanlde);
+    self->ttl = DnsResolver_getAnswerTtl(&self->msghanlde);
+    DnsResolver_updateMinTtl(self, response_ttl);
+    if (self->retain_answers) {
+        DnsResolver_retainAnswer(self, domain, rrtype, self->msgbuf, self->msglen, self->ttl,
+                                 response_ttl);
+    }   // end if
+
+  evaluate:;
+    int response_stat = DnsResolver_getResponseStat(&self->msghanlde);
+    return (NETDB_SUCCESS == response_stat)
+        ? NETDB_SUCCESS : DnsResolver_setError(self, response_stat);
 }   // end function : DnsResolver_query
 
 int
@@ -453,24 +1363,36 @@ DnsResolver_expandReverseEntry6(const struct in6_addr *addr6, char *buf, size_t
     return true;
 }   // end function : DnsResolver_expandReverseEntry6
 
-int
-DnsResolver_lookupPtr(DnsResolver *self, int af, const void *addr, DnsPtrResponse **resp)
+/*
+ * buflen のサイズは DNS_IP6_REVENT_MAXLEN 以上である必要がある.
+ * @return 成功した場合は true, 未知のアドレスファミリーの場合は errno を設定して false.
+ */
+static bool
+DnsResolver_expandReverseEntry(int af, const void *addr, char *buf, size_t buflen)
 {
-    // IPv6 の逆引きエントリ名生成に十分な長さのバッファを確保する.
-    char domain[DNS_IP6_REVENT_MAXLEN];
     switch (af) {
     case AF_INET:
-        if (!DnsResolver_expandReverseEntry4(addr, domain, sizeof(domain))) {
+        if (!DnsResolver_expandReverseEntry4(addr, buf, buflen)) {
             abort();
         }   // end if
-        break;
+        return true;
     case AF_INET6:
-        if (!DnsResolver_expandReverseEntry6(addr, domain, sizeof(domain))) {
+        if (!DnsResolver_expandReverseEntry6(addr, buf, buflen)) {
             abort();
         }   // end if
-        break;
+        return true;
     default:
         errno = EAFNOSUPPORT;
+        return false;
+    }   // end if
+}   // end function : DnsResolver_expandReverseEntry
+
+int
+DnsResolver_lookupPtr(DnsResolver *self, int af, const void *addr, DnsPtrResponse **resp)
+{
+    // IPv6 の逆引きエントリ名生成に十分な長さのバッファを確保する.
+    char domain[DNS_IP6_REVENT_MAXLEN];
+    if (!DnsResolver_expandReverseEntry(af, addr, domain, sizeof(domain))) {
         return NETDB_INTERNAL;
     }   // end if
 
@@ -523,3 +1445,238 @@ DnsResolver_lookupPtr(DnsResolver *self, int af, const void *addr, DnsPtrRespons
     DnsPtrResponse_free(respobj);
     return DnsResolver_setError(self, NETDB_INTERNAL);
 }   // end function : DnsResolver_lookupPtr
+
+/*
+ * view に arena の内容を設定する. 呼び出し後に arena に書き込んではならない.
+ * @return 成功した場合は NETDB_SUCCESS.
+ */
+static int
+DnsResolver_setView(DnsResolver *self, XBuffer *arena, size_t num, DnsRrView *view)
+{
+    if (0 != XBuffer_status(arena)) {
+        return DnsResolver_setError(self, NETDB_INTERNAL);
+    }   // end if
+    if (0 == num) {
+        return DnsResolver_setError(self, NO_RECOVERY);
+    }   // end if
+    view->num = num;
+    view->next = (const char *) XBuffer_getBytes(arena);
+    view->tail = view->next + XBuffer_getSize(arena);
+    return NETDB_SUCCESS;
+}   // end function : DnsResolver_setView
+
+/*
+ * 直前の問い合わせの応答に含まれる rrtype 型の RR の RDATA 中のドメイン名を name_arena に展開する.
+ * @param offset RDATA 中のドメイン名の位置
+ */
+static int
+DnsResolver_viewNames(DnsResolver *self, int rrtype, size_t offset, DnsRrView *view)
+{
+    XBuffer_reset(self->name_arena);
+    size_t num = 0;
+    size_t msg_count = ns_msg_count(self->msghanlde, ns_s_an);
+    for (size_t n = 0; n < msg_count; ++n) {
+        ns_rr rr;
+        if (0 != ns_parserr(&self->msghanlde, ns_s_an, n, &rr)) {
+            return DnsResolver_setError(self, NO_RECOVERY);
+        }   // end if
+        if (rrtype != (int) ns_rr_type(rr)) {
+            continue;
+        }   // end if
+        if (ns_rr_rdlen(rr) < offset) {
+            return DnsResolver_setError(self, NO_RECOVERY);
+        }   // end if
+        char dnamebuf[NS_MAXDNAME];
+        int dnamelen =
+            ns_name_uncompress(self->msgbuf, self->msgbuf + self->msglen, ns_rr_rdata(rr) + offset,
+                               dnamebuf, sizeof(dnamebuf));
+        if ((int) offset + dnamelen != ns_rr_rdlen(rr)) {
+            return DnsResolver_setError(self, NO_RECOVERY);
+        }   // end if
+        XBuffer_appendBytes(self->name_arena, dnamebuf, strlen(dnamebuf) + 1);
+        ++num;
+    }   // end for
+    return DnsResolver_setView(self, self->name_arena, num, view);
+}   // end function : DnsResolver_viewNames
+
+/**
+ * MX RR を引き, exchange のドメイン名を順に取り出すビューを返す.
+ * DnsResolver_lookupMx() と異なり, RR 毎のメモリの確保はおこなわない.
+ * @return 成功した場合は NETDB_SUCCESS.
+ */
+int
+DnsResolver_viewMx(DnsResolver *self, const char *domain, DnsRrView *view)
+{
+    int query_stat = DnsResolver_query(self, domain, ns_t_mx);
+    if (NETDB_SUCCESS != query_stat) {
+        return query_stat;
+    }   // end if
+    return DnsResolver_viewNames(self, ns_t_mx, NS_INT16SZ, view);
+}   // end function : DnsResolver_viewMx
+
+/**
+ * PTR RR を引き, ドメイン名を順に取り出すビューを返す.
+ * @return 成功した場合は NETDB_SUCCESS.
+ */
+int
+DnsResolver_viewPtr(DnsResolver *self, int af, const void *addr, DnsRrView *view)
+{
+    char domain[DNS_IP6_REVENT_MAXLEN];
+    if (!DnsResolver_expandReverseEntry(af, addr, domain, sizeof(domain))) {
+        return NETDB_INTERNAL;
+    }   // end if
+    int query_stat = DnsResolver_query(self, domain, ns_t_ptr);
+    if (NETDB_SUCCESS != query_stat) {
+        return query_stat;
+    }   // end if
+    return DnsResolver_viewNames(self, ns_t_ptr, 0, view);
+}   // end function : DnsResolver_viewPtr
+
+/*
+ * TXT 形式の RR を引き, 各 RR の character-string を連結したものを txt_arena に置く.
+ */
+static int
+DnsResolver_viewTxtData(DnsResolver *self, int rrtype, const char *domain, DnsRrView *view)
+{
+    int query_stat = DnsResolver_query(self, domain, rrtype);
+    if (NETDB_SUCCESS != query_stat) {
+        return query_stat;
+    }   // end if
+    XBuffer_reset(self->txt_arena);
+    // 連結した文字列の長さの合計は応答の長さを越えないので, 先に確保しておけば再確保は起きない
+    XBuffer_reserve(self->txt_arena, self->msglen);
+    size_t num = 0;
+    size_t msg_count = ns_msg_count(self->msghanlde, ns_s_an);
+    for (size_t n = 0; n < msg_count; ++n) {
+        ns_rr rr;
+        if (0 != ns_parserr(&self->msghanlde, ns_s_an, n, &rr)) {
+            return DnsResolver_setError(self, NO_RECOVERY);
+        }   // end if
+        if (ns_t_txt != ns_rr_type(rr)) {
+            continue;
+        }   // end if
+        const unsigned char *rdata = ns_rr_rdata(rr);
+        const unsigned char *rdata_tail = ns_rr_rdata(rr) + ns_rr_rdlen(rr);
+        bool terminated = false;    // NULL 文字を含む場合はそこで打ち切る
+        while (rdata < rdata_tail) {
+            // 長さフィールドが RDLEN の中に収まっているか確認する
+            if (rdata_tail < rdata + (*rdata) + 1) {
+                return DnsResolver_setError(self, NO_RECOVERY);
+            }   // end if
+            if (!terminated) {
+                const unsigned char *nul = memchr(rdata + 1, '\0', *rdata);
+                XBuffer_appendBytes(self->txt_arena, rdata + 1,
+                                    NULL != nul ? (size_t) (nul - (rdata + 1)) : (size_t) *rdata);
+                terminated = (NULL != nul);
+            }   // end if
+            rdata += (size_t) *rdata + 1;
+        }   // end while
+        XBuffer_appendByte(self->txt_arena, '\0');
+        ++num;
+    }   // end for
+    return DnsResolver_setView(self, self->txt_arena, num, view);
+}   // end function : DnsResolver_viewTxtData
+
+/**
+ * TXT RR を引き, 各 RR の文字列を順に取り出すビューを返す.
+ * DnsResolver_lookupTxt() と異なり, RR 毎のメモリの確保はおこなわない.
+ * @return 成功した場合は NETDB_SUCCESS.
+ */
+int
+DnsResolver_viewTxt(DnsResolver *self, const char *domain, DnsRrView *view)
+{
+    return DnsResolver_viewTxtData(self, ns_t_txt, domain, view);
+}   // end function : DnsResolver_viewTxt
+
+int
+DnsResolver_viewSpf(DnsResolver *self, const char *domain, DnsRrView *view)
+{
+    return DnsResolver_viewTxtData(self, 99 /* as ns_t_spf */ , domain, view);
+}   // end function : DnsResolver_viewSpf
+
+/**
+ * ビューから次の文字列を取り出す.
+ * @return 次の文字列, 全て取り出した後は NULL.
+ */
+const char *
+DnsRrView_next(DnsRrView *view)
+{
+    assert(NULL != view);
+    if (view->tail <= view->next) {
+        return NULL;
+    }   // end if
+    const char *current = view->next;
+    view->next += strlen(current) + 1;
+    return current;
+}   // end function : DnsRrView_next
+
+/*
+ * DnsCache の猶予期間中のエントリを, 裏で問い合わせ直して更新するスレッド.
+ */
+struct DnsRefresher {
+    DnsCache *cache;
+    DnsResolver *resolver;
+    pthread_t thread;
+};
+
+static void *
+DnsRefresher_main(void *arg)
+{
+    DnsRefresher *self = (DnsRefresher *) arg;
+    char domain[NS_MAXDNAME];
+    int rrtype;
+    while (DnsCache_takeRefresh(self->cache, domain, sizeof(domain), &rrtype)) {
+        // 応答はエラーも含め DnsResolver_storeCache() の規則に従ってキャッシュに格納する.
+        // 応答が得られなかった場合はエントリを期限切れのまま残し, 次に引かれた際に再び依頼させる.
+        if (NETDB_SUCCESS == DnsResolver_send(self->resolver, domain, rrtype)) {
+            DnsResolver_storeCache(self->resolver, domain, rrtype, &self->resolver->msghanlde,
+                                   self->resolver->msgbuf, self->resolver->msglen);
+        }   // end if
+        DnsCache_endRefresh(self->cache, domain, rrtype);
+    }   // end while
+    return NULL;
+}   // end function : DnsRefresher_main
+
+/**
+ * DnsCache の猶予期間中のエントリを更新するスレッドを開始する.
+ * 猶予期間は DnsCache_setGrace() で設定する.
+ * @return DnsRefresher オブジェクト, スレッドの開始に失敗した場合は NULL.
+ */
+DnsRefresher *
+DnsRefresher_start(DnsCache *cache)
+{
+    assert(NULL != cache);
+    DnsRefresher *self = (DnsRefresher *) malloc(sizeof(DnsRefresher));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    self->cache = cache;
+    self->resolver = DnsResolver_new();
+    if (NULL == self->resolver) {
+        free(self);
+        return NULL;
+    }   // end if
+    DnsResolver_setCache(self->resolver, cache);
+    if (0 != pthread_create(&self->thread, NULL, DnsRefresher_main, self)) {
+        DnsResolver_free(self->resolver);
+        free(self);
+        return NULL;
+    }   // end if
+    return self;
+}   // end function : DnsRefresher_start
+
+/**
+ * 更新のスレッドを止めて DnsRefresher オブジェクトを解放する.
+ * 以降 cache には更新の依頼が積まれなくなる. 問い合わせ中の更新があれば終わるまで待つ.
+ */
+void
+DnsRefresher_stop(DnsRefresher *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    DnsCache_stopRefresh(self->cache);
+    (void) pthread_join(self->thread, NULL);
+    DnsResolver_free(self->resolver);
+    free(self);
+}   // end function : DnsRefresher_stop
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * res_ninit() 済みの DnsResolver を使い回すためのプール.
+ * 返却された DnsResolver は状態を初期化して保持し, 次の DnsResolverPool_acquire() で渡す.
+ * resolv.conf が更新された場合は, それ以前に res_ninit() した DnsResolver を破棄する.
+ * 保持する DnsResolver の数は, 同時に貸し出された数の最大値を越えることはない.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <resolv.h>
+
+#include "dnsresolv.h"
+#include "dnsresolvpool.h"
+
+#ifndef _PATH_RESCONF
+# define _PATH_RESCONF "/etc/resolv.conf"
+#endif
+
+#define DNS_RESOLVPOOL_CHECK_INTERVAL 1 // resolv.conf の更新を確認する間隔 (秒)
+
+struct DnsResolverPool {
+    pthread_mutex_t lock;
+    DnsResolver **idle;         // 貸し出していない DnsResolver
+    size_t idle_num;
+    size_t idle_capacity;
+    unsigned long generation;   // resolv.conf の更新を検出する度に増やす
+    time_t resconf_mtime;
+    time_t last_check;
+};
+
+/*
+ * resolv.conf の更新を確認し, 更新されていた場合は世代を進めて保持している DnsResolver を破棄する.
+ * ロックを保持した状態で呼ぶこと.
+ */
+static void
+DnsResolverPool_checkResConf(DnsResolverPool *self)
+{
+    time_t now = time(NULL);
+    if (now < self->last_check + DNS_RESOLVPOOL_CHECK_INTERVAL && self->last_check <= now) {
+        return;
+    }   // end if
+    self->last_check = now;
+
+    struct stat st;
+    time_t mtime = (0 == stat(_PATH_RESCONF, &st)) ? st.st_mtime : 0;
+    if (mtime == self->resconf_mtime) {
+        return;
+    }   // end if
+    self->resconf_mtime = mtime;
+    ++(self->generation);
+    for (size_t n = 0; n < self->idle_num; ++n) {
+        DnsResolver_free(self->idle[n]);
+    }   // end for
+    self->idle_num = 0;
+}   // end function : DnsResolverPool_checkResConf
+
+/**
+ * DnsResolver を 1 つ借りる. 保持している DnsResolver がない場合は新たに構築する.
+ * 借りた DnsResolver は DnsResolverPool_release() で返却すること.
+ * @return DnsResolver オブジェクト, 構築に失敗した場合は NULL.
+ */
+DnsResolver *
+DnsResolverPool_acquire(DnsResolverPool *self)
+{
+    assert(NULL != self);
+
+    pthread_mutex_lock(&self->lock);
+    DnsResolverPool_checkResConf(self);
+    unsigned long generation = self->generation;
+    DnsResolver *resolver = (0 < self->idle_num) ? self->idle[--(self->idle_num)] : NULL;
+    pthread_mutex_unlock(&self->lock);
+
+    if (NULL == resolver) {
+        // res_ninit() は resolv.conf を読むのでロックの外でおこなう
+        resolver = DnsResolver_new();
+        if (NULL == resolver) {
+            return NULL;
+        }   // end if
+        resolver->pool_generation = generation;
+    }   // end if
+    return resolver;
+}   // end function : DnsResolverPool_acquire
+
+/**
+ * DnsResolverPool_acquire() で借りた DnsResolver を返却する.
+ * DnsResolver の設定 (キャッシュ, 遅延モード, 期限など), 手元の応答, 応答待ちの問い合わせは初期化される.
+ */
+void
+DnsResolverPool_release(DnsResolverPool *self, DnsResolver *resolver)
+{
+    assert(NULL != self);
+    assert(NULL != resolver);
+
+    DnsResolver_reset(resolver);
+
+    pthread_mutex_lock(&self->lock);
+    if (resolver->pool_generation == self->generation) {
+        if (self->idle_num < self->idle_capacity) {
+            self->idle[(self->idle_num)++] = resolver;
+            resolver = NULL;
+        } else {
+            size_t newcapacity = (0 < self->idle_capacity) ? self->idle_capacity * 2 : 16;
+            DnsResolver **newidle =
+                (DnsResolver **) realloc(self->idle, newcapacity * sizeof(DnsResolver *));
+            if (NULL != newidle) {
+                self->idle = newidle;
+                self->idle_capacity = newcapacity;
+                self->idle[(self->idle_num)++] = resolver;
+                resolver = NULL;
+            }   // end if
+        }   // end if
+    }   // end if
+    pthread_mutex_unlock(&self->lock);
+
+    // 古い世代のもの, 保持できなかったものは破棄する
+    if (NULL != resolver) {
+        DnsResolver_free(resolver);
+    }   // end if
+}   // end function : DnsResolverPool_release
+
+void
+DnsResolverPool_free(DnsResolverPool *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    for (size_t n = 0; n < self->idle_num; ++n) {
+        DnsResolver_free(self->idle[n]);
+    }   // end for
+    free(self->idle);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+}   // end function : DnsResolverPool_free
+
+/**
+ * DnsResolverPool オブジェクトを構築する.
+ */
+DnsResolverPool *
+DnsResolverPool_new(void)
+{
+    DnsResolverPool *self = (DnsResolverPool *) malloc(sizeof(DnsResolverPool));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DnsResolverPool));
+    if (0 != pthread_mutex_init(&self->lock, NULL)) {
+        free(self);
+        return NULL;
+    }   // end if
+    self->idle = NULL;
+    self->idle_num = 0;
+    self->idle_capacity = 0;
+    self->generation = 0;
+    struct stat st;
+    self->resconf_mtime = (0 == stat(_PATH_RESCONF, &st)) ? st.st_mtime : 0;
+    self->last_check = time(NULL);
+    return self;
+}   // end function : DnsResolverPool_new
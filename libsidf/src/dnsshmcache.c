@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * 同じホスト上の複数のプロセスで共有する DNS 応答キャッシュ.
+ * POSIX 共有メモリ上に固定長のスロットを並べ, 4 way のセットアソシアティブ方式で配置する.
+ * スロット毎にシーケンス番号を持つ seqlock で保護し, ロックは一切使わない.
+ * 書き込み側はシーケンス番号を CAS で奇数にできた場合のみ書き込み, 偶数に戻して公開する.
+ * 読み込み側はシーケンス番号が奇数でなく, 読み込みの前後で変化していない場合のみ結果を採用する.
+ * キャッシュなので, 競合した場合は書き込みを諦め, 読み込みはミスとして扱う.
+ * 書き込み中にプロセスが落ちたスロットは使われなくなるが, 同じセットの他のスロットは使い続けられる.
+ * 全体がゼロで埋まった状態を空のキャッシュとして扱えるので, 最初に作成したプロセスが
+ * 初期化を終えるのを他のプロセスが待つ必要はない.
+ * 共有メモリ上のアドレスはプロセス毎に異なるので, ポインタは一切置かない.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "cacheutil.h"
+#include "dnsshmcache.h"
+
+#define DNSSHMCACHE_MAGIC 0x44534d43U  /* "DSMC" */
+#define DNSSHMCACHE_VERSION 1
+#define DNSSHMCACHE_SLOT_SIZE 1024
+#define DNSSHMCACHE_WAYS 4      // 1 つのセットに含まれるスロットの数
+#define DNSSHMCACHE_MAX_TTL 86400   // これより長い TTL は切り詰める
+#define DNSSHMCACHE_READ_RETRY 4    // 書き込みと競合した場合に読み直す回数
+
+typedef struct DnsShmCacheHeader {
+    uint32_t magic;             // 初期化が済むまでは 0
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t slot_num;
+    unsigned char padding[48];
+} DnsShmCacheHeader;
+
+typedef struct DnsShmCacheSlotHeader {
+    volatile uint32_t seq;      // 書き込み中は奇数
+    uint32_t hash;
+    int32_t rrtype;
+    uint16_t keylen;
+    uint16_t msglen;
+    int64_t expire;             // CLOCK_MONOTONIC 基準の有効期限 (秒). 空のスロットは 0
+} DnsShmCacheSlotHeader;
+
+#define DNSSHMCACHE_DATA_SIZE (DNSSHMCACHE_SLOT_SIZE - sizeof(DnsShmCacheSlotHeader))
+
+typedef struct DnsShmCacheSlot {
+    DnsShmCacheSlotHeader h;
+    unsigned char data[DNSSHMCACHE_DATA_SIZE];  // キー (keylen バイト) の後に応答メッセージが続く
+} DnsShmCacheSlot;
+
+struct DnsShmCache {
+    void *map;
+    size_t maplen;
+    DnsShmCacheSlot *slot;
+    size_t set_mask;
+};
+
+static DnsShmCacheSlot *
+DnsShmCache_getSet(DnsShmCache *self, uint32_t hash)
+{
+    return self->slot + (hash & self->set_mask) * DNSSHMCACHE_WAYS;
+}   // end function : DnsShmCache_getSet
+
+/**
+ * 共有メモリ上のキャッシュを引く.
+ * @param key DnsCache で正規化済みのドメイン名 (NULL 終端でなくてよい)
+ * @param buf ヒットした場合に応答メッセージをコピーするバッファ
+ * @param ttl ヒットした場合にエントリが期限切れになるまでの秒数を受け取る. NULL の場合は受け取らない.
+ * @return ヒットした場合は buf にコピーした応答メッセージの長さ, ヒットしなかった場合は -1.
+ */
+int
+DnsShmCache_lookup(DnsShmCache *self, const char *key, size_t keylen, int rrtype,
+                   unsigned char *buf, size_t buflen, unsigned long *ttl)
+{
+    assert(NULL != self);
+    if (DNSSHMCACHE_DATA_SIZE <= keylen) {
+        return -1;
+    }   // end if
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) rrtype);
+    DnsShmCacheSlot *set = DnsShmCache_getSet(self, hash);
+    int64_t now = (int64_t) CacheUtil_now();
+
+    for (size_t way = 0; way < DNSSHMCACHE_WAYS; ++way) {
+        DnsShmCacheSlot *slot = &(set[way]);
+        for (int retry = 0; retry < DNSSHMCACHE_READ_RETRY; ++retry) {
+            uint32_t seq = slot->h.seq;
+            __sync_synchronize();
+            if (seq & 1) {
+                continue;   // 書き込み中
+            }   // end if
+            // 書き込みと競合していれば以下の値は壊れている可能性があるので,
+            // 範囲を確かめてから使い, 最後にシーケンス番号で検証する
+            DnsShmCacheSlotHeader h = slot->h;
+            bool match = h.hash == hash && h.rrtype == rrtype && h.keylen == keylen
+                && now < h.expire && keylen + h.msglen <= DNSSHMCACHE_DATA_SIZE
+                && h.msglen <= buflen && 0 == memcmp(slot->data, key, keylen);
+            if (match) {
+                memcpy(buf, slot->data + keylen, h.msglen);
+            }   // end if
+            __sync_synchronize();
+            if (seq != slot->h.seq) {
+                continue;   // 読んでいる間に書き換えられた
+            }   // end if
+            if (!match) {
+                break;
+            }   // end if
+            if (NULL != ttl) {
+                *ttl = (unsigned long) (h.expire - now);
+            }   // end if
+            return (int) h.msglen;
+        }   // end for
+    }   // end for
+    return -1;
+}   // end function : DnsShmCache_lookup
+
+/**
+ * 応答メッセージを共有メモリ上のキャッシュに格納する.
+ * 同じキーのスロットがあれば置き換え, なければ空のスロットか最も早く期限切れになるスロットを使う.
+ * スロットに収まらない応答や, 他のプロセスが書き込み中の場合は格納しない.
+ * @param key DnsCache で正規化済みのドメイン名 (NULL 終端でなくてよい)
+ * @param ttl キャッシュしておく秒数. 0 の場合は何もしない.
+ */
+void
+DnsShmCache_store(DnsShmCache *self, const char *key, size_t keylen, int rrtype,
+                  const unsigned char *msg, size_t msglen, unsigned long ttl)
+{
+    assert(NULL != self);
+    if (0 == ttl || DNSSHMCACHE_DATA_SIZE < keylen + msglen) {
+        return;
+    }   // end if
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) rrtype);
+    DnsShmCacheSlot *set = DnsShmCache_getSet(self, hash);
+    int64_t now = (int64_t) CacheUtil_now();
+
+    // 置き換えるスロットを選ぶ. 他のプロセスと競合して読み違えても, 追い出す対象が変わるだけ
+    DnsShmCacheSlot *victim = NULL;
+    uint32_t victim_seq = 0;
+    for (size_t way = 0; way < DNSSHMCACHE_WAYS; ++way) {
+        DnsShmCacheSlot *slot = &(set[way]);
+        uint32_t seq = slot->h.seq;
+        if (seq & 1) {
+            continue;
+        }   // end if
+        if (slot->h.hash == hash && slot->h.rrtype == rrtype && slot->h.keylen == keylen
+            && 0 == memcmp(slot->data, key, keylen)) {
+            victim = slot;
+            victim_seq = seq;
+            break;
+        }   // end if
+        if (NULL == victim || slot->h.expire < victim->h.expire) {
+            victim = slot;
+            victim_seq = seq;
+        }   // end if
+    }   // end for
+    if (NULL == victim || !__sync_bool_compare_and_swap(&victim->h.seq, victim_seq, victim_seq + 1)) {
+        return;
+    }   // end if
+
+    victim->h.hash = hash;
+    victim->h.rrtype = rrtype;
+    victim->h.keylen = (uint16_t) keylen;
+    victim->h.msglen = (uint16_t) msglen;
+    victim->h.expire = now + (int64_t) (DNSSHMCACHE_MAX_TTL < ttl ? DNSSHMCACHE_MAX_TTL : ttl);
+    memcpy(victim->data, key, keylen);
+    memcpy(victim->data + keylen, msg, msglen);
+    __sync_synchronize();
+    victim->h.seq = victim_seq + 2;
+}   // end function : DnsShmCache_store
+
+/**
+ * 共有メモリ上のキャッシュを閉じる.
+ * 他のプロセスが使っている可能性があるので, 共有メモリオブジェクトは削除しない.
+ */
+void
+DnsShmCache_close(DnsShmCache *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    if (NULL != self->map) {
+        (void) munmap(self->map, self->maplen);
+    }   // end if
+    free(self);
+}   // end function : DnsShmCache_close
+
+/**
+ * 名前付きの POSIX 共有メモリオブジェクトを開き, キャッシュとして使う.
+ * 存在しない場合は memory_limit の大きさで作成する. 既に存在する場合はその大きさのまま使う.
+ * 既に存在するものが実効ユーザー以外の所有であるか, 所有者以外にもアクセスを許している場合は使わない.
+ * 開いた後に fork しても, 子プロセスは同じキャッシュを使い続けられる.
+ * @param name shm_open(3) に渡す名前. "/" で始まること.
+ * @param memory_limit 新たに作成する場合の大きさ (バイト)
+ * @return 失敗した場合は NULL (errno がセットされる).
+ */
+DnsShmCache *
+DnsShmCache_open(const char *name, size_t memory_limit)
+{
+    assert(NULL != name);
+
+    DnsShmCache *self = (DnsShmCache *) malloc(sizeof(DnsShmCache));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DnsShmCache));
+
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (0 > fd) {
+        goto cleanup;
+    }   // end if
+    struct stat st;
+    if (0 != fstat(fd, &st)) {
+        goto close;
+    }   // end if
+    // 他のユーザーが用意した, または他のユーザーも書き込める共有メモリの内容は信用できない
+    if (st.st_uid != geteuid() || 0 != (st.st_mode & 077)) {
+        errno = EACCES;
+        goto close;
+    }   // end if
+    if (0 == st.st_size) {
+        // 同時に複数のプロセスが伸ばしても, 同じ大きさなら問題ない
+        if (0 != ftruncate(fd, (off_t) (sizeof(DnsShmCacheHeader) + memory_limit))
+            || 0 != fstat(fd, &st)) {
+            goto close;
+        }   // end if
+    }   // end if
+    size_t slot_num = 0;
+    if ((off_t) sizeof(DnsShmCacheHeader) < st.st_size) {
+        size_t fit = ((size_t) st.st_size - sizeof(DnsShmCacheHeader)) / DNSSHMCACHE_SLOT_SIZE;
+        for (slot_num = DNSSHMCACHE_WAYS; slot_num * 2 <= fit; slot_num *= 2);
+        if (fit < slot_num) {
+            slot_num = 0;
+        }   // end if
+    }   // end if
+    if (0 == slot_num) {
+        errno = EINVAL;
+        goto close;
+    }   // end if
+    self->maplen = (size_t) st.st_size;
+    self->map = mmap(NULL, self->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == self->map) {
+        self->map = NULL;
+        goto close;
+    }   // end if
+    (void) close(fd);
+
+    DnsShmCacheHeader *header = (DnsShmCacheHeader *) self->map;
+    if (DNSSHMCACHE_MAGIC != header->magic) {
+        // 大きさから決まる値なので, 複数のプロセスが同時に書き込んでも同じ値になる
+        header->version = DNSSHMCACHE_VERSION;
+        header->slot_size = DNSSHMCACHE_SLOT_SIZE;
+        header->slot_num = (uint32_t) slot_num;
+        __sync_synchronize();
+        (void) __sync_bool_compare_and_swap(&header->magic, 0, DNSSHMCACHE_MAGIC);
+    }   // end if
+    if (DNSSHMCACHE_MAGIC != header->magic || DNSSHMCACHE_VERSION != header->version
+        || DNSSHMCACHE_SLOT_SIZE != header->slot_size || slot_num != header->slot_num) {
+        // 別のバージョンが作成したもの
+        errno = EINVAL;
+        goto cleanup;
+    }   // end if
+    self->slot = (DnsShmCacheSlot *) ((unsigned char *) self->map + sizeof(DnsShmCacheHeader));
+    self->set_mask = slot_num / DNSSHMCACHE_WAYS - 1;
+    return self;
+
+  close:;
+    int save_errno = errno;
+    (void) close(fd);
+    errno = save_errno;
+
+  cleanup:
+    save_errno = errno;
+    DnsShmCache_close(self);
+    errno = save_errno;
+    return NULL;
+}   // end function : DnsShmCache_open
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+/**
+ * @file
+ * @brief 使い回すオブジェクトをロックなしで出し入れする容量固定のスタック
+ * @version $Id$
+ */
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freelist.h"
+
+/*
+ * ノードは配列で確保し, 番号で参照する.
+ * 空きノードのスタックとオブジェクトを保持するノードのスタックの 2 つをそれぞれ CAS で操作する.
+ * スタックの先頭は上位 32 ビットを更新の度に増やす世代, 下位 32 ビットをノードの番号 + 1 (0 は空)
+ * とした 64 ビットの値で表し, 取り出したノードが戻された場合に CAS が誤って成功すること (ABA) を防ぐ.
+ * ノードは解放しないので, 他のスレッドが取り出したノードの next を読んでも不正な参照にはならない.
+ */
+
+#define FREELIST_INDEX(head) ((uint32_t) ((head) & 0xffffffffULL))
+#define FREELIST_HEAD(head, index) ((((head) >> 32) + 1) << 32 | (uint64_t) (index))
+
+typedef struct FreeListNode {
+    void *obj;
+    volatile uint32_t next;     // 同じスタックで次にあるノードの番号 + 1, 末尾の場合は 0
+} FreeListNode;
+
+struct FreeList {
+    volatile uint64_t used;     // オブジェクトを保持するノードのスタック
+    volatile uint64_t empty;    // 空きノードのスタック
+    size_t capacity;
+    FreeListNode *node;
+};
+
+static uint32_t
+FreeList_popNode(FreeList *self, volatile uint64_t *head)
+{
+    for (;;) {
+        uint64_t old_head = *head;
+        uint32_t index = FREELIST_INDEX(old_head);
+        if (0 == index) {
+            return 0;
+        }   // end if
+        uint32_t next = self->node[index - 1].next;
+        if (__sync_bool_compare_and_swap(head, old_head, FREELIST_HEAD(old_head, next))) {
+            return index;
+        }   // end if
+    }   // end for
+}   // end function : FreeList_popNode
+
+static void
+FreeList_pushNode(FreeList *self, volatile uint64_t *head, uint32_t index)
+{
+    for (;;) {
+        uint64_t old_head = *head;
+        self->node[index - 1].next = FREELIST_INDEX(old_head);
+        if (__sync_bool_compare_and_swap(head, old_head, FREELIST_HEAD(old_head, index))) {
+            return;
+        }   // end if
+    }   // end for
+}   // end function : FreeList_pushNode
+
+/**
+ * オブジェクトを 1 つ預ける.
+ * @return 預けた場合は true, 容量を越える場合は false. false の場合は呼び出し側で obj を解放すること.
+ */
+bool
+FreeList_push(FreeList *self, void *obj)
+{
+    assert(NULL != self);
+    assert(NULL != obj);
+
+    uint32_t index = FreeList_popNode(self, &(self->empty));
+    if (0 == index) {
+        return false;
+    }   // end if
+    // 空きノードのスタックから取り出したノードは, used に積むまで他のスレッドから参照されない
+    self->node[index - 1].obj = obj;
+    FreeList_pushNode(self, &(self->used), index);
+    return true;
+}   // end function : FreeList_push
+
+/**
+ * 預けたオブジェクトを 1 つ取り出す.
+ * @return 取り出したオブジェクト, 預けられたオブジェクトがない場合は NULL.
+ */
+void *
+FreeList_pop(FreeList *self)
+{
+    assert(NULL != self);
+
+    uint32_t index = FreeList_popNode(self, &(self->used));
+    if (0 == index) {
+        return NULL;
+    }   // end if
+    void *obj = self->node[index - 1].obj;
+    self->node[index - 1].obj = NULL;
+    FreeList_pushNode(self, &(self->empty), index);
+    return obj;
+}   // end function : FreeList_pop
+
+/**
+ * FreeList オブジェクトの解放.
+ * 預けられたままのオブジェクトは解放しないので, 先に FreeList_pop() で取り出して解放すること.
+ */
+void
+FreeList_free(FreeList *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    free(self->node);
+    free(self);
+}   // end function : FreeList_free
+
+/**
+ * FreeList オブジェクトの構築
+ * @param capacity 預けられるオブジェクトの最大数
+ * @return 空の FreeList オブジェクト, メモリの確保に失敗した場合は NULL
+ */
+FreeList *
+FreeList_new(size_t capacity)
+{
+    assert(0 < capacity && capacity < UINT32_MAX);
+
+    FreeList *self = (FreeList *) malloc(sizeof(FreeList));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(FreeList));
+    self->node = (FreeListNode *) malloc(capacity * sizeof(FreeListNode));
+    if (NULL == self->node) {
+        free(self);
+        return NULL;
+    }   // end if
+    self->capacity = capacity;
+    // 全てのノードを空きノードのスタックに積んでおく
+    for (size_t n = 0; n < capacity; ++n) {
+        self->node[n].obj = NULL;
+        self->node[n].next = (capacity == n + 1) ? 0 : (uint32_t) (n + 2);
+    }   // end for
+    self->used = 0;
+    self->empty = 1;
+    return self;
+}   // end function : FreeList_new
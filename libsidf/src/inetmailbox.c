@@ -23,6 +23,7 @@ RCSID("$Id: inetmailbox.c 195 2008-07-17 05:39:12Z takahiko $");
 #include "xskip.h"
 #include "xparse.h"
 #include "xbuffer.h"
+#include "memarena.h"
 #include "inetmailbox.h"
 
 struct InetMailbox {
@@ -33,12 +34,15 @@ struct InetMailbox {
 
 /**
  * InetMailbox オブジェクトの構築
+ * @param arena メモリを切り出す MemArena オブジェクト. NULL の場合はヒープから確保する.
  * @return 空の InetMailbox オブジェクト
  */
 static InetMailbox *
-InetMailbox_new(size_t buflen)
+InetMailbox_new(MemArena *arena, size_t buflen)
 {
-    InetMailbox *self = (InetMailbox *) malloc(sizeof(InetMailbox) + buflen);
+    InetMailbox *self = (InetMailbox *)
+        (NULL != arena ? MemArena_alloc(arena, sizeof(InetMailbox) + buflen)
+         : malloc(sizeof(InetMailbox) + buflen));
     if (NULL == self) {
         return NULL;
     }   // end if
@@ -58,6 +62,49 @@ InetMailbox_free(InetMailbox *self)
     free(self);
 }   // end function : InetMailbox_free
 
+/*
+ * 構築に失敗した InetMailbox オブジェクトを後始末する.
+ * MemArena から切り出したものは MemArena と共に無効になるので何もしない.
+ */
+static void
+InetMailbox_discard(MemArena *arena, InetMailbox *self)
+{
+    if (NULL == arena) {
+        InetMailbox_free(self);
+    }   // end if
+}   // end function : InetMailbox_discard
+
+/**
+ * local-part と domain を指定して InetMailbox オブジェクトを構築する
+ * @param arena メモリを切り出す MemArena オブジェクト. NULL の場合はヒープから確保する.
+ * @param localpart local-part を指定する. NULL は許されない.
+ * @param domain domain を指定する. NULL は許されない.
+ * @return 構築した InetMailbox オブジェクト. 失敗した場合は NULL
+ */
+static InetMailbox *
+InetMailbox_buildImpl(MemArena *arena, const char *localpart, const char *domain)
+{
+    assert(NULL != localpart);
+    assert(NULL != domain);
+
+    size_t localpartlen = strlen(localpart);
+    size_t domainlen = strlen(domain);
+
+    InetMailbox *self = InetMailbox_new(arena, localpartlen + domainlen + 2);
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+
+    memcpy(self->buf, localpart, localpartlen);
+    self->buf[localpartlen] = '\0';
+    memcpy(self->buf + localpartlen + 1, domain, domainlen);
+    self->buf[localpartlen + 1 + domainlen] = '\0';
+    self->localpart = self->buf;
+    self->domain = self->buf + localpartlen + 1;
+
+    return self;
+}   // end function : InetMailbox_buildImpl
+
 const char *
 InetMailbox_getLocalPart(const InetMailbox *self)
 {
@@ -87,7 +134,7 @@ InetMailbox_isNullAddr(const InetMailbox *self)
  * addr-spec = local-part "@" domain
  */
 static InetMailbox *
-InetMailbox_parse(const char *head, const char *tail, const char **nextp,
+InetMailbox_parse(MemArena *arena, const char *head, const char *tail, const char **nextp,
                   xparse_funcp xparse_localpart, bool requireLocalPart,
                   xparse_funcp xparse_domain, bool requireDomain, const char **errptr)
 {
@@ -131,7 +178,7 @@ InetMailbox_parse(const char *head, const char *tail, const char **nextp,
     }   // end if
 
     size_t xbuflen = XBuffer_getSize(xbuf);
-    InetMailbox *self = InetMailbox_new(xbuflen + 1);   // 1 は NULL 文字の分
+    InetMailbox *self = InetMailbox_new(arena, xbuflen + 1);   // 1 は NULL 文字の分
     if (NULL == self) {
         SETDEREF(errptr, NULL);
         goto cleanup;
@@ -189,7 +236,8 @@ InetMailbox_build2822Mailbox(const char *head, const char *tail, const char **ne
     }   // end if
 
     InetMailbox *self =
-        InetMailbox_parse(p, tail, &p, XParse_2822LocalPart, true, XParse_2822Domain, true, errptr);
+        InetMailbox_parse(NULL, p, tail, &p, XParse_2822LocalPart, true, XParse_2822Domain, true,
+                          errptr);
     if (NULL == self) {
         goto cleanup;
     }   // end if
@@ -228,7 +276,8 @@ InetMailbox_build2821Mailbox(const char *head, const char *tail, const char **ne
 {
     const char *p = head;
     InetMailbox *self =
-        InetMailbox_parse(p, tail, &p, XParse_2821LocalPart, true, XParse_2821Domain, true, errptr);
+        InetMailbox_parse(NULL, p, tail, &p, XParse_2821LocalPart, true, XParse_2821Domain, true,
+                          errptr);
     if (NULL == self) {
         *nextp = head;
         return NULL;
@@ -255,8 +304,8 @@ InetMailbox_build2821Mailbox(const char *head, const char *tail, const char **ne
  *       ; MAY be case-sensitive
  */
 static InetMailbox *
-InetMailbox_build2821PathImpl(const char *head, const char *tail, const char **nextp,
-                              bool require_bracket, const char **errptr)
+InetMailbox_build2821PathImpl(MemArena *arena, const char *head, const char *tail,
+                              const char **nextp, bool require_bracket, const char **errptr)
 {
     InetMailbox *self = NULL;
     bool have_bracket = false;
@@ -272,7 +321,8 @@ InetMailbox_build2821PathImpl(const char *head, const char *tail, const char **n
     }   // end if
 
     self =
-        InetMailbox_parse(p, tail, &p, XParse_2821LocalPart, true, XParse_2821Domain, true, errptr);
+        InetMailbox_parse(arena, p, tail, &p, XParse_2821LocalPart, true, XParse_2821Domain, true,
+                          errptr);
     if (NULL == self) {
         goto cleanup;
     }   // end if
@@ -288,7 +338,7 @@ InetMailbox_build2821PathImpl(const char *head, const char *tail, const char **n
 
   cleanup:
     if (NULL != self) {
-        InetMailbox_free(self);
+        InetMailbox_discard(arena, self);
     }   // end if
     *nextp = head;
     return NULL;
@@ -298,7 +348,7 @@ InetMailbox *
 InetMailbox_build2821Path(const char *head, const char *tail, const char **nextp,
                           const char **errptr)
 {
-    return InetMailbox_build2821PathImpl(head, tail, nextp, true, errptr);
+    return InetMailbox_build2821PathImpl(NULL, head, tail, nextp, true, errptr);
 }   // end function : InetMailbox_build2821Path
 
 /*
@@ -309,20 +359,21 @@ InetMailbox *
 InetMailbox_buildSendmailPath(const char *head, const char *tail, const char **nextp,
                               const char **errptr)
 {
-    return InetMailbox_build2821PathImpl(head, tail, nextp, false, errptr);
+    return InetMailbox_build2821PathImpl(NULL, head, tail, nextp, false, errptr);
 }   // end function : InetMailbox_buildSendmailPath
 
 static InetMailbox *
-InetMailbox_build2821ReversePathImpl(const char *head, const char *tail, const char **nextp,
-                                     bool require_bracket, const char **errptr)
+InetMailbox_build2821ReversePathImpl(MemArena *arena, const char *head, const char *tail,
+                                     const char **nextp, bool require_bracket,
+                                     const char **errptr)
 {
     if (0 < XSkip_string(head, tail, "<>", nextp)) {
         // "<>" 用
         SETDEREF(errptr, NULL);
-        return InetMailbox_build("", "");
+        return InetMailbox_buildImpl(arena, "", "");
     }   // end if
 
-    return InetMailbox_build2821PathImpl(head, tail, nextp, require_bracket, errptr);
+    return InetMailbox_build2821PathImpl(arena, head, tail, nextp, require_bracket, errptr);
 }   // end function : InetMailbox_build2821ReversePathImpl
 
 /*
@@ -332,7 +383,7 @@ InetMailbox *
 InetMailbox_build2821ReversePath(const char *head, const char *tail, const char **nextp,
                                  const char **errptr)
 {
-    return InetMailbox_build2821ReversePathImpl(head, tail, nextp, true, errptr);
+    return InetMailbox_build2821ReversePathImpl(NULL, head, tail, nextp, true, errptr);
 }   // end function : InetMailbox_build2821ReversePath
 
 /*
@@ -343,9 +394,22 @@ InetMailbox *
 InetMailbox_buildSendmailReversePath(const char *head, const char *tail, const char **nextp,
                                      const char **errptr)
 {
-    return InetMailbox_build2821ReversePathImpl(head, tail, nextp, false, errptr);
+    return InetMailbox_build2821ReversePathImpl(NULL, head, tail, nextp, false, errptr);
 }   // end function : InetMailbox_buildSendmailReversePath
 
+/*
+ * InetMailbox_buildSendmailReversePath() と同じだが, 構築した InetMailbox オブジェクトを
+ * arena から切り出す. 構築した InetMailbox オブジェクトは InetMailbox_free() で解放してはならず,
+ * arena と共に無効になる.
+ */
+InetMailbox *
+InetMailbox_buildSendmailReversePathInArena(MemArena *arena, const char *head, const char *tail,
+                                            const char **nextp, const char **errptr)
+{
+    assert(NULL != arena);
+    return InetMailbox_build2821ReversePathImpl(arena, head, tail, nextp, false, errptr);
+}   // end function : InetMailbox_buildSendmailReversePathInArena
+
 /*
  * [RFC4871]
  * sig-i-tag =   %x69 [FWS] "=" [FWS] [ Local-part ] "@" domain-name
@@ -354,8 +418,8 @@ InetMailbox *
 InetMailbox_buildDkimIdentity(const char *head, const char *tail, const char **nextp,
                               const char **errptr)
 {
-    return InetMailbox_parse(head, tail, nextp, XParse_2821LocalPart, false, XParse_domainName,
-                             true, errptr);
+    return InetMailbox_parse(NULL, head, tail, nextp, XParse_2821LocalPart, false,
+                             XParse_domainName, true, errptr);
 }   // end function : InetMailbox_buildDkimIdentity
 
 /**
@@ -367,25 +431,7 @@ InetMailbox_buildDkimIdentity(const char *head, const char *tail, const char **n
 InetMailbox *
 InetMailbox_build(const char *localpart, const char *domain)
 {
-    assert(NULL != localpart);
-    assert(NULL != domain);
-
-    size_t localpartlen = strlen(localpart);
-    size_t domainlen = strlen(domain);
-
-    InetMailbox *self = InetMailbox_new(localpartlen + domainlen + 2);
-    if (NULL == self) {
-        return NULL;
-    }   // end if
-
-    memcpy(self->buf, localpart, localpartlen);
-    self->buf[localpartlen] = '\0';
-    memcpy(self->buf + localpartlen + 1, domain, domainlen);
-    self->buf[localpartlen + 1 + domainlen] = '\0';
-    self->localpart = self->buf;
-    self->domain = self->buf + localpartlen + 1;
-
-    return self;
+    return InetMailbox_buildImpl(NULL, localpart, domain);
 }   // end function : InetMailbox_build
 
 /**
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+/**
+ * @file
+ * @brief まとめて解放するメモリを切り出すアリーナ
+ * @version $Id$
+ */
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memarena.h"
+
+// 切り出すメモリの境界, どの型のオブジェクトを置いても問題ない値にする
+#define MEMARENA_ALIGN 16
+#define MEMARENA_ROUNDUP(len) (((len) + (MEMARENA_ALIGN - 1)) & ~((size_t) (MEMARENA_ALIGN - 1)))
+
+#define MEMARENA_CHUNK_SIZE_DEFAULT 4096
+
+typedef struct MemArenaChunk {
+    struct MemArenaChunk *next;
+    size_t size;                // 切り出せる領域のサイズ
+} MemArenaChunk;
+
+// 切り出せる領域はチャンクのヘッダの直後から MEMARENA_ALIGN の境界に揃えて始まる
+#define MEMARENA_CHUNK_DATA(chunk) \
+    ((unsigned char *) (chunk) + MEMARENA_ROUNDUP(sizeof(MemArenaChunk)))
+
+/*
+ * 最初のチャンクは MemArena_reset() でも解放せずに使い回す.
+ * 最初のチャンクに収まらなかった分だけ追加のチャンクを確保し,
+ * 追加のチャンクは MemArena_reset() で解放する.
+ */
+struct MemArena {
+    size_t chunk_size;
+    MemArenaChunk *first;
+    MemArenaChunk *current;     // 切り出し中のチャンク
+    size_t used;                // current の使用済みサイズ
+};
+
+static MemArenaChunk *
+MemArenaChunk_new(size_t size)
+{
+    MemArenaChunk *chunk = (MemArenaChunk *) malloc(MEMARENA_ROUNDUP(sizeof(MemArenaChunk)) + size);
+    if (NULL == chunk) {
+        return NULL;
+    }   // end if
+    chunk->next = NULL;
+    chunk->size = size;
+    return chunk;
+}   // end function : MemArenaChunk_new
+
+/**
+ * MemArena オブジェクトの構築
+ * @param chunk_size 一度に確保するメモリのサイズ. 0 の場合はデフォルト値を使用する.
+ * @return 空の MemArena オブジェクト, メモリの確保に失敗した場合は NULL
+ */
+MemArena *
+MemArena_new(size_t chunk_size)
+{
+    MemArena *self = (MemArena *) malloc(sizeof(MemArena));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    self->chunk_size =
+        MEMARENA_ROUNDUP(0 < chunk_size ? chunk_size : MEMARENA_CHUNK_SIZE_DEFAULT);
+    self->first = MemArenaChunk_new(self->chunk_size);
+    if (NULL == self->first) {
+        free(self);
+        return NULL;
+    }   // end if
+    self->current = self->first;
+    self->used = 0;
+    return self;
+}   // end function : MemArena_new
+
+/*
+ * 追加のチャンクを全て解放する.
+ */
+static void
+MemArena_releaseChunks(MemArena *self)
+{
+    MemArenaChunk *chunk = self->first->next;
+    while (NULL != chunk) {
+        MemArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }   // end while
+    self->first->next = NULL;
+}   // end function : MemArena_releaseChunks
+
+/**
+ * MemArena オブジェクトの解放
+ * 切り出したメモリも全て無効になる.
+ */
+void
+MemArena_free(MemArena *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    MemArena_releaseChunks(self);
+    free(self->first);
+    free(self);
+}   // end function : MemArena_free
+
+/**
+ * これまでに切り出したメモリを全て無効にし, 最初のチャンクの先頭から切り出しを再開する.
+ * 最初のチャンクに収まっていた場合は何も解放しない.
+ */
+void
+MemArena_reset(MemArena *self)
+{
+    assert(NULL != self);
+    if (NULL != self->first->next) {
+        MemArena_releaseChunks(self);
+    }   // end if
+    self->current = self->first;
+    self->used = 0;
+}   // end function : MemArena_reset
+
+/**
+ * メモリを切り出す.
+ * 切り出したメモリは個別に解放できず, MemArena_reset() か MemArena_free() でまとめて無効になる.
+ * @return 切り出したメモリ, メモリの確保に失敗した場合は NULL
+ */
+void *
+MemArena_alloc(MemArena *self, size_t size)
+{
+    assert(NULL != self);
+
+    size = MEMARENA_ROUNDUP(0 < size ? size : 1);
+    if (self->current->size - self->used < size) {
+        // チャンクより大きな要求にはその大きさのチャンクを割り当てる
+        MemArenaChunk *chunk = MemArenaChunk_new(self->chunk_size < size ? size : self->chunk_size);
+        if (NULL == chunk) {
+            return NULL;
+        }   // end if
+        chunk->next = self->current->next;
+        self->current->next = chunk;
+        self->current = chunk;
+        self->used = 0;
+    }   // end if
+
+    void *p = MEMARENA_CHUNK_DATA(self->current) + self->used;
+    self->used += size;
+    return p;
+}   // end function : MemArena_alloc
+
+/**
+ * 文字列を複製する.
+ * @return 複製した文字列, メモリの確保に失敗した場合は NULL
+ */
+char *
+MemArena_strdup(MemArena *self, const char *s)
+{
+    assert(NULL != self);
+    assert(NULL != s);
+
+    size_t len = strlen(s) + 1;
+    char *p = (char *) MemArena_alloc(self, len);
+    if (NULL == p) {
+        return NULL;
+    }   // end if
+    memcpy(p, s, len);
+    return p;
+}   // end function : MemArena_strdup
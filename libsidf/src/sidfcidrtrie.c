@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * ip4/ip6 メカニズムの連なりを 1 回の探索で評価するための Patricia trie.
+ * 各プレフィックスには値 (レコード中の directive の番号) を持たせ, 探索では
+ * アドレスにマッチする全てのプレフィックスのうち最小の値を返す.
+ * 最小の値を返すことで, 先頭から順に評価した場合と同じ directive が選ばれる.
+ * ノードは配列にまとめて確保し, 子は添字で参照する.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "bitmemcmp.h"
+#include "sidfcidrtrie.h"
+
+#define SIDF_CIDRTRIE_MAX_ADDRLEN 16    // IPv6 アドレスのバイト数
+#define SIDF_CIDRTRIE_NIL UINT32_MAX    // 子がないこと, 値を持たないことを表す
+
+typedef struct SidfCidrTrieNode {
+    uint8_t key[SIDF_CIDRTRIE_MAX_ADDRLEN]; // 根からこのノードまでのプレフィックス
+    uint32_t bitlen;            // key の有効なビット数
+    uint32_t value;             // このノードで終わるプレフィックスの値の最小値
+    uint32_t child[2];
+} SidfCidrTrieNode;
+
+struct SidfCidrTrie {
+    unsigned int addrbits;      // 32 (IPv4) または 128 (IPv6)
+    uint32_t root;
+    SidfCidrTrieNode *node;
+    uint32_t node_num;
+    uint32_t node_capacity;
+};
+
+static unsigned int
+SidfCidrTrie_getBit(const uint8_t *key, unsigned int bit)
+{
+    return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}   // end function : SidfCidrTrie_getBit
+
+/*
+ * 2 つのキーの先頭から一致しているビット数を返す. maxbits を越えることはない.
+ */
+static unsigned int
+SidfCidrTrie_getCommonBits(const uint8_t *key1, const uint8_t *key2, unsigned int maxbits)
+{
+    unsigned int bit = 0;
+    for (; bit + 8 <= maxbits && key1[bit >> 3] == key2[bit >> 3]; bit += 8);
+    for (; bit < maxbits && SidfCidrTrie_getBit(key1, bit) == SidfCidrTrie_getBit(key2, bit);
+         ++bit);
+    return bit;
+}   // end function : SidfCidrTrie_getCommonBits
+
+/*
+ * ノードを 1 つ確保する. 配列を拡張する場合があるので, 以前に取得したノードへのポインタは無効になる.
+ * @return 確保したノードの添字, 失敗した場合は SIDF_CIDRTRIE_NIL.
+ */
+static uint32_t
+SidfCidrTrie_newNode(SidfCidrTrie *self, const uint8_t *key, unsigned int bitlen, uint32_t value)
+{
+    if (self->node_capacity <= self->node_num) {
+        uint32_t newcapacity = (0 < self->node_capacity) ? self->node_capacity * 2 : 16;
+        SidfCidrTrieNode *newnode =
+            (SidfCidrTrieNode *) realloc(self->node, newcapacity * sizeof(SidfCidrTrieNode));
+        if (NULL == newnode) {
+            return SIDF_CIDRTRIE_NIL;
+        }   // end if
+        self->node = newnode;
+        self->node_capacity = newcapacity;
+    }   // end if
+    uint32_t index = self->node_num++;
+    SidfCidrTrieNode *node = &(self->node[index]);
+    memset(node->key, 0, sizeof(node->key));
+    memcpy(node->key, key, (bitlen + 7) / 8);
+    node->bitlen = bitlen;
+    node->value = value;
+    node->child[0] = node->child[1] = SIDF_CIDRTRIE_NIL;
+    return index;
+}   // end function : SidfCidrTrie_newNode
+
+static uint32_t
+SidfCidrTrie_getLink(const SidfCidrTrie *self, uint32_t parent, unsigned int branch)
+{
+    return (SIDF_CIDRTRIE_NIL == parent) ? self->root : self->node[parent].child[branch];
+}   // end function : SidfCidrTrie_getLink
+
+static void
+SidfCidrTrie_setLink(SidfCidrTrie *self, uint32_t parent, unsigned int branch, uint32_t child)
+{
+    if (SIDF_CIDRTRIE_NIL == parent) {
+        self->root = child;
+    } else {
+        self->node[parent].child[branch] = child;
+    }   // end if
+}   // end function : SidfCidrTrie_setLink
+
+/**
+ * プレフィックスを追加する.
+ * 同じプレフィックスが既に登録されている場合は, 小さい方の値を残す.
+ * @param prefix プレフィックス (ネットワークバイトオーダー). prefixlen を越えるビットは無視する.
+ * @return 成功した場合は true, メモリの確保に失敗した場合は false.
+ */
+bool
+SidfCidrTrie_insert(SidfCidrTrie *self, const void *prefix, unsigned int prefixlen,
+                    unsigned int value)
+{
+    assert(NULL != self);
+    assert(prefixlen <= self->addrbits);
+
+    // prefixlen を越えるビットを落としておく
+    uint8_t key[SIDF_CIDRTRIE_MAX_ADDRLEN];
+    memset(key, 0, sizeof(key));
+    memcpy(key, prefix, (prefixlen + 7) / 8);
+    if (0 != prefixlen % 8) {
+        key[prefixlen / 8] &= (uint8_t) (0xff << (8 - prefixlen % 8));
+    }   // end if
+
+    // 子へのリンクを (親ノードの添字, 分岐のビット) で表す. 親が SIDF_CIDRTRIE_NIL の場合は root.
+    // ノードの配列は拡張の際に移動するので, リンクの位置をポインタで覚えてはならない.
+    uint32_t parent = SIDF_CIDRTRIE_NIL;
+    unsigned int branch = 0;
+    while (true) {
+        uint32_t current = SidfCidrTrie_getLink(self, parent, branch);
+        if (SIDF_CIDRTRIE_NIL == current) {
+            uint32_t leaf = SidfCidrTrie_newNode(self, key, prefixlen, value);
+            if (SIDF_CIDRTRIE_NIL == leaf) {
+                return false;
+            }   // end if
+            SidfCidrTrie_setLink(self, parent, branch, leaf);
+            return true;
+        }   // end if
+
+        SidfCidrTrieNode *node = &(self->node[current]);
+        unsigned int maxbits = (prefixlen < node->bitlen) ? prefixlen : node->bitlen;
+        unsigned int common = SidfCidrTrie_getCommonBits(key, node->key, maxbits);
+        if (common == node->bitlen) {
+            if (prefixlen == node->bitlen) {
+                // 同じプレフィックス, 先に現れた directive を優先する
+                if (value < node->value) {
+                    node->value = value;
+                }   // end if
+                return true;
+            }   // end if
+            // このノードの下に続く
+            parent = current;
+            branch = SidfCidrTrie_getBit(key, node->bitlen);
+            continue;
+        }   // end if
+
+        // 新しいノードをこのノードの上に挿入する
+        uint32_t upper;
+        if (common == prefixlen) {
+            // 追加するプレフィックスがこのノードを包含する
+            upper = SidfCidrTrie_newNode(self, key, prefixlen, value);
+            if (SIDF_CIDRTRIE_NIL == upper) {
+                return false;
+            }   // end if
+            self->node[upper].child[SidfCidrTrie_getBit(self->node[current].key, prefixlen)] =
+                current;
+        } else {
+            // 途中で分岐する
+            upper = SidfCidrTrie_newNode(self, key, common, SIDF_CIDRTRIE_NIL);
+            if (SIDF_CIDRTRIE_NIL == upper) {
+                return false;
+            }   // end if
+            uint32_t leaf = SidfCidrTrie_newNode(self, key, prefixlen, value);
+            if (SIDF_CIDRTRIE_NIL == leaf) {
+                return false;
+            }   // end if
+            self->node[upper].child[SidfCidrTrie_getBit(self->node[current].key, common)] =
+                current;
+            self->node[upper].child[SidfCidrTrie_getBit(key, common)] = leaf;
+        }   // end if
+        SidfCidrTrie_setLink(self, parent, branch, upper);
+        return true;
+    }   // end while
+}   // end function : SidfCidrTrie_insert
+
+/**
+ * アドレスにマッチするプレフィックスを探す.
+ * @param addr addrbits ビットのアドレス (ネットワークバイトオーダー).
+ * @return マッチしたプレフィックスの値のうち最小のもの, どれにもマッチしなかった場合は -1.
+ */
+int
+SidfCidrTrie_lookup(const SidfCidrTrie *self, const void *addr)
+{
+    assert(NULL != self);
+    uint32_t found = SIDF_CIDRTRIE_NIL;
+    uint32_t current = self->root;
+    while (SIDF_CIDRTRIE_NIL != current) {
+        const SidfCidrTrieNode *node = &(self->node[current]);
+        if (0 != bitmemcmp(addr, node->key, node->bitlen)) {
+            break;
+        }   // end if
+        if (node->value < found) {
+            found = node->value;
+        }   // end if
+        if (self->addrbits <= node->bitlen) {
+            break;
+        }   // end if
+        current = node->child[SidfCidrTrie_getBit(addr, node->bitlen)];
+    }   // end while
+    return (SIDF_CIDRTRIE_NIL == found) ? -1 : (int) found;
+}   // end function : SidfCidrTrie_lookup
+
+void
+SidfCidrTrie_free(SidfCidrTrie *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    free(self->node);
+    free(self);
+}   // end function : SidfCidrTrie_free
+
+/**
+ * SidfCidrTrie オブジェクトを構築する.
+ * @param addrbits アドレスのビット数. IPv4 なら 32, IPv6 なら 128.
+ */
+SidfCidrTrie *
+SidfCidrTrie_new(unsigned int addrbits)
+{
+    assert(addrbits <= SIDF_CIDRTRIE_MAX_ADDRLEN * 8);
+    SidfCidrTrie *self = (SidfCidrTrie *) malloc(sizeof(SidfCidrTrie));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(SidfCidrTrie));
+    self->addrbits = addrbits;
+    self->root = SIDF_CIDRTRIE_NIL;
+    return self;
+}   // end function : SidfCidrTrie_new
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * マクロを含まない include の木を, 全てのレコードを解決した状態で保持する.
+ * 木を構成するのは ip4, ip6, all, include メカニズムのみからなるレコードなので,
+ * 評価結果は IP アドレスだけで決まり, DNS を引かずにメモリ上で評価できる.
+ * 木の組み立てと評価は sidfrequest.c で, 共有は SidfRecordCache でおこなう.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ptrarray.h"
+#include "strarray.h"
+#include "sidfrecord.h"
+#include "sidfincludetree.h"
+
+static void
+SidfIncludeNode_free(void *element)
+{
+    SidfIncludeNode *self = (SidfIncludeNode *) element;
+    if (NULL == self) {
+        return;
+    }   // end if
+    SidfRecord_free(self->record);
+    free(self->child);
+    free(self);
+}   // end function : SidfIncludeNode_free
+
+/**
+ * 木にノードを追加する.
+ * @param record ノードのレコード. ノードは新たに参照を取得するので,
+ *               呼び出し側の参照はそのまま使い続けてよい.
+ * @return 追加したノード, メモリの確保に失敗した場合は NULL.
+ */
+SidfIncludeNode *
+SidfIncludeTree_addNode(SidfIncludeTree *self, const char *domain, SidfRecord *record)
+{
+    assert(NULL != self);
+    assert(NULL != record);
+    size_t domain_len = strlen(domain);
+    SidfIncludeNode *node = (SidfIncludeNode *) malloc(sizeof(SidfIncludeNode) + domain_len + 1);
+    if (NULL == node) {
+        return NULL;
+    }   // end if
+    memcpy(node->domain, domain, domain_len + 1);
+    size_t directive_num = PtrArray_getCount(record->directives);
+    node->child = (SidfIncludeNode **) calloc(0 < directive_num ? directive_num : 1,
+                                              sizeof(SidfIncludeNode *));
+    if (NULL == node->child) {
+        free(node);
+        return NULL;
+    }   // end if
+    node->record = SidfRecord_ref(record);
+    if (0 > PtrArray_append(self->node, node)) {
+        SidfIncludeNode_free(node);
+        return NULL;
+    }   // end if
+    if (0 > StrArray_append(self->domain, domain)) {
+        return NULL;
+    }   // end if
+    if (NULL == self->root) {
+        self->root = node;
+    }   // end if
+    return node;
+}   // end function : SidfIncludeTree_addNode
+
+SidfIncludeTree *
+SidfIncludeTree_ref(SidfIncludeTree *self)
+{
+    assert(NULL != self);
+    (void) __sync_add_and_fetch(&(self->refcount), 1);
+    return self;
+}   // end function : SidfIncludeTree_ref
+
+void
+SidfIncludeTree_free(SidfIncludeTree *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    if (0 < __sync_sub_and_fetch(&(self->refcount), 1)) {
+        // 他にも参照している箇所が残っている
+        return;
+    }   // end if
+    if (NULL != self->node) {
+        PtrArray_free(self->node);
+    }   // end if
+    if (NULL != self->domain) {
+        StrArray_free(self->domain);
+    }   // end if
+    free(self);
+}   // end function : SidfIncludeTree_free
+
+/**
+ * SidfIncludeTree オブジェクトを構築する. 最初に追加したノードが根になる.
+ */
+SidfIncludeTree *
+SidfIncludeTree_new(void)
+{
+    SidfIncludeTree *self = (SidfIncludeTree *) malloc(sizeof(SidfIncludeTree));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(SidfIncludeTree));
+    self->refcount = 1;
+    self->node = PtrArray_new(0, SidfIncludeNode_free);
+    if (NULL == self->node) {
+        goto cleanup;
+    }   // end if
+    self->domain = StrArray_new(0);
+    if (NULL == self->domain) {
+        goto cleanup;
+    }   // end if
+    return self;
+
+  cleanup:
+    SidfIncludeTree_free(self);
+    return NULL;
+}   // end function : SidfIncludeTree_new
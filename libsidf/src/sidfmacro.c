@@ -194,35 +194,40 @@ SidfMacro_isValidatedDomainName(const SidfRequest *request, const char *revdomai
 static char *
 SidfMacro_dupValidatedDomainName(const SidfRequest *request, const char *domain)
 {
-    DnsPtrResponse *respptr;
+    // 検証中に引くのは A/AAAA RR だけなので, ドメイン名は関数を抜けるまで有効
+    DnsRrView ptrview;
     int ptrquery_stat =
-        DnsResolver_lookupPtr(request->resolver, request->sin_family, &(request->ipaddr), &respptr);
+        DnsResolver_viewPtr(request->resolver, request->sin_family, &(request->ipaddr), &ptrview);
     if (NETDB_SUCCESS != ptrquery_stat) {
         return strdup(SIDF_MACRO_DEFAULT_P_MACRO_VALUE);
     }   // end if
     char *expand = NULL;
-    for (size_t n = 0; n < MIN(respptr->num, SIDF_MACRO_DOMAIN_VALIDATION_PTRRR_MAXNUM); ++n) {
-        if (InetDomain_isMatch(domain, respptr->domain[n])
-            && SidfMacro_isValidatedDomainName(request, respptr->domain[n], &expand)) {
-            goto finally;
+    size_t ptrnum = MIN(ptrview.num, SIDF_MACRO_DOMAIN_VALIDATION_PTRRR_MAXNUM);
+    DnsRrView view = ptrview;
+    for (size_t n = 0; n < ptrnum; ++n) {
+        const char *ptrdomain = DnsRrView_next(&view);
+        if (InetDomain_isMatch(domain, ptrdomain)
+            && SidfMacro_isValidatedDomainName(request, ptrdomain, &expand)) {
+            return expand;
         }   // end if
     }   // end for
-    for (size_t n = 0; n < MIN(respptr->num, SIDF_MACRO_DOMAIN_VALIDATION_PTRRR_MAXNUM); ++n) {
-        if (InetDomain_isParent(domain, respptr->domain[n])
-            && !InetDomain_isMatch(domain, respptr->domain[n])
-            && SidfMacro_isValidatedDomainName(request, respptr->domain[n], &expand)) {
-            goto finally;
+    view = ptrview;
+    for (size_t n = 0; n < ptrnum; ++n) {
+        const char *ptrdomain = DnsRrView_next(&view);
+        if (InetDomain_isParent(domain, ptrdomain)
+            && !InetDomain_isMatch(domain, ptrdomain)
+            && SidfMacro_isValidatedDomainName(request, ptrdomain, &expand)) {
+            return expand;
         }   // end if
     }   // end for
-    for (size_t n = 0; n < MIN(respptr->num, SIDF_MACRO_DOMAIN_VALIDATION_PTRRR_MAXNUM); ++n) {
-        if (!InetDomain_isParent(domain, respptr->domain[n])
-            && SidfMacro_isValidatedDomainName(request, respptr->domain[n], &expand)) {
-            goto finally;
+    view = ptrview;
+    for (size_t n = 0; n < ptrnum; ++n) {
+        const char *ptrdomain = DnsRrView_next(&view);
+        if (!InetDomain_isParent(domain, ptrdomain)
+            && SidfMacro_isValidatedDomainName(request, ptrdomain, &expand)) {
+            return expand;
         }   // end if
     }   // end for
-
-  finally:
-    DnsPtrResponse_free(respptr);
     return expand;
 }   // end function : SidfMacro_dupValidatedDomainName
 
@@ -718,3 +723,23 @@ SidfMacro_parseDomainSpec(const SidfRequest *request, const char *head, const ch
     }   // end if
     return parse_stat;
 }   // end function : SidfMacro_parseDomainSpec
+
+/**
+ * 送信者のローカルパートか時刻に依存するマクロ (s, l, t) を含むかを調べる.
+ * これらを展開した評価結果は IP アドレスとドメインが同じでも変わり得るので, 評価結果のキャッシュに使えない.
+ * "%%" などのエスケープは読み飛ばす.
+ * @return 含む場合は true.
+ */
+bool
+SidfMacro_hasSenderOrTimeMacro(const char *head, const char *tail)
+{
+    const char *p = head;
+    while (NULL != (p = memchr(p, '%', tail - p)) && p + 1 < tail) {
+        if ('{' == p[1] && p + 2 < tail && '\0' != p[2]
+            && NULL != strchr("slt", tolower((unsigned char) p[2]))) {
+            return true;
+        }   // end if
+        p += 2;
+    }   // end while
+    return false;
+}   // end function : SidfMacro_hasSenderOrTimeMacro
@@ -17,8 +17,13 @@ RCSID("$Id: sidfpolicy.c 40 2008-05-28 04:49:01Z takahiko $");
 #include <string.h>
 #include <assert.h>
 
+#include "ptrop.h"
+#include "loghandler.h"
+#include "eventlogger.h"
 #include "sidf.h"
 #include "sidfpolicy.h"
+#include "sidfrequest.h"
+#include "sidfrecord.h"
 
 #define SIDF_POLICY_DEFAULT_MACRO_EXPANSION_LIMIT 10240
 #define SIDF_EVAL_MAX_DNSMECH 10
@@ -37,6 +42,7 @@ SidfPolicy_new(void)
     self->lookup_exp = false;
     self->checking_domain = NULL;
     self->local_policy = NULL;
+    self->local_policy_record = NULL;
     self->local_policy_explanation = NULL;
     self->macro_expansion_limit = SIDF_POLICY_DEFAULT_MACRO_EXPANSION_LIMIT;
     self->max_dns_mech = SIDF_EVAL_MAX_DNSMECH;
@@ -45,6 +51,11 @@ SidfPolicy_new(void)
     self->max_ptrrr_per_ptrmech = SIDF_EVAL_PTRMECH_PTRRR_MAXNUM;
     self->logging_plus_all_directive = false;
     self->overwrite_all_directive_score = SIDF_SCORE_NULL;
+    self->record_cache = NULL;
+    self->flatten_include = false;
+    self->result_cache = NULL;
+    self->prefetch_directives = 0;
+    self->eval_timeout = 0;
     return self;
 }   // end function : SidfPolicy_new
 
@@ -66,10 +77,59 @@ SidfPolicy_setCheckingDomain(SidfPolicy *self, const char *domain)
     return SidfPolicy_replaceString(domain, &(self->checking_domain));
 }   // end function : SidfPolicy_setCheckingDomain
 
+/*
+ * マクロを含まないローカルポリシーを SidfRecord オブジェクトに構築しておく.
+ * マクロを含む場合は展開結果がリクエスト毎に異なるので, 評価の度に構築する.
+ */
+static SidfStat
+SidfPolicy_compileLocalPolicy(SidfPolicy *self)
+{
+    if (NULL != self->local_policy_record) {
+        SidfRecord_free(self->local_policy_record);
+        self->local_policy_record = NULL;
+    }   // end if
+    if (NULL == self->local_policy
+        || !SidfRecord_isMacroFree(self->local_policy, STRTAIL(self->local_policy))) {
+        return SIDF_STAT_OK;
+    }   // end if
+
+    // パースに使うバッファを借りるための, 評価には使わないリクエスト
+    SidfRequest *request = SidfRequest_new(self, NULL);
+    if (NULL == request) {
+        LogNoResource();
+        return SIDF_STAT_NO_RESOURCE;
+    }   // end if
+    SidfStat build_stat = SidfRecord_build(request, SIDF_RECORD_SCOPE_NULL, self->local_policy,
+                                           STRTAIL(self->local_policy),
+                                           &(self->local_policy_record));
+    if (SIDF_STAT_OK == build_stat) {
+        self->local_policy_record->request = NULL;
+        self->local_policy_record->domain = NULL;
+    } else {
+        LogConfigError("failed to build local policy record: policy=%s", self->local_policy);
+    }   // end if
+    SidfRequest_free(request);
+    return build_stat;
+}   // end function : SidfPolicy_compileLocalPolicy
+
+/**
+ * ローカルポリシーを設定する.
+ * マクロを含まないローカルポリシーはここでパースしておき, 全てのリクエストで共有する.
+ * @return 成功した場合は SIDF_STAT_OK. ローカルポリシーがパースできなかった場合は
+ *         ローカルポリシーを設定せずにパースエラーを返す.
+ */
 SidfStat
 SidfPolicy_setLocalPolicyDirectives(SidfPolicy *self, const char *policy)
 {
-    return SidfPolicy_replaceString(policy, &(self->local_policy));
+    SidfStat replace_stat = SidfPolicy_replaceString(policy, &(self->local_policy));
+    if (SIDF_STAT_OK != replace_stat) {
+        return replace_stat;
+    }   // end if
+    SidfStat compile_stat = SidfPolicy_compileLocalPolicy(self);
+    if (SIDF_STAT_OK != compile_stat) {
+        PTRINIT(self->local_policy);
+    }   // end if
+    return compile_stat;
 }   // end function : SidfPolicy_setLocalPolicyDirectives
 
 SidfStat
@@ -88,6 +148,9 @@ SidfPolicy_free(SidfPolicy *self)
     if (NULL != self->local_policy) {
         free(self->local_policy);
     }   // end if
+    if (NULL != self->local_policy_record) {
+        SidfRecord_free(self->local_policy_record);
+    }   // end if
     if (NULL != self->local_policy_explanation) {
         free(self->local_policy_explanation);
     }   // end if
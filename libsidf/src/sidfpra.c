@@ -14,93 +14,231 @@ RCSID("$Id: sidfpra.c 40 2008-05-28 04:49:01Z takahiko $");
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
 #include "ptrop.h"
 #include "mailheaders.h"
 #include "inetmailbox.h"
 #include "xskip.h"
+#include "memarena.h"
 #include "eventlogger.h"
 #include "sidf.h"
 #include "sidfpra.h"
 
-static int
-SidfPra_lookup(const MailHeaders *headers)
+/*
+ * PRA の候補となるヘッダの種類. 値の小さいものほど優先される.
+ */
+typedef enum SidfPraCandidateKind {
+    SIDF_PRA_CANDIDATE_RESENT_SENDER = 0,
+    SIDF_PRA_CANDIDATE_RESENT_FROM,
+    SIDF_PRA_CANDIDATE_SENDER,
+    SIDF_PRA_CANDIDATE_FROM,
+    SIDF_PRA_CANDIDATE_NUM,
+} SidfPraCandidateKind;
+
+typedef struct SidfPraCandidate {
+    int index;                  // 最初に現れた空でないヘッダの位置, 現れていない場合は -1
+    bool multiple;              // 空でないヘッダが 2 つ以上現れたか
+    char *headerf;
+    char *headerv;
+} SidfPraCandidate;
+
+/*
+ * ヘッダを 1 つずつ受け取りながら, RFC4407 の PRA の候補となるヘッダを追跡する.
+ * 保持するのは候補となる種類毎に最初に現れた空でないヘッダだけなので,
+ * ヘッダ全体を保持しておく必要はなく, ヘッダの終わりに達した時点で 1 回の走査で PRA が決まる.
+ */
+struct SidfPraScanner {
+    MemArena *arena;            // 候補のヘッダを複製する先, NULL の場合はヒープに複製する
+    int header_num;             // これまでに受け取ったヘッダの数
+    // Resent-From の後, Resent-Sender より前に Received か Return-Path が現れたか
+    bool trace_after_resent_from;
+    SidfPraCandidate candidate[SIDF_PRA_CANDIDATE_NUM];
+};
+
+static const char *const SidfPra_candidateHeaders[SIDF_PRA_CANDIDATE_NUM] = {
+    SIDF_PRA_RESENT_SENDER_HEADER,
+    SIDF_PRA_RESENT_FROM_HEADER,
+    SIDF_PRA_SENDER_HEADER,
+    SIDF_PRA_FROM_HEADER,
+};
+
+/**
+ * 受け取ったヘッダを全て忘れ, 次のメッセージのヘッダを受け取れる状態にする.
+ */
+void
+SidfPraScanner_reset(SidfPraScanner *self)
 {
-    bool multiple;
-    int resent_sender_pos =
-        MailHeaders_getNonEmptyHeaderIndex(headers, SIDF_PRA_RESENT_SENDER_HEADER, &multiple);
-    int resent_from_pos =
-        MailHeaders_getNonEmptyHeaderIndex(headers, SIDF_PRA_RESENT_FROM_HEADER, &multiple);
-
-    if (0 <= resent_sender_pos) {
-        if (0 <= resent_from_pos && resent_from_pos < resent_sender_pos) {
-            for (int i = resent_from_pos + 1; i < resent_sender_pos; ++i) {
-                const char *headerf, *headerv;
-                MailHeaders_get(headers, i, &headerf, &headerv);
-                if (0 == strcasecmp(headerf, SIDF_PRA_RECEIVED_HEADER)
-                    || 0 == strcasecmp(headerf, SIDF_PRA_RETURN_PATH_HEADER)) {
-                    // RFC4407 では, Resent-From と　Resent-Sender の間に
-                    // Received や Return-Path ヘッダが存在する場合は step 2 に進めとあるが,
-                    // ここでは Resent-From の存在を確認しているので, resent_from_pos を返せばよい.
-                    return resent_from_pos;
-                }   // end if
-            }   // end for
+    assert(NULL != self);
+    self->header_num = 0;
+    self->trace_after_resent_from = false;
+    for (int kind = 0; kind < SIDF_PRA_CANDIDATE_NUM; ++kind) {
+        SidfPraCandidate *candidate = &(self->candidate[kind]);
+        candidate->index = -1;
+        candidate->multiple = false;
+        if (NULL == self->arena) {
+            PTRINIT(candidate->headerf);
+            PTRINIT(candidate->headerv);
+        } else {
+            candidate->headerf = NULL;
+            candidate->headerv = NULL;
         }   // end if
-        return resent_sender_pos;
+    }   // end for
+}   // end function : SidfPraScanner_reset
+
+void
+SidfPraScanner_free(SidfPraScanner *self)
+{
+    if (NULL == self) {
+        return;
     }   // end if
+    SidfPraScanner_reset(self);
+    free(self);
+}   // end function : SidfPraScanner_free
 
-    if (0 <= resent_from_pos) {
-        return resent_from_pos;
+/**
+ * SidfPraScanner オブジェクトの構築
+ * @param arena 候補のヘッダを複製する MemArena オブジェクト. NULL の場合はヒープに複製する.
+ *              arena を指定した場合は, arena を MemArena_reset() する前に
+ *              SidfPraScanner_reset() を呼ばなければならない.
+ * @return 空の SidfPraScanner オブジェクト, メモリの確保に失敗した場合は NULL
+ */
+SidfPraScanner *
+SidfPraScanner_new(MemArena *arena)
+{
+    SidfPraScanner *self = (SidfPraScanner *) malloc(sizeof(SidfPraScanner));
+    if (NULL == self) {
+        return NULL;
     }   // end if
+    memset(self, 0, sizeof(SidfPraScanner));
+    self->arena = arena;
+    SidfPraScanner_reset(self);
+    return self;
+}   // end function : SidfPraScanner_new
 
-    int pos = MailHeaders_getNonEmptyHeaderIndex(headers, SIDF_PRA_SENDER_HEADER, &multiple);
-    if (0 <= pos) {
-        if (multiple) {
-            LogDebug("multiple Sender header found");
-            return -1;
+/**
+ * ヘッダを出現順に 1 つ受け取る.
+ * @return 成功した場合は true, メモリの確保に失敗した場合は false.
+ */
+bool
+SidfPraScanner_feed(SidfPraScanner *self, const char *headerf, const char *headerv)
+{
+    assert(NULL != self);
+    assert(NULL != headerf);
+    assert(NULL != headerv);
+
+    int index = (self->header_num)++;
+    if (0 == strcasecmp(headerf, SIDF_PRA_RECEIVED_HEADER)
+        || 0 == strcasecmp(headerf, SIDF_PRA_RETURN_PATH_HEADER)) {
+        if (0 <= self->candidate[SIDF_PRA_CANDIDATE_RESENT_FROM].index
+            && self->candidate[SIDF_PRA_CANDIDATE_RESENT_SENDER].index < 0) {
+            self->trace_after_resent_from = true;
         }   // end if
-        return pos;
+        return true;
     }   // end if
 
-    pos = MailHeaders_getNonEmptyHeaderIndex(headers, SIDF_PRA_FROM_HEADER, &multiple);
-    if (0 <= pos) {
-        if (multiple) {
-            LogDebug("multiple From header found");
-            return -1;
+    int kind = 0;
+    for (; kind < SIDF_PRA_CANDIDATE_NUM; ++kind) {
+        if (0 == strcasecmp(headerf, SidfPra_candidateHeaders[kind])) {
+            break;
         }   // end if
-        return pos;
+    }   // end for
+    if (SIDF_PRA_CANDIDATE_NUM == kind) {
+        return true;
     }   // end if
 
-    LogDebug("No (Resent-)Sender/From header found");
-    return -1;
-}   // end function : SidfPra_lookup
+    // [RFC4407 2.]
+    // For the purposes of this algorithm, a header field is "non-empty" if
+    // and only if it contains any non-whitespace characters.  Header fields
+    // that are otherwise relevant but contain only whitespace are ignored
+    // and treated as if they were not present.
+    const char *nextp;
+    const char *headerv_tail = STRTAIL(headerv);
+    XSkip_fws(headerv, headerv_tail, &nextp);
+    if (nextp == headerv_tail) {
+        return true;
+    }   // end if
 
-/**
- * PRA に従ってヘッダを選択する.
- * @param pra_index PRA によって選択されたヘッダへのインデックスを格納する変数へのポインタ.
- *                  該当するヘッダが存在しなかった場合は -1 が格納される.
- * @param pra_mailbox PRA によって選択されたヘッダのメールアドレスを保持する
- *                    InetMailbox オブジェクトを格納する変数へのポインタ.
- *                    該当するヘッダが存在しなかった場合, ヘッダが存在したがフォーマットが不正だった場合は NULL が格納される.
- * @return ヘッダの探索を完了した場合は true, 途中でエラーが発生した場合は false.
+    SidfPraCandidate *candidate = &(self->candidate[kind]);
+    if (0 <= candidate->index) {
+        candidate->multiple = true;
+        return true;
+    }   // end if
+    if (NULL == self->arena) {
+        candidate->headerf = strdup(headerf);
+        candidate->headerv = strdup(headerv);
+        if (NULL == candidate->headerf || NULL == candidate->headerv) {
+            PTRINIT(candidate->headerf);
+            PTRINIT(candidate->headerv);
+            return false;
+        }   // end if
+    } else {
+        candidate->headerf = MemArena_strdup(self->arena, headerf);
+        candidate->headerv = MemArena_strdup(self->arena, headerv);
+        if (NULL == candidate->headerf || NULL == candidate->headerv) {
+            candidate->headerf = NULL;
+            candidate->headerv = NULL;
+            return false;
+        }   // end if
+    }   // end if
+    candidate->index = index;
+    return true;
+}   // end function : SidfPraScanner_feed
+
+/*
+ * RFC4407 の手順に従って PRA となるヘッダを選ぶ.
+ * @return 選ばれたヘッダ, 該当するヘッダがない場合は NULL.
  */
-bool
-SidfPra_extract(const MailHeaders *headers, int *pra_index, InetMailbox **pra_mailbox)
+static const SidfPraCandidate *
+SidfPraScanner_select(const SidfPraScanner *self)
 {
-    assert(NULL != headers);
+    const SidfPraCandidate *resent_sender = &(self->candidate[SIDF_PRA_CANDIDATE_RESENT_SENDER]);
+    const SidfPraCandidate *resent_from = &(self->candidate[SIDF_PRA_CANDIDATE_RESENT_FROM]);
+    if (0 <= resent_sender->index) {
+        if (self->trace_after_resent_from) {
+            // RFC4407 では, Resent-From と　Resent-Sender の間に
+            // Received や Return-Path ヘッダが存在する場合は step 2 に進めとあるが,
+            // ここでは Resent-From の存在を確認しているので, Resent-From を返せばよい.
+            return resent_from;
+        }   // end if
+        return resent_sender;
+    }   // end if
 
-    int index = SidfPra_lookup(headers);
-    *pra_index = index;
-    if (index < 0) {
-        LogPermFail("No PRA header selected");
-        *pra_mailbox = NULL;
-        return true;
+    if (0 <= resent_from->index) {
+        return resent_from;
     }   // end if
 
-    const char *headerf, *headerv;
-    MailHeaders_get(headers, index, &headerf, &headerv);
+    const SidfPraCandidate *sender = &(self->candidate[SIDF_PRA_CANDIDATE_SENDER]);
+    if (0 <= sender->index) {
+        if (sender->multiple) {
+            LogDebug("multiple Sender header found");
+            return NULL;
+        }   // end if
+        return sender;
+    }   // end if
+
+    const SidfPraCandidate *from = &(self->candidate[SIDF_PRA_CANDIDATE_FROM]);
+    if (0 <= from->index) {
+        if (from->multiple) {
+            LogDebug("multiple From header found");
+            return NULL;
+        }   // end if
+        return from;
+    }   // end if
+
+    LogDebug("No (Resent-)Sender/From header found");
+    return NULL;
+}   // end function : SidfPraScanner_select
 
+/*
+ * PRA として選ばれたヘッダの値から 2822-mailbox を取り出す.
+ * @return 取り出しを完了した場合は true, メモリの確保に失敗した場合は false.
+ */
+static bool
+SidfPra_parseMailbox(const char *headerf, const char *headerv, InetMailbox **pra_mailbox)
+{
     const char *p, *errptr = NULL;
     const char *headerv_tail = STRTAIL(headerv);
     XSkip_fws(headerv, headerv_tail, &p);
@@ -126,4 +264,102 @@ SidfPra_extract(const MailHeaders *headers, int *pra_index, InetMailbox **pra_ma
         InetMailbox_free(mailbox);
         return true;
     }   // end if
+}   // end function : SidfPra_parseMailbox
+
+/**
+ * これまでに受け取ったヘッダから PRA に従ってヘッダを選択する.
+ * @param pra_header PRA によって選択されたヘッダのフィールド名を格納する変数へのポインタ.
+ *                   SidfPraScanner_reset() か SidfPraScanner_free() を呼ぶまで有効.
+ *                   該当するヘッダが存在しなかった場合は NULL が格納される.
+ * @param pra_mailbox SidfPra_extract() と同じ.
+ * @return SidfPra_extract() と同じ.
+ */
+bool
+SidfPraScanner_extract(const SidfPraScanner *self, const char **pra_header,
+                       InetMailbox **pra_mailbox)
+{
+    assert(NULL != self);
+
+    const SidfPraCandidate *candidate = SidfPraScanner_select(self);
+    if (NULL == candidate) {
+        LogPermFail("No PRA header selected");
+        *pra_header = NULL;
+        *pra_mailbox = NULL;
+        return true;
+    }   // end if
+    *pra_header = candidate->headerf;
+    return SidfPra_parseMailbox(candidate->headerf, candidate->headerv, pra_mailbox);
+}   // end function : SidfPraScanner_extract
+
+/**
+ * PRA の選択に関係するヘッダかを判定する.
+ * SidfPraScanner_feed() や SidfPra_extract() には, このヘッダだけを元の順序のまま渡せばよい.
+ * Received と Return-Path は Resent-From と Resent-Sender の間にあるかどうかしか見ないので,
+ * 値は空文字列で代用できる.
+ * @param need_value 関係するヘッダの場合に, 値も格納する必要があるかを受け取る.
+ * @return 関係するヘッダの場合は true.
+ */
+bool
+SidfPra_isRelevantHeader(const char *headerf, bool *need_value)
+{
+    assert(NULL != headerf);
+    assert(NULL != need_value);
+
+    if (0 == strcasecmp(headerf, SIDF_PRA_FROM_HEADER)
+        || 0 == strcasecmp(headerf, SIDF_PRA_SENDER_HEADER)
+        || 0 == strcasecmp(headerf, SIDF_PRA_RESENT_FROM_HEADER)
+        || 0 == strcasecmp(headerf, SIDF_PRA_RESENT_SENDER_HEADER)) {
+        *need_value = true;
+        return true;
+    }   // end if
+    if (0 == strcasecmp(headerf, SIDF_PRA_RECEIVED_HEADER)
+        || 0 == strcasecmp(headerf, SIDF_PRA_RETURN_PATH_HEADER)) {
+        *need_value = false;
+        return true;
+    }   // end if
+    return false;
+}   // end function : SidfPra_isRelevantHeader
+
+/**
+ * PRA に従ってヘッダを選択する.
+ * @param pra_index PRA によって選択されたヘッダへのインデックスを格納する変数へのポインタ.
+ *                  該当するヘッダが存在しなかった場合は -1 が格納される.
+ * @param pra_mailbox PRA によって選択されたヘッダのメールアドレスを保持する
+ *                    InetMailbox オブジェクトを格納する変数へのポインタ.
+ *                    該当するヘッダが存在しなかった場合, ヘッダが存在したがフォーマットが不正だった場合は NULL が格納される.
+ * @return ヘッダの探索を完了した場合は true, 途中でエラーが発生した場合は false.
+ */
+bool
+SidfPra_extract(const MailHeaders *headers, int *pra_index, InetMailbox **pra_mailbox)
+{
+    assert(NULL != headers);
+
+    SidfPraScanner *scanner = SidfPraScanner_new(NULL);
+    if (NULL == scanner) {
+        LogNoResource();
+        return false;
+    }   // end if
+    int headernum = MailHeaders_getCount(headers);
+    for (int i = 0; i < headernum; ++i) {
+        const char *headerf, *headerv;
+        MailHeaders_get(headers, i, &headerf, &headerv);
+        if (!SidfPraScanner_feed(scanner, headerf, headerv)) {
+            LogNoResource();
+            SidfPraScanner_free(scanner);
+            return false;
+        }   // end if
+    }   // end for
+
+    const SidfPraCandidate *candidate = SidfPraScanner_select(scanner);
+    if (NULL == candidate) {
+        LogPermFail("No PRA header selected");
+        *pra_index = -1;
+        *pra_mailbox = NULL;
+        SidfPraScanner_free(scanner);
+        return true;
+    }   // end if
+    *pra_index = candidate->index;
+    bool extract_stat = SidfPra_parseMailbox(candidate->headerf, candidate->headerv, pra_mailbox);
+    SidfPraScanner_free(scanner);
+    return extract_stat;
 }   // end function : SidfPra_extract
@@ -45,6 +45,8 @@ RCSID("$Id: sidfrecord.c 85 2008-06-20 07:20:38Z takahiko $");
 // 128 が最大値なので3桁あれば十分
 #define SIDF_RECORD_CIDRLEN_MAX_WIDTH 3
 #define SIDF_MACRO_EXPANSION_MAX_LENGTH 253
+// この数以上連続する ip4/ip6 メカニズムを trie にまとめる. 短いものは先頭から順に評価した方が速い.
+#define SIDF_RECORD_CIDR_RUN_MIN_TERMS 8
 
 /*
  * [RFC4408]
@@ -285,6 +287,7 @@ SidfRecord_parseDomainSpec(SidfRecord *self, const char *head, const char *tail,
          * successive domain labels until the total length does not exceed 253
          * characters.
          */
+        term->involve_macro = (NULL != memchr(head, '%', *nextp - head));
         term->querydomain = term->param.domain;
         while (SIDF_MACRO_EXPANSION_MAX_LENGTH < strlen(term->querydomain)) {
             term->querydomain = InetDomain_upward(term->querydomain);
@@ -786,6 +789,10 @@ void
 SidfRecord_free(SidfRecord *self)
 {
     assert(NULL != self);
+    if (0 < __sync_sub_and_fetch(&(self->refcount), 1)) {
+        // 他にも参照している箇所が残っている
+        return;
+    }   // end if
     if (NULL != self->directives) {
         PtrArray_free(self->directives);
     }   // end if
@@ -795,9 +802,26 @@ SidfRecord_free(SidfRecord *self)
     if (NULL != self->modifiers.exp) {
         SidfTerm_free(self->modifiers.exp);
     }   // end if
+    for (unsigned int n = 0; n < self->cidr_run_num; ++n) {
+        SidfCidrTrie_free(self->cidr_run[n].trie4);
+        SidfCidrTrie_free(self->cidr_run[n].trie6);
+    }   // end for
+    free(self->cidr_run);
     free(self);
 }   // end function : SidfRecord_free
 
+/**
+ * 参照カウントを増やす. 増やした参照は SidfRecord_free() で手放す.
+ * @return self
+ */
+SidfRecord *
+SidfRecord_ref(SidfRecord *self)
+{
+    assert(NULL != self);
+    (void) __sync_add_and_fetch(&(self->refcount), 1);
+    return self;
+}   // end function : SidfRecord_ref
+
 static SidfRecord *
 SidfRecord_new(const SidfRequest *request)
 {
@@ -807,6 +831,7 @@ SidfRecord_new(const SidfRequest *request)
         return NULL;
     }   // end if
     memset(self, 0, sizeof(SidfRecord));
+    self->refcount = 1;
     self->directives = PtrArray_new(0, (void (*)(void *)) SidfTerm_free);
     if (NULL == self->directives) {
         LogNoResource();
@@ -821,6 +846,87 @@ SidfRecord_new(const SidfRequest *request)
     return NULL;
 }   // end function : SidfRecord_new
 
+static bool
+SidfRecord_isCidrTerm(const SidfTerm *term)
+{
+    return SIDF_TERM_MECH_IP4 == term->attr->type || SIDF_TERM_MECH_IP6 == term->attr->type;
+}   // end function : SidfRecord_isCidrTerm
+
+/*
+ * directives[begin, end) の ip4/ip6 メカニズムを trie にまとめ, cidr_run に追加する.
+ * @return 成功した場合は true, メモリの確保に失敗した場合は false.
+ */
+static bool
+SidfRecord_appendCidrRun(SidfRecord *self, unsigned int begin, unsigned int end)
+{
+    SidfCidrRun *newrun =
+        (SidfCidrRun *) realloc(self->cidr_run, (self->cidr_run_num + 1) * sizeof(SidfCidrRun));
+    if (NULL == newrun) {
+        return false;
+    }   // end if
+    self->cidr_run = newrun;
+    SidfCidrRun *run = &(self->cidr_run[self->cidr_run_num++]);
+    run->begin = begin;
+    run->end = end;
+    run->trie4 = NULL;
+    run->trie6 = NULL;
+    for (unsigned int n = begin; n < end; ++n) {
+        const SidfTerm *term = PtrArray_get(self->directives, n);
+        if (SIDF_TERM_MECH_IP4 == term->attr->type) {
+            if (NULL == run->trie4 && NULL == (run->trie4 = SidfCidrTrie_new(32))) {
+                return false;
+            }   // end if
+            if (!SidfCidrTrie_insert(run->trie4, &(term->param.addr4), term->ip4cidr, n)) {
+                return false;
+            }   // end if
+        } else {
+            if (NULL == run->trie6 && NULL == (run->trie6 = SidfCidrTrie_new(128))) {
+                return false;
+            }   // end if
+            if (!SidfCidrTrie_insert(run->trie6, &(term->param.addr6), term->ip6cidr, n)) {
+                return false;
+            }   // end if
+        }   // end if
+    }   // end for
+    return true;
+}   // end function : SidfRecord_appendCidrRun
+
+/*
+ * 連続する ip4/ip6 メカニズムを trie にまとめる.
+ * trie は評価を速くするためだけのものなので, 構築に失敗した場合は trie を使わずに評価する.
+ */
+static void
+SidfRecord_compileCidrRuns(SidfRecord *self)
+{
+    unsigned int directive_num = PtrArray_getCount(self->directives);
+    unsigned int begin = 0;
+    while (begin < directive_num) {
+        if (!SidfRecord_isCidrTerm(PtrArray_get(self->directives, begin))) {
+            ++begin;
+            continue;
+        }   // end if
+        unsigned int end = begin + 1;
+        while (end < directive_num && SidfRecord_isCidrTerm(PtrArray_get(self->directives, end))) {
+            ++end;
+        }   // end while
+        if (SIDF_RECORD_CIDR_RUN_MIN_TERMS <= end - begin
+            && !SidfRecord_appendCidrRun(self, begin, end)) {
+            LogNoResource();
+            goto cleanup;
+        }   // end if
+        begin = end;
+    }   // end while
+    return;
+
+  cleanup:
+    for (unsigned int n = 0; n < self->cidr_run_num; ++n) {
+        SidfCidrTrie_free(self->cidr_run[n].trie4);
+        SidfCidrTrie_free(self->cidr_run[n].trie6);
+    }   // end for
+    PTRINIT(self->cidr_run);
+    self->cidr_run_num = 0;
+}   // end function : SidfRecord_compileCidrRuns
+
 /**
  * SPFレコードのスコープを除いた部分をパースして, SidfRecord オブジェクトを構築する.
  * @param scope 構築する SidfRecord オブジェクトに設定するスコープ.
@@ -843,11 +949,13 @@ SidfRecord_build(const SidfRequest *request, SidfRecordScope scope, const char *
         LogNoResource();
         return SIDF_STAT_NO_RESOURCE;
     }   // end if
-    self->domain = SidfRequest_getDomain(request);
+    // ローカルポリシーを事前に構築する場合など, 評価中のドメインがない場合もある
+    self->domain = PTROR(SidfRequest_getDomain(request), "(none)");
     self->scope = scope;
 
     SidfStat build_stat = SidfRecord_parse(self, record_head, record_tail);
     if (SIDF_STAT_OK == build_stat) {
+        SidfRecord_compileCidrRuns(self);
         *recordobj = self;
     } else {
         SidfRecord_free(self);
@@ -855,6 +963,18 @@ SidfRecord_build(const SidfRequest *request, SidfRecordScope scope, const char *
     return build_stat;
 }   // end function : SidfRecord_build
 
+/**
+ * マクロを含まないレコードかを調べる.
+ * マクロを含まないレコードから構築した SidfRecord オブジェクトはリクエストに依存しないので,
+ * 複数のリクエストで共有できる.
+ * [RFC4408] 8.1. の macro-string 中以外に '%' が現れることはないので, '%' の有無で判断する.
+ */
+bool
+SidfRecord_isMacroFree(const char *record_head, const char *record_tail)
+{
+    return NULL == memchr(record_head, '%', record_tail - record_head);
+}   // end function : SidfRecord_isMacroFree
+
 /**
  * 指定した SPF/SIDF レコードのスコープを取得する.
  * スコープを取得できた場合はそのスコープを, 取得できなかった場合は
@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * パース済みの SPF/SIDF レコードのキャッシュ.
+ * (ドメイン名, 評価スコープ) をキーに SidfRecord オブジェクトを DNS の TTL の間保持し,
+ * 複数のリクエストから読み取り専用で共有する.
+ * マクロを含むレコードはリクエスト毎に展開結果が異なるので格納してはならない.
+ * 各エントリには, そのドメインを根とする解決済みの include の木を併せて格納できる.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/nameser.h>
+
+#include "cacheutil.h"
+#include "sidf.h"
+#include "sidfrecord.h"
+#include "sidfincludetree.h"
+#include "sidfrecordcache.h"
+
+#define SIDF_RECORDCACHE_MAX_TTL 86400  // これより長い TTL は切り詰める
+#define SIDF_RECORDCACHE_MIN_BUCKETS 64
+
+typedef struct SidfRecordCacheEntry {
+    CacheLruLink lru;           // 先頭に置くこと
+    struct SidfRecordCacheEntry *hash_next;
+    uint32_t hash;
+    SidfRecordScope scope;
+    time_t expire;              // CLOCK_MONOTONIC 基準の有効期限 (秒)
+    SidfRecord *record;         // キャッシュが保持する参照
+    SidfIncludeTree *tree;      // 解決済みの include の木, 組み立てていない場合は NULL
+    time_t tree_expire;         // 木の有効期限, 木を構成するレコードのうち最も早く切れるもの
+    size_t keylen;
+    char key[];                 // 小文字に揃え, 末尾の '.' を取り除いたドメイン名
+} SidfRecordCacheEntry;
+
+struct SidfRecordCache {
+    pthread_mutex_t lock;
+    SidfRecordCacheEntry **bucket;
+    size_t bucket_mask;
+    CacheLru lru;
+    size_t entry_num;
+    size_t entry_limit;
+};
+
+static SidfRecordCacheEntry **
+SidfRecordCache_getBucket(SidfRecordCache *self, uint32_t hash)
+{
+    return &(self->bucket[hash & self->bucket_mask]);
+}   // end function : SidfRecordCache_getBucket
+
+static void
+SidfRecordCache_freeEntry(SidfRecordCacheEntry *entry)
+{
+    if (NULL == entry) {
+        return;
+    }   // end if
+    SidfIncludeTree_free(entry->tree);
+    SidfRecord_free(entry->record);
+    free(entry);
+}   // end function : SidfRecordCache_freeEntry
+
+/*
+ * エントリをハッシュチェーンと LRU リストから外す.
+ * ロックを保持した状態で呼ぶこと. 外したエントリは,
+ * ロックを手放してから SidfRecordCache_freeEntry() すること.
+ */
+static SidfRecordCacheEntry *
+SidfRecordCache_removeEntry(SidfRecordCache *self, SidfRecordCacheEntry *entry)
+{
+    for (SidfRecordCacheEntry **pp = SidfRecordCache_getBucket(self, entry->hash); NULL != *pp;
+         pp = &((*pp)->hash_next)) {
+        if (*pp == entry) {
+            *pp = entry->hash_next;
+            break;
+        }   // end if
+    }   // end for
+    CacheLru_unlink(&self->lru, &entry->lru);
+    --(self->entry_num);
+    return entry;
+}   // end function : SidfRecordCache_removeEntry
+
+/*
+ * ロックを保持した状態で呼ぶこと.
+ */
+static SidfRecordCacheEntry *
+SidfRecordCache_findEntry(SidfRecordCache *self, uint32_t hash, const char *key, size_t keylen,
+                          SidfRecordScope scope)
+{
+    for (SidfRecordCacheEntry *entry = *SidfRecordCache_getBucket(self, hash); NULL != entry;
+         entry = entry->hash_next) {
+        if (entry->hash == hash && entry->scope == scope && entry->keylen == keylen
+            && 0 == memcmp(entry->key, key, keylen)) {
+            return entry;
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function : SidfRecordCache_findEntry
+
+/**
+ * キャッシュを引く.
+ * @param scope 評価スコープ. 選択されたレコードのスコープではなく, 評価を要求したスコープを指定する.
+ * @param ttl ヒットした場合にエントリの残りの有効期間 (秒) を受け取る. NULL の場合は受け取らない.
+ * @return ヒットした場合はレコードへの参照. 使い終わったら SidfRecord_free() で手放すこと.
+ *         ヒットしなかった場合は NULL.
+ */
+SidfRecord *
+SidfRecordCache_lookup(SidfRecordCache *self, const char *domain, SidfRecordScope scope,
+                       unsigned long *ttl)
+{
+    assert(NULL != self);
+    char key[NS_MAXDNAME];
+    int keylen = CacheUtil_normalizeDomain(domain, key, sizeof(key));
+    if (keylen < 0) {
+        return NULL;
+    }   // end if
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) scope);
+    time_t now = CacheUtil_now();
+    SidfRecord *record = NULL;
+    SidfRecordCacheEntry *expired = NULL;
+
+    pthread_mutex_lock(&self->lock);
+    SidfRecordCacheEntry *entry = SidfRecordCache_findEntry(self, hash, key, keylen, scope);
+    if (NULL != entry) {
+        if (entry->expire <= now) {
+            expired = SidfRecordCache_removeEntry(self, entry);
+        } else {
+            record = SidfRecord_ref(entry->record);
+            if (NULL != ttl) {
+                *ttl = (unsigned long) (entry->expire - now);
+            }   // end if
+            CacheLru_unlink(&self->lru, &entry->lru);
+            CacheLru_push(&self->lru, &entry->lru);
+        }   // end if
+    }   // end if
+    pthread_mutex_unlock(&self->lock);
+
+    SidfRecordCache_freeEntry(expired);
+    return record;
+}   // end function : SidfRecordCache_lookup
+
+/**
+ * レコードをキャッシュに格納する.
+ * 同じキーのエントリが既に存在する場合は置き換える.
+ * エントリ数の上限を越える場合は LRU リストの末尾から追い出す.
+ * 格納したレコードは構築したリクエストから切り離され, 以降は読み取り専用として扱われる.
+ * @param record マクロを含まないレコード. キャッシュは新たに参照を取得するので,
+ *               呼び出し側の参照はそのまま使い続けてよい.
+ * @param ttl キャッシュしておく秒数. 0 の場合は何もしない.
+ */
+void
+SidfRecordCache_store(SidfRecordCache *self, const char *domain, SidfRecordScope scope,
+                      SidfRecord *record, unsigned long ttl)
+{
+    assert(NULL != self);
+    assert(NULL != record);
+    if (0 == ttl || 0 == self->entry_limit) {
+        return;
+    }   // end if
+    char key[NS_MAXDNAME];
+    int keylen = CacheUtil_normalizeDomain(domain, key, sizeof(key));
+    if (keylen < 0) {
+        return;
+    }   // end if
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) scope);
+
+    SidfRecordCacheEntry *newentry =
+        (SidfRecordCacheEntry *) malloc(sizeof(SidfRecordCacheEntry) + keylen + 1);
+    if (NULL == newentry) {
+        return;
+    }   // end if
+    memset(newentry, 0, sizeof(SidfRecordCacheEntry));
+    newentry->hash = hash;
+    newentry->scope = scope;
+    newentry->expire = CacheUtil_now()
+        + (time_t) (SIDF_RECORDCACHE_MAX_TTL < ttl ? SIDF_RECORDCACHE_MAX_TTL : ttl);
+    newentry->keylen = keylen;
+    memcpy(newentry->key, key, keylen + 1);
+    // パース時にしか使わないリクエストへの参照を切っておく
+    record->request = NULL;
+    record->domain = NULL;
+    newentry->record = SidfRecord_ref(record);
+
+    SidfRecordCacheEntry *removed[2] = { NULL, NULL };
+    pthread_mutex_lock(&self->lock);
+    SidfRecordCacheEntry *oldentry = SidfRecordCache_findEntry(self, hash, key, keylen, scope);
+    if (NULL != oldentry) {
+        removed[0] = SidfRecordCache_removeEntry(self, oldentry);
+    }   // end if
+    if (self->entry_limit <= self->entry_num && NULL != self->lru.tail) {
+        removed[1] = SidfRecordCache_removeEntry(self, CACHELRU_ENTRY(SidfRecordCacheEntry, self->lru.tail));
+    }   // end if
+    SidfRecordCacheEntry **bucket = SidfRecordCache_getBucket(self, hash);
+    newentry->hash_next = *bucket;
+    *bucket = newentry;
+    CacheLru_push(&self->lru, &newentry->lru);
+    ++(self->entry_num);
+    pthread_mutex_unlock(&self->lock);
+
+    for (size_t n = 0; n < sizeof(removed) / sizeof(removed[0]); ++n) {
+        SidfRecordCache_freeEntry(removed[n]);
+    }   // end for
+}   // end function : SidfRecordCache_store
+
+/**
+ * ドメインを根とする解決済みの include の木を引く.
+ * 木の有効期限が切れている場合は木だけを捨てる. 根のレコード自体は引き続き有効な場合がある.
+ * @param ttl ヒットした場合に木の残りの有効期間 (秒) を受け取る. NULL の場合は受け取らない.
+ * @return ヒットした場合は木への参照. 使い終わったら SidfIncludeTree_free() で手放すこと.
+ *         ヒットしなかった場合は NULL.
+ */
+SidfIncludeTree *
+SidfRecordCache_lookupTree(SidfRecordCache *self, const char *domain, SidfRecordScope scope,
+                           unsigned long *ttl)
+{
+    assert(NULL != self);
+    char key[NS_MAXDNAME];
+    int keylen = CacheUtil_normalizeDomain(domain, key, sizeof(key));
+    if (keylen < 0) {
+        return NULL;
+    }   // end if
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) scope);
+    time_t now = CacheUtil_now();
+    SidfIncludeTree *tree = NULL;
+    SidfIncludeTree *expired = NULL;
+
+    pthread_mutex_lock(&self->lock);
+    SidfRecordCacheEntry *entry = SidfRecordCache_findEntry(self, hash, key, keylen, scope);
+    if (NULL != entry && NULL != entry->tree) {
+        if (entry->tree_expire <= now) {
+            expired = entry->tree;
+            entry->tree = NULL;
+        } else {
+            tree = SidfIncludeTree_ref(entry->tree);
+            if (NULL != ttl) {
+                *ttl = (unsigned long) (entry->tree_expire - now);
+            }   // end if
+        }   // end if
+    }   // end if
+    pthread_mutex_unlock(&self->lock);
+
+    SidfIncludeTree_free(expired);
+    return tree;
+}   // end function : SidfRecordCache_lookupTree
+
+/**
+ * ドメインを根とする解決済みの include の木を, 根のレコードのエントリに格納する.
+ * 根のレコードのエントリが存在しない場合は何もしない.
+ * @param tree 格納する木. キャッシュは新たに参照を取得するので,
+ *             呼び出し側の参照はそのまま使い続けてよい.
+ *             tree->ttl 秒経過するか, 根のレコードのエントリが破棄されるまで保持する.
+ */
+void
+SidfRecordCache_storeTree(SidfRecordCache *self, const char *domain, SidfRecordScope scope,
+                          SidfIncludeTree *tree)
+{
+    assert(NULL != self);
+    assert(NULL != tree);
+    if (0 == tree->ttl) {
+        return;
+    }   // end if
+    char key[NS_MAXDNAME];
+    int keylen = CacheUtil_normalizeDomain(domain, key, sizeof(key));
+    if (keylen < 0) {
+        return;
+    }   // end if
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) scope);
+    time_t tree_expire = CacheUtil_now()
+        + (time_t) (SIDF_RECORDCACHE_MAX_TTL < tree->ttl ? SIDF_RECORDCACHE_MAX_TTL : tree->ttl);
+    SidfIncludeTree *replaced = NULL;
+
+    pthread_mutex_lock(&self->lock);
+    SidfRecordCacheEntry *entry = SidfRecordCache_findEntry(self, hash, key, keylen, scope);
+    if (NULL != entry && entry->record == tree->root->record) {
+        replaced = entry->tree;
+        entry->tree = SidfIncludeTree_ref(tree);
+        entry->tree_expire = (tree_expire < entry->expire) ? tree_expire : entry->expire;
+    }   // end if
+    pthread_mutex_unlock(&self->lock);
+
+    SidfIncludeTree_free(replaced);
+}   // end function : SidfRecordCache_storeTree
+
+void
+SidfRecordCache_free(SidfRecordCache *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    CacheLruLink *link = self->lru.head;
+    while (NULL != link) {
+        CacheLruLink *next = link->next;
+        SidfRecordCache_freeEntry(CACHELRU_ENTRY(SidfRecordCacheEntry, link));
+        link = next;
+    }   // end while
+    free(self->bucket);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+}   // end function : SidfRecordCache_free
+
+/**
+ * SidfRecordCache オブジェクトを構築する.
+ * @param entry_limit キャッシュしておくレコード数の上限.
+ */
+SidfRecordCache *
+SidfRecordCache_new(size_t entry_limit)
+{
+    SidfRecordCache *self = (SidfRecordCache *) malloc(sizeof(SidfRecordCache));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(SidfRecordCache));
+    pthread_mutex_init(&self->lock, NULL);
+    self->entry_limit = entry_limit;
+
+    size_t bucket_num = SIDF_RECORDCACHE_MIN_BUCKETS;
+    while (bucket_num < entry_limit) {
+        bucket_num <<= 1;
+    }   // end while
+    self->bucket_mask = bucket_num - 1;
+    self->bucket = (SidfRecordCacheEntry **) calloc(bucket_num, sizeof(SidfRecordCacheEntry *));
+    if (NULL == self->bucket) {
+        goto cleanup;
+    }   // end if
+    return self;
+
+  cleanup:
+    SidfRecordCache_free(self);
+    return NULL;
+}   // end function : SidfRecordCache_new
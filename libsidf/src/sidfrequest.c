@@ -16,6 +16,7 @@ RCSID("$Id: sidfrequest.c 348 2008-08-13 15:44:32Z takahiko $");
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <arpa/nameser.h>
 #include <netdb.h>
@@ -34,6 +35,9 @@ RCSID("$Id: sidfrequest.c 348 2008-08-13 15:44:32Z takahiko $");
 #include "sidf.h"
 #include "sidfenum.h"
 #include "sidfrecord.h"
+#include "sidfincludetree.h"
+#include "sidfrecordcache.h"
+#include "sidfresultcache.h"
 #include "sidfrequest.h"
 #include "sidfmacro.h"
 
@@ -42,6 +46,53 @@ RCSID("$Id: sidfrequest.c 348 2008-08-13 15:44:32Z takahiko $");
 #endif
 
 #define SIDF_REQUEST_DEFAULT_LOCALPART "postmaster"
+#define SIDF_REQUEST_FRAME_GROWTH 8
+
+/*
+ * 遅延モードのリゾルバで応答待ちになった場合はエラーではないのでログに残さない.
+ */
+#define LogDnsLookupError(resolv_stat, format, ...) \
+    do { \
+        if (DNS_STAT_PENDING != (resolv_stat)) { \
+            LogDnsError(format, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+/*
+ * 評価スタックのフレーム. RFC4408 の check_host() 関数の呼び出し 1 回分に相当する.
+ */
+typedef enum SidfFrameKind {
+    SIDF_FRAME_KIND_TOP,        // SidfRequest_start() から評価を開始したもの
+    SIDF_FRAME_KIND_INCLUDE,    // "include" メカニズムによるもの
+    SIDF_FRAME_KIND_REDIRECT,   // "redirect=" modifier によるもの
+} SidfFrameKind;
+
+typedef enum SidfFrameStage {
+    SIDF_FRAME_STAGE_CHECK_DOMAIN,  // <domain> の検証と登録
+    SIDF_FRAME_STAGE_LOOKUP,    // レコードの取得とパース
+    SIDF_FRAME_STAGE_DIRECTIVES,    // レコード中の directive の評価
+    SIDF_FRAME_STAGE_EXPLANATION,   // "exp=" modifier の評価
+    SIDF_FRAME_STAGE_REDIRECT,  // "redirect=" modifier の評価
+    SIDF_FRAME_STAGE_LOCAL_POLICY_BUILD,    // ローカルポリシーの構築
+    SIDF_FRAME_STAGE_LOCAL_POLICY,  // ローカルポリシー中の directive の評価
+    SIDF_FRAME_STAGE_LOCAL_POLICY_EXPLANATION,  // ローカルポリシー用 explanation の評価
+    SIDF_FRAME_STAGE_DEFAULT,   // どれにもマッチしなかった場合
+} SidfFrameStage;
+
+struct SidfFrame {
+    SidfFrameKind kind;
+    SidfFrameStage stage;
+    const char *domain;         // check_host() の <domain>. 親フレームの SidfRecord が所有する.
+    bool domain_pushed;         // domain を SidfRequest の domain スタックに積んだか
+    SidfRecord *record;
+    SidfRecord *local_policy_record;
+    unsigned int directive_index;   // 評価中の directive の番号
+    unsigned int cidr_run_index;    // 次に評価する SidfCidrRun の番号
+    unsigned int prefetch_index;    // 問い合わせを先読みし終えた directive の番号の次
+    bool returned;              // 子フレームから復帰した直後は true
+    SidfScore callee_score;     // 子フレームの評価結果
+    SidfScore score;            // 確定したスコア ("exp=" 評価中に保持しておくため)
+};
 
 typedef struct SidfRawRecord {
     const char *record_head;
@@ -50,8 +101,6 @@ typedef struct SidfRawRecord {
     SidfRecordScope scope;
 } SidfRawRecord;
 
-static SidfScore SidfRequest_checkHost(SidfRequest *self, const char *domain);
-
 static unsigned int
 SidfRequest_getDepth(const SidfRequest *self)
 {
@@ -92,6 +141,9 @@ SidfRequest_getScoreByQualifier(SidfQualifier qualifier)
 static SidfStat
 SidfRequest_setExplanation(SidfRequest *self, const char *domain, const char *exp_macro)
 {
+    if (SidfMacro_hasSenderOrTimeMacro(exp_macro, STRTAIL(exp_macro))) {
+        self->sender_dependent = true;
+    }   // end if
     const char *nextp;
     XBuffer_reset(self->xbuf);
     SidfStat parse_stat =
@@ -142,10 +194,10 @@ SidfRequest_uniqueByScope(const SidfRawRecord *rawrecords, unsigned int recordnu
  * @return 成功した場合は SIDF_SCORE_NULL, SPFレコード取得の際にエラーが発生した場合は SIDF_SCORE_NULL 以外.
  */
 static SidfScore
-SidfRequest_fetch(const SidfRequest *self, const char *domain, DnsTxtResponse **txtresp)
+SidfRequest_fetch(const SidfRequest *self, const char *domain, DnsRrView *txtview)
 {
     if (self->policy->lookup_spf_rr) {
-        int spfquery_stat = DnsResolver_lookupSpf(self->resolver, domain, txtresp);
+        int spfquery_stat = DnsResolver_viewSpf(self->resolver, domain, txtview);
         switch (spfquery_stat) {
         case NETDB_SUCCESS:
             /*
@@ -192,7 +244,7 @@ SidfRequest_fetch(const SidfRequest *self, const char *domain, DnsTxtResponse **
     }   // end if
 
     // TXT RR を引く
-    int txtquery_stat = DnsResolver_lookupTxt(self->resolver, domain, txtresp);
+    int txtquery_stat = DnsResolver_viewTxt(self->resolver, domain, txtview);
     switch (txtquery_stat) {
     case NETDB_SUCCESS:
         return SIDF_SCORE_NULL;
@@ -236,21 +288,103 @@ SidfRequest_fetch(const SidfRequest *self, const char *domain, DnsTxtResponse **
     }   // end switch
 }   // end function : SidfRequest_fetch
 
+/*
+ * 評価中に参照したキャッシュの残りの有効期間を, 評価結果をキャッシュしてよい期間に反映する.
+ */
+static void
+SidfRequest_updateMinTtl(SidfRequest *self, unsigned long ttl)
+{
+    if (ttl < self->min_ttl) {
+        self->min_ttl = ttl;
+    }   // end if
+}   // end function : SidfRequest_updateMinTtl
+
+/*
+ * SPF と Sender ID (PRA) の評価は同じドメインの TXT RR を引くことが多いので,
+ * 一方のスコープでレコードを取得した際に, 同じ応答からもう一方のスコープのレコードも選択して
+ * SidfRecordCache に格納しておく. もう一方のスコープの評価は TXT RR を引かずに済む.
+ * もう一方のスコープのレコードが唯一つに定まらない場合やマクロを含む場合は何もしない.
+ * @param selected self->scope に対して選択したレコード
+ * @param record selected から構築したレコード
+ */
+static void
+SidfRequest_storeSiblingRecord(SidfRequest *self, const char *domain,
+                               const SidfRawRecord *rawrecords, unsigned int recordnum,
+                               const SidfRawRecord *selected, SidfRecord *record)
+{
+    SidfRecordScope sibling_scope;
+    switch (self->scope) {
+    case SIDF_RECORD_SCOPE_SPF1:
+        sibling_scope = SIDF_RECORD_SCOPE_SPF2_PRA;
+        break;
+    case SIDF_RECORD_SCOPE_SPF2_PRA:
+        sibling_scope = SIDF_RECORD_SCOPE_SPF1;
+        break;
+    default:
+        return;
+    }   // end switch
+
+    // SidfRequest_lookupRecord() と同じ手順で選択する
+    const SidfRawRecord *sibling = NULL;
+    if (sibling_scope & SIDF_RECORD_SCOPE_SPF2_PRA) {
+        if (SIDF_SCORE_NULL !=
+            SidfRequest_uniqueByScope(rawrecords, recordnum, sibling_scope, &sibling)) {
+            return;
+        }   // end if
+    }   // end if
+    if (NULL == sibling
+        && SIDF_SCORE_NULL != SidfRequest_uniqueByScope(rawrecords, recordnum,
+                                                        SIDF_RECORD_SCOPE_SPF1, &sibling)) {
+        return;
+    }   // end if
+    if (NULL == sibling || !SidfRecord_isMacroFree(sibling->scope_tail, sibling->record_tail)) {
+        return;
+    }   // end if
+
+    unsigned long ttl = DnsResolver_getTtl(self->resolver);
+    if (sibling == selected) {
+        // spf2.0/pra レコードがなく, 両方のスコープで同じ v=spf1 レコードを使う
+        SidfRecordCache_store(self->policy->record_cache, domain, sibling_scope, record, ttl);
+        return;
+    }   // end if
+    SidfRecord *sibling_record = NULL;
+    if (SIDF_STAT_OK ==
+        SidfRecord_build(self, sibling->scope, sibling->scope_tail, sibling->record_tail,
+                         &sibling_record)) {
+        SidfRecordCache_store(self->policy->record_cache, domain, sibling_scope, sibling_record,
+                              ttl);
+        SidfRecord_free(sibling_record);
+    }   // end if
+}   // end function : SidfRequest_storeSiblingRecord
+
 static SidfScore
-SidfRequest_lookupRecord(const SidfRequest *self, const char *domain, SidfRecord **record)
+SidfRequest_lookupRecord(SidfRequest *self, const char *domain, SidfRecord **record)
 {
-    DnsTxtResponse *txtresp = NULL;
-    SidfScore fetch_score = SidfRequest_fetch(self, domain, &txtresp);
+    // パース済みレコードのキャッシュを引く
+    SidfRecordCache *record_cache = self->policy->record_cache;
+    if (NULL != record_cache) {
+        unsigned long ttl;
+        *record = SidfRecordCache_lookup(record_cache, domain, self->scope, &ttl);
+        if (NULL != *record) {
+            LogSidfDebug("record cache hit: domain=%s", domain);
+            SidfRequest_updateMinTtl(self, ttl);
+            return SIDF_SCORE_NULL;
+        }   // end if
+    }   // end if
+
+    // レコードの文字列は resolver の領域にあり, 次に TXT RR を引くまで有効
+    DnsRrView txtview;
+    SidfScore fetch_score = SidfRequest_fetch(self, domain, &txtview);
     if (SIDF_SCORE_NULL != fetch_score) {
         return fetch_score;
     }   // end if
-    assert(NULL != txtresp);
 
     // 各レコードのスコープを調べる
-    SidfRawRecord rawrecords[txtresp->num];
-    for (size_t n = 0; n < txtresp->num; ++n) {
-        rawrecords[n].record_head = txtresp->data[n];
-        rawrecords[n].record_tail = STRTAIL(txtresp->data[n]);
+    SidfRawRecord rawrecords[txtview.num];
+    for (size_t n = 0; n < txtview.num; ++n) {
+        const char *txtdata = DnsRrView_next(&txtview);
+        rawrecords[n].record_head = txtdata;
+        rawrecords[n].record_tail = STRTAIL(txtdata);
         (void) SidfRecord_getSidfScope(rawrecords[n].record_head, rawrecords[n].record_tail,
                                        &(rawrecords[n].scope), &(rawrecords[n].scope_tail));
     }   // end for
@@ -259,13 +393,12 @@ SidfRequest_lookupRecord(const SidfRequest *self, const char *domain, SidfRecord
     const SidfRawRecord *selected = NULL;
     if (self->scope & (SIDF_RECORD_SCOPE_SPF2_MFROM | SIDF_RECORD_SCOPE_SPF2_PRA)) {
         SidfScore select_score =
-            SidfRequest_uniqueByScope(rawrecords, txtresp->num, self->scope, &selected);
+            SidfRequest_uniqueByScope(rawrecords, txtview.num, self->scope, &selected);
         if (SIDF_SCORE_NULL != select_score) {
             LogPermFail
                 ("multiple spf2 record found: domain=%s, spf2-mfrom=%s, spf2-pra=%s",
                  domain, self->scope & SIDF_RECORD_SCOPE_SPF2_MFROM ? "true" : "false",
                  self->scope & SIDF_RECORD_SCOPE_SPF2_PRA ? "true" : "false");
-            DnsTxtResponse_free(txtresp);
             return select_score;
         }   // end if
     }   // end if
@@ -273,12 +406,11 @@ SidfRequest_lookupRecord(const SidfRequest *self, const char *domain, SidfRecord
     // SPFv1 なスコープを持つ場合, SIDF なスコープを持つが SIDF レコードが見つからなかった場合は SPF レコードを探す
     if (NULL == selected) {
         SidfScore select_score =
-            SidfRequest_uniqueByScope(rawrecords, txtresp->num, SIDF_RECORD_SCOPE_SPF1,
+            SidfRequest_uniqueByScope(rawrecords, txtview.num, SIDF_RECORD_SCOPE_SPF1,
                                       &selected);
         if (SIDF_SCORE_NULL != select_score) {
             LogPermFail("multiple spf1 record found: domain=%s, spf1=%s", domain,
                         self->scope & SIDF_RECORD_SCOPE_SPF1 ? "true" : "false");
-            DnsTxtResponse_free(txtresp);
             return select_score;
         }   // end if
     }   // end if
@@ -289,16 +421,26 @@ SidfRequest_lookupRecord(const SidfRequest *self, const char *domain, SidfRecord
                  domain, self->scope & SIDF_RECORD_SCOPE_SPF1 ? "true" : "false",
                  self->scope & SIDF_RECORD_SCOPE_SPF2_MFROM ? "true" : "false",
                  self->scope & SIDF_RECORD_SCOPE_SPF2_PRA ? "true" : "false");
-        DnsTxtResponse_free(txtresp);
         return SIDF_SCORE_NONE;
     }   // end if
 
     // スコープに一致する SPF/SIDF レコードが唯一つ存在した
+    if (SidfMacro_hasSenderOrTimeMacro(selected->scope_tail, selected->record_tail)) {
+        self->sender_dependent = true;
+    }   // end if
     // レコードのパース
     SidfStat build_stat =
         SidfRecord_build(self, selected->scope, selected->scope_tail, selected->record_tail,
                          record);
-    DnsTxtResponse_free(txtresp);
+    if (SIDF_STAT_OK == build_stat && NULL != record_cache
+        && SidfRecord_isMacroFree(selected->scope_tail, selected->record_tail)) {
+        // マクロを含まないレコードはリクエストに依存しないので, 他のリクエストと共有する
+        SidfRecordCache_store(record_cache, domain, self->scope, *record,
+                              DnsResolver_getTtl(self->resolver));
+    }   // end if
+    if (SIDF_STAT_OK == build_stat && NULL != record_cache) {
+        SidfRequest_storeSiblingRecord(self, domain, rawrecords, txtview.num, selected, *record);
+    }   // end if
     switch (build_stat) {
     case SIDF_STAT_OK:
         return SIDF_SCORE_NULL;
@@ -357,25 +499,28 @@ SidfRequest_incrementDnsMechCounter(SidfRequest *self)
     }   // end if
 }   // end function : SidfRequest_incrementDnsMechCounter
 
+/*
+ * @param domain "all" メカニズムを含むレコードのドメイン名, ログの出力に使用する.
+ */
 static SidfScore
-SidfRequest_evalMechAll(SidfRequest *self, const SidfTerm *term)
+SidfRequest_evalMechAll(SidfRequest *self, const SidfTerm *term, const char *domain)
 {
     // "+all" に遭遇した場合, logging_pass_all_directive が有効ならログに出力する
     if (self->policy->logging_plus_all_directive && SIDF_QUALIFIER_PLUS == term->qualifier) {
-        LogSidfNotice("Found +all directive in SPF record: domain=%s", SidfRequest_getDomain(self));
+        LogSidfNotice("Found +all directive in SPF record: domain=%s", domain);
     }   // end if
     return SIDF_SCORE_NULL == self->policy->overwrite_all_directive_score
         ? SidfRequest_getScoreByQualifier(term->qualifier)
         : self->policy->overwrite_all_directive_score;
 }   // end function : SidfRequest_evalMechAll
 
+/*
+ * "include" メカニズムで呼び出した check_host() の評価結果を, "include" メカニズムの評価結果にマップする.
+ */
 static SidfScore
-SidfRequest_evalMechInclude(SidfRequest *self, const SidfTerm *term)
+SidfRequest_mapIncludeScore(const SidfTerm *term, SidfScore eval_score)
 {
     assert(SIDF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
-    ++(self->include_depth);
-    SidfScore eval_score = SidfRequest_checkHost(self, term->querydomain);
-    --(self->include_depth);
     switch (eval_score) {
     case SIDF_SCORE_PASS:
         return SidfRequest_getScoreByQualifier(term->qualifier);
@@ -394,7 +539,7 @@ SidfRequest_evalMechInclude(SidfRequest *self, const SidfTerm *term)
     default:
         abort();
     }   // end switch
-}   // end function : SidfRequest_evalMechInclude
+}   // end function : SidfRequest_mapIncludeScore
 
 /*
  * "a" メカニズムと "mx" メカニズムの共通部分を実装する関数
@@ -408,8 +553,8 @@ SidfRequest_evalByALookup(SidfRequest *self, const char *domain, const SidfTerm
         DnsAResponse *resp4;
         int query4_stat = DnsResolver_lookupA(self->resolver, domain, &resp4);
         if (NETDB_SUCCESS != query4_stat) {
-            LogDnsError("DNS lookup failure: rrtype=a, domain=%s, err=%s", domain,
-                        DnsResolver_getErrorString(self->resolver));
+            LogDnsLookupError(query4_stat, "DNS lookup failure: rrtype=a, domain=%s, err=%s",
+                              domain, DnsResolver_getErrorString(self->resolver));
             return SidfRequest_mapMechDnsResponseToSidfScore(query4_stat);
         }   // end if
 
@@ -426,8 +571,8 @@ SidfRequest_evalByALookup(SidfRequest *self, const char *domain, const SidfTerm
         DnsAaaaResponse *resp6;
         int query6_stat = DnsResolver_lookupAaaa(self->resolver, domain, &resp6);
         if (NETDB_SUCCESS != query6_stat) {
-            LogDnsError("DNS lookup failure: rrtype=aaaa, domain=%s, err=%s", domain,
-                        DnsResolver_getErrorString(self->resolver));
+            LogDnsLookupError(query6_stat, "DNS lookup failure: rrtype=aaaa, domain=%s, err=%s",
+                              domain, DnsResolver_getErrorString(self->resolver));
             return SidfRequest_mapMechDnsResponseToSidfScore(query6_stat);
         }   // end if
 
@@ -455,16 +600,49 @@ SidfRequest_evalMechA(SidfRequest *self, const SidfTerm *term)
     return SidfRequest_evalByALookup(self, domain, term);
 }   // end function : SidfRequest_evalMechA
 
+/*
+ * "mx", "ptr" メカニズムで検証するドメイン名の A/AAAA レコードをまとめて並行に問い合わせておく.
+ * 照合は従来通りドメイン名の順に 1 つずつおこなうので, 評価結果と問い合わせるドメイン名の数の
+ * 上限は 1 つずつ問い合わせる場合と変わらない. 最初のドメイン名でマッチした場合も
+ * 残りの問い合わせは済んでいるので, 上限を越えない範囲で余分に問い合わせることになる.
+ * 並行に問い合わせるのは DNSRESOLV_PREFETCH_MAXNUM 個までで, 越える分は照合の際に問い合わせる.
+ * @param view 問い合わせるドメイン名を先頭から limit 個まで取り出す.
+ * @param domain NULL でない場合, このドメイン名で終わるものだけを問い合わせる.
+ */
+static void
+SidfRequest_prefetchAddress(SidfRequest *self, DnsRrView view, size_t limit, const char *domain)
+{
+    if (limit < 2) {
+        return;
+    }   // end if
+    if (DNSRESOLV_PREFETCH_MAXNUM < limit) {
+        limit = DNSRESOLV_PREFETCH_MAXNUM;
+    }   // end if
+    DnsQuestion questions[DNSRESOLV_PREFETCH_MAXNUM];
+    int rrtype = (AF_INET6 == self->sin_family) ? ns_t_aaaa : ns_t_a;
+    size_t num = 0;
+    for (size_t n = 0; n < limit; ++n) {
+        const char *name = DnsRrView_next(&view);
+        if (NULL != domain && !InetDomain_isParent(domain, name)) {
+            continue;
+        }   // end if
+        questions[num].domain = name;
+        questions[num].rrtype = rrtype;
+        ++num;
+    }   // end for
+    (void) DnsResolver_prefetch(self->resolver, questions, num);
+}   // end function : SidfRequest_prefetchAddress
+
 static SidfScore
 SidfRequest_evalMechMx(SidfRequest *self, const SidfTerm *term)
 {
     assert(SIDF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
     const char *domain = SidfRequest_getTargetName(self, term);
-    DnsMxResponse *respmx;
-    int mxquery_stat = DnsResolver_lookupMx(self->resolver, domain, &respmx);
+    DnsRrView mxview;
+    int mxquery_stat = DnsResolver_viewMx(self->resolver, domain, &mxview);
     if (NETDB_SUCCESS != mxquery_stat) {
-        LogDnsError("DNS lookup failure: rrtype=mx, domain=%s, err=%s", domain,
-                    DnsResolver_getErrorString(self->resolver));
+        LogDnsLookupError(mxquery_stat, "DNS lookup failure: rrtype=mx, domain=%s, err=%s",
+                          domain, DnsResolver_getErrorString(self->resolver));
         return SidfRequest_mapMechDnsResponseToSidfScore(mxquery_stat);
     }   // end if
 
@@ -477,14 +655,14 @@ SidfRequest_evalMechMx(SidfRequest *self, const SidfTerm *term)
      * evaluation of an "mx" mechanism (see Section 10).  If any address
      * matches, the mechanism matches.
      */
-    for (size_t n = 0; n < MIN(respmx->num, self->policy->max_mxrr_per_mxmech); ++n) {
-        SidfScore score = SidfRequest_evalByALookup(self, respmx->exchange[n]->domain, term);
+    size_t mx_num = MIN(mxview.num, self->policy->max_mxrr_per_mxmech);
+    SidfRequest_prefetchAddress(self, mxview, mx_num, NULL);
+    for (size_t n = 0; n < mx_num; ++n) {
+        SidfScore score = SidfRequest_evalByALookup(self, DnsRrView_next(&mxview), term);
         if (SIDF_SCORE_NULL != score) {
-            DnsMxResponse_free(respmx);
             return score;
         }   // end if
     }   // end for
-    DnsMxResponse_free(respmx);
     return SIDF_SCORE_NULL;
 }   // end function : SidfRequest_evalMechMx
 
@@ -502,8 +680,8 @@ SidfRequest_evalMechPtrValidate4(SidfRequest *self, const SidfTerm *term, const
          * mechanism fails to match.  If a DNS error occurs while doing an A RR
          * lookup, then that domain name is skipped and the search continues.
          */
-        LogDnsError("DNS lookup failure (ignored): rrtype=a, domain=%s, err=%s", revdomain,
-                    DnsResolver_getErrorString(self->resolver));
+        LogDnsLookupError(query_stat, "DNS lookup failure (ignored): rrtype=a, domain=%s, err=%s",
+                          revdomain, DnsResolver_getErrorString(self->resolver));
         return SIDF_SCORE_NULL;
     }   // end if
     for (size_t m = 0; m < resp->num; ++m) {
@@ -536,8 +714,9 @@ SidfRequest_evalMechPtrValidate6(SidfRequest *self, const SidfTerm *term, const
     DnsAaaaResponse *resp;
     int query_stat = DnsResolver_lookupAaaa(self->resolver, revdomain, &resp);
     if (NETDB_SUCCESS != query_stat) {
-        LogDnsError("DNS lookup failure (ignored): rrtype=aaaa, domain=%s, err=%s", revdomain,
-                    DnsResolver_getErrorString(self->resolver));
+        LogDnsLookupError(query_stat,
+                          "DNS lookup failure (ignored): rrtype=aaaa, domain=%s, err=%s",
+                          revdomain, DnsResolver_getErrorString(self->resolver));
         return SIDF_SCORE_NULL;
     }   // end if
     for (size_t m = 0; m < resp->num; ++m) {
@@ -555,9 +734,9 @@ SidfRequest_evalMechPtr(SidfRequest *self, const SidfTerm *term)
 {
     assert(SIDF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
     const char *domain = SidfRequest_getTargetName(self, term);
-    DnsPtrResponse *respptr;
+    DnsRrView ptrview;
     int ptrquery_stat =
-        DnsResolver_lookupPtr(self->resolver, self->sin_family, &(self->ipaddr), &respptr);
+        DnsResolver_viewPtr(self->resolver, self->sin_family, &(self->ipaddr), &ptrview);
     if (NETDB_SUCCESS != ptrquery_stat) {
         /*
          * "ptr" メカニズムの評価中に PTR レコードのルックアップでエラーが発生した場合,
@@ -569,8 +748,9 @@ SidfRequest_evalMechPtr(SidfRequest *self, const SidfTerm *term)
          */
         char addrbuf[INET6_ADDRSTRLEN];
         (void) inet_ntop(self->sin_family, &(self->ipaddr), addrbuf, sizeof(addrbuf));
-        LogDnsError("DNS lookup failure (ignored): rrtype=ptr, ipaddr=%s, err=%s", addrbuf,
-                    DnsResolver_getErrorString(self->resolver));
+        LogDnsLookupError(ptrquery_stat,
+                          "DNS lookup failure (ignored): rrtype=ptr, ipaddr=%s, err=%s",
+                          addrbuf, DnsResolver_getErrorString(self->resolver));
         return SIDF_SCORE_NULL;
     }   // end if
 
@@ -585,30 +765,31 @@ SidfRequest_evalMechPtr(SidfRequest *self, const SidfTerm *term)
      * a "ptr" mechanism (see Section 10).  If <ip> is among the returned IP
      * addresses, then that domain name is validated.
      */
-    for (size_t n = 0; n < MIN(respptr->num, self->policy->max_ptrrr_per_ptrmech); ++n) {
+    size_t ptr_num = MIN(ptrview.num, self->policy->max_ptrrr_per_ptrmech);
+    SidfRequest_prefetchAddress(self, ptrview, ptr_num, domain);
+    for (size_t n = 0; n < ptr_num; ++n) {
+        const char *ptrdomain = DnsRrView_next(&ptrview);
         // アルゴリズムをよく読むと validated domain が <target-name> で終わっているかどうかの判断を
         // 先におこなった方が DNS ルックアップの回数が少なくて済む場合があることがわかる.
-        if (!InetDomain_isParent(domain, respptr->domain[n])) {
+        if (!InetDomain_isParent(domain, ptrdomain)) {
             continue;
         }   // end if
 
         SidfScore score;
         switch (self->sin_family) {
         case AF_INET:
-            score = SidfRequest_evalMechPtrValidate4(self, term, respptr->domain[n]);
+            score = SidfRequest_evalMechPtrValidate4(self, term, ptrdomain);
             break;
         case AF_INET6:
-            score = SidfRequest_evalMechPtrValidate6(self, term, respptr->domain[n]);
+            score = SidfRequest_evalMechPtrValidate6(self, term, ptrdomain);
             break;
         default:
             abort();
         }   // end switch
         if (SIDF_SCORE_NULL != score) {
-            DnsPtrResponse_free(respptr);
             return score;
         }   // end if
     }   // end for
-    DnsPtrResponse_free(respptr);
     return SIDF_SCORE_NULL;
 }   // end function : SidfRequest_evalMechPtr
 
@@ -630,6 +811,36 @@ SidfRequest_evalMechIp6(SidfRequest *self, const SidfTerm *term)
         ? SidfRequest_getScoreByQualifier(term->qualifier) : SIDF_SCORE_NULL;
 }   // end function : SidfRequest_evalMechIp6
 
+/*
+ * 連続する ip4/ip6 メカニズムをまとめて評価する.
+ * @param matched マッチした場合に, マッチした directive のうち最も前にあるものの番号を受け取る.
+ * @return いずれかにマッチした場合は true.
+ */
+static bool
+SidfRequest_evalCidrRun(const SidfRequest *self, const SidfCidrRun *run, unsigned int *matched)
+{
+    int found = -1;
+    switch (self->sin_family) {
+    case AF_INET:
+        if (NULL != run->trie4) {
+            found = SidfCidrTrie_lookup(run->trie4, &(self->ipaddr.addr4));
+        }   // end if
+        break;
+    case AF_INET6:
+        if (NULL != run->trie6) {
+            found = SidfCidrTrie_lookup(run->trie6, &(self->ipaddr.addr6));
+        }   // end if
+        break;
+    default:
+        break;
+    }   // end switch
+    if (0 > found) {
+        return false;
+    }   // end if
+    *matched = (unsigned int) found;
+    return true;
+}   // end function : SidfRequest_evalCidrRun
+
 static SidfScore
 SidfRequest_evalMechExists(SidfRequest *self, const SidfTerm *term)
 {
@@ -637,8 +848,8 @@ SidfRequest_evalMechExists(SidfRequest *self, const SidfTerm *term)
     DnsAResponse *resp;
     int aquery_stat = DnsResolver_lookupA(self->resolver, term->querydomain, &resp);
     if (NETDB_SUCCESS != aquery_stat) {
-        LogDnsError("DNS lookup failure: rrtype=a, domain=%s, err=%s", term->querydomain,
-                    DnsResolver_getErrorString(self->resolver));
+        LogDnsLookupError(aquery_stat, "DNS lookup failure: rrtype=a, domain=%s, err=%s",
+                          term->querydomain, DnsResolver_getErrorString(self->resolver));
         return SidfRequest_mapMechDnsResponseToSidfScore(aquery_stat);
     }   // end if
 
@@ -647,27 +858,6 @@ SidfRequest_evalMechExists(SidfRequest *self, const SidfTerm *term)
     return (0 < num) ? SidfRequest_getScoreByQualifier(term->qualifier) : SIDF_SCORE_NULL;
 }   // end function : SidfRequest_evalMechExists
 
-static SidfScore
-SidfRequest_evalModRedirect(SidfRequest *self, const SidfTerm *term)
-{
-    assert(SIDF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
-    SidfScore incr_stat = SidfRequest_incrementDnsMechCounter(self);
-    if (SIDF_SCORE_NULL != incr_stat) {
-        return incr_stat;
-    }   // end if
-    ++(self->redirect_depth);
-    SidfScore eval_score = SidfRequest_checkHost(self, term->querydomain);
-    --(self->redirect_depth);
-    /*
-     * [RFC4408] 6.1.
-     * The result of this new evaluation of check_host() is then considered
-     * the result of the current evaluation with the exception that if no
-     * SPF record is found, or if the target-name is malformed, the result
-     * is a "PermError" rather than "None".
-     */
-    return SIDF_SCORE_NONE == eval_score ? SIDF_SCORE_PERMERROR : eval_score;
-}   // end function : SidfRequest_evalModRedirect
-
 static SidfStat
 SidfRequest_evalModExplanation(SidfRequest *self, const SidfTerm *term)
 {
@@ -681,22 +871,20 @@ SidfRequest_evalModExplanation(SidfRequest *self, const SidfTerm *term)
 
     assert(SIDF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
 
-    DnsTxtResponse *resp;
-    int txtquery_stat = DnsResolver_lookupTxt(self->resolver, term->querydomain, &resp);
+    // explanation の展開中に引く可能性があるのは PTR RR だけなので, 文字列は展開の間有効
+    DnsRrView txtview;
+    int txtquery_stat = DnsResolver_viewTxt(self->resolver, term->querydomain, &txtview);
     if (NETDB_SUCCESS != txtquery_stat) {
-        LogDnsError("DNS lookup failure: rrtype=txt, domain=%s, err=%s", term->querydomain,
-                    DnsResolver_getErrorString(self->resolver));
+        LogDnsLookupError(txtquery_stat, "DNS lookup failure: rrtype=txt, domain=%s, err=%s",
+                          term->querydomain, DnsResolver_getErrorString(self->resolver));
         return SIDF_STAT_OK;
     }   // end if
 
-    if (1 != resp->num) {
-        DnsTxtResponse_free(resp);
+    if (1 != txtview.num) {
         return SIDF_STAT_OK;
     }   // end if
 
-    SidfStat expand_stat = SidfRequest_setExplanation(self, term->querydomain, resp->data[0]);
-    DnsTxtResponse_free(resp);
-    return expand_stat;
+    return SidfRequest_setExplanation(self, term->querydomain, DnsRrView_next(&txtview));
 }   // end function : SidfRequest_evalModExplanation
 
 static SidfScore
@@ -714,9 +902,7 @@ SidfRequest_evalMechanism(SidfRequest *self, const SidfTerm *term)
 
     switch (term->attr->type) {
     case SIDF_TERM_MECH_ALL:
-        return SidfRequest_evalMechAll(self, term);
-    case SIDF_TERM_MECH_INCLUDE:
-        return SidfRequest_evalMechInclude(self, term);
+        return SidfRequest_evalMechAll(self, term, SidfRequest_getDomain(self));
     case SIDF_TERM_MECH_A:
         return SidfRequest_evalMechA(self, term);
     case SIDF_TERM_MECH_MX:
@@ -729,6 +915,8 @@ SidfRequest_evalMechanism(SidfRequest *self, const SidfTerm *term)
         return SidfRequest_evalMechIp6(self, term);
     case SIDF_TERM_MECH_EXISTS:
         return SidfRequest_evalMechExists(self, term);
+    case SIDF_TERM_MECH_INCLUDE:
+        // "include" は評価スタックにフレームを積んで評価するので, ここには来ない
     default:
         abort();
     }   // end switch
@@ -772,52 +960,264 @@ SidfRequest_checkDomain(const SidfRequest *self, const char *domain)
     return SIDF_SCORE_NULL;
 }   // end function : SidfRequest_checkDomain
 
+/*
+ * include の木に加えてよいドメイン名か.
+ * ループの検出を除いて SidfRequest_checkDomain() と同じ条件で判定する. ログは出力しない.
+ */
+static bool
+SidfRequest_isValidTreeDomain(const SidfRequest *self, const char *domain)
+{
+    size_t domain_len = strlen(domain);
+    if (self->policy->max_domain_len < domain_len) {
+        return false;
+    }   // end if
+    const char *p;
+    const char *domain_tail = domain + domain_len;
+    XSkip_dotAtomText(domain, domain_tail, &p);
+    XSkip_char(p, domain_tail, '.', &p);
+    return domain_tail == p;
+}   // end function : SidfRequest_isValidTreeDomain
+
+/*
+ * SidfRecordCache に載っているレコードだけを使って, domain を根とする include の部分木を組み立てる.
+ * ip4, ip6, all, include 以外のメカニズムや "redirect=" modifier を含むレコード,
+ * キャッシュに載っていないレコード, ループを形成する include を含む場合は組み立てない.
+ * @param path 木の根からこのノードの親までのドメイン名.
+ * @return 組み立てたノード, 組み立てられなかった場合は NULL.
+ */
+static SidfIncludeNode *
+SidfRequest_assembleIncludeNode(const SidfRequest *self, SidfIncludeTree *tree,
+                                const char *domain, StrArray *path)
+{
+    if (!SidfRequest_isValidTreeDomain(self, domain)
+        || 0 <= StrArray_linearSearchIgnoreCase(path, domain)) {
+        return NULL;
+    }   // end if
+    unsigned long ttl = 0;
+    SidfRecord *record =
+        SidfRecordCache_lookup(self->policy->record_cache, domain, self->scope, &ttl);
+    if (NULL == record) {
+        return NULL;
+    }   // end if
+    SidfIncludeNode *node = NULL;
+    if (NULL != record->modifiers.rediect) {
+        goto finally;
+    }   // end if
+    node = SidfIncludeTree_addNode(tree, domain, record);
+    if (NULL == node) {
+        goto finally;
+    }   // end if
+    // 木の有効期限は最も早く切れるレコードに合わせる
+    if (tree->root == node || ttl < tree->ttl) {
+        tree->ttl = ttl;
+    }   // end if
+    if (0 > StrArray_append(path, domain)) {
+        node = NULL;
+        goto finally;
+    }   // end if
+
+    size_t directive_num = PtrArray_getCount(record->directives);
+    for (size_t n = 0; n < directive_num && NULL != node; ++n) {
+        const SidfTerm *term = PtrArray_get(record->directives, n);
+        switch (term->attr->type) {
+        case SIDF_TERM_MECH_ALL:
+        case SIDF_TERM_MECH_IP4:
+        case SIDF_TERM_MECH_IP6:
+            break;
+        case SIDF_TERM_MECH_INCLUDE:
+            // 評価時には実際に評価した数を数えるが, 全体で上限を越える木はそもそも組み立てない.
+            // ドメイン名の表記の違いによって検出できないループもここで止まる.
+            if (self->policy->max_dns_mech < ++(tree->include_num)) {
+                node = NULL;
+                break;
+            }   // end if
+            node->child[n] = SidfRequest_assembleIncludeNode(self, tree, term->querydomain, path);
+            if (NULL == node->child[n]) {
+                node = NULL;
+            }   // end if
+            break;
+        default:
+            // DNS ルックアップの結果が IP アドレスによって変わるメカニズムは扱わない
+            node = NULL;
+            break;
+        }   // end switch
+    }   // end for
+    StrArray_unappend(path);
+
+  finally:
+    SidfRecord_free(record);
+    return node;
+}   // end function : SidfRequest_assembleIncludeNode
+
+/*
+ * domain を根とする include の木を組み立てる.
+ * @return 組み立てた木, 組み立てられなかった場合は NULL.
+ */
+static SidfIncludeTree *
+SidfRequest_assembleIncludeTree(const SidfRequest *self, const char *domain)
+{
+    SidfIncludeTree *tree = SidfIncludeTree_new();
+    if (NULL == tree) {
+        return NULL;
+    }   // end if
+    StrArray *path = StrArray_new(0);
+    if (NULL == path) {
+        SidfIncludeTree_free(tree);
+        return NULL;
+    }   // end if
+    if (NULL == SidfRequest_assembleIncludeNode(self, tree, domain, path)) {
+        SidfIncludeTree_free(tree);
+        tree = NULL;
+    }   // end if
+    StrArray_free(path);
+    return tree;
+}   // end function : SidfRequest_assembleIncludeTree
+
+/*
+ * include の木のノードを評価する. DNS を引かずに check_host() と同じ結果を得る.
+ * @param include_count 評価した include メカニズムの数を加算する.
+ */
 static SidfScore
-SidfRequest_evalDirectives(SidfRequest *self, const PtrArray *directives)
+SidfRequest_evalIncludeNode(SidfRequest *self, const SidfIncludeNode *node,
+                            unsigned int *include_count)
 {
-    const char *domain = SidfRequest_getDomain(self);
-    unsigned int directive_num = PtrArray_getCount(directives);
-    for (unsigned int i = 0; i < directive_num; ++i) {
-        SidfTerm *term = PtrArray_get(directives, i);
-        SidfScore eval_score = SidfRequest_evalMechanism(self, term);
+    const SidfRecord *record = node->record;
+    unsigned int directive_num = PtrArray_getCount(record->directives);
+    unsigned int cidr_run_index = 0;
+    for (unsigned int n = 0; n < directive_num; ++n) {
+        if (cidr_run_index < record->cidr_run_num && record->cidr_run[cidr_run_index].begin == n) {
+            const SidfCidrRun *run = &(record->cidr_run[cidr_run_index++]);
+            unsigned int matched;
+            if (SidfRequest_evalCidrRun(self, run, &matched)) {
+                const SidfTerm *matched_term = PtrArray_get(record->directives, matched);
+                return SidfRequest_getScoreByQualifier(matched_term->qualifier);
+            }   // end if
+            n = run->end - 1;
+            continue;
+        }   // end if
+        const SidfTerm *term = PtrArray_get(record->directives, n);
+        SidfScore eval_score;
+        switch (term->attr->type) {
+        case SIDF_TERM_MECH_INCLUDE:
+            ++(*include_count);
+            eval_score = SidfRequest_mapIncludeScore(term,
+                                                     SidfRequest_evalIncludeNode(self,
+                                                                                 node->child[n],
+                                                                                 include_count));
+            break;
+        case SIDF_TERM_MECH_ALL:
+            eval_score = SidfRequest_evalMechAll(self, term, node->domain);
+            break;
+        default:
+            eval_score = SidfRequest_evalMechanism(self, term);
+            break;
+        }   // end switch
         if (SIDF_SCORE_NULL != eval_score) {
-            LogSidfDebug("mechanism match: domain=%s, mech%02u=%s, score=%s", domain, i,
-                         term->attr->name, SidfEnum_lookupScoreByValue(eval_score));
             return eval_score;
         }   // end if
-        LogSidfDebug("mechanism not match: domain=%s, mech_no=%u, mech=%s", domain, i,
-                     term->attr->name);
+    }   // end for
+    // 木のレコードは "redirect=" を持たず, include の内側ではローカルポリシーも評価しない
+    return SIDF_SCORE_NEUTRAL;
+}   // end function : SidfRequest_evalIncludeNode
+
+/*
+ * "include" メカニズムを解決済みの include の木で評価する.
+ * 木が見つからなければ SidfRecordCache に載っているレコードから組み立てる.
+ * @param eval_score "include" メカニズムの評価結果を受け取る.
+ * @return 木で評価した場合は true. 木が使えない場合は false を返すので, 通常の評価をおこなうこと.
+ */
+static bool
+SidfRequest_evalIncludeTree(SidfRequest *self, const SidfTerm *term, SidfScore *eval_score)
+{
+    SidfRecordCache *record_cache = self->policy->record_cache;
+    if (!self->policy->flatten_include || NULL == record_cache) {
+        return false;
+    }   // end if
+    unsigned long ttl;
+    SidfIncludeTree *tree =
+        SidfRecordCache_lookupTree(record_cache, term->querydomain, self->scope, &ttl);
+    if (NULL == tree) {
+        tree = SidfRequest_assembleIncludeTree(self, term->querydomain);
+        if (NULL == tree) {
+            return false;
+        }   // end if
+        LogSidfDebug("include tree assembled: domain=%s, records=%u, ttl=%lu",
+                     term->querydomain, (unsigned int) PtrArray_getCount(tree->node), tree->ttl);
+        SidfRecordCache_storeTree(record_cache, term->querydomain, self->scope, tree);
+        ttl = tree->ttl;
     }   // end if
-    return SIDF_SCORE_NULL;
-}   // end function : SidfRequest_evalDirectives
 
-static SidfScore
-SidfRequest_evalLocalPolicy(SidfRequest *self)
+    // 評価中のドメインが木に含まれている場合はループを形成しているので, 通常の評価で検出させる
+    bool evaluated = false;
+    size_t domain_num = StrArray_getCount(self->domain);
+    for (size_t n = 0; n < domain_num; ++n) {
+        if (0 <= StrArray_linearSearchIgnoreCase(tree->domain, StrArray_get(self->domain, n))) {
+            goto finally;
+        }   // end if
+    }   // end for
+
+    SidfRequest_updateMinTtl(self, ttl);
+    unsigned int include_count = 0;
+    SidfScore tree_score = SidfRequest_evalIncludeNode(self, tree->root, &include_count);
+    LogSidfDebug("include tree evaluated: domain=%s, includes=%u, score=%s", term->querydomain,
+                 include_count, SidfEnum_lookupScoreByValue(tree_score));
+    /*
+     * 木の内側で評価した "include" も DNS ルックアップを伴うメカニズムとして数える.
+     * 途中で上限を越えた場合, 通常の評価ではその時点の PermError が呼び出し元まで伝わるので,
+     * 評価し終えてからまとめて判定しても結果は変わらない.
+     */
+    self->dns_mech_count += include_count;
+    if (self->policy->max_dns_mech < self->dns_mech_count) {
+        LogPermFail("over %d mechanisms with dns look up evaluated: sender=%s, domain=%s",
+                    self->policy->max_dns_mech, InetMailbox_getDomain(self->sender),
+                    term->querydomain);
+        *eval_score = SIDF_SCORE_PERMERROR;
+    } else {
+        *eval_score = SidfRequest_mapIncludeScore(term, tree_score);
+    }   // end if
+    evaluated = true;
+
+  finally:
+    SidfIncludeTree_free(tree);
+    return evaluated;
+}   // end function : SidfRequest_evalIncludeTree
+
+/*
+ * ローカルポリシーのレコードを構築する.
+ * @return ローカルポリシーを評価する場合は SIDF_STAT_OK,
+ *         評価しない場合 (設定されていない場合, 構築に失敗した場合など) は SIDF_STAT_OK 以外.
+ */
+static SidfStat
+SidfRequest_buildLocalPolicy(SidfRequest *self, SidfRecord **record)
 {
     // 再帰評価 (include や redirect) の内側にいない場合のみ, ローカルポリシーの評価をおこなう
     if (0 < SidfRequest_getDepth(self) || NULL == self->policy->local_policy
         || self->local_policy_mode) {
-        return SIDF_SCORE_NULL;
+        return SIDF_STAT_RECORD_NOT_MATCH;
     }   // end if
 
     LogSidfDebug("evaluating local policy: policy=%s", self->policy->local_policy);
-    // SPF/SIDF 評価過程で遭遇した DNS をひくメカニズムのカウンタをクリア
-    SidfRecord *local_policy_record = NULL;
+    if (NULL != self->policy->local_policy_record) {
+        // 事前にパースしておいたものを使う
+        *record = SidfRecord_ref(self->policy->local_policy_record);
+        return SIDF_STAT_OK;
+    }   // end if
+    if (SidfMacro_hasSenderOrTimeMacro(self->policy->local_policy,
+                                       STRTAIL(self->policy->local_policy))) {
+        self->sender_dependent = true;
+    }   // end if
     SidfStat build_stat = SidfRecord_build(self, self->scope, self->policy->local_policy,
-                                           STRTAIL(self->policy->local_policy),
-                                           &local_policy_record);
+                                           STRTAIL(self->policy->local_policy), record);
     if (SIDF_STAT_OK != build_stat) {
         LogConfigError("failed to build local policy record: policy=%s",
                        self->policy->local_policy);
-        return SIDF_SCORE_NULL;
     }   // end if
-    self->dns_mech_count = 0;   // 本物のレコード評価中に遭遇した DNS ルックアップを伴うメカニズムの数は忘れる
-    self->local_policy_mode = true; // ローカルポリシー評価中に, さらにローカルポリシーを適用して無限ループに入らないようにフラグを立てる.
-    SidfScore local_policy_score =
-        SidfRequest_evalDirectives(self, local_policy_record->directives);
-    self->local_policy_mode = false;
-    SidfRecord_free(local_policy_record);
+    return build_stat;
+}   // end function : SidfRequest_buildLocalPolicy
 
+static SidfScore
+SidfRequest_mapLocalPolicyScore(SidfScore local_policy_score)
+{
     switch (local_policy_score) {
     case SIDF_SCORE_PERMERROR:
     case SIDF_SCORE_TEMPERROR:
@@ -830,113 +1230,611 @@ SidfRequest_evalLocalPolicy(SidfRequest *self)
                      SidfEnum_lookupScoreByValue(local_policy_score));
         return local_policy_score;
     }   // end switch
-}   // end function : SidfRequest_evalLocalPolicy
+}   // end function : SidfRequest_mapLocalPolicyScore
 
-static SidfScore
-SidfRequest_checkHost(SidfRequest *self, const char *domain)
+/*
+ * 直前の呼び出し以降, リゾルバが応答待ち (DNS_STAT_PENDING) を返したかを調べる.
+ */
+static bool
+SidfRequest_isDeferred(const SidfRequest *self, unsigned long deferred_count)
+{
+    return deferred_count != DnsResolver_getDeferredCount(self->resolver);
+}   // end function : SidfRequest_isDeferred
+
+static SidfFrame *
+SidfRequest_getFrame(SidfRequest *self)
+{
+    assert(0 < self->frame_num);
+    return &(self->frame[self->frame_num - 1]);
+}   // end function : SidfRequest_getFrame
+
+/*
+ * 評価スタックにフレームを積む. check_host() 関数の呼び出しに相当する.
+ */
+static SidfStat
+SidfRequest_pushFrame(SidfRequest *self, SidfFrameKind kind, const char *domain)
 {
-    // check <domain> parameter
-    SidfScore precond_score = SidfRequest_checkDomain(self, domain);
-    if (SIDF_SCORE_NULL != precond_score) {
-        return precond_score;
+    if (self->frame_capacity <= self->frame_num) {
+        unsigned int newcapacity = self->frame_capacity + SIDF_REQUEST_FRAME_GROWTH;
+        SidfFrame *newframe = (SidfFrame *) realloc(self->frame, newcapacity * sizeof(SidfFrame));
+        if (NULL == newframe) {
+            LogNoResource();
+            return SIDF_STAT_NO_RESOURCE;
+        }   // end if
+        self->frame = newframe;
+        self->frame_capacity = newcapacity;
     }   // end if
+    SidfFrame *frame = &(self->frame[self->frame_num++]);
+    memset(frame, 0, sizeof(SidfFrame));
+    frame->kind = kind;
+    frame->stage = SIDF_FRAME_STAGE_CHECK_DOMAIN;
+    frame->domain = domain;
+    frame->domain_pushed = false;
+    frame->record = NULL;
+    frame->local_policy_record = NULL;
+    frame->returned = false;
+    return SIDF_STAT_OK;
+}   // end function : SidfRequest_pushFrame
 
-    // register <domain> parameter
-    SidfStat push_stat = SidfRequest_pushDomain(self, domain);
-    if (SIDF_STAT_OK != push_stat) {
-        return SIDF_SCORE_SYSERROR;
+/*
+ * "include" メカニズム, "redirect=" modifier の評価のため, 子フレームを積む.
+ * 子フレームの評価結果は, 子フレームから復帰した際に親フレームの callee_score にセットされる.
+ */
+static void
+SidfRequest_callFrame(SidfRequest *self, SidfFrameKind kind, const char *domain)
+{
+    if (SIDF_STAT_OK != SidfRequest_pushFrame(self, kind, domain)) {
+        // 子フレームが SIDF_SCORE_SYSERROR を返したものとして扱う
+        SidfFrame *frame = SidfRequest_getFrame(self);
+        frame->returned = true;
+        frame->callee_score = SIDF_SCORE_SYSERROR;
+        return;
+    }   // end if
+    if (SIDF_FRAME_KIND_INCLUDE == kind) {
+        ++(self->include_depth);
+    } else {
+        ++(self->redirect_depth);
     }   // end if
+}   // end function : SidfRequest_callFrame
 
-    SidfRecord *record = NULL;
-    SidfScore lookup_score = SidfRequest_lookupRecord(self, SidfRequest_getDomain(self), &record);
-    if (SIDF_SCORE_NULL != lookup_score) {
+/*
+ * フレームの評価を終え, 評価スタックから降ろす. check_host() 関数からの復帰に相当する.
+ * 最も外側のフレームだった場合は評価全体の結果として score にセットする.
+ */
+static void
+SidfRequest_returnFrame(SidfRequest *self, SidfScore eval_score, SidfScore *score)
+{
+    SidfFrame *frame = SidfRequest_getFrame(self);
+    if (frame->domain_pushed) {
         SidfRequest_popDomain(self);
-        return lookup_score;
     }   // end if
+    if (NULL != frame->record) {
+        SidfRecord_free(frame->record);
+    }   // end if
+    if (NULL != frame->local_policy_record) {
+        SidfRecord_free(frame->local_policy_record);
+        self->local_policy_mode = false;
+    }   // end if
+    SidfFrameKind kind = frame->kind;
+    --(self->frame_num);
 
-    // mechanism evaluation
-    SidfScore eval_score = SidfRequest_evalDirectives(self, record->directives);
-    if (SIDF_SCORE_NULL != eval_score) {
-        /*
-         * SidfPolicy で "exp=" を取得するようの指定されている場合に "exp=" を取得する.
-         * ただし, 以下の点に注意する:
-         * - include メカニズム中の exp= は評価しない.
-         * - redirect 評価中に元のドメインの exp= は評価しない.
-         * [RFC4408] 6.2.
-         * Note: During recursion into an "include" mechanism, an exp= modifier
-         * from the <target-name> MUST NOT be used.  In contrast, when executing
-         * a "redirect" modifier, an exp= modifier from the original domain MUST
-         * NOT be used.
-         *
-         * <target-name> は メカニズムの引数で指定されている <domain-spec>,
-         * 指定されていない場合は check_host() 関数の <domain>.
-         * [RFC4408] 4.8.
-         * Several of these mechanisms and modifiers have a <domain-spec>
-         * section.  The <domain-spec> string is macro expanded (see Section 8).
-         * The resulting string is the common presentation form of a fully-
-         * qualified DNS name: a series of labels separated by periods.  This
-         * domain is called the <target-name> in the rest of this document.
-         */
+    if (0 == self->frame_num) {
+        *score = eval_score;
+        return;
+    }   // end if
+    if (SIDF_FRAME_KIND_INCLUDE == kind) {
+        --(self->include_depth);
+    } else {
+        --(self->redirect_depth);
+    }   // end if
+    SidfFrame *caller = SidfRequest_getFrame(self);
+    caller->returned = true;
+    caller->callee_score = eval_score;
+}   // end function : SidfRequest_returnFrame
+
+/*
+ * 評価スタックを空にする.
+ */
+static void
+SidfRequest_clearFrames(SidfRequest *self)
+{
+    for (unsigned int n = 0; n < self->frame_num; ++n) {
+        if (NULL != self->frame[n].record) {
+            SidfRecord_free(self->frame[n].record);
+        }   // end if
+        if (NULL != self->frame[n].local_policy_record) {
+            SidfRecord_free(self->frame[n].local_policy_record);
+        }   // end if
+    }   // end for
+    self->frame_num = 0;
+    self->local_policy_mode = false;
+    self->redirect_depth = 0;
+    self->include_depth = 0;
+    if (NULL != self->domain) {
+        StrArray_reset(self->domain);
+    }   // end if
+}   // end function : SidfRequest_clearFrames
+
+/*
+ * directive の評価によってスコアが決定した, または全ての directive にマッチしなかった場合の処理.
+ * @param eval_score directive の評価によって決定したスコア. どれにもマッチしなかった場合は SIDF_SCORE_NULL.
+ */
+static void
+SidfRequest_finishDirectives(SidfRequest *self, SidfFrame *frame, SidfScore eval_score,
+                             SidfScore *score)
+{
+    if (SIDF_FRAME_STAGE_LOCAL_POLICY == frame->stage) {
+        self->local_policy_mode = false;
+        SidfRecord_free(frame->local_policy_record);
+        frame->local_policy_record = NULL;
+        eval_score = SidfRequest_mapLocalPolicyScore(eval_score);
+        if (SIDF_SCORE_NULL == eval_score) {
+            frame->stage = SIDF_FRAME_STAGE_DEFAULT;
+            return;
+        }   // end if
+        // exp= を評価する条件は directive によってスコアが決定する場合とほぼ同じ.
+        // 違いは local_policy_explanation を使用する点.
         if (self->policy->lookup_exp && SIDF_SCORE_HARDFAIL == eval_score
-            && 0 == self->include_depth && NULL != record->modifiers.exp) {
-            (void) SidfRequest_evalModExplanation(self, record->modifiers.exp);
+            && 0 == self->include_depth && NULL != self->policy->local_policy_explanation) {
+            frame->score = eval_score;
+            frame->stage = SIDF_FRAME_STAGE_LOCAL_POLICY_EXPLANATION;
+            return;
         }   // end if
-        goto finally;
+        SidfRequest_returnFrame(self, eval_score, score);
+        return;
+    }   // end if
+
+    if (SIDF_SCORE_NULL == eval_score) {
+        /*
+         * レコード中の全てのメカニズムにマッチしなかった場合
+         * [RFC4408] 4.7.
+         * If none of the mechanisms match and there is no "redirect" modifier,
+         * then the check_host() returns a result of "Neutral", just as if
+         * "?all" were specified as the last directive.  If there is a
+         * "redirect" modifier, check_host() proceeds as defined in Section 6.1.
+         */
+        frame->stage = (NULL != frame->record->modifiers.rediect)
+            ? SIDF_FRAME_STAGE_REDIRECT : SIDF_FRAME_STAGE_LOCAL_POLICY_BUILD;
+        return;
     }   // end if
 
     /*
-     * レコード中の全てのメカニズムにマッチしなかった場合
-     * [RFC4408] 4.7.
-     * If none of the mechanisms match and there is no "redirect" modifier,
-     * then the check_host() returns a result of "Neutral", just as if
-     * "?all" were specified as the last directive.  If there is a
-     * "redirect" modifier, check_host() proceeds as defined in Section 6.1.
+     * SidfPolicy で "exp=" を取得するようの指定されている場合に "exp=" を取得する.
+     * ただし, 以下の点に注意する:
+     * - include メカニズム中の exp= は評価しない.
+     * - redirect 評価中に元のドメインの exp= は評価しない.
+     * [RFC4408] 6.2.
+     * Note: During recursion into an "include" mechanism, an exp= modifier
+     * from the <target-name> MUST NOT be used.  In contrast, when executing
+     * a "redirect" modifier, an exp= modifier from the original domain MUST
+     * NOT be used.
+     *
+     * <target-name> は メカニズムの引数で指定されている <domain-spec>,
+     * 指定されていない場合は check_host() 関数の <domain>.
+     * [RFC4408] 4.8.
+     * Several of these mechanisms and modifiers have a <domain-spec>
+     * section.  The <domain-spec> string is macro expanded (see Section 8).
+     * The resulting string is the common presentation form of a fully-
+     * qualified DNS name: a series of labels separated by periods.  This
+     * domain is called the <target-name> in the rest of this document.
      */
+    if (self->policy->lookup_exp && SIDF_SCORE_HARDFAIL == eval_score
+        && 0 == self->include_depth && NULL != frame->record->modifiers.exp) {
+        frame->score = eval_score;
+        frame->stage = SIDF_FRAME_STAGE_EXPLANATION;
+        return;
+    }   // end if
+    SidfRequest_returnFrame(self, eval_score, score);
+}   // end function : SidfRequest_finishDirectives
 
-    // "redirect=" modifier evaluation
-    if (NULL != record->modifiers.rediect) {
-        LogSidfDebug("redirect: from=%s, to=%s", domain, record->modifiers.rediect->param.domain);
-        eval_score = SidfRequest_evalModRedirect(self, record->modifiers.rediect);
-        goto finally;
+/*
+ * 評価しようとしている directive から, DNS ルックアップを伴う directive を
+ * policy->prefetch_directives 個まで先読みし, 問い合わせをまとめて並行に送っておく.
+ * 先読みした問い合わせは DNS ルックアップの回数としては数えず, 評価した時点で数える.
+ * 先にマッチした directive があって評価されなかった分の応答は, 使われずに捨てられる.
+ */
+static void
+SidfRequest_prefetchDirectives(SidfRequest *self, SidfFrame *frame, const SidfRecord *record)
+{
+    unsigned int limit = self->policy->prefetch_directives;
+    if (0 == limit) {
+        return;
+    }   // end if
+    // DNS ルックアップを伴うメカニズムの数の上限を越える分は評価されないので先読みしない
+    if (self->policy->max_dns_mech <= self->dns_mech_count) {
+        return;
+    }   // end if
+    if (self->dns_mech_count + limit > self->policy->max_dns_mech) {
+        limit = self->policy->max_dns_mech - self->dns_mech_count;
+    }   // end if
+    // include は SPF RR と TXT RR の 2 つを問い合わせる場合がある
+    if (DNSRESOLV_PREFETCH_MAXNUM / 2 < limit) {
+        limit = DNSRESOLV_PREFETCH_MAXNUM / 2;
+    }   // end if
+    DnsQuestion questions[DNSRESOLV_PREFETCH_MAXNUM];
+
+    size_t question_num = 0;
+    unsigned int dns_term_num = 0;
+    size_t directive_num = PtrArray_getCount(record->directives);
+    size_t index;
+    for (index = frame->directive_index; index < directive_num && dns_term_num < limit; ++index) {
+        const SidfTerm *term = PtrArray_get(record->directives, index);
+        if (!term->attr->involve_dnslookup) {
+            continue;
+        }   // end if
+        ++dns_term_num;
+        if (term->involve_macro) {
+            // リクエストに固有のドメイン名は投機的には問い合わせない
+            continue;
+        }   // end if
+        const char *domain = SidfRequest_getTargetName(self, term);
+        switch (term->attr->type) {
+        case SIDF_TERM_MECH_INCLUDE:
+            if (NULL != self->policy->record_cache) {
+                // パース済みのレコードがキャッシュにあれば問い合わせる必要はない
+                SidfRecord *cached =
+                    SidfRecordCache_lookup(self->policy->record_cache, domain, self->scope, NULL);
+                if (NULL != cached) {
+                    SidfRecord_free(cached);
+                    break;
+                }   // end if
+            }   // end if
+            if (self->policy->lookup_spf_rr) {
+                questions[question_num].domain = domain;
+                questions[question_num++].rrtype = 99 /* as ns_t_spf */ ;
+            }   // end if
+            questions[question_num].domain = domain;
+            questions[question_num++].rrtype = ns_t_txt;
+            break;
+        case SIDF_TERM_MECH_A:
+        case SIDF_TERM_MECH_EXISTS:
+            questions[question_num].domain = domain;
+            questions[question_num++].rrtype =
+                (SIDF_TERM_MECH_A == term->attr->type && AF_INET6 == self->sin_family)
+                ? ns_t_aaaa : ns_t_a;
+            break;
+        case SIDF_TERM_MECH_MX:
+            questions[question_num].domain = domain;
+            questions[question_num++].rrtype = ns_t_mx;
+            break;
+        default:
+            // ptr は逆引きの結果によって問い合わせが変わるので先読みしない
+            break;
+        }   // end switch
+    }   // end for
+    frame->prefetch_index = index;
+    (void) DnsResolver_prefetch(self->resolver, questions, question_num);
+}   // end function : SidfRequest_prefetchDirectives
+
+/*
+ * directive を 1 つ評価する.
+ * "include" メカニズムの場合は子フレームを積み, 子フレームから復帰した際に評価結果をマップする.
+ */
+static SidfStat
+SidfRequest_stepDirective(SidfRequest *self, SidfFrame *frame, SidfScore *score)
+{
+    const SidfRecord *record = (SIDF_FRAME_STAGE_LOCAL_POLICY == frame->stage)
+        ? frame->local_policy_record : frame->record;
+    const PtrArray *directives = record->directives;
+    SidfScore eval_score;
+    if (frame->returned) {
+        frame->returned = false;
+        eval_score = SidfRequest_mapIncludeScore(PtrArray_get(directives, frame->directive_index),
+                                                 frame->callee_score);
+    } else {
+        if (PtrArray_getCount(directives) <= frame->directive_index) {
+            SidfRequest_finishDirectives(self, frame, SIDF_SCORE_NULL, score);
+            return SIDF_STAT_OK;
+        }   // end if
+        if (frame->cidr_run_index < record->cidr_run_num
+            && record->cidr_run[frame->cidr_run_index].begin == frame->directive_index) {
+            // 連続する ip4/ip6 メカニズムは trie で一度に評価する
+            const SidfCidrRun *run = &(record->cidr_run[frame->cidr_run_index++]);
+            if (!SidfRequest_evalCidrRun(self, run, &(frame->directive_index))) {
+                LogSidfDebug("mechanism not match: domain=%s, mech_no=%u-%u, mech=ip4/ip6",
+                             frame->domain, run->begin, run->end - 1);
+                frame->directive_index = run->end;
+                return SIDF_STAT_OK;
+            }   // end if
+            const SidfTerm *matched_term = PtrArray_get(directives, frame->directive_index);
+            eval_score = SidfRequest_getScoreByQualifier(matched_term->qualifier);
+            goto evaluated;
+        }   // end if
+        const SidfTerm *term = PtrArray_get(directives, frame->directive_index);
+        if (term->attr->involve_dnslookup && frame->prefetch_index <= frame->directive_index) {
+            SidfRequest_prefetchDirectives(self, frame, record);
+        }   // end if
+        if (SIDF_TERM_MECH_INCLUDE == term->attr->type) {
+            eval_score = SidfRequest_incrementDnsMechCounter(self);
+            if (SIDF_SCORE_NULL == eval_score
+                && !SidfRequest_evalIncludeTree(self, term, &eval_score)) {
+                SidfRequest_callFrame(self, SIDF_FRAME_KIND_INCLUDE, term->querydomain);
+                return SIDF_STAT_OK;
+            }   // end if
+        } else {
+            unsigned long deferred_count = DnsResolver_getDeferredCount(self->resolver);
+            unsigned int dns_mech_count = self->dns_mech_count;
+            eval_score = SidfRequest_evalMechanism(self, term);
+            if (SidfRequest_isDeferred(self, deferred_count)) {
+                // 応答が揃ってから評価し直すので, カウンタを戻しておく
+                self->dns_mech_count = dns_mech_count;
+                return SIDF_STAT_DNS_PENDING;
+            }   // end if
+        }   // end if
     }   // end if
 
-    eval_score = SidfRequest_evalLocalPolicy(self);
+  evaluated:;
+    const SidfTerm *term = PtrArray_get(directives, frame->directive_index);
     if (SIDF_SCORE_NULL != eval_score) {
-        // exp= を評価する条件は directive によってスコアが決定する場合とほぼ同じ.
-        // 違いは local_policy_explanation を使用する点.
-        if (self->policy->lookup_exp && SIDF_SCORE_HARDFAIL == eval_score
-            && 0 == self->include_depth && NULL != self->policy->local_policy_explanation) {
-            // local policy 専用の explanation をセットする.
-            (void) SidfRequest_setExplanation(self, domain, self->policy->local_policy_explanation);
+        LogSidfDebug("mechanism match: domain=%s, mech%02u=%s, score=%s", frame->domain,
+                     frame->directive_index, term->attr->name,
+                     SidfEnum_lookupScoreByValue(eval_score));
+        SidfRequest_finishDirectives(self, frame, eval_score, score);
+        return SIDF_STAT_OK;
+    }   // end if
+    LogSidfDebug("mechanism not match: domain=%s, mech_no=%u, mech=%s", frame->domain,
+                 frame->directive_index, term->attr->name);
+    ++(frame->directive_index);
+    return SIDF_STAT_OK;
+}   // end function : SidfRequest_stepDirective
+
+/*
+ * 評価スタックの一番上のフレームを 1 段階進める.
+ * DNS の応答待ちになった場合は, その段階の評価結果を全て捨てて SIDF_STAT_DNS_PENDING を返す.
+ * 再開時には同じ段階を最初からやり直すので, 各段階は繰り返し実行しても結果が変わらないように作ること.
+ */
+static SidfStat
+SidfRequest_step(SidfRequest *self, SidfScore *score)
+{
+    SidfFrame *frame = SidfRequest_getFrame(self);
+    unsigned long deferred_count = DnsResolver_getDeferredCount(self->resolver);
+    SidfScore eval_score;
+
+    switch (frame->stage) {
+    case SIDF_FRAME_STAGE_CHECK_DOMAIN:
+        // check <domain> parameter
+        eval_score = SidfRequest_checkDomain(self, frame->domain);
+        if (SIDF_SCORE_NULL != eval_score) {
+            SidfRequest_returnFrame(self, eval_score, score);
+            return SIDF_STAT_OK;
         }   // end if
-        goto finally;
+        // register <domain> parameter
+        if (SIDF_STAT_OK != SidfRequest_pushDomain(self, frame->domain)) {
+            SidfRequest_returnFrame(self, SIDF_SCORE_SYSERROR, score);
+            return SIDF_STAT_OK;
+        }   // end if
+        frame->domain_pushed = true;
+        frame->stage = SIDF_FRAME_STAGE_LOOKUP;
+        return SIDF_STAT_OK;
+
+    case SIDF_FRAME_STAGE_LOOKUP:;
+        SidfRecord *record = NULL;
+        eval_score = SidfRequest_lookupRecord(self, SidfRequest_getDomain(self), &record);
+        if (SidfRequest_isDeferred(self, deferred_count)) {
+            if (NULL != record) {
+                SidfRecord_free(record);
+            }   // end if
+            return SIDF_STAT_DNS_PENDING;
+        }   // end if
+        if (SIDF_SCORE_NULL != eval_score) {
+            SidfRequest_returnFrame(self, eval_score, score);
+            return SIDF_STAT_OK;
+        }   // end if
+        frame->record = record;
+        frame->directive_index = 0;
+        frame->cidr_run_index = 0;
+        frame->prefetch_index = 0;
+        frame->stage = SIDF_FRAME_STAGE_DIRECTIVES;
+        return SIDF_STAT_OK;
+
+    case SIDF_FRAME_STAGE_DIRECTIVES:
+    case SIDF_FRAME_STAGE_LOCAL_POLICY:
+        return SidfRequest_stepDirective(self, frame, score);
+
+    case SIDF_FRAME_STAGE_EXPLANATION:
+        (void) SidfRequest_evalModExplanation(self, frame->record->modifiers.exp);
+        if (SidfRequest_isDeferred(self, deferred_count)) {
+            PTRINIT(self->explanation);
+            return SIDF_STAT_DNS_PENDING;
+        }   // end if
+        SidfRequest_returnFrame(self, frame->score, score);
+        return SIDF_STAT_OK;
+
+    case SIDF_FRAME_STAGE_REDIRECT:
+        if (frame->returned) {
+            frame->returned = false;
+            /*
+             * [RFC4408] 6.1.
+             * The result of this new evaluation of check_host() is then considered
+             * the result of the current evaluation with the exception that if no
+             * SPF record is found, or if the target-name is malformed, the result
+             * is a "PermError" rather than "None".
+             */
+            eval_score = (SIDF_SCORE_NONE == frame->callee_score)
+                ? SIDF_SCORE_PERMERROR : frame->callee_score;
+            SidfRequest_returnFrame(self, eval_score, score);
+            return SIDF_STAT_OK;
+        }   // end if
+        // "redirect=" modifier evaluation
+        LogSidfDebug("redirect: from=%s, to=%s", frame->domain,
+                     frame->record->modifiers.rediect->param.domain);
+        eval_score = SidfRequest_incrementDnsMechCounter(self);
+        if (SIDF_SCORE_NULL != eval_score) {
+            SidfRequest_returnFrame(self, eval_score, score);
+            return SIDF_STAT_OK;
+        }   // end if
+        SidfRequest_callFrame(self, SIDF_FRAME_KIND_REDIRECT,
+                              frame->record->modifiers.rediect->querydomain);
+        return SIDF_STAT_OK;
+
+    case SIDF_FRAME_STAGE_LOCAL_POLICY_BUILD:;
+        SidfRecord *local_policy_record = NULL;
+        SidfStat build_stat = SidfRequest_buildLocalPolicy(self, &local_policy_record);
+        if (SidfRequest_isDeferred(self, deferred_count)) {
+            if (NULL != local_policy_record) {
+                SidfRecord_free(local_policy_record);
+            }   // end if
+            return SIDF_STAT_DNS_PENDING;
+        }   // end if
+        if (SIDF_STAT_OK != build_stat) {
+            frame->stage = SIDF_FRAME_STAGE_DEFAULT;
+            return SIDF_STAT_OK;
+        }   // end if
+        self->dns_mech_count = 0;   // 本物のレコード評価中に遭遇した DNS ルックアップを伴うメカニズムの数は忘れる
+        self->local_policy_mode = true; // ローカルポリシー評価中に, さらにローカルポリシーを適用して無限ループに入らないようにフラグを立てる.
+        frame->local_policy_record = local_policy_record;
+        frame->directive_index = 0;
+        frame->cidr_run_index = 0;
+        frame->prefetch_index = 0;
+        frame->stage = SIDF_FRAME_STAGE_LOCAL_POLICY;
+        return SIDF_STAT_OK;
+
+    case SIDF_FRAME_STAGE_LOCAL_POLICY_EXPLANATION:
+        // local policy 専用の explanation をセットする.
+        (void) SidfRequest_setExplanation(self, frame->domain,
+                                          self->policy->local_policy_explanation);
+        if (SidfRequest_isDeferred(self, deferred_count)) {
+            PTRINIT(self->explanation);
+            return SIDF_STAT_DNS_PENDING;
+        }   // end if
+        SidfRequest_returnFrame(self, frame->score, score);
+        return SIDF_STAT_OK;
+
+    case SIDF_FRAME_STAGE_DEFAULT:
+        // returns "Neutral" as default socre
+        LogSidfDebug("default score applied: domain=%s", frame->domain);
+        SidfRequest_returnFrame(self, SIDF_SCORE_NEUTRAL, score);
+        return SIDF_STAT_OK;
+
+    default:
+        abort();
+    }   // end switch
+}   // end function : SidfRequest_step
+
+/*
+ * 評価結果のキャッシュを引く.
+ * @return ヒットした場合は true. score と explanation に評価結果をセットする.
+ */
+static bool
+SidfRequest_lookupResult(SidfRequest *self, SidfScore *score)
+{
+    SidfResultCache *result_cache = self->policy->result_cache;
+    if (NULL == result_cache) {
+        return false;
+    }   // end if
+    char *explanation;
+    if (!SidfResultCache_lookup(result_cache, self->scope, self->sin_family, &(self->ipaddr),
+                                self->eval_by_sender ? InetMailbox_getDomain(self->sender) : NULL,
+                                self->helo_domain, score, &explanation)) {
+        return false;
+    }   // end if
+    LogSidfDebug("result cache hit: sender=%s, helo=%s, score=%s",
+                 InetMailbox_getDomain(self->sender), self->helo_domain,
+                 SidfEnum_lookupScoreByValue(*score));
+    if (NULL != self->explanation) {
+        free(self->explanation);
     }   // end if
+    self->explanation = explanation;
+    return true;
+}   // end function : SidfRequest_lookupResult
 
-    // returns "Neutral" as default socre
-    eval_score = SIDF_SCORE_NEUTRAL;
-    LogSidfDebug("default score applied: domain=%s", domain);
+/*
+ * 評価を開始してから, リゾルバが一時的なエラーを返したかを調べる.
+ * "ptr" メカニズムの検証や %{p} マクロの展開では DNS のエラーを無視して評価を続けるので,
+ * 評価結果が TempError でなくても一時的なエラーの影響を受けている場合がある.
+ */
+static bool
+SidfRequest_hasTransientFailure(const SidfRequest *self)
+{
+    return self->transient_count != DnsResolver_getTransientCount(self->resolver);
+}   // end function : SidfRequest_hasTransientFailure
 
-  finally:
-    SidfRequest_popDomain(self);
-    SidfRecord_free(record);
-    return eval_score;
-}   // end function : SidfRequest_checkHost
+/*
+ * 評価結果をキャッシュに格納する.
+ * 送信者のローカルパートや時刻に依存する評価結果, 一時的なエラーは格納しない.
+ * 一時的なエラーを無視して得た評価結果も, 問い合わせ直せば変わりうるので格納しない.
+ * 評価中に参照した DNS の応答やキャッシュのうち, 最も早く期限が切れるものに合わせて期限を決める.
+ */
+static void
+SidfRequest_storeResult(SidfRequest *self, SidfScore score)
+{
+    SidfResultCache *result_cache = self->policy->result_cache;
+    if (NULL == result_cache || self->sender_dependent || SidfRequest_hasTransientFailure(self)) {
+        return;
+    }   // end if
+    switch (score) {
+    case SIDF_SCORE_NULL:
+    case SIDF_SCORE_TEMPERROR:
+    case SIDF_SCORE_SYSERROR:
+        return;
+    default:
+        break;
+    }   // end switch
+    unsigned long ttl = MIN(self->min_ttl, DnsResolver_getMinTtl(self->resolver));
+    if (ULONG_MAX == ttl) {
+        // DNS の応答もキャッシュも参照せずに決まった評価結果は期限を決められない
+        return;
+    }   // end if
+    SidfResultCache_store(result_cache, self->scope, self->sin_family, &(self->ipaddr),
+                          self->eval_by_sender ? InetMailbox_getDomain(self->sender) : NULL,
+                          self->helo_domain, score, self->explanation, ttl);
+}   // end function : SidfRequest_storeResult
+
+static SidfStat
+SidfRequest_run(SidfRequest *self, SidfScore *score)
+{
+    while (0 < self->frame_num) {
+        if (DnsResolver_isExpired(self->resolver)) {
+            LogSidfNotice("evaluation timed out: sender=%s, helo=%s, timeout=%u",
+                          InetMailbox_getDomain(self->sender), self->helo_domain,
+                          self->policy->eval_timeout);
+            SidfRequest_clearFrames(self);
+            *score = SIDF_SCORE_TEMPERROR;
+            return SIDF_STAT_OK;
+        }   // end if
+        SidfStat step_stat = SidfRequest_step(self, score);
+        if (SIDF_STAT_OK != step_stat) {
+            return step_stat;
+        }   // end if
+    }   // end while
+    SidfRequest_storeResult(self, *score);
+    return SIDF_STAT_OK;
+}   // end function : SidfRequest_run
 
 /**
+ * SPF/Sender ID の評価を開始する.
+ * リゾルバが遅延モードの場合, 手元にない DNS の応答が必要になった時点で評価を中断し
+ * SIDF_STAT_DNS_PENDING を返す. 応答待ちの問い合わせは DnsResolver_takePendingQuery() で取り出し,
+ * 応答を DnsResolver_feedAnswer() で与えてから SidfRequest_resume() で評価を再開する.
+ * 評価は明示的なスタックの上でおこなうので, 中断中のスレッドを占有しない.
+ * SidfPolicy の eval_timeout を過ぎた場合は, 評価を打ち切って SIDF_SCORE_TEMPERROR を返す.
  * HELO は指定必須. sender が指定されていない場合, postmaster@(HELOとして指定したドメイン) を sender として使用する.
- * @return SIDF_SCORE_NULL: 引数がセットされていない.
- *         SIDF_SCORE_SYSERROR: メモリの確保に失敗した.
- *         それ以外の場合は評価結果.
+ * @param score 評価が完了した場合に評価結果を受け取る.
+ *              SIDF_SCORE_NULL: 引数がセットされていない.
+ *              SIDF_SCORE_SYSERROR: メモリの確保に失敗した.
+ *              それ以外の場合は評価結果.
+ * @return 評価が完了した場合は SIDF_STAT_OK, DNS の応答待ちで中断した場合は SIDF_STAT_DNS_PENDING.
  */
-SidfScore
-SidfRequest_eval(SidfRequest *self, SidfRecordScope scope)
+SidfStat
+SidfRequest_start(SidfRequest *self, SidfRecordScope scope, SidfScore *score)
 {
     assert(NULL != self);
+    assert(NULL != score);
 
+    SidfRequest_clearFrames(self);
     self->scope = scope;
     self->dns_mech_count = 0;
+    self->sender_dependent = false;
+    self->transient_count = DnsResolver_getTransientCount(self->resolver);
+    self->min_ttl = ULONG_MAX;
+    DnsResolver_resetMinTtl(self->resolver);
+    // 前回の評価で並行に問い合わせた応答が残っていれば捨てる
+    DnsResolver_resetPrefetch(self->resolver);
+    // 中断と再開を挟んでも評価を開始した時点から数える
+    DnsResolver_setDeadline(self->resolver, (unsigned long) self->policy->eval_timeout * 1000);
     if (0 == self->sin_family || NULL == self->helo_domain) {
-        return SIDF_SCORE_NULL;
+        *score = SIDF_SCORE_NULL;
+        return SIDF_STAT_OK;
     }   // end if
     if (NULL == self->sender) {
         /*
@@ -947,15 +1845,60 @@ SidfRequest_eval(SidfRequest *self, SidfRecordScope scope)
         self->sender = InetMailbox_build(SIDF_REQUEST_DEFAULT_LOCALPART, self->helo_domain);
         if (NULL == self->sender) {
             LogNoResource();
-            return SIDF_SCORE_SYSERROR;
+            *score = SIDF_SCORE_SYSERROR;
+            return SIDF_STAT_OK;
         }   // end if
         self->eval_by_sender = false;
     } else {
         self->eval_by_sender = true;
     }   // end if
-    self->redirect_depth = 0;
-    self->include_depth = 0;
-    return SidfRequest_checkHost(self, InetMailbox_getDomain(self->sender));
+    if (SidfRequest_lookupResult(self, score)) {
+        return SIDF_STAT_OK;
+    }   // end if
+    if (SIDF_STAT_OK !=
+        SidfRequest_pushFrame(self, SIDF_FRAME_KIND_TOP, InetMailbox_getDomain(self->sender))) {
+        *score = SIDF_SCORE_SYSERROR;
+        return SIDF_STAT_OK;
+    }   // end if
+    return SidfRequest_run(self, score);
+}   // end function : SidfRequest_start
+
+/**
+ * SIDF_STAT_DNS_PENDING で中断した評価を再開する.
+ * 中断した時点で応答待ちだった問い合わせの応答が全て揃っていなくても構わないが,
+ * その場合は再び SIDF_STAT_DNS_PENDING を返す.
+ * @return SidfRequest_start() と同じ.
+ */
+SidfStat
+SidfRequest_resume(SidfRequest *self, SidfScore *score)
+{
+    assert(NULL != self);
+    assert(NULL != score);
+    assert(0 < self->frame_num);
+    return SidfRequest_run(self, score);
+}   // end function : SidfRequest_resume
+
+/**
+ * SPF/Sender ID の評価をおこなう.
+ * 遅延モードでないリゾルバを使う場合は, SidfRequest_start() と同じ評価を途中で中断せずにおこなう.
+ * HELO は指定必須. sender が指定されていない場合, postmaster@(HELOとして指定したドメイン) を sender として使用する.
+ * @return SIDF_SCORE_NULL: 引数がセットされていない.
+ *         SIDF_SCORE_SYSERROR: メモリの確保に失敗した.
+ *         それ以外の場合は評価結果.
+ */
+SidfScore
+SidfRequest_eval(SidfRequest *self, SidfRecordScope scope)
+{
+    assert(NULL != self);
+
+    SidfScore score;
+    if (SIDF_STAT_OK != SidfRequest_start(self, scope, &score)) {
+        // 遅延モードのリゾルバを渡された場合はここで諦める
+        LogImplError("DNS lookup deferred during synchronous evaluation");
+        SidfRequest_clearFrames(self);
+        return SIDF_SCORE_TEMPERROR;
+    }   // end if
+    return score;
 }   // end function : SidfRequest_eval
 
 /**
@@ -1065,16 +2008,19 @@ void
 SidfRequest_reset(SidfRequest *self)
 {
     assert(NULL != self);
+    SidfRequest_clearFrames(self);
     self->scope = SIDF_RECORD_SCOPE_NULL;
     self->sin_family = 0;
     memset(&(self->ipaddr), 0, sizeof(union ipaddr46));
     if (NULL != self->domain) {
         StrArray_reset(self->domain);
     }   // end if
-    self->sender = NULL;
     self->dns_mech_count = 0;
-    self->eval_by_sender = true;
+    self->eval_by_sender = false;
     self->local_policy_mode = false;
+    self->sender_dependent = false;
+    self->transient_count = 0;
+    self->min_ttl = ULONG_MAX;
     if (NULL != self->xbuf) {
         XBuffer_reset(self->xbuf);
     }   // end if
@@ -1096,6 +2042,10 @@ void
 SidfRequest_free(SidfRequest *self)
 {
     assert(NULL != self);
+    SidfRequest_clearFrames(self);
+    if (NULL != self->frame) {
+        free(self->frame);
+    }   // end if
     if (NULL != self->domain) {
         StrArray_free(self->domain);
     }   // end if
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * 評価を終えた SidfRequest を使い回すためのプール.
+ * 返却された SidfRequest は SidfRequest_reset() で状態を初期化して保持し,
+ * 評価スタックや作業用バッファに確保済みのメモリは次の評価でそのまま使う.
+ * 出し入れはロックを取らずにおこなう. 容量を越えて返却されたものは解放する.
+ */
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freelist.h"
+#include "dnsresolv.h"
+#include "sidfpolicy.h"
+#include "sidfrequest.h"
+#include "sidfrequestpool.h"
+
+struct SidfRequestPool {
+    FreeList *idle;             // 貸し出していない SidfRequest
+};
+
+/**
+ * SidfRequest を 1 つ借りる. 保持している SidfRequest がない場合は新たに構築する.
+ * 借りた SidfRequest は SidfRequestPool_release() で返却すること.
+ * @return SidfRequest オブジェクト, 構築に失敗した場合は NULL.
+ */
+SidfRequest *
+SidfRequestPool_acquire(SidfRequestPool *self, const SidfPolicy *policy, DnsResolver *resolver)
+{
+    assert(NULL != self);
+
+    SidfRequest *request = (SidfRequest *) FreeList_pop(self->idle);
+    if (NULL == request) {
+        return SidfRequest_new(policy, resolver);
+    }   // end if
+    request->policy = policy;
+    request->resolver = resolver;
+    return request;
+}   // end function : SidfRequestPool_acquire
+
+/**
+ * SidfRequestPool_acquire() で借りた SidfRequest を返却する.
+ */
+void
+SidfRequestPool_release(SidfRequestPool *self, SidfRequest *request)
+{
+    assert(NULL != self);
+    assert(NULL != request);
+
+    SidfRequest_reset(request);
+    request->policy = NULL;
+    request->resolver = NULL;
+    if (!FreeList_push(self->idle, request)) {
+        SidfRequest_free(request);
+    }   // end if
+}   // end function : SidfRequestPool_release
+
+void
+SidfRequestPool_free(SidfRequestPool *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    SidfRequest *request;
+    while (NULL != (request = (SidfRequest *) FreeList_pop(self->idle))) {
+        SidfRequest_free(request);
+    }   // end while
+    FreeList_free(self->idle);
+    free(self);
+}   // end function : SidfRequestPool_free
+
+/**
+ * SidfRequestPool オブジェクトを構築する.
+ * @param capacity 保持する SidfRequest の最大数
+ */
+SidfRequestPool *
+SidfRequestPool_new(size_t capacity)
+{
+    SidfRequestPool *self = (SidfRequestPool *) malloc(sizeof(SidfRequestPool));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(SidfRequestPool));
+    self->idle = FreeList_new(capacity);
+    if (NULL == self->idle) {
+        free(self);
+        return NULL;
+    }   // end if
+    return self;
+}   // end function : SidfRequestPool_new
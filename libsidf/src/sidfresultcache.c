@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * SPF/SIDF の評価結果のキャッシュ.
+ * (評価スコープ, IP アドレス, 送信者のドメイン, HELO) をキーに, 評価結果と explanation を
+ * 評価中に参照した DNS の応答の TTL の最小値の間保持する.
+ * 送信者のローカルパートや時刻に依存するマクロを展開した評価結果は格納してはならない.
+ * 評価結果は SidfPolicy の設定にも依存するので, SidfPolicy 毎に別のキャッシュを使うこと.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "rcsid.h"
+RCSID("$Id$");
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+
+#include "ptrop.h"
+#include "cacheutil.h"
+#include "sidf.h"
+#include "sidfresultcache.h"
+
+#define SIDF_RESULTCACHE_MAX_TTL 86400  // これより長い TTL は切り詰める
+#define SIDF_RESULTCACHE_MIN_BUCKETS 64
+#define SIDF_RESULTCACHE_ADDRLEN 16 // IPv6 アドレスのバイト数
+#define SIDF_RESULTCACHE_MAX_KEYLEN \
+    (sizeof(uint32_t) + 1 + SIDF_RESULTCACHE_ADDRLEN + 2 * NS_MAXDNAME)
+
+typedef struct SidfResultCacheEntry {
+    CacheLruLink lru;           // 先頭に置くこと
+    struct SidfResultCacheEntry *hash_next;
+    uint32_t hash;
+    time_t expire;              // CLOCK_MONOTONIC 基準の有効期限 (秒)
+    SidfScore score;
+    char *explanation;          // explanation が得られなかった場合は NULL
+    size_t keylen;
+    unsigned char key[];        // スコープ, アドレスファミリー, アドレス, ドメイン, HELO を繋げたもの
+} SidfResultCacheEntry;
+
+struct SidfResultCache {
+    pthread_mutex_t lock;
+    SidfResultCacheEntry **bucket;
+    size_t bucket_mask;
+    CacheLru lru;
+    size_t entry_num;
+    size_t entry_limit;
+};
+
+/*
+ * キャッシュのキーを作る.
+ * ドメインと HELO は explanation の展開結果に影響するので, 大文字小文字も含めてそのまま使う.
+ * @param domain 送信者のドメイン. 送信者が指定されず HELO で評価した場合は NULL.
+ * @return キーの長さ, buflen に収まらない場合は -1.
+ */
+static int
+SidfResultCache_buildKey(SidfRecordScope scope, int af, const void *addr, const char *domain,
+                         const char *helo, unsigned char *buf, size_t buflen)
+{
+    size_t addrlen;
+    switch (af) {
+    case AF_INET:
+        addrlen = sizeof(struct in_addr);
+        break;
+    case AF_INET6:
+        addrlen = sizeof(struct in6_addr);
+        break;
+    default:
+        return -1;
+    }   // end switch
+    size_t domain_len = (NULL != domain) ? strlen(domain) : 0;
+    size_t helo_len = strlen(helo);
+    size_t keylen = sizeof(uint32_t) + 1 + addrlen + domain_len + 1 + helo_len + 1;
+    if (buflen < keylen) {
+        return -1;
+    }   // end if
+    unsigned char *p = buf;
+    uint32_t scope32 = (uint32_t) scope;
+    memcpy(p, &scope32, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    *p++ = (unsigned char) af;
+    memcpy(p, addr, addrlen);
+    p += addrlen;
+    memcpy(p, PTROR(domain, ""), domain_len + 1);
+    p += domain_len + 1;
+    memcpy(p, helo, helo_len + 1);
+    return (int) keylen;
+}   // end function : SidfResultCache_buildKey
+
+static SidfResultCacheEntry **
+SidfResultCache_getBucket(SidfResultCache *self, uint32_t hash)
+{
+    return &(self->bucket[hash & self->bucket_mask]);
+}   // end function : SidfResultCache_getBucket
+
+static void
+SidfResultCache_freeEntry(SidfResultCacheEntry *entry)
+{
+    if (NULL == entry) {
+        return;
+    }   // end if
+    free(entry->explanation);
+    free(entry);
+}   // end function : SidfResultCache_freeEntry
+
+/*
+ * エントリをハッシュチェーンと LRU リストから外す.
+ * ロックを保持した状態で呼ぶこと. 外したエントリは,
+ * ロックを手放してから SidfResultCache_freeEntry() すること.
+ */
+static SidfResultCacheEntry *
+SidfResultCache_removeEntry(SidfResultCache *self, SidfResultCacheEntry *entry)
+{
+    for (SidfResultCacheEntry **pp = SidfResultCache_getBucket(self, entry->hash); NULL != *pp;
+         pp = &((*pp)->hash_next)) {
+        if (*pp == entry) {
+            *pp = entry->hash_next;
+            break;
+        }   // end if
+    }   // end for
+    CacheLru_unlink(&self->lru, &entry->lru);
+    --(self->entry_num);
+    return entry;
+}   // end function : SidfResultCache_removeEntry
+
+/*
+ * ロックを保持した状態で呼ぶこと.
+ */
+static SidfResultCacheEntry *
+SidfResultCache_findEntry(SidfResultCache *self, uint32_t hash, const unsigned char *key,
+                          size_t keylen)
+{
+    for (SidfResultCacheEntry *entry = *SidfResultCache_getBucket(self, hash); NULL != entry;
+         entry = entry->hash_next) {
+        if (entry->hash == hash && entry->keylen == keylen
+            && 0 == memcmp(entry->key, key, keylen)) {
+            return entry;
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function : SidfResultCache_findEntry
+
+/**
+ * キャッシュを引く.
+ * @param af AF_INET または AF_INET6.
+ * @param addr af に対応する struct in_addr または struct in6_addr.
+ * @param domain 送信者のドメイン. 送信者が指定されず HELO で評価する場合は NULL.
+ * @param helo HELO のドメイン.
+ * @param score ヒットした場合に評価結果を受け取る.
+ * @param explanation ヒットした場合に explanation の複製を受け取る.
+ *                    使い終わったら free() で解放すること. explanation がない場合は NULL.
+ * @return ヒットした場合は true.
+ */
+bool
+SidfResultCache_lookup(SidfResultCache *self, SidfRecordScope scope, int af, const void *addr,
+                       const char *domain, const char *helo, SidfScore *score,
+                       char **explanation)
+{
+    assert(NULL != self);
+    unsigned char key[SIDF_RESULTCACHE_MAX_KEYLEN];
+    int keylen = SidfResultCache_buildKey(scope, af, addr, domain, helo, key, sizeof(key));
+    if (keylen < 0) {
+        return false;
+    }   // end if
+    uint32_t hash = CacheUtil_hash(key, keylen);
+    time_t now = CacheUtil_now();
+    bool hit = false;
+    SidfResultCacheEntry *expired = NULL;
+
+    pthread_mutex_lock(&self->lock);
+    SidfResultCacheEntry *entry = SidfResultCache_findEntry(self, hash, key, keylen);
+    if (NULL != entry) {
+        if (entry->expire <= now) {
+            expired = SidfResultCache_removeEntry(self, entry);
+        } else {
+            *explanation = NULL;
+            if (NULL == entry->explanation
+                || NULL != (*explanation = strdup(entry->explanation))) {
+                *score = entry->score;
+                hit = true;
+                CacheLru_unlink(&self->lru, &entry->lru);
+                CacheLru_push(&self->lru, &entry->lru);
+            }   // end if
+        }   // end if
+    }   // end if
+    pthread_mutex_unlock(&self->lock);
+
+    SidfResultCache_freeEntry(expired);
+    return hit;
+}   // end function : SidfResultCache_lookup
+
+/**
+ * 評価結果をキャッシュに格納する.
+ * 同じキーのエントリが既に存在する場合は置き換える.
+ * エントリ数の上限を越える場合は LRU リストの末尾から追い出す.
+ * @param explanation explanation がない場合は NULL. キャッシュは複製を保持する.
+ * @param ttl キャッシュしておく秒数. 0 の場合は何もしない.
+ */
+void
+SidfResultCache_store(SidfResultCache *self, SidfRecordScope scope, int af, const void *addr,
+                      const char *domain, const char *helo, SidfScore score,
+                      const char *explanation, unsigned long ttl)
+{
+    assert(NULL != self);
+    if (0 == ttl || 0 == self->entry_limit) {
+        return;
+    }   // end if
+    unsigned char key[SIDF_RESULTCACHE_MAX_KEYLEN];
+    int keylen = SidfResultCache_buildKey(scope, af, addr, domain, helo, key, sizeof(key));
+    if (keylen < 0) {
+        return;
+    }   // end if
+    uint32_t hash = CacheUtil_hash(key, keylen);
+
+    SidfResultCacheEntry *newentry =
+        (SidfResultCacheEntry *) malloc(sizeof(SidfResultCacheEntry) + keylen);
+    if (NULL == newentry) {
+        return;
+    }   // end if
+    memset(newentry, 0, sizeof(SidfResultCacheEntry));
+    if (NULL != explanation && NULL == (newentry->explanation = strdup(explanation))) {
+        free(newentry);
+        return;
+    }   // end if
+    newentry->hash = hash;
+    newentry->expire = CacheUtil_now()
+        + (time_t) (SIDF_RESULTCACHE_MAX_TTL < ttl ? SIDF_RESULTCACHE_MAX_TTL : ttl);
+    newentry->score = score;
+    newentry->keylen = keylen;
+    memcpy(newentry->key, key, keylen);
+
+    SidfResultCacheEntry *removed[2] = { NULL, NULL };
+    pthread_mutex_lock(&self->lock);
+    SidfResultCacheEntry *oldentry = SidfResultCache_findEntry(self, hash, key, keylen);
+    if (NULL != oldentry) {
+        removed[0] = SidfResultCache_removeEntry(self, oldentry);
+    }   // end if
+    if (self->entry_limit <= self->entry_num && NULL != self->lru.tail) {
+        removed[1] = SidfResultCache_removeEntry(self, CACHELRU_ENTRY(SidfResultCacheEntry, self->lru.tail));
+    }   // end if
+    SidfResultCacheEntry **bucket = SidfResultCache_getBucket(self, hash);
+    newentry->hash_next = *bucket;
+    *bucket = newentry;
+    CacheLru_push(&self->lru, &newentry->lru);
+    ++(self->entry_num);
+    pthread_mutex_unlock(&self->lock);
+
+    for (size_t n = 0; n < sizeof(removed) / sizeof(removed[0]); ++n) {
+        SidfResultCache_freeEntry(removed[n]);
+    }   // end for
+}   // end function : SidfResultCache_store
+
+void
+SidfResultCache_free(SidfResultCache *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    CacheLruLink *link = self->lru.head;
+    while (NULL != link) {
+        CacheLruLink *next = link->next;
+        SidfResultCache_freeEntry(CACHELRU_ENTRY(SidfResultCacheEntry, link));
+        link = next;
+    }   // end while
+    free(self->bucket);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+}   // end function : SidfResultCache_free
+
+/**
+ * SidfResultCache オブジェクトを構築する.
+ * @param entry_limit キャッシュしておく評価結果の数の上限.
+ */
+SidfResultCache *
+SidfResultCache_new(size_t entry_limit)
+{
+    SidfResultCache *self = (SidfResultCache *) malloc(sizeof(SidfResultCache));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(SidfResultCache));
+    pthread_mutex_init(&self->lock, NULL);
+    self->entry_limit = entry_limit;
+
+    size_t bucket_num = SIDF_RESULTCACHE_MIN_BUCKETS;
+    while (bucket_num < entry_limit) {
+        bucket_num <<= 1;
+    }   // end while
+    self->bucket_mask = bucket_num - 1;
+    self->bucket = (SidfResultCacheEntry **) calloc(bucket_num, sizeof(SidfResultCacheEntry *));
+    if (NULL == self->bucket) {
+        goto cleanup;
+    }   // end if
+    return self;
+
+  cleanup:
+    SidfResultCache_free(self);
+    return NULL;
+}   // end function : SidfResultCache_new
@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * DnsAsync が ID, question section, 送信先のネームサーバの全てが一致する応答だけを受け付けること,
+ * 応答がなければ再送の後に TRY_AGAIN で完了すること, 切り詰められた応答を受け取った場合は
+ * TCP で問い合わせ直すことを, ループバック上で動かす試験用のネームサーバを相手に確かめる.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "unittest.h"
+// 問い合わせ毎のソケットを直接参照するため, 実装をそのまま取り込む
+#include "../src/dnsasync.c"
+
+// 待たされた場合に止まったままにならないよう, この秒数で打ち切る
+#define TEST_TIMEOUT 30
+#define TEST_QUERY_TIMEOUT 200  // 1 回の送信あたりのタイムアウト (ミリ秒)
+
+/*
+ * 試験用のネームサーバは問い合わせた名前の先頭のラベルで応答を変える.
+ */
+#define TEST_NAME_OK "ok.example.test"          // 応答を 1 つ返す
+#define TEST_NAME_SPOOF "spoof.example.test"    // 一致しない応答を返してから応答を返す
+#define TEST_NAME_SILENT "silent.example.test"  // 応答しない
+#define TEST_NAME_TC "tc.example.test"          // UDP では切り詰めた応答を返す
+#define TEST_NAME_TCBAD "tcbad.example.test"    // TCP では ID の異なる応答を返す
+
+typedef struct TestServer {
+    int udp_fd;
+    int tcp_fd;
+    struct sockaddr_in addr;
+    volatile int stopping;
+    volatile int udp_query_num[5];  // 上の名前毎の UDP での問い合わせの数
+    volatile int tcp_query_num;
+    pthread_t thread;
+} TestServer;
+
+typedef struct TestResult {
+    int called;
+    int stat;
+    unsigned char msg[NS_MAXMSG];
+    int msglen;
+} TestResult;
+
+static const char *const test_names[5] = {
+    TEST_NAME_OK, TEST_NAME_SPOOF, TEST_NAME_SILENT, TEST_NAME_TC, TEST_NAME_TCBAD,
+};
+
+static int
+Test_nameIndex(const char *name)
+{
+    for (int n = 0; n < 5; ++n) {
+        if (0 == strcasecmp(test_names[n], name)) {
+            return n;
+        }   // end if
+    }   // end for
+    return -1;
+}   // end function : Test_nameIndex
+
+/*
+ * 問い合わせに対する応答を作る. answer_num 個の A レコードを付ける.
+ * @return 応答の長さ
+ */
+static int
+Test_makeResponse(const unsigned char *query, int querylen, int answer_num, bool truncated,
+                  unsigned char *buf)
+{
+    memcpy(buf, query, querylen);
+    HEADER *header = (HEADER *) buf;
+    header->qr = 1;
+    header->ra = 1;
+    header->tc = truncated ? 1 : 0;
+    header->ancount = htons((uint16_t) answer_num);
+    unsigned char *p = buf + querylen;
+    for (int n = 0; n < answer_num; ++n) {
+        ns_put16(0xc000 | NS_HFIXEDSZ, p);  // question section の名前を指す
+        ns_put16(ns_t_a, p + 2);
+        ns_put16(ns_c_in, p + 4);
+        ns_put32(300, p + 6);
+        ns_put16(NS_INADDRSZ, p + 10);
+        p[12] = 192;
+        p[13] = 0;
+        p[14] = 2;
+        p[15] = (unsigned char) (n + 1);
+        p += 16;
+    }   // end for
+    return (int) (p - buf);
+}   // end function : Test_makeResponse
+
+static bool
+Test_parseQuery(const unsigned char *query, int querylen, char *name, size_t namelen)
+{
+    ns_msg msghandle;
+    ns_rr rr;
+    if (0 > ns_initparse(query, querylen, &msghandle) || 1 != ns_msg_count(msghandle, ns_s_qd)
+        || 0 != ns_parserr(&msghandle, ns_s_qd, 0, &rr)) {
+        return false;
+    }   // end if
+    snprintf(name, namelen, "%s", ns_rr_name(rr));
+    return true;
+}   // end function : Test_parseQuery
+
+static void
+Test_handleUdp(TestServer *server)
+{
+    unsigned char query[NS_PACKETSZ], response[NS_MAXMSG];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t querylen = recvfrom(server->udp_fd, query, sizeof(query), 0,
+                                (struct sockaddr *) &from, &fromlen);
+    char name[NS_MAXDNAME];
+    if (querylen < NS_HFIXEDSZ || !Test_parseQuery(query, querylen, name, sizeof(name))) {
+        return;
+    }   // end if
+    int index = Test_nameIndex(name);
+    if (0 > index) {
+        return;
+    }   // end if
+    __sync_fetch_and_add(&server->udp_query_num[index], 1);
+    int len;
+    if (0 == strcasecmp(TEST_NAME_SPOOF, name)) {
+        // ID が異なる
+        len = Test_makeResponse(query, querylen, 1, false, response);
+        ns_put16(ns_get16(query) ^ 0x5a5a, response);
+        (void) sendto(server->udp_fd, response, len, 0, (struct sockaddr *) &from, fromlen);
+        // RR タイプが異なる
+        len = Test_makeResponse(query, querylen, 1, false, response);
+        ns_put16(ns_t_txt, response + querylen - 2 * NS_INT16SZ);
+        (void) sendto(server->udp_fd, response, len, 0, (struct sockaddr *) &from, fromlen);
+        // 名前が異なる. 先頭のラベルの 1 文字目を書き換える
+        len = Test_makeResponse(query, querylen, 1, false, response);
+        response[NS_HFIXEDSZ + 1] = 'x';
+        (void) sendto(server->udp_fd, response, len, 0, (struct sockaddr *) &from, fromlen);
+        // 応答でなく問い合わせ
+        (void) sendto(server->udp_fd, query, querylen, 0, (struct sockaddr *) &from, fromlen);
+        // 短すぎる
+        (void) sendto(server->udp_fd, response, NS_HFIXEDSZ - 1, 0, (struct sockaddr *) &from,
+                      fromlen);
+        // 最後に正しい応答を返す. 区別できるように A レコードを 3 つ付ける
+        len = Test_makeResponse(query, querylen, 3, false, response);
+    } else if (0 == strcasecmp(TEST_NAME_SILENT, name)) {
+        return;
+    } else if (0 == strcasecmp(TEST_NAME_TC, name) || 0 == strcasecmp(TEST_NAME_TCBAD, name)) {
+        len = Test_makeResponse(query, querylen, 0, true, response);
+    } else {
+        len = Test_makeResponse(query, querylen, 1, false, response);
+    }   // end if
+    (void) sendto(server->udp_fd, response, len, 0, (struct sockaddr *) &from, fromlen);
+}   // end function : Test_handleUdp
+
+static bool
+Test_readAll(int fd, unsigned char *buf, size_t buflen)
+{
+    while (0 < buflen) {
+        ssize_t len = read(fd, buf, buflen);
+        if (len <= 0) {
+            return false;
+        }   // end if
+        buf += len;
+        buflen -= len;
+    }   // end while
+    return true;
+}   // end function : Test_readAll
+
+static void
+Test_handleTcp(TestServer *server)
+{
+    int fd = accept(server->tcp_fd, NULL, NULL);
+    if (0 > fd) {
+        return;
+    }   // end if
+    __sync_fetch_and_add(&server->tcp_query_num, 1);
+    unsigned char lenbuf[NS_INT16SZ], query[NS_PACKETSZ], response[NS_INT16SZ + NS_MAXMSG];
+    char name[NS_MAXDNAME];
+    if (!Test_readAll(fd, lenbuf, sizeof(lenbuf))) {
+        goto close;
+    }   // end if
+    int querylen = ns_get16(lenbuf);
+    if (querylen < NS_HFIXEDSZ || (int) sizeof(query) < querylen
+        || !Test_readAll(fd, query, querylen)
+        || !Test_parseQuery(query, querylen, name, sizeof(name))) {
+        goto close;
+    }   // end if
+    // UDP での応答と区別できるように, A レコードを 2 つ付ける
+    int len = Test_makeResponse(query, querylen, 2, false, response + NS_INT16SZ);
+    if (0 == strcasecmp(TEST_NAME_TCBAD, name)) {
+        ns_put16(ns_get16(query) ^ 0x5a5a, response + NS_INT16SZ);
+    }   // end if
+    ns_put16(len, response);
+    (void) write(fd, response, NS_INT16SZ + len);
+
+  close:
+    (void) close(fd);
+}   // end function : Test_handleTcp
+
+static void *
+Test_serverMain(void *arg)
+{
+    TestServer *server = (TestServer *) arg;
+    while (!server->stopping) {
+        struct pollfd pfd[2];
+        pfd[0].fd = server->udp_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = server->tcp_fd;
+        pfd[1].events = POLLIN;
+        if (0 >= poll(pfd, 2, 50)) {
+            continue;
+        }   // end if
+        if (0 != (pfd[0].revents & POLLIN)) {
+            Test_handleUdp(server);
+        }   // end if
+        if (0 != (pfd[1].revents & POLLIN)) {
+            Test_handleTcp(server);
+        }   // end if
+    }   // end while
+    return NULL;
+}   // end function : Test_serverMain
+
+/*
+ * ループバックの同じポート番号で UDP と TCP を待ち受けるネームサーバを起動する.
+ */
+static bool
+Test_startServer(TestServer *server)
+{
+    memset(server, 0, sizeof(TestServer));
+    for (int n = 0; n < 16; ++n) {
+        server->udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        server->tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (0 > server->udp_fd || 0 > server->tcp_fd) {
+            return false;
+        }   // end if
+        memset(&server->addr, 0, sizeof(server->addr));
+        server->addr.sin_family = AF_INET;
+        server->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addrlen = sizeof(server->addr);
+        if (0 == bind(server->udp_fd, (struct sockaddr *) &server->addr, addrlen)
+            && 0 == getsockname(server->udp_fd, (struct sockaddr *) &server->addr, &addrlen)
+            && 0 == bind(server->tcp_fd, (struct sockaddr *) &server->addr, addrlen)
+            && 0 == listen(server->tcp_fd, 16)) {
+            return 0 == pthread_create(&server->thread, NULL, Test_serverMain, server);
+        }   // end if
+        // UDP で選ばれたポート番号が TCP では使用中だった
+        (void) close(server->udp_fd);
+        (void) close(server->tcp_fd);
+    }   // end for
+    return false;
+}   // end function : Test_startServer
+
+static void
+Test_stopServer(TestServer *server)
+{
+    server->stopping = 1;
+    (void) pthread_join(server->thread, NULL);
+    (void) close(server->udp_fd);
+    (void) close(server->tcp_fd);
+}   // end function : Test_stopServer
+
+static void
+Test_callback(void *arg, const char *domain, int rrtype, int stat, const unsigned char *msg,
+              int msglen)
+{
+    (void) domain;
+    (void) rrtype;
+    TestResult *result = (TestResult *) arg;
+    ++(result->called);
+    result->stat = stat;
+    result->msglen = msglen;
+    if (NETDB_SUCCESS == stat) {
+        UNITTEST_CHECK(NULL != msg && 0 < msglen && msglen <= (int) sizeof(result->msg));
+        memcpy(result->msg, msg, msglen);
+    } else {
+        UNITTEST_CHECK(NULL == msg);
+    }   // end if
+}   // end function : Test_callback
+
+/*
+ * 問い合わせが成功し, name に対する answer_num 個の A レコードを含む応答を受け取ったことを確かめる.
+ */
+static void
+Test_checkAnswer(const TestResult *result, const char *name, int answer_num)
+{
+    UNITTEST_CHECK(1 == result->called);
+    UNITTEST_CHECK(NETDB_SUCCESS == result->stat);
+    if (1 != result->called || NETDB_SUCCESS != result->stat) {
+        return;
+    }   // end if
+    char qname[NS_MAXDNAME];
+    UNITTEST_CHECK(Test_parseQuery(result->msg, result->msglen, qname, sizeof(qname)));
+    UNITTEST_CHECK(0 == strcasecmp(name, qname));
+    UNITTEST_CHECK((unsigned int) answer_num == ns_get16(result->msg + 6));  // ANCOUNT
+}   // end function : Test_checkAnswer
+
+static uint64_t
+Test_now(void)
+{
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}   // end function : Test_now
+
+/*
+ * 複数の問い合わせを同時に進める.
+ * 一致しない応答は捨てて正しい応答を待ち, 切り詰められた応答は TCP で問い合わせ直す.
+ */
+static void
+Test_dispatch(TestServer *server, struct __res_state *resolver)
+{
+    resolver->nscount = 1;
+    resolver->nsaddr_list[0] = server->addr;
+    DnsAsync *dnsasync = DnsAsync_new(resolver);
+    UNITTEST_CHECK(NULL != dnsasync);
+    if (NULL == dnsasync) {
+        return;
+    }   // end if
+    DnsAsync_setTimeout(dnsasync, TEST_QUERY_TIMEOUT, 2);
+
+    TestResult results[5];
+    memset(results, 0, sizeof(results));
+    for (int n = 0; n < 5; ++n) {
+        UNITTEST_CHECK(0 == DnsAsync_submit(dnsasync, test_names[n], ns_t_a, Test_callback,
+                                            &results[n]));
+    }   // end for
+    UNITTEST_CHECK(5 == DnsAsync_getQueryCount(dnsasync));
+    uint64_t start = Test_now();
+    uint64_t silent_done = 0;
+    while (0 < DnsAsync_getQueryCount(dnsasync)) {
+        UNITTEST_CHECK(0 <= DnsAsync_dispatch(dnsasync, -1));
+        if (0 == silent_done && 0 < results[2].called) {
+            silent_done = Test_now();
+        }   // end if
+    }   // end while
+    UNITTEST_CHECK(0 == DnsAsync_dispatch(dnsasync, 0));
+    // 全て完了したのでソケットは閉じている
+    UNITTEST_CHECK(0 > dnsasync->server[0].fd);
+
+    Test_checkAnswer(&results[0], TEST_NAME_OK, 1);
+    // 一致しない応答は全て無視し, 最後の正しい応答を受け取る
+    Test_checkAnswer(&results[1], TEST_NAME_SPOOF, 3);
+    // 応答がなければ, 再送してからタイムアウトで TRY_AGAIN になる
+    UNITTEST_CHECK(1 == results[2].called && TRY_AGAIN == results[2].stat);
+    UNITTEST_CHECK(2 * TEST_QUERY_TIMEOUT <= silent_done - start);
+    UNITTEST_CHECK(2 == server->udp_query_num[2]);
+    // 切り詰められた応答を受け取れば TCP で問い合わせ直し, その応答を受け取る
+    Test_checkAnswer(&results[3], TEST_NAME_TC, 2);
+    // TCP での応答が一致しなければ TRY_AGAIN になる
+    UNITTEST_CHECK(1 == results[4].called && TRY_AGAIN == results[4].stat);
+    UNITTEST_CHECK(2 == server->tcp_query_num);
+    // 応答が得られた問い合わせは再送しない
+    UNITTEST_CHECK(1 == server->udp_query_num[0] && 1 == server->udp_query_num[1]
+                   && 1 == server->udp_query_num[3] && 1 == server->udp_query_num[4]);
+
+    // 一連の問い合わせを終えた後も同じオブジェクトで問い合わせられる
+    memset(results, 0, sizeof(results));
+    UNITTEST_CHECK(0 == DnsAsync_submit(dnsasync, TEST_NAME_OK, ns_t_a, Test_callback,
+                                        &results[0]));
+    while (0 < DnsAsync_dispatch(dnsasync, -1));
+    Test_checkAnswer(&results[0], TEST_NAME_OK, 1);
+    DnsAsync_free(dnsasync);
+}   // end function : Test_dispatch
+
+/*
+ * 送信していないネームサーバからの応答は, ID と question section が一致していても受け付けない.
+ */
+static void
+Test_unaskedServer(TestServer *server, struct __res_state *resolver)
+{
+    // 2 番目のネームサーバは試験の中で直接応答する
+    int other_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in other_addr;
+    memset(&other_addr, 0, sizeof(other_addr));
+    other_addr.sin_family = AF_INET;
+    other_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(other_addr);
+    UNITTEST_CHECK(0 <= other_fd);
+    UNITTEST_CHECK(0 == bind(other_fd, (struct sockaddr *) &other_addr, addrlen));
+    UNITTEST_CHECK(0 == getsockname(other_fd, (struct sockaddr *) &other_addr, &addrlen));
+
+    resolver->nscount = 2;
+    resolver->nsaddr_list[0] = server->addr;
+    resolver->nsaddr_list[1] = other_addr;
+    DnsAsync *dnsasync = DnsAsync_new(resolver);
+    UNITTEST_CHECK(NULL != dnsasync);
+    if (NULL == dnsasync) {
+        (void) close(other_fd);
+        return;
+    }   // end if
+    UNITTEST_CHECK(2 == dnsasync->server_num);
+    DnsAsync_setTimeout(dnsasync, TEST_QUERY_TIMEOUT, 1);
+
+    TestResult result;
+    memset(&result, 0, sizeof(result));
+    UNITTEST_CHECK(0 == DnsAsync_submit(dnsasync, TEST_NAME_SILENT, ns_t_a, Test_callback,
+                                        &result));
+    DnsAsyncQuery *q = NULL;
+    for (size_t n = 0; n < DNSASYNC_ID_BUCKETS && NULL == q; ++n) {
+        q = dnsasync->id_bucket[n];
+    }   // end for
+    UNITTEST_CHECK(NULL != q);
+    if (NULL == q) {
+        DnsAsync_free(dnsasync);
+        (void) close(other_fd);
+        return;
+    }   // end if
+
+    // まだ送信していない 2 番目のネームサーバのソケットに, 正しい応答を送り付ける
+    struct sockaddr_in client_addr;
+    addrlen = sizeof(client_addr);
+    UNITTEST_CHECK(0 == getsockname(dnsasync->server[1].fd, (struct sockaddr *) &client_addr,
+                                    &addrlen));
+    unsigned char response[NS_MAXMSG];
+    int len = Test_makeResponse(q->query, q->querylen, 1, false, response);
+    UNITTEST_CHECK(len == sendto(other_fd, response, len, 0, (struct sockaddr *) &client_addr,
+                                 addrlen));
+    UNITTEST_CHECK(1 == DnsAsync_dispatch(dnsasync, TEST_QUERY_TIMEOUT / 2));
+    UNITTEST_CHECK(0 == result.called);
+
+    // タイムアウトすると 2 番目のネームサーバに再送するので, そこへの応答は受け付ける
+    struct pollfd pfd;
+    pfd.fd = other_fd;
+    pfd.events = POLLIN;
+    while (0 == result.called && 0 == poll(&pfd, 1, 0)) {
+        UNITTEST_CHECK(0 <= DnsAsync_dispatch(dnsasync, 10));
+    }   // end while
+    UNITTEST_CHECK(0 == result.called);
+    unsigned char query[NS_PACKETSZ];
+    ssize_t querylen = recv(other_fd, query, sizeof(query), 0);
+    UNITTEST_CHECK(q->querylen == querylen && 0 == memcmp(q->query, query, querylen));
+    len = Test_makeResponse(query, querylen, 2, false, response);
+    UNITTEST_CHECK(len == sendto(other_fd, response, len, 0, (struct sockaddr *) &client_addr,
+                                 sizeof(client_addr)));
+    while (0 < DnsAsync_dispatch(dnsasync, -1));
+    Test_checkAnswer(&result, TEST_NAME_SILENT, 2);
+    DnsAsync_free(dnsasync);
+    (void) close(other_fd);
+}   // end function : Test_unaskedServer
+
+int
+main(void)
+{
+    alarm(TEST_TIMEOUT);
+    struct __res_state resolver;
+    memset(&resolver, 0, sizeof(resolver));
+    UNITTEST_CHECK(0 == res_ninit(&resolver));
+
+    TestServer server;
+    UNITTEST_CHECK(Test_startServer(&server));
+    Test_dispatch(&server, &resolver);
+    Test_unaskedServer(&server, &resolver);
+    Test_stopServer(&server);
+    res_nclose(&resolver);
+    return UNITTEST_RESULT();
+}   // end function : main
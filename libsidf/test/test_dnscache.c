@@ -0,0 +1,631 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * DnsCache のシャード毎の LRU とメモリの上限, 同じ問い合わせの合流 (single-flight),
+ * 猶予期間中のエントリの更新の依頼, スナップショットの書き出しと読み込みを確かめる.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <arpa/nameser.h>
+
+#include "unittest.h"
+// シャードの使用量やエントリの有効期限を直接確かめるため, 実装をそのまま取り込む
+#include "../src/dnscache.c"
+
+#define TEST_MSGLEN 100
+#define TEST_SHARD_ENTRY_NUM 3
+#define TEST_WAITER_NUM 4
+#define TEST_SNAPSHOT_ENTRY_NUM 50
+
+static uint32_t test_seed = 2463534242U;
+
+static uint32_t
+Test_random(void)
+{
+    // xorshift32
+    test_seed ^= test_seed << 13;
+    test_seed ^= test_seed >> 17;
+    test_seed ^= test_seed << 5;
+    return test_seed;
+}   // end function : Test_random
+
+/*
+ * 名前毎に異なる内容の応答メッセージを作る. キャッシュは中身を解釈しない.
+ */
+static void
+Test_makeMessage(const char *domain, unsigned char *msg, size_t msglen)
+{
+    size_t domainlen = strlen(domain);
+    for (size_t n = 0; n < msglen; ++n) {
+        msg[n] = (unsigned char) (domain[n % domainlen] + n / domainlen);
+    }   // end for
+}   // end function : Test_makeMessage
+
+static uint32_t
+Test_hash(const char *domain, int rrtype)
+{
+    char key[NS_MAXDNAME];
+    int keylen = CacheUtil_normalizeDomain(domain, key, sizeof(key));
+    return CacheUtil_hashTyped(key, keylen, (uint32_t) rrtype);
+}   // end function : Test_hash
+
+/*
+ * shard 番目のシャードに入る名前を, start 番から順に探して buf に書き出す.
+ * @return 次に探し始める番号
+ */
+static unsigned int
+Test_findName(size_t shard, unsigned int start, char *buf, size_t buflen)
+{
+    for (;; ++start) {
+        snprintf(buf, buflen, "h%06u.example.com", start);
+        if (shard == (Test_hash(buf, ns_t_a) & (DNSCACHE_SHARD_NUM - 1))) {
+            return start + 1;
+        }   // end if
+    }   // end for
+}   // end function : Test_findName
+
+static bool
+Test_isCached(DnsCache *cache, const char *domain, int rrtype, size_t msglen)
+{
+    unsigned char expected[NS_PACKETSZ], buf[NS_PACKETSZ];
+    Test_makeMessage(domain, expected, msglen);
+    int len = DnsCache_lookup(cache, domain, rrtype, buf, sizeof(buf), NULL);
+    return (size_t) len == msglen && 0 == memcmp(expected, buf, msglen);
+}   // end function : Test_isCached
+
+static void
+Test_store(DnsCache *cache, const char *domain, int rrtype, size_t msglen, unsigned long ttl)
+{
+    unsigned char msg[NS_PACKETSZ];
+    Test_makeMessage(domain, msg, msglen);
+    DnsCache_store(cache, domain, rrtype, msg, msglen, ttl);
+}   // end function : Test_store
+
+/*
+ * エントリの有効期限を現在から seconds 秒前にずらす.
+ */
+static void
+Test_expire(DnsCache *cache, const char *domain, int rrtype, time_t seconds)
+{
+    char key[NS_MAXDNAME];
+    int keylen = CacheUtil_normalizeDomain(domain, key, sizeof(key));
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) rrtype);
+    DnsCacheShard *shard = DnsCache_getShard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    DnsCacheEntry *entry = DnsCacheShard_findEntry(shard, hash, key, keylen, rrtype);
+    UNITTEST_CHECK(NULL != entry);
+    if (NULL != entry) {
+        entry->expire = CacheUtil_now() - seconds;
+    }   // end if
+    pthread_mutex_unlock(&shard->lock);
+}   // end function : Test_expire
+
+/*
+ * シャードの使用量が上限を越えておらず, LRU リスト上のエントリのサイズの合計と一致するか確かめる.
+ */
+static void
+Test_checkUsage(DnsCache *cache)
+{
+    for (size_t n = 0; n < DNSCACHE_SHARD_NUM; ++n) {
+        DnsCacheShard *shard = &(cache->shard[n]);
+        size_t total = 0;
+        pthread_mutex_lock(&shard->lock);
+        for (CacheLruLink *link = shard->lru.head; NULL != link; link = link->next) {
+            total += CACHELRU_ENTRY(DnsCacheEntry, link)->entry_size;
+        }   // end for
+        UNITTEST_CHECK(total == shard->memory_used);
+        UNITTEST_CHECK(shard->memory_used <= shard->memory_limit);
+        pthread_mutex_unlock(&shard->lock);
+    }   // end for
+}   // end function : Test_checkUsage
+
+/*
+ * 同じシャードに入る名前で上限を越えると, 最も長く参照されていないエントリから追い出す.
+ */
+static void
+Test_lru(void)
+{
+    char names[TEST_SHARD_ENTRY_NUM + 1][NS_MAXDNAME];
+    unsigned int next = 0;
+    for (size_t n = 0; n <= TEST_SHARD_ENTRY_NUM; ++n) {
+        next = Test_findName(0, next, names[n], sizeof(names[n]));
+    }   // end for
+    // 名前は全て同じ長さなので, エントリのサイズも揃う
+    size_t entry_size = sizeof(DnsCacheEntry) + TEST_MSGLEN + strlen(names[0]) + 1;
+    DnsCache *cache = DnsCache_new(DNSCACHE_SHARD_NUM * TEST_SHARD_ENTRY_NUM * entry_size);
+    UNITTEST_CHECK(NULL != cache);
+    if (NULL == cache) {
+        return;
+    }   // end if
+
+    for (size_t n = 0; n < TEST_SHARD_ENTRY_NUM; ++n) {
+        Test_store(cache, names[n], ns_t_a, TEST_MSGLEN, 300);
+    }   // end for
+    UNITTEST_CHECK(TEST_SHARD_ENTRY_NUM * entry_size == cache->shard[0].memory_used);
+    // 引いたエントリは LRU リストの先頭に移る
+    for (size_t n = 0; n < TEST_SHARD_ENTRY_NUM; ++n) {
+        UNITTEST_CHECK(Test_isCached(cache, names[n], ns_t_a, TEST_MSGLEN));
+    }   // end for
+    UNITTEST_CHECK(Test_isCached(cache, names[0], ns_t_a, TEST_MSGLEN));
+
+    // 上限に達しているので, 最も長く参照されていない names[1] が追い出される
+    Test_store(cache, names[TEST_SHARD_ENTRY_NUM], ns_t_a, TEST_MSGLEN, 300);
+    UNITTEST_CHECK(TEST_SHARD_ENTRY_NUM * entry_size == cache->shard[0].memory_used);
+    UNITTEST_CHECK(!Test_isCached(cache, names[1], ns_t_a, TEST_MSGLEN));
+    UNITTEST_CHECK(Test_isCached(cache, names[0], ns_t_a, TEST_MSGLEN));
+    UNITTEST_CHECK(Test_isCached(cache, names[2], ns_t_a, TEST_MSGLEN));
+    UNITTEST_CHECK(Test_isCached(cache, names[TEST_SHARD_ENTRY_NUM], ns_t_a, TEST_MSGLEN));
+
+    // 同じキーで格納し直すと置き換わり, 他のエントリは追い出さない
+    Test_store(cache, names[0], ns_t_a, TEST_MSGLEN - 1, 300);
+    UNITTEST_CHECK(Test_isCached(cache, names[0], ns_t_a, TEST_MSGLEN - 1));
+    UNITTEST_CHECK(Test_isCached(cache, names[2], ns_t_a, TEST_MSGLEN));
+    UNITTEST_CHECK(Test_isCached(cache, names[TEST_SHARD_ENTRY_NUM], ns_t_a, TEST_MSGLEN));
+
+    // 名前の大文字小文字や末尾のドットは区別しないが, RR タイプは区別する
+    char upper[NS_MAXDNAME + 1];
+    snprintf(upper, sizeof(upper), "%s.", names[2]);
+    for (char *p = upper; '\0' != *p; ++p) {
+        if ('a' <= *p && *p <= 'z') {
+            *p = (char) (*p - 'a' + 'A');
+        }   // end if
+    }   // end for
+    unsigned char buf[NS_PACKETSZ];
+    UNITTEST_CHECK(TEST_MSGLEN == DnsCache_lookup(cache, upper, ns_t_a, buf, sizeof(buf), NULL));
+    UNITTEST_CHECK(0 > DnsCache_lookup(cache, names[2], ns_t_txt, buf, sizeof(buf), NULL));
+    // バッファに収まらない場合はヒットしない
+    UNITTEST_CHECK(0 > DnsCache_lookup(cache, names[2], ns_t_a, buf, TEST_MSGLEN - 1, NULL));
+
+    // シャードの上限より大きなエントリは格納しない
+    Test_store(cache, names[1], ns_t_a, NS_PACKETSZ, 300);
+    UNITTEST_CHECK(!Test_isCached(cache, names[1], ns_t_a, NS_PACKETSZ));
+    UNITTEST_CHECK(Test_isCached(cache, names[2], ns_t_a, TEST_MSGLEN));
+    // TTL 0 の応答は格納しない
+    Test_store(cache, names[1], ns_t_a, TEST_MSGLEN, 0);
+    UNITTEST_CHECK(!Test_isCached(cache, names[1], ns_t_a, TEST_MSGLEN));
+    Test_checkUsage(cache);
+
+    // 大きさの異なるエントリを大量に格納しても, どのシャードも上限を越えない
+    for (unsigned int n = 0; n < 5000; ++n) {
+        char name[NS_MAXDNAME];
+        snprintf(name, sizeof(name), "r%u.example.net", Test_random() % 2000);
+        Test_store(cache, name, (0 == n % 3) ? ns_t_txt : ns_t_a, 1 + Test_random() % 200, 300);
+    }   // end for
+    Test_checkUsage(cache);
+    DnsCache_free(cache);
+}   // end function : Test_lru
+
+typedef struct TestWaiter {
+    DnsCache *cache;
+    const char *domain;
+    int64_t timeout_msec;
+    int result;
+    int stat;
+    unsigned char buf[NS_PACKETSZ];
+} TestWaiter;
+
+static void *
+Test_joinThread(void *arg)
+{
+    TestWaiter *waiter = (TestWaiter *) arg;
+    DnsCacheFlight *flight;
+    waiter->result = DnsCache_joinFlight(waiter->cache, waiter->domain, ns_t_a, waiter->buf,
+                                         sizeof(waiter->buf), &flight, &waiter->stat,
+                                         waiter->timeout_msec);
+    UNITTEST_CHECK(NULL == flight);
+    return NULL;
+}   // end function : Test_joinThread
+
+/*
+ * 先行する問い合わせを待つスレッドが waiter_num 個 (先行するスレッド自身を含む) になるまで待つ.
+ */
+static void
+Test_waitWaiters(DnsCache *cache, DnsCacheFlight *flight, unsigned int waiter_num)
+{
+    DnsCacheShard *shard = DnsCache_getShard(cache, flight->hash);
+    for (;;) {
+        pthread_mutex_lock(&shard->lock);
+        bool ready = (waiter_num <= flight->waiter_num);
+        pthread_mutex_unlock(&shard->lock);
+        if (ready) {
+            return;
+        }   // end if
+        usleep(1000);
+    }   // end for
+}   // end function : Test_waitWaiters
+
+/*
+ * 最初のスレッドだけが問い合わせ, 同時に同じ問い合わせをした他のスレッドはその結果を受け取る.
+ * stat が NETDB_SUCCESS 以外の場合は, 待っていたスレッドも同じ stat で失敗する.
+ */
+static void
+Test_flightShare(DnsCache *cache, const char *domain, int stat)
+{
+    unsigned char buf[NS_PACKETSZ];
+    DnsCacheFlight *flight = NULL;
+    int lead_stat;
+    UNITTEST_CHECK(DNSCACHE_FLIGHT_LEAD ==
+                   DnsCache_joinFlight(cache, domain, ns_t_a, buf, sizeof(buf), &flight,
+                                       &lead_stat, INT64_MAX));
+    UNITTEST_CHECK(NULL != flight);
+    if (NULL == flight) {
+        return;
+    }   // end if
+
+    TestWaiter waiters[TEST_WAITER_NUM];
+    pthread_t threads[TEST_WAITER_NUM];
+    for (size_t n = 0; n < TEST_WAITER_NUM; ++n) {
+        waiters[n].cache = cache;
+        waiters[n].domain = domain;
+        waiters[n].timeout_msec = (0 == n % 2) ? INT64_MAX : 60000;
+        waiters[n].result = 0;
+        waiters[n].stat = NETDB_SUCCESS;
+        UNITTEST_CHECK(0 == pthread_create(&threads[n], NULL, Test_joinThread, &waiters[n]));
+    }   // end for
+    Test_waitWaiters(cache, flight, TEST_WAITER_NUM + 1);
+
+    unsigned char msg[NS_PACKETSZ];
+    Test_makeMessage(domain, msg, TEST_MSGLEN);
+    DnsCache_landFlight(cache, flight, stat, msg, TEST_MSGLEN);
+    for (size_t n = 0; n < TEST_WAITER_NUM; ++n) {
+        UNITTEST_CHECK(0 == pthread_join(threads[n], NULL));
+        if (NETDB_SUCCESS == stat) {
+            UNITTEST_CHECK(TEST_MSGLEN == waiters[n].result);
+            UNITTEST_CHECK(0 == memcmp(msg, waiters[n].buf, TEST_MSGLEN));
+        } else {
+            UNITTEST_CHECK(DNSCACHE_FLIGHT_FAILED == waiters[n].result);
+            UNITTEST_CHECK(stat == waiters[n].stat);
+        }   // end if
+    }   // end for
+
+    // 着地した問い合わせは取り除かれているので, 次は改めて問い合わせる側になる
+    UNITTEST_CHECK(DNSCACHE_FLIGHT_LEAD ==
+                   DnsCache_joinFlight(cache, domain, ns_t_a, buf, sizeof(buf), &flight,
+                                       &lead_stat, INT64_MAX));
+    UNITTEST_CHECK(NULL != flight);
+    DnsCache_landFlight(cache, flight, HOST_NOT_FOUND, NULL, 0);
+}   // end function : Test_flightShare
+
+static void
+Test_flight(void)
+{
+    DnsCache *cache = DnsCache_new(1 << 20);
+    UNITTEST_CHECK(NULL != cache);
+    if (NULL == cache) {
+        return;
+    }   // end if
+    Test_flightShare(cache, "share.example.com", NETDB_SUCCESS);
+    Test_flightShare(cache, "fail.example.com", NO_RECOVERY);
+
+    // 先行する問い合わせを待つのは timeout_msec までで, 過ぎると TRY_AGAIN で諦める
+    unsigned char buf[NS_PACKETSZ];
+    DnsCacheFlight *flight = NULL;
+    int stat;
+    UNITTEST_CHECK(DNSCACHE_FLIGHT_LEAD ==
+                   DnsCache_joinFlight(cache, "slow.example.com", ns_t_a, buf, sizeof(buf),
+                                       &flight, &stat, INT64_MAX));
+    UNITTEST_CHECK(NULL != flight);
+    TestWaiter waiter;
+    waiter.cache = cache;
+    waiter.domain = "slow.example.com";
+    waiter.timeout_msec = 50;
+    Test_joinThread(&waiter);
+    UNITTEST_CHECK(DNSCACHE_FLIGHT_FAILED == waiter.result);
+    UNITTEST_CHECK(TRY_AGAIN == waiter.stat);
+    UNITTEST_CHECK(ETIMEDOUT == errno);
+    // 待つ時間が 0 の場合は待たずに諦める
+    waiter.timeout_msec = 0;
+    Test_joinThread(&waiter);
+    UNITTEST_CHECK(DNSCACHE_FLIGHT_FAILED == waiter.result);
+    UNITTEST_CHECK(TRY_AGAIN == waiter.stat);
+    // 諦めたスレッドがいても先行する問い合わせはそのまま着地できる
+    DnsCache_landFlight(cache, flight, NETDB_SUCCESS, buf, 0);
+
+    // 異なる RR タイプの問い合わせは合流しない
+    DnsCacheFlight *flight_a = NULL, *flight_txt = NULL;
+    UNITTEST_CHECK(DNSCACHE_FLIGHT_LEAD ==
+                   DnsCache_joinFlight(cache, "type.example.com", ns_t_a, buf, sizeof(buf),
+                                       &flight_a, &stat, 0));
+    UNITTEST_CHECK(DNSCACHE_FLIGHT_LEAD ==
+                   DnsCache_joinFlight(cache, "type.example.com", ns_t_txt, buf, sizeof(buf),
+                                       &flight_txt, &stat, 0));
+    UNITTEST_CHECK(NULL != flight_a && NULL != flight_txt && flight_a != flight_txt);
+    DnsCache_landFlight(cache, flight_txt, HOST_NOT_FOUND, NULL, 0);
+    DnsCache_landFlight(cache, flight_a, HOST_NOT_FOUND, NULL, 0);
+
+    // 登録の直前に格納された応答があれば, 問い合わせずにそれを受け取る
+    Test_store(cache, "stored.example.com", ns_t_a, TEST_MSGLEN, 300);
+    UNITTEST_CHECK(TEST_MSGLEN ==
+                   DnsCache_joinFlight(cache, "stored.example.com", ns_t_a, buf, sizeof(buf),
+                                       &flight, &stat, INT64_MAX));
+    UNITTEST_CHECK(NULL == flight);
+    DnsCache_free(cache);
+}   // end function : Test_flight
+
+/*
+ * 猶予期間中のエントリは TTL 0 として返し, 更新の依頼を 1 つだけ積む.
+ */
+static void
+Test_grace(void)
+{
+    DnsCache *cache = DnsCache_new(1 << 20);
+    UNITTEST_CHECK(NULL != cache);
+    if (NULL == cache) {
+        return;
+    }   // end if
+    unsigned char buf[NS_PACKETSZ];
+    unsigned long ttl = 0;
+
+    // 猶予期間を設定しなければ, 期限切れのエントリは返さない
+    Test_store(cache, "stale.example.com", ns_t_a, TEST_MSGLEN, 300);
+    UNITTEST_CHECK(TEST_MSGLEN ==
+                   DnsCache_lookup(cache, "stale.example.com", ns_t_a, buf, sizeof(buf), &ttl));
+    UNITTEST_CHECK(0 < ttl && ttl <= 300);
+    Test_expire(cache, "stale.example.com", ns_t_a, 1);
+    UNITTEST_CHECK(0 > DnsCache_lookup(cache, "stale.example.com", ns_t_a, buf, sizeof(buf), &ttl));
+    UNITTEST_CHECK(0 == cache->refresh_num);
+
+    DnsCache_setGrace(cache, 60);
+    Test_store(cache, "stale.example.com", ns_t_a, TEST_MSGLEN, 300);
+    Test_expire(cache, "stale.example.com", ns_t_a, 1);
+    ttl = 1;
+    UNITTEST_CHECK(Test_isCached(cache, "stale.example.com", ns_t_a, TEST_MSGLEN));
+    UNITTEST_CHECK(TEST_MSGLEN ==
+                   DnsCache_lookup(cache, "stale.example.com", ns_t_a, buf, sizeof(buf), &ttl));
+    UNITTEST_CHECK(0 == ttl);
+    // 何度引いても, 更新中の依頼は 1 つだけ
+    UNITTEST_CHECK(1 == cache->refresh_num);
+
+    char domain[NS_MAXDNAME];
+    int rrtype = 0;
+    UNITTEST_CHECK(DnsCache_takeRefresh(cache, domain, sizeof(domain), &rrtype));
+    UNITTEST_CHECK(0 == strcmp("stale.example.com", domain) && ns_t_a == rrtype);
+    UNITTEST_CHECK(0 == cache->refresh_num);
+    UNITTEST_CHECK(Test_isCached(cache, "stale.example.com", ns_t_a, TEST_MSGLEN));
+    UNITTEST_CHECK(0 == cache->refresh_num);
+
+    // 更新に失敗して期限切れのまま残っていれば, 次に引かれた際に改めて依頼を積む
+    DnsCache_endRefresh(cache, domain, rrtype);
+    UNITTEST_CHECK(Test_isCached(cache, "stale.example.com", ns_t_a, TEST_MSGLEN));
+    UNITTEST_CHECK(1 == cache->refresh_num);
+    UNITTEST_CHECK(DnsCache_takeRefresh(cache, domain, sizeof(domain), &rrtype));
+
+    // 更新に成功すれば有効なエントリに戻る
+    Test_store(cache, domain, rrtype, TEST_MSGLEN, 300);
+    DnsCache_endRefresh(cache, domain, rrtype);
+    UNITTEST_CHECK(TEST_MSGLEN ==
+                   DnsCache_lookup(cache, "stale.example.com", ns_t_a, buf, sizeof(buf), &ttl));
+    UNITTEST_CHECK(0 < ttl);
+    UNITTEST_CHECK(0 == cache->refresh_num);
+
+    // 猶予期間も過ぎたエントリは取り除く
+    Test_expire(cache, "stale.example.com", ns_t_a, 60);
+    UNITTEST_CHECK(0 > DnsCache_lookup(cache, "stale.example.com", ns_t_a, buf, sizeof(buf), &ttl));
+    UNITTEST_CHECK(0 == cache->refresh_num);
+    UNITTEST_CHECK(0 == cache->shard[Test_hash("stale.example.com", ns_t_a)
+                                     & (DNSCACHE_SHARD_NUM - 1)].memory_used);
+
+    // 停止後は依頼を積まず, 取り出そうとしても待たずに戻る
+    Test_store(cache, "stale.example.com", ns_t_a, TEST_MSGLEN, 300);
+    Test_expire(cache, "stale.example.com", ns_t_a, 1);
+    DnsCache_stopRefresh(cache);
+    UNITTEST_CHECK(Test_isCached(cache, "stale.example.com", ns_t_a, TEST_MSGLEN));
+    UNITTEST_CHECK(0 == cache->refresh_num);
+    UNITTEST_CHECK(!DnsCache_takeRefresh(cache, domain, sizeof(domain), &rrtype));
+    DnsCache_free(cache);
+}   // end function : Test_grace
+
+static bool
+Test_writeFile(const char *path, const void *data, size_t datalen)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (0 > fd) {
+        return false;
+    }   // end if
+    bool ok = ((ssize_t) datalen == write(fd, data, datalen));
+    return 0 == close(fd) && ok;
+}   // end function : Test_writeFile
+
+/*
+ * path のスナップショットを読み込み, 読み込んだエントリの数を返す.
+ * 読み込んだエントリは names の先頭から順に格納したものと一致することを確かめる.
+ */
+static long
+Test_load(const char *path, char names[][NS_MAXDNAME], size_t name_num)
+{
+    DnsCache *cache = DnsCache_new(1 << 20);
+    UNITTEST_CHECK(NULL != cache);
+    if (NULL == cache) {
+        return -1;
+    }   // end if
+    long entry_num = DnsCache_load(cache, path);
+    int save_errno = errno;
+    for (size_t n = 0; 0 < entry_num && n < name_num; ++n) {
+        bool cached = Test_isCached(cache, names[n], ns_t_a, TEST_MSGLEN + n);
+        UNITTEST_CHECK(cached == (n < (size_t) entry_num));
+    }   // end for
+    DnsCache_free(cache);
+    errno = save_errno;
+    return entry_num;
+}   // end function : Test_load
+
+/*
+ * 有効なエントリだけを書き出し, 残りの TTL を引き継いで読み込む.
+ * 壊れたファイルは読み込まず, 途中で壊れていればそこで読み込みを打ち切る.
+ */
+static void
+Test_snapshot(void)
+{
+    char dir[] = "/tmp/test_dnscache.XXXXXX";
+    UNITTEST_CHECK(NULL != mkdtemp(dir));
+    char path[sizeof(dir) + 32], copy[sizeof(dir) + 32];
+    snprintf(path, sizeof(path), "%s/snapshot", dir);
+    snprintf(copy, sizeof(copy), "%s/copy", dir);
+
+    DnsCache *cache = DnsCache_new(1 << 20);
+    UNITTEST_CHECK(NULL != cache);
+    if (NULL == cache) {
+        return;
+    }   // end if
+    // 全て同じシャードに入る名前にして, 参照されていない順 (格納した順) に書き出させる
+    static char names[TEST_SNAPSHOT_ENTRY_NUM][NS_MAXDNAME];
+    unsigned int next = 0;
+    for (size_t n = 0; n < TEST_SNAPSHOT_ENTRY_NUM; ++n) {
+        next = Test_findName(3, next, names[n], sizeof(names[n]));
+        Test_store(cache, names[n], ns_t_a, TEST_MSGLEN + n, 300);
+    }   // end for
+    Test_store(cache, "expired.example.com", ns_t_a, TEST_MSGLEN, 300);
+    Test_expire(cache, "expired.example.com", ns_t_a, 1);
+
+    // 期限切れのエントリは書き出さない
+    UNITTEST_CHECK(TEST_SNAPSHOT_ENTRY_NUM == DnsCache_save(cache, path));
+    DnsCache_free(cache);
+
+    // 書き出した TTL を引き継ぐ
+    cache = DnsCache_new(1 << 20);
+    UNITTEST_CHECK(NULL != cache);
+    if (NULL == cache) {
+        return;
+    }   // end if
+    UNITTEST_CHECK(TEST_SNAPSHOT_ENTRY_NUM == DnsCache_load(cache, path));
+    unsigned char buf[NS_PACKETSZ];
+    unsigned long ttl = 0;
+    UNITTEST_CHECK(TEST_MSGLEN ==
+                   DnsCache_lookup(cache, names[0], ns_t_a, buf, sizeof(buf), &ttl));
+    UNITTEST_CHECK(290 < ttl && ttl <= 300);
+    UNITTEST_CHECK(0 > DnsCache_lookup(cache, "expired.example.com", ns_t_a, buf, sizeof(buf),
+                                       NULL));
+    DnsCache_free(cache);
+    UNITTEST_CHECK(TEST_SNAPSHOT_ENTRY_NUM == Test_load(path, names, TEST_SNAPSHOT_ENTRY_NUM));
+
+    // スナップショットをメモリに読み込んでおき, 書き換えたものを読ませる
+    static unsigned char image[(sizeof(DnsCacheSnapshotEntry) + NS_MAXDNAME + NS_PACKETSZ)
+                               * TEST_SNAPSHOT_ENTRY_NUM];
+    int fd = open(path, O_RDONLY);
+    UNITTEST_CHECK(0 <= fd);
+    ssize_t imagelen = read(fd, image, sizeof(image));
+    (void) close(fd);
+    UNITTEST_CHECK((ssize_t) sizeof(DnsCacheSnapshotHeader) < imagelen);
+    if ((ssize_t) sizeof(DnsCacheSnapshotHeader) >= imagelen) {
+        return;
+    }   // end if
+    // 最初と 2 番目のエントリの位置
+    size_t first = sizeof(DnsCacheSnapshotHeader);
+    DnsCacheSnapshotEntry entry;
+    memcpy(&entry, image + first, sizeof(entry));
+    size_t second = first + DNSCACHE_SNAPSHOT_ALIGN(sizeof(entry) + entry.keylen + entry.msglen);
+
+    // ヘッダより短い
+    UNITTEST_CHECK(Test_writeFile(copy, image, sizeof(DnsCacheSnapshotHeader) - 1));
+    errno = 0;
+    UNITTEST_CHECK(-1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM) && EINVAL == errno);
+    // マジックナンバーが異なる
+    image[0] ^= 0xff;
+    UNITTEST_CHECK(Test_writeFile(copy, image, imagelen));
+    errno = 0;
+    UNITTEST_CHECK(-1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM) && EINVAL == errno);
+    image[0] ^= 0xff;
+    // バージョンが異なる
+    image[4] ^= 0xff;
+    UNITTEST_CHECK(Test_writeFile(copy, image, imagelen));
+    errno = 0;
+    UNITTEST_CHECK(-1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM) && EINVAL == errno);
+    image[4] ^= 0xff;
+
+    // 2 番目のエントリの途中で切れている
+    UNITTEST_CHECK(Test_writeFile(copy, image, second + sizeof(entry) + 1));
+    UNITTEST_CHECK(1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM));
+    // エントリのヘッダの途中で切れている
+    UNITTEST_CHECK(Test_writeFile(copy, image, second + 1));
+    UNITTEST_CHECK(1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM));
+    // ヘッダのエントリ数より少ない
+    UNITTEST_CHECK(Test_writeFile(copy, image, sizeof(DnsCacheSnapshotHeader)));
+    UNITTEST_CHECK(0 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM));
+
+    // 2 番目のエントリのキーの長さが壊れている. ファイルには収まるがドメイン名としては長すぎる
+    DnsCacheSnapshotEntry broken;
+    memcpy(&broken, image + second, sizeof(broken));
+    DnsCacheSnapshotEntry saved = broken;
+    broken.keylen = NS_MAXDNAME;
+    memcpy(image + second, &broken, sizeof(broken));
+    UNITTEST_CHECK(Test_writeFile(copy, image, imagelen));
+    UNITTEST_CHECK(1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM));
+    broken.keylen = UINT32_MAX;
+    memcpy(image + second, &broken, sizeof(broken));
+    UNITTEST_CHECK(Test_writeFile(copy, image, imagelen));
+    UNITTEST_CHECK(1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM));
+    // 応答メッセージの長さがファイルの末尾を越える
+    broken = saved;
+    broken.msglen = (uint32_t) imagelen;
+    memcpy(image + second, &broken, sizeof(broken));
+    UNITTEST_CHECK(Test_writeFile(copy, image, imagelen));
+    UNITTEST_CHECK(1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM));
+    memcpy(image + second, &saved, sizeof(saved));
+
+    // 書き出してから TTL 以上経っていれば, 読み込むが格納しない
+    DnsCacheSnapshotHeader header;
+    memcpy(&header, image, sizeof(header));
+    header.saved_at -= 301;
+    memcpy(image, &header, sizeof(header));
+    UNITTEST_CHECK(Test_writeFile(copy, image, imagelen));
+    UNITTEST_CHECK(0 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM));
+    header.saved_at += 301;
+    memcpy(image, &header, sizeof(header));
+
+    // グループや他のユーザーが書き込めるファイルは読み込まない
+    UNITTEST_CHECK(Test_writeFile(copy, image, imagelen));
+    UNITTEST_CHECK(TEST_SNAPSHOT_ENTRY_NUM == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM));
+    UNITTEST_CHECK(0 == chmod(copy, 0620));
+    errno = 0;
+    UNITTEST_CHECK(-1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM) && EACCES == errno);
+    UNITTEST_CHECK(0 == chmod(copy, 0602));
+    errno = 0;
+    UNITTEST_CHECK(-1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM) && EACCES == errno);
+    UNITTEST_CHECK(0 == chmod(copy, 0644));
+    UNITTEST_CHECK(TEST_SNAPSHOT_ENTRY_NUM == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM));
+    // 他のユーザーが所有するファイルも読み込まない. 所有者を変えられるのは root の場合だけ
+    if (0 == geteuid()) {
+        UNITTEST_CHECK(0 == chown(copy, 1, (gid_t) -1));
+        errno = 0;
+        UNITTEST_CHECK(-1 == Test_load(copy, names, TEST_SNAPSHOT_ENTRY_NUM) && EACCES == errno);
+    }   // end if
+    // 通常のファイルでなければ読み込まない
+    errno = 0;
+    UNITTEST_CHECK(-1 == Test_load(dir, names, TEST_SNAPSHOT_ENTRY_NUM) && EACCES == errno);
+    // 存在しない
+    errno = 0;
+    UNITTEST_CHECK(-1 == Test_load("/nonexistent/snapshot", names, 0) && ENOENT == errno);
+
+    (void) unlink(copy);
+    (void) unlink(path);
+    UNITTEST_CHECK(0 == rmdir(dir));
+}   // end function : Test_snapshot
+
+int
+main(void)
+{
+    Test_lru();
+    Test_flight();
+    Test_grace();
+    Test_snapshot();
+    return UNITTEST_RESULT();
+}   // end function : main
@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * DnsShmCache の格納と検索, セット内での置き換え, 書き込み中のスロットの扱い,
+ * 同じ共有メモリを別々に開いた読み手と書き手が競合しても壊れた応答を返さないこと,
+ * 他のユーザーもアクセスできる共有メモリを使わないことを確かめる.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/nameser.h>
+
+#include "unittest.h"
+// スロットのシーケンス番号を直接操作するため, 実装をそのまま取り込む
+#include "../src/dnsshmcache.c"
+
+#define TEST_MSGLEN 100
+#define TEST_WRITER_NUM 2
+#define TEST_READER_NUM 2
+#define TEST_ITERATION_NUM 1000000
+#define TEST_KEY_NUM 6          // 1 つのセットに収まらない数
+
+static char test_name[64];
+static DnsShmCache *test_writer_cache = NULL;
+static DnsShmCache *test_reader_cache = NULL;
+static volatile int test_violations = 0;
+static volatile int test_hits = 0;
+
+static const char *const test_keys[TEST_KEY_NUM] = {
+    "a.example.com", "b.example.com", "c.example.com",
+    "d.example.com", "e.example.com", "f.example.com",
+};
+
+static void
+Test_makeMessage(unsigned char value, unsigned char *msg, size_t msglen)
+{
+    memset(msg, value, msglen);
+}   // end function : Test_makeMessage
+
+static void
+Test_store(DnsShmCache *cache, const char *key, int rrtype, unsigned char value, size_t msglen,
+           unsigned long ttl)
+{
+    unsigned char msg[DNSSHMCACHE_SLOT_SIZE];
+    Test_makeMessage(value, msg, msglen);
+    DnsShmCache_store(cache, key, strlen(key), rrtype, msg, msglen, ttl);
+}   // end function : Test_store
+
+static bool
+Test_isCached(DnsShmCache *cache, const char *key, int rrtype, unsigned char value,
+              size_t msglen)
+{
+    unsigned char expected[DNSSHMCACHE_SLOT_SIZE], buf[DNSSHMCACHE_SLOT_SIZE];
+    Test_makeMessage(value, expected, msglen);
+    int len = DnsShmCache_lookup(cache, key, strlen(key), rrtype, buf, sizeof(buf), NULL);
+    return (size_t) len == msglen && 0 == memcmp(expected, buf, msglen);
+}   // end function : Test_isCached
+
+static DnsShmCacheSlot *
+Test_findSlot(DnsShmCache *cache, const char *key, int rrtype)
+{
+    size_t keylen = strlen(key);
+    uint32_t hash = CacheUtil_hashTyped(key, keylen, (uint32_t) rrtype);
+    DnsShmCacheSlot *set = DnsShmCache_getSet(cache, hash);
+    for (size_t way = 0; way < DNSSHMCACHE_WAYS; ++way) {
+        if (set[way].h.hash == hash && set[way].h.keylen == keylen
+            && 0 == memcmp(set[way].data, key, keylen)) {
+            return &(set[way]);
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function : Test_findSlot
+
+static void
+Test_basic(void)
+{
+    // 1 つのセットだけからなる最小の大きさ
+    DnsShmCache *cache = DnsShmCache_open(test_name, DNSSHMCACHE_WAYS * DNSSHMCACHE_SLOT_SIZE);
+    UNITTEST_CHECK(NULL != cache);
+    if (NULL == cache) {
+        return;
+    }   // end if
+    UNITTEST_CHECK(0 == cache->set_mask);
+    UNITTEST_CHECK(!Test_isCached(cache, test_keys[0], ns_t_a, 1, TEST_MSGLEN));
+
+    unsigned char buf[DNSSHMCACHE_SLOT_SIZE];
+    unsigned long ttl = 0;
+    Test_store(cache, test_keys[0], ns_t_a, 1, TEST_MSGLEN, 300);
+    UNITTEST_CHECK(TEST_MSGLEN == DnsShmCache_lookup(cache, test_keys[0], strlen(test_keys[0]),
+                                                     ns_t_a, buf, sizeof(buf), &ttl));
+    UNITTEST_CHECK(290 < ttl && ttl <= 300);
+    UNITTEST_CHECK(Test_isCached(cache, test_keys[0], ns_t_a, 1, TEST_MSGLEN));
+    // RR タイプは区別する
+    UNITTEST_CHECK(!Test_isCached(cache, test_keys[0], ns_t_txt, 1, TEST_MSGLEN));
+    // バッファに収まらない場合はヒットしない
+    UNITTEST_CHECK(0 > DnsShmCache_lookup(cache, test_keys[0], strlen(test_keys[0]), ns_t_a, buf,
+                                          TEST_MSGLEN - 1, NULL));
+
+    // 同じキーで格納し直すと, 同じスロットを置き換える
+    DnsShmCacheSlot *slot = Test_findSlot(cache, test_keys[0], ns_t_a);
+    UNITTEST_CHECK(NULL != slot);
+    uint32_t seq = (NULL != slot) ? slot->h.seq : 0;
+    Test_store(cache, test_keys[0], ns_t_a, 2, TEST_MSGLEN + 1, 300);
+    UNITTEST_CHECK(Test_isCached(cache, test_keys[0], ns_t_a, 2, TEST_MSGLEN + 1));
+    UNITTEST_CHECK(slot == Test_findSlot(cache, test_keys[0], ns_t_a));
+    UNITTEST_CHECK(NULL != slot && seq + 2 == slot->h.seq);
+
+    // スロットに収まらない応答と TTL 0 の応答は格納しない
+    Test_store(cache, test_keys[1], ns_t_a, 3, DNSSHMCACHE_DATA_SIZE, 300);
+    UNITTEST_CHECK(!Test_isCached(cache, test_keys[1], ns_t_a, 3, DNSSHMCACHE_DATA_SIZE));
+    Test_store(cache, test_keys[1], ns_t_a, 3, TEST_MSGLEN, 0);
+    UNITTEST_CHECK(!Test_isCached(cache, test_keys[1], ns_t_a, 3, TEST_MSGLEN));
+    // キーと合わせてちょうど収まる応答は格納する
+    size_t maxlen = DNSSHMCACHE_DATA_SIZE - strlen(test_keys[1]);
+    Test_store(cache, test_keys[1], ns_t_a, 3, maxlen, 300);
+    UNITTEST_CHECK(Test_isCached(cache, test_keys[1], ns_t_a, 3, maxlen));
+
+    // 別に開いても同じ内容が見える
+    DnsShmCache *other = DnsShmCache_open(test_name, 1 << 20);
+    UNITTEST_CHECK(NULL != other);
+    if (NULL != other) {
+        // 既に存在する場合は, 指定した大きさではなく既存の大きさで使う
+        UNITTEST_CHECK(0 == other->set_mask);
+        UNITTEST_CHECK(Test_isCached(other, test_keys[0], ns_t_a, 2, TEST_MSGLEN + 1));
+        Test_store(other, test_keys[2], ns_t_a, 4, TEST_MSGLEN, 300);
+        UNITTEST_CHECK(Test_isCached(cache, test_keys[2], ns_t_a, 4, TEST_MSGLEN));
+        DnsShmCache_close(other);
+    }   // end if
+    DnsShmCache_close(cache);
+    UNITTEST_CHECK(0 == shm_unlink(test_name));
+}   // end function : Test_basic
+
+/*
+ * セットが埋まっていれば, 最も早く期限切れになるスロットを置き換える.
+ */
+static void
+Test_replace(void)
+{
+    DnsShmCache *cache = DnsShmCache_open(test_name, DNSSHMCACHE_WAYS * DNSSHMCACHE_SLOT_SIZE);
+    UNITTEST_CHECK(NULL != cache);
+    if (NULL == cache) {
+        return;
+    }   // end if
+    static const unsigned long ttls[DNSSHMCACHE_WAYS] = { 300, 100, 400, 200 };
+    for (size_t n = 0; n < DNSSHMCACHE_WAYS; ++n) {
+        Test_store(cache, test_keys[n], ns_t_a, (unsigned char) n, TEST_MSGLEN, ttls[n]);
+    }   // end for
+    Test_store(cache, test_keys[4], ns_t_a, 4, TEST_MSGLEN, 500);
+    UNITTEST_CHECK(!Test_isCached(cache, test_keys[1], ns_t_a, 1, TEST_MSGLEN));
+    UNITTEST_CHECK(Test_isCached(cache, test_keys[0], ns_t_a, 0, TEST_MSGLEN));
+    UNITTEST_CHECK(Test_isCached(cache, test_keys[2], ns_t_a, 2, TEST_MSGLEN));
+    UNITTEST_CHECK(Test_isCached(cache, test_keys[3], ns_t_a, 3, TEST_MSGLEN));
+    UNITTEST_CHECK(Test_isCached(cache, test_keys[4], ns_t_a, 4, TEST_MSGLEN));
+    Test_store(cache, test_keys[5], ns_t_a, 5, TEST_MSGLEN, 500);
+    UNITTEST_CHECK(!Test_isCached(cache, test_keys[3], ns_t_a, 3, TEST_MSGLEN));
+    UNITTEST_CHECK(Test_isCached(cache, test_keys[5], ns_t_a, 5, TEST_MSGLEN));
+
+    // 期限切れのスロットは返さない
+    DnsShmCacheSlot *slot = Test_findSlot(cache, test_keys[0], ns_t_a);
+    UNITTEST_CHECK(NULL != slot);
+    if (NULL != slot) {
+        slot->h.expire = (int64_t) CacheUtil_now();
+        UNITTEST_CHECK(!Test_isCached(cache, test_keys[0], ns_t_a, 0, TEST_MSGLEN));
+    }   // end if
+    DnsShmCache_close(cache);
+    UNITTEST_CHECK(0 == shm_unlink(test_name));
+}   // end function : Test_replace
+
+/*
+ * 書き込み中 (シーケンス番号が奇数) のスロットは読まず, 書き込み先にも選ばない.
+ * 書き込み中にプロセスが落ちた場合もこの状態のまま残る.
+ */
+static void
+Test_seqlock(void)
+{
+    DnsShmCache *cache = DnsShmCache_open(test_name, DNSSHMCACHE_WAYS * DNSSHMCACHE_SLOT_SIZE);
+    UNITTEST_CHECK(NULL != cache);
+    if (NULL == cache) {
+        return;
+    }   // end if
+    Test_store(cache, test_keys[0], ns_t_a, 1, TEST_MSGLEN, 300);
+    DnsShmCacheSlot *slot = Test_findSlot(cache, test_keys[0], ns_t_a);
+    UNITTEST_CHECK(NULL != slot);
+    if (NULL == slot) {
+        DnsShmCache_close(cache);
+        (void) shm_unlink(test_name);
+        return;
+    }   // end if
+    ++(slot->h.seq);
+    UNITTEST_CHECK(!Test_isCached(cache, test_keys[0], ns_t_a, 1, TEST_MSGLEN));
+
+    // 同じキーの格納は他のスロットにおこない, 書き込み中のスロットには触れない
+    Test_store(cache, test_keys[0], ns_t_a, 2, TEST_MSGLEN, 300);
+    UNITTEST_CHECK(Test_isCached(cache, test_keys[0], ns_t_a, 2, TEST_MSGLEN));
+    UNITTEST_CHECK(1 == slot->data[strlen(test_keys[0])]);
+    // 他のスロットは使い続けられる
+    for (size_t n = 1; n < TEST_KEY_NUM; ++n) {
+        Test_store(cache, test_keys[n], ns_t_a, (unsigned char) n, TEST_MSGLEN, 300 + n);
+        UNITTEST_CHECK(Test_isCached(cache, test_keys[n], ns_t_a, (unsigned char) n, TEST_MSGLEN));
+        UNITTEST_CHECK(1 == slot->data[strlen(test_keys[0])]);
+    }   // end for
+    DnsShmCache_close(cache);
+    UNITTEST_CHECK(0 == shm_unlink(test_name));
+}   // end function : Test_seqlock
+
+/*
+ * 応答メッセージは全てのバイトが同じ値で, 長さも値から決まるようにしておく.
+ * 読み込みが書き込みと競合して混ざれば, 値か長さが食い違う.
+ */
+static size_t
+Test_messageLength(unsigned char value)
+{
+    return 1 + (size_t) value * 3;
+}   // end function : Test_messageLength
+
+static void *
+Test_writer(void *arg)
+{
+    uint32_t seed = (uint32_t) (uintptr_t) arg;
+    unsigned char msg[DNSSHMCACHE_SLOT_SIZE];
+    for (int n = 0; n < TEST_ITERATION_NUM; ++n) {
+        // xorshift32
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        unsigned char value = (unsigned char) (seed >> 8);
+        const char *key = test_keys[seed % TEST_KEY_NUM];
+        size_t msglen = Test_messageLength(value);
+        Test_makeMessage(value, msg, msglen);
+        DnsShmCache_store(test_writer_cache, key, strlen(key), ns_t_a, msg, msglen, 300);
+    }   // end for
+    return NULL;
+}   // end function : Test_writer
+
+static void *
+Test_reader(void *arg)
+{
+    (void) arg;
+    unsigned char buf[DNSSHMCACHE_SLOT_SIZE];
+    for (int n = 0; n < TEST_ITERATION_NUM; ++n) {
+        const char *key = test_keys[n % TEST_KEY_NUM];
+        int len = DnsShmCache_lookup(test_reader_cache, key, strlen(key), ns_t_a, buf,
+                                     sizeof(buf), NULL);
+        if (0 > len) {
+            continue;
+        }   // end if
+        __sync_fetch_and_add(&test_hits, 1);
+        bool consistent = (0 < len && (size_t) len == Test_messageLength(buf[0]));
+        for (int i = 1; consistent && i < len; ++i) {
+            consistent = (buf[0] == buf[i]);
+        }   // end for
+        if (!consistent) {
+            __sync_fetch_and_add(&test_violations, 1);
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function : Test_reader
+
+/*
+ * 同じ共有メモリを別々に開き, 書き手と読み手が同じセットのスロットを奪い合う.
+ */
+static void
+Test_concurrent(void)
+{
+    test_writer_cache = DnsShmCache_open(test_name, DNSSHMCACHE_WAYS * DNSSHMCACHE_SLOT_SIZE);
+    test_reader_cache = DnsShmCache_open(test_name, DNSSHMCACHE_WAYS * DNSSHMCACHE_SLOT_SIZE);
+    UNITTEST_CHECK(NULL != test_writer_cache && NULL != test_reader_cache);
+    if (NULL == test_writer_cache || NULL == test_reader_cache) {
+        DnsShmCache_close(test_writer_cache);
+        DnsShmCache_close(test_reader_cache);
+        (void) shm_unlink(test_name);
+        return;
+    }   // end if
+    UNITTEST_CHECK(test_writer_cache->map != test_reader_cache->map);
+
+    pthread_t writers[TEST_WRITER_NUM], readers[TEST_READER_NUM];
+    for (size_t n = 0; n < TEST_WRITER_NUM; ++n) {
+        UNITTEST_CHECK(0 == pthread_create(&writers[n], NULL, Test_writer,
+                                           (void *) (uintptr_t) (2463534242U + n)));
+    }   // end for
+    for (size_t n = 0; n < TEST_READER_NUM; ++n) {
+        UNITTEST_CHECK(0 == pthread_create(&readers[n], NULL, Test_reader, NULL));
+    }   // end for
+    for (size_t n = 0; n < TEST_WRITER_NUM; ++n) {
+        UNITTEST_CHECK(0 == pthread_join(writers[n], NULL));
+    }   // end for
+    for (size_t n = 0; n < TEST_READER_NUM; ++n) {
+        UNITTEST_CHECK(0 == pthread_join(readers[n], NULL));
+    }   // end for
+    UNITTEST_CHECK(0 == test_violations);
+    UNITTEST_CHECK(0 < test_hits);
+
+    // 書き込みを終えた後は, 書き込み中のまま残っているスロットはない
+    for (size_t way = 0; way < DNSSHMCACHE_WAYS; ++way) {
+        UNITTEST_CHECK(0 == (test_writer_cache->slot[way].h.seq & 1));
+    }   // end for
+    DnsShmCache_close(test_writer_cache);
+    DnsShmCache_close(test_reader_cache);
+    UNITTEST_CHECK(0 == shm_unlink(test_name));
+}   // end function : Test_concurrent
+
+/*
+ * 所有者以外もアクセスできる共有メモリや, 1 つのセットも収まらない共有メモリは使わない.
+ */
+static void
+Test_reject(void)
+{
+    int fd = shm_open(test_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    UNITTEST_CHECK(0 <= fd);
+    if (0 > fd) {
+        return;
+    }   // end if
+    UNITTEST_CHECK(0 == ftruncate(fd, sizeof(DnsShmCacheHeader)
+                                  + DNSSHMCACHE_WAYS * DNSSHMCACHE_SLOT_SIZE));
+    static const mode_t modes[] = { 0660, 0620, 0604, 0602 };
+    for (size_t n = 0; n < sizeof(modes) / sizeof(modes[0]); ++n) {
+        UNITTEST_CHECK(0 == fchmod(fd, modes[n]));
+        errno = 0;
+        UNITTEST_CHECK(NULL == DnsShmCache_open(test_name, 1 << 20));
+        UNITTEST_CHECK(EACCES == errno);
+    }   // end for
+    UNITTEST_CHECK(0 == fchmod(fd, 0600));
+    DnsShmCache *cache = DnsShmCache_open(test_name, 1 << 20);
+    UNITTEST_CHECK(NULL != cache);
+    // 他のユーザーが所有する共有メモリも使わない. 所有者を変えられるのは root の場合だけ
+    if (0 == geteuid()) {
+        UNITTEST_CHECK(0 == fchown(fd, 1, (gid_t) -1));
+        errno = 0;
+        UNITTEST_CHECK(NULL == DnsShmCache_open(test_name, 1 << 20));
+        UNITTEST_CHECK(EACCES == errno);
+        UNITTEST_CHECK(0 == fchown(fd, 0, (gid_t) -1));
+    }   // end if
+    // 開いた後に異なるバージョンで作り直されたものは使わない
+    if (NULL != cache) {
+        DnsShmCacheHeader *header = (DnsShmCacheHeader *) cache->map;
+        ++(header->version);
+        errno = 0;
+        UNITTEST_CHECK(NULL == DnsShmCache_open(test_name, 1 << 20));
+        UNITTEST_CHECK(EINVAL == errno);
+        DnsShmCache_close(cache);
+    }   // end if
+
+    // 1 つのセットも収まらない
+    UNITTEST_CHECK(0 == ftruncate(fd, 0));
+    UNITTEST_CHECK(0 == ftruncate(fd, sizeof(DnsShmCacheHeader) + DNSSHMCACHE_SLOT_SIZE));
+    errno = 0;
+    UNITTEST_CHECK(NULL == DnsShmCache_open(test_name, 1 << 20));
+    UNITTEST_CHECK(EINVAL == errno);
+    (void) close(fd);
+    UNITTEST_CHECK(0 == shm_unlink(test_name));
+}   // end function : Test_reject
+
+int
+main(void)
+{
+    snprintf(test_name, sizeof(test_name), "/test_dnsshmcache.%ld", (long) getpid());
+    (void) shm_unlink(test_name);
+    Test_basic();
+    Test_replace();
+    Test_seqlock();
+    Test_concurrent();
+    Test_reject();
+    return UNITTEST_RESULT();
+}   // end function : main
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * FreeList の容量制限と, 複数スレッドから出し入れしてもオブジェクトが
+ * 失われたり二重に取り出されたりしないこと (ABA が起きないこと) を確かめる.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "unittest.h"
+// スタックの先頭の世代を直接確かめるため, 実装をそのまま取り込む
+#include "../src/freelist.c"
+
+#define TEST_CAPACITY 8
+#define TEST_THREAD_NUM 8
+#define TEST_ITERATION_NUM 200000
+
+typedef struct TestObject {
+    volatile int owned;         // 取り出したスレッドが保持している間は 1
+    volatile uint32_t popped;
+} TestObject;
+
+static FreeList *test_freelist = NULL;
+static TestObject test_objects[TEST_CAPACITY];
+static volatile int test_violations = 0;
+
+static void
+Test_basic(void)
+{
+    FreeList *freelist = FreeList_new(TEST_CAPACITY);
+    UNITTEST_CHECK(NULL != freelist);
+    UNITTEST_CHECK(NULL == FreeList_pop(freelist));
+
+    for (size_t n = 0; n < TEST_CAPACITY; ++n) {
+        UNITTEST_CHECK(FreeList_push(freelist, &test_objects[n]));
+    }   // end for
+    // 容量を越える分は受け取らない
+    int extra = 0;
+    UNITTEST_CHECK(!FreeList_push(freelist, &extra));
+
+    // 最後に預けたものから取り出す
+    for (size_t n = TEST_CAPACITY; 0 < n; --n) {
+        UNITTEST_CHECK(&test_objects[n - 1] == FreeList_pop(freelist));
+    }   // end for
+    UNITTEST_CHECK(NULL == FreeList_pop(freelist));
+
+    // 取り出した分だけ再び預けられる
+    UNITTEST_CHECK(FreeList_push(freelist, &test_objects[0]));
+    UNITTEST_CHECK(FreeList_push(freelist, &extra));
+    UNITTEST_CHECK(&extra == FreeList_pop(freelist));
+    UNITTEST_CHECK(&test_objects[0] == FreeList_pop(freelist));
+    UNITTEST_CHECK(NULL == FreeList_pop(freelist));
+    FreeList_free(freelist);
+
+    // 容量 1
+    freelist = FreeList_new(1);
+    UNITTEST_CHECK(NULL != freelist);
+    UNITTEST_CHECK(FreeList_push(freelist, &extra));
+    UNITTEST_CHECK(!FreeList_push(freelist, &test_objects[0]));
+    UNITTEST_CHECK(&extra == FreeList_pop(freelist));
+    UNITTEST_CHECK(NULL == FreeList_pop(freelist));
+    FreeList_free(freelist);
+    FreeList_free(NULL);
+}   // end function : Test_basic
+
+/*
+ * 取り出したノードがすぐに戻されてスタックの先頭が同じノードになっても,
+ * 先頭の値は世代が進んで変わっているので, 古い値を読んだスレッドの CAS は失敗する.
+ */
+static void
+Test_abaTag(void)
+{
+    FreeList *freelist = FreeList_new(TEST_CAPACITY);
+    UNITTEST_CHECK(NULL != freelist);
+    for (size_t n = 0; n < 3; ++n) {
+        UNITTEST_CHECK(FreeList_push(freelist, &test_objects[n]));
+    }   // end for
+
+    // 他のスレッドが取り出しの途中で先頭とその次を読んだところで止まったとする
+    uint64_t stale_head = freelist->used;
+    uint32_t stale_index = FREELIST_INDEX(stale_head);
+    uint32_t stale_next = freelist->node[stale_index - 1].next;
+
+    // その間に別のスレッドが取り出して戻すと, 同じノードが再び先頭になる
+    void *obj = FreeList_pop(freelist);
+    UNITTEST_CHECK(&test_objects[2] == obj);
+    UNITTEST_CHECK(FreeList_push(freelist, obj));
+    UNITTEST_CHECK(stale_index == FREELIST_INDEX(freelist->used));
+    UNITTEST_CHECK(stale_head != freelist->used);
+
+    // 止まっていたスレッドの CAS は失敗し, 他のスレッドの更新を上書きしない
+    UNITTEST_CHECK(!__sync_bool_compare_and_swap(&freelist->used, stale_head,
+                                                 FREELIST_HEAD(stale_head, stale_next)));
+    for (size_t n = 3; 0 < n; --n) {
+        UNITTEST_CHECK(&test_objects[n - 1] == FreeList_pop(freelist));
+    }   // end for
+    UNITTEST_CHECK(NULL == FreeList_pop(freelist));
+    FreeList_free(freelist);
+}   // end function : Test_abaTag
+
+/*
+ * 取り出しと預け入れを繰り返す.
+ * 同じノードが短い間に取り出されては戻されるので, 世代による保護がなければ
+ * CAS が古い next で成功し, 同じオブジェクトを 2 つのスレッドが同時に取り出すことになる.
+ */
+static void *
+Test_worker(void *arg)
+{
+    (void) arg;
+    TestObject *held[2];
+    for (int n = 0; n < TEST_ITERATION_NUM; ++n) {
+        size_t held_num = 0;
+        for (; held_num < 2; ++held_num) {
+            held[held_num] = (TestObject *) FreeList_pop(test_freelist);
+            if (NULL == held[held_num]) {
+                break;
+            }   // end if
+            if (0 != __sync_lock_test_and_set(&held[held_num]->owned, 1)) {
+                __sync_fetch_and_add(&test_violations, 1);
+            }   // end if
+            __sync_fetch_and_add(&held[held_num]->popped, 1);
+        }   // end for
+        while (0 < held_num) {
+            --held_num;
+            __sync_lock_release(&held[held_num]->owned);
+            if (!FreeList_push(test_freelist, held[held_num])) {
+                // 容量と同じ数のオブジェクトしかないので, 預けられないのは壊れている
+                __sync_fetch_and_add(&test_violations, 1);
+            }   // end if
+        }   // end while
+    }   // end for
+    return NULL;
+}   // end function : Test_worker
+
+static void
+Test_concurrent(void)
+{
+    test_freelist = FreeList_new(TEST_CAPACITY);
+    UNITTEST_CHECK(NULL != test_freelist);
+    for (size_t n = 0; n < TEST_CAPACITY; ++n) {
+        test_objects[n].owned = 0;
+        test_objects[n].popped = 0;
+        UNITTEST_CHECK(FreeList_push(test_freelist, &test_objects[n]));
+    }   // end for
+
+    pthread_t threads[TEST_THREAD_NUM];
+    for (size_t n = 0; n < TEST_THREAD_NUM; ++n) {
+        UNITTEST_CHECK(0 == pthread_create(&threads[n], NULL, Test_worker, NULL));
+    }   // end for
+    for (size_t n = 0; n < TEST_THREAD_NUM; ++n) {
+        UNITTEST_CHECK(0 == pthread_join(threads[n], NULL));
+    }   // end for
+    UNITTEST_CHECK(0 == test_violations);
+
+    // 全てのオブジェクトがちょうど 1 回ずつ残っている
+    bool seen[TEST_CAPACITY] = { false };
+    for (size_t n = 0; n < TEST_CAPACITY; ++n) {
+        TestObject *obj = (TestObject *) FreeList_pop(test_freelist);
+        UNITTEST_CHECK(NULL != obj);
+        if (NULL != obj) {
+            size_t index = (size_t) (obj - test_objects);
+            UNITTEST_CHECK(index < TEST_CAPACITY && !seen[index]);
+            seen[index] = true;
+            UNITTEST_CHECK(0 < obj->popped);
+        }   // end if
+    }   // end for
+    UNITTEST_CHECK(NULL == FreeList_pop(test_freelist));
+    FreeList_free(test_freelist);
+}   // end function : Test_concurrent
+
+int
+main(void)
+{
+    Test_basic();
+    Test_abaTag();
+    Test_concurrent();
+    return UNITTEST_RESULT();
+}   // end function : main
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * MemArena がチャンクを越えて拡張しても, 切り出した領域が重ならず境界も揃っていることを確かめる.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "unittest.h"
+#include "memarena.h"
+
+#define TEST_ALLOC_NUM 1000
+
+// どの型のオブジェクトを置いても問題ない境界
+typedef struct TestAlign {
+    char c;
+    union {
+        long double ld;
+        long long ll;
+        void *p;
+    } u;
+} TestAlign;
+#define TEST_ALIGN offsetof(TestAlign, u)
+
+static uint32_t test_seed = 2463534242U;
+
+static uint32_t
+Test_random(void)
+{
+    // xorshift32
+    test_seed ^= test_seed << 13;
+    test_seed ^= test_seed >> 17;
+    test_seed ^= test_seed << 5;
+    return test_seed;
+}   // end function : Test_random
+
+static bool
+Test_isAligned(const void *p)
+{
+    return 0 == (uintptr_t) p % TEST_ALIGN;
+}   // end function : Test_isAligned
+
+/*
+ * 大きさの異なる領域をチャンクを何度も越えるまで切り出し,
+ * それぞれを固有の値で埋めた後に他の領域に上書きされていないか確かめる.
+ */
+static void
+Test_growth(MemArena *arena)
+{
+    static unsigned char *block[TEST_ALLOC_NUM];
+    static size_t blocklen[TEST_ALLOC_NUM];
+    for (size_t n = 0; n < TEST_ALLOC_NUM; ++n) {
+        // 大半はチャンクより小さく, 時々チャンクより大きな要求を混ぜる
+        blocklen[n] = (0 == n % 50) ? 1000 + Test_random() % 4000 : Test_random() % 100;
+        block[n] = (unsigned char *) MemArena_alloc(arena, blocklen[n]);
+        UNITTEST_CHECK(NULL != block[n]);
+        UNITTEST_CHECK(Test_isAligned(block[n]));
+        memset(block[n], (int) (n & 0xff), blocklen[n]);
+    }   // end for
+    for (size_t n = 0; n < TEST_ALLOC_NUM; ++n) {
+        for (size_t i = 0; i < blocklen[n]; ++i) {
+            if ((unsigned char) (n & 0xff) != block[n][i]) {
+                UNITTEST_CHECK(!"block overwritten");
+                break;
+            }   // end if
+        }   // end for
+    }   // end for
+}   // end function : Test_growth
+
+static void
+Test_basic(void)
+{
+    MemArena *arena = MemArena_new(64);
+    UNITTEST_CHECK(NULL != arena);
+
+    // チャンク内では続けて切り出す
+    char *p1 = (char *) MemArena_alloc(arena, 1);
+    char *p2 = (char *) MemArena_alloc(arena, 1);
+    UNITTEST_CHECK(NULL != p1 && NULL != p2);
+    UNITTEST_CHECK(p1 < p2 && p2 - p1 < 64);
+    UNITTEST_CHECK(Test_isAligned(p1) && Test_isAligned(p2));
+
+    // 大きさ 0 の要求にも, 他と重ならない領域を返す
+    char *p0 = (char *) MemArena_alloc(arena, 0);
+    char *p3 = (char *) MemArena_alloc(arena, 0);
+    UNITTEST_CHECK(NULL != p0 && NULL != p3 && p0 != p3);
+
+    char *s = MemArena_strdup(arena, "example.com");
+    UNITTEST_CHECK(NULL != s && 0 == strcmp("example.com", s));
+    char *empty = MemArena_strdup(arena, "");
+    UNITTEST_CHECK(NULL != empty && '\0' == *empty);
+
+    // チャンクより大きな文字列も複製できる
+    char longstr[1000];
+    memset(longstr, 'x', sizeof(longstr) - 1);
+    longstr[sizeof(longstr) - 1] = '\0';
+    char *longdup = MemArena_strdup(arena, longstr);
+    UNITTEST_CHECK(NULL != longdup && 0 == strcmp(longstr, longdup));
+    UNITTEST_CHECK(0 == strcmp("example.com", s));
+
+    Test_growth(arena);
+
+    // reset 後は最初のチャンクの先頭から切り出しを再開する
+    MemArena_reset(arena);
+    UNITTEST_CHECK(p1 == MemArena_alloc(arena, 1));
+    Test_growth(arena);
+    MemArena_reset(arena);
+    MemArena_reset(arena);
+    UNITTEST_CHECK(p1 == MemArena_alloc(arena, 1));
+    MemArena_free(arena);
+
+    // chunk_size が 0 の場合はデフォルト値を使う
+    arena = MemArena_new(0);
+    UNITTEST_CHECK(NULL != arena);
+    Test_growth(arena);
+    MemArena_free(arena);
+
+    // 境界に揃わない chunk_size
+    arena = MemArena_new(33);
+    UNITTEST_CHECK(NULL != arena);
+    Test_growth(arena);
+    MemArena_free(arena);
+    MemArena_free(NULL);
+}   // end function : Test_basic
+
+int
+main(void)
+{
+    Test_basic();
+    return UNITTEST_RESULT();
+}   // end function : main
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * SidfCidrTrie の探索結果が, プレフィックスを先頭から順に照合した場合と一致することを確かめる.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "unittest.h"
+#include "bitmemcmp.h"
+#include "sidfcidrtrie.h"
+
+#define TEST_RANDOM_PREFIX_NUM 200
+#define TEST_RANDOM_LOOKUP_NUM 2000
+
+typedef struct Prefix {
+    uint8_t addr[16];
+    unsigned int len;
+} Prefix;
+
+static uint32_t test_seed = 2463534242U;
+
+static uint32_t
+Test_random(void)
+{
+    // xorshift32
+    test_seed ^= test_seed << 13;
+    test_seed ^= test_seed >> 17;
+    test_seed ^= test_seed << 5;
+    return test_seed;
+}   // end function : Test_random
+
+/*
+ * 先頭から順に照合し, 最初にマッチしたプレフィックスの番号を返す.
+ */
+static int
+Test_linearLookup(const Prefix *prefix, size_t prefix_num, const uint8_t *addr)
+{
+    for (size_t n = 0; n < prefix_num; ++n) {
+        if (0 == bitmemcmp(prefix[n].addr, addr, prefix[n].len)) {
+            return (int) n;
+        }   // end if
+    }   // end for
+    return -1;
+}   // end function : Test_linearLookup
+
+static void
+Test_insertString(SidfCidrTrie *trie, int af, const char *prefix, unsigned int prefixlen,
+                  unsigned int value)
+{
+    uint8_t addr[16];
+    UNITTEST_CHECK(1 == inet_pton(af, prefix, addr));
+    UNITTEST_CHECK(SidfCidrTrie_insert(trie, addr, prefixlen, value));
+}   // end function : Test_insertString
+
+static int
+Test_lookupString(const SidfCidrTrie *trie, int af, const char *address)
+{
+    uint8_t addr[16];
+    UNITTEST_CHECK(1 == inet_pton(af, address, addr));
+    return SidfCidrTrie_lookup(trie, addr);
+}   // end function : Test_lookupString
+
+static void
+Test_ip4Edges(void)
+{
+    SidfCidrTrie *trie = SidfCidrTrie_new(32);
+    UNITTEST_CHECK(NULL != trie);
+    UNITTEST_CHECK(-1 == Test_lookupString(trie, AF_INET, "192.0.2.1"));
+
+    Test_insertString(trie, AF_INET, "192.0.2.1", 32, 3);
+    Test_insertString(trie, AF_INET, "192.0.2.0", 24, 5);
+    UNITTEST_CHECK(3 == Test_lookupString(trie, AF_INET, "192.0.2.1"));
+    UNITTEST_CHECK(5 == Test_lookupString(trie, AF_INET, "192.0.2.2"));
+    UNITTEST_CHECK(-1 == Test_lookupString(trie, AF_INET, "192.0.3.1"));
+
+    // /0 は全てのアドレスにマッチするが, 値の小さいプレフィックスが優先される
+    Test_insertString(trie, AF_INET, "0.0.0.0", 0, 4);
+    UNITTEST_CHECK(3 == Test_lookupString(trie, AF_INET, "192.0.2.1"));
+    UNITTEST_CHECK(4 == Test_lookupString(trie, AF_INET, "192.0.2.2"));
+    UNITTEST_CHECK(4 == Test_lookupString(trie, AF_INET, "0.0.0.0"));
+    UNITTEST_CHECK(4 == Test_lookupString(trie, AF_INET, "255.255.255.255"));
+
+    // prefixlen を越えるビットは無視される
+    Test_insertString(trie, AF_INET, "10.1.2.3", 8, 1);
+    UNITTEST_CHECK(1 == Test_lookupString(trie, AF_INET, "10.255.255.255"));
+
+    // 同じプレフィックスを登録した場合は小さい方の値が残る
+    Test_insertString(trie, AF_INET, "192.0.2.1", 32, 7);
+    Test_insertString(trie, AF_INET, "255.255.255.255", 32, 2);
+    Test_insertString(trie, AF_INET, "255.255.255.255", 32, 0);
+    UNITTEST_CHECK(3 == Test_lookupString(trie, AF_INET, "192.0.2.1"));
+    UNITTEST_CHECK(0 == Test_lookupString(trie, AF_INET, "255.255.255.255"));
+    UNITTEST_CHECK(4 == Test_lookupString(trie, AF_INET, "255.255.255.254"));
+    SidfCidrTrie_free(trie);
+}   // end function : Test_ip4Edges
+
+static void
+Test_ip6Edges(void)
+{
+    SidfCidrTrie *trie = SidfCidrTrie_new(128);
+    UNITTEST_CHECK(NULL != trie);
+    Test_insertString(trie, AF_INET6, "2001:db8::1", 128, 1);
+    Test_insertString(trie, AF_INET6, "2001:db8::", 32, 2);
+    UNITTEST_CHECK(1 == Test_lookupString(trie, AF_INET6, "2001:db8::1"));
+    UNITTEST_CHECK(2 == Test_lookupString(trie, AF_INET6, "2001:db8::2"));
+    UNITTEST_CHECK(2 == Test_lookupString(trie, AF_INET6, "2001:db8:ffff::"));
+    UNITTEST_CHECK(-1 == Test_lookupString(trie, AF_INET6, "2001:db9::1"));
+    UNITTEST_CHECK(-1 == Test_lookupString(trie, AF_INET6, "::"));
+
+    // 最終ビットだけが異なる /128 を区別する
+    Test_insertString(trie, AF_INET6, "ffff:ffff:ffff:ffff:ffff:ffff:ffff:fffe", 128, 0);
+    UNITTEST_CHECK(0 == Test_lookupString(trie, AF_INET6,
+                                          "ffff:ffff:ffff:ffff:ffff:ffff:ffff:fffe"));
+    UNITTEST_CHECK(-1 == Test_lookupString(trie, AF_INET6,
+                                           "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff"));
+
+    Test_insertString(trie, AF_INET6, "::", 0, 3);
+    UNITTEST_CHECK(3 == Test_lookupString(trie, AF_INET6, "::"));
+    UNITTEST_CHECK(3 == Test_lookupString(trie, AF_INET6,
+                                          "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff"));
+    UNITTEST_CHECK(1 == Test_lookupString(trie, AF_INET6, "2001:db8::1"));
+    SidfCidrTrie_free(trie);
+}   // end function : Test_ip6Edges
+
+/*
+ * 入れ子になったプレフィックスを乱数で作り, 先頭から順に照合した結果と比較する.
+ * 先頭の 1 バイトは少数の値に絞り, ランダムなアドレスもマッチしやすくする.
+ */
+static void
+Test_randomPrefixes(unsigned int addrbits)
+{
+    static Prefix prefix[TEST_RANDOM_PREFIX_NUM];
+    size_t addrlen = addrbits / 8;
+    SidfCidrTrie *trie = SidfCidrTrie_new(addrbits);
+    UNITTEST_CHECK(NULL != trie);
+    for (size_t n = 0; n < TEST_RANDOM_PREFIX_NUM; ++n) {
+        memset(prefix[n].addr, 0, sizeof(prefix[n].addr));
+        for (size_t i = 0; i < addrlen; ++i) {
+            prefix[n].addr[i] = (uint8_t) Test_random();
+        }   // end for
+        prefix[n].addr[0] &= 0x03;
+        if (TEST_RANDOM_PREFIX_NUM - 1 == n) {
+            // 最後に /0 を加えて, どれにもマッチしなかったアドレスを拾う
+            prefix[n].len = 0;
+        } else if (0 < n && 0 == Test_random() % 2) {
+            // 既存のプレフィックスを延ばして, 入れ子になったプレフィックスを作る
+            const Prefix *base = &prefix[Test_random() % n];
+            for (unsigned int bit = 0; bit < base->len; ++bit) {
+                uint8_t mask = (uint8_t) (0x80 >> (bit % 8));
+                prefix[n].addr[bit / 8] =
+                    (prefix[n].addr[bit / 8] & ~mask) | (base->addr[bit / 8] & mask);
+            }   // end for
+            prefix[n].len = base->len + Test_random() % (addrbits - base->len + 1);
+        } else {
+            prefix[n].len = 8 + Test_random() % (addrbits - 7);
+        }   // end if
+        UNITTEST_CHECK(SidfCidrTrie_insert(trie, prefix[n].addr, prefix[n].len,
+                                           (unsigned int) n));
+    }   // end for
+    for (size_t n = 0; n < TEST_RANDOM_LOOKUP_NUM; ++n) {
+        uint8_t addr[16];
+        if (0 == n % 2) {
+            // プレフィックスの内側のアドレス
+            const Prefix *base = &prefix[Test_random() % TEST_RANDOM_PREFIX_NUM];
+            memcpy(addr, base->addr, addrlen);
+            addr[addrlen - 1] ^= (uint8_t) Test_random() & ((addrbits == base->len) ? 0 : 0x01);
+        } else {
+            for (size_t i = 0; i < addrlen; ++i) {
+                addr[i] = (uint8_t) Test_random();
+            }   // end for
+            addr[0] &= 0x03;
+        }   // end if
+        UNITTEST_CHECK(Test_linearLookup(prefix, TEST_RANDOM_PREFIX_NUM, addr) ==
+                       SidfCidrTrie_lookup(trie, addr));
+    }   // end for
+    SidfCidrTrie_free(trie);
+}   // end function : Test_randomPrefixes
+
+int
+main(void)
+{
+    Test_ip4Edges();
+    Test_ip6Edges();
+    Test_randomPrefixes(32);
+    Test_randomPrefixes(128);
+    return UNITTEST_RESULT();
+}   // end function : main
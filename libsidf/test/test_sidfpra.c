@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * ヘッダを 1 つずつ受け取る SidfPraScanner の選択結果が,
+ * ヘッダ全体を見渡して選ぶ従来の方法と一致することを確かめる.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "unittest.h"
+#include "mailheaders.h"
+#include "inetmailbox.h"
+#include "memarena.h"
+#include "sidfpra.h"
+
+#define TEST_RANDOM_MESSAGE_NUM 3000
+#define TEST_RANDOM_HEADER_MAXNUM 10
+
+typedef struct TestCase {
+    const char *headers[8][2];
+    int expected;
+} TestCase;
+
+static const TestCase test_cases[] = {
+    // 候補が 1 つだけ
+    {{{"Subject", "hello"}, {"From", "a@example.com"}}, 1},
+    // Sender は From より優先される
+    {{{"From", "a@example.com"}, {"Sender", "b@example.com"}}, 1},
+    // From が 2 つあれば PRA はない
+    {{{"From", "a@example.com"}, {"from", "b@example.com"}}, -1},
+    // Sender が 2 つあれば From があっても PRA はない
+    {{{"Sender", "a@example.com"}, {"From", "b@example.com"}, {"Sender", "c@example.com"}}, -1},
+    // 空白だけのヘッダは存在しないものとして扱う
+    {{{"Sender", " \t"}, {"From", "a@example.com"}}, 1},
+    {{{"From", ""}, {"From", "a@example.com"}}, 1},
+    // Resent-From が複数あっても最初のものを選ぶ
+    {{{"Resent-From", "a@example.com"}, {"Resent-From", "b@example.com"},
+      {"From", "c@example.com"}}, 0},
+    // Resent-Sender は Resent-From より優先される
+    {{{"Resent-From", "a@example.com"}, {"Resent-Sender", "b@example.com"}}, 1},
+    {{{"Resent-Sender", "a@example.com"}, {"Received", "from x"},
+      {"Resent-From", "b@example.com"}}, 0},
+    // Resent-From と Resent-Sender の間に Received や Return-Path があれば Resent-From
+    {{{"Resent-From", "a@example.com"}, {"Received", "from x"},
+      {"Resent-Sender", "b@example.com"}}, 0},
+    {{{"Resent-From", "a@example.com"}, {"RETURN-PATH", "<x@example.com>"},
+      {"Resent-Sender", "b@example.com"}}, 0},
+    // Resent-From より前の Received は関係しない
+    {{{"Received", "from x"}, {"Resent-From", "a@example.com"},
+      {"Resent-Sender", "b@example.com"}}, 2},
+    // 候補がない
+    {{{"Received", "from x"}, {"Subject", "hello"}}, -1},
+    {{{NULL, NULL}}, -1},
+};
+
+static const char *const test_random_fields[] = {
+    "Resent-Sender", "resent-sender", "Resent-From", "RESENT-FROM", "Sender", "sender",
+    "From", "from", "Received", "Return-Path", "Subject", "To",
+};
+
+static uint32_t test_seed = 2463534242U;
+
+static uint32_t
+Test_random(void)
+{
+    // xorshift32
+    test_seed ^= test_seed << 13;
+    test_seed ^= test_seed >> 17;
+    test_seed ^= test_seed << 5;
+    return test_seed;
+}   // end function : Test_random
+
+/*
+ * RFC4407 の手順をヘッダ全体に対してそのまま適用する, 比較用の実装.
+ */
+static int
+Test_batchLookup(const MailHeaders *headers)
+{
+    bool multiple;
+    int resent_sender_pos =
+        MailHeaders_getNonEmptyHeaderIndex(headers, SIDF_PRA_RESENT_SENDER_HEADER, &multiple);
+    int resent_from_pos =
+        MailHeaders_getNonEmptyHeaderIndex(headers, SIDF_PRA_RESENT_FROM_HEADER, &multiple);
+
+    if (0 <= resent_sender_pos) {
+        if (0 <= resent_from_pos && resent_from_pos < resent_sender_pos) {
+            for (int i = resent_from_pos + 1; i < resent_sender_pos; ++i) {
+                const char *headerf, *headerv;
+                MailHeaders_get(headers, i, &headerf, &headerv);
+                if (0 == strcasecmp(headerf, SIDF_PRA_RECEIVED_HEADER)
+                    || 0 == strcasecmp(headerf, SIDF_PRA_RETURN_PATH_HEADER)) {
+                    return resent_from_pos;
+                }   // end if
+            }   // end for
+        }   // end if
+        return resent_sender_pos;
+    }   // end if
+    if (0 <= resent_from_pos) {
+        return resent_from_pos;
+    }   // end if
+    int pos = MailHeaders_getNonEmptyHeaderIndex(headers, SIDF_PRA_SENDER_HEADER, &multiple);
+    if (0 <= pos) {
+        return multiple ? -1 : pos;
+    }   // end if
+    pos = MailHeaders_getNonEmptyHeaderIndex(headers, SIDF_PRA_FROM_HEADER, &multiple);
+    if (0 <= pos) {
+        return multiple ? -1 : pos;
+    }   // end if
+    return -1;
+}   // end function : Test_batchLookup
+
+/*
+ * PRA として選ばれたヘッダと, 取り出したメールアドレスが期待通りか確かめる.
+ */
+static void
+Test_checkSelected(const MailHeaders *headers, int expected, const char *pra_header,
+                   InetMailbox *pra_mailbox)
+{
+    if (expected < 0) {
+        UNITTEST_CHECK(NULL == pra_header);
+        UNITTEST_CHECK(NULL == pra_mailbox);
+        return;
+    }   // end if
+    const char *headerf, *headerv;
+    MailHeaders_get(headers, expected, &headerf, &headerv);
+    UNITTEST_CHECK(NULL != pra_header && 0 == strcmp(headerf, pra_header));
+    // 値はヘッダ毎に異なるので, ローカルパートで選ばれたヘッダを識別できる
+    headerv += strspn(headerv, " \t");
+    const char *at = strchr(headerv, '@');
+    if (NULL != at && NULL == strchr(headerv, '<')) {
+        UNITTEST_CHECK(NULL != pra_mailbox);
+        if (NULL != pra_mailbox) {
+            const char *localpart = InetMailbox_getLocalPart(pra_mailbox);
+            UNITTEST_CHECK(strlen(localpart) == (size_t) (at - headerv)
+                           && 0 == strncmp(localpart, headerv, (size_t) (at - headerv)));
+        }   // end if
+    } else {
+        UNITTEST_CHECK(NULL == pra_mailbox);
+    }   // end if
+}   // end function : Test_checkSelected
+
+/*
+ * headers を SidfPra_extract() と, SidfPraScanner に全てのヘッダを流す場合と,
+ * SidfPra_isRelevantHeader() で絞り込んだヘッダを流す場合とで評価し, expected と比較する.
+ */
+static void
+Test_checkHeaders(const MailHeaders *headers, SidfPraScanner *scanner, MemArena *arena,
+                  int expected)
+{
+    int pra_index = -2;
+    InetMailbox *pra_mailbox = NULL;
+    UNITTEST_CHECK(SidfPra_extract(headers, &pra_index, &pra_mailbox));
+    UNITTEST_CHECK(expected == pra_index);
+    const char *headerf = NULL, *headerv;
+    if (0 <= pra_index) {
+        MailHeaders_get(headers, pra_index, &headerf, &headerv);
+    }   // end if
+    Test_checkSelected(headers, expected, headerf, pra_mailbox);
+    if (NULL != pra_mailbox) {
+        InetMailbox_free(pra_mailbox);
+    }   // end if
+
+    for (int relevant_only = 0; relevant_only < 2; ++relevant_only) {
+        SidfPraScanner_reset(scanner);
+        if (NULL != arena) {
+            MemArena_reset(arena);
+        }   // end if
+        int headernum = MailHeaders_getCount(headers);
+        for (int i = 0; i < headernum; ++i) {
+            MailHeaders_get(headers, i, &headerf, &headerv);
+            if (relevant_only) {
+                bool need_value;
+                if (!SidfPra_isRelevantHeader(headerf, &need_value)) {
+                    continue;
+                }   // end if
+                if (!need_value) {
+                    headerv = "";
+                }   // end if
+            }   // end if
+            UNITTEST_CHECK(SidfPraScanner_feed(scanner, headerf, headerv));
+        }   // end for
+        const char *pra_header = NULL;
+        pra_mailbox = NULL;
+        UNITTEST_CHECK(SidfPraScanner_extract(scanner, &pra_header, &pra_mailbox));
+        Test_checkSelected(headers, expected, pra_header, pra_mailbox);
+        if (NULL != pra_mailbox) {
+            InetMailbox_free(pra_mailbox);
+        }   // end if
+    }   // end for
+}   // end function : Test_checkHeaders
+
+static void
+Test_fixedCases(SidfPraScanner *scanner, MemArena *arena)
+{
+    for (size_t n = 0; n < sizeof(test_cases) / sizeof(test_cases[0]); ++n) {
+        MailHeaders *headers = MailHeaders_new(8);
+        UNITTEST_CHECK(NULL != headers);
+        for (size_t i = 0; i < 8 && NULL != test_cases[n].headers[i][0]; ++i) {
+            UNITTEST_CHECK(0 <= MailHeaders_append(headers, test_cases[n].headers[i][0],
+                                                   test_cases[n].headers[i][1]));
+        }   // end for
+        UNITTEST_CHECK(test_cases[n].expected == Test_batchLookup(headers));
+        Test_checkHeaders(headers, scanner, arena, test_cases[n].expected);
+        MailHeaders_free(headers);
+    }   // end for
+}   // end function : Test_fixedCases
+
+/*
+ * 候補となるヘッダを多く含むヘッダ列を乱数で作り, 比較用の実装と選択結果を比べる.
+ * 値は空, 空白のみ, 不正なアドレス, 正しいアドレスのいずれか.
+ */
+static void
+Test_randomHeaders(SidfPraScanner *scanner, MemArena *arena)
+{
+    static const size_t fieldnum = sizeof(test_random_fields) / sizeof(test_random_fields[0]);
+    for (size_t n = 0; n < TEST_RANDOM_MESSAGE_NUM; ++n) {
+        MailHeaders *headers = MailHeaders_new(TEST_RANDOM_HEADER_MAXNUM);
+        UNITTEST_CHECK(NULL != headers);
+        size_t headernum = Test_random() % (TEST_RANDOM_HEADER_MAXNUM + 1);
+        for (size_t i = 0; i < headernum; ++i) {
+            char value[64];
+            switch (Test_random() % 8) {
+            case 0:
+                value[0] = '\0';
+                break;
+            case 1:
+                snprintf(value, sizeof(value), " \t ");
+                break;
+            case 2:
+                snprintf(value, sizeof(value), "<broken%zu", i);
+                break;
+            default:
+                snprintf(value, sizeof(value), " user%zu@example.com ", i);
+                break;
+            }   // end switch
+            const char *headerf = test_random_fields[Test_random() % fieldnum];
+            UNITTEST_CHECK(0 <= MailHeaders_append(headers, headerf, value));
+        }   // end for
+        Test_checkHeaders(headers, scanner, arena, Test_batchLookup(headers));
+        MailHeaders_free(headers);
+    }   // end for
+}   // end function : Test_randomHeaders
+
+int
+main(void)
+{
+    // ヒープに複製する場合
+    SidfPraScanner *scanner = SidfPraScanner_new(NULL);
+    UNITTEST_CHECK(NULL != scanner);
+    Test_fixedCases(scanner, NULL);
+    Test_randomHeaders(scanner, NULL);
+    SidfPraScanner_free(scanner);
+
+    // MemArena に複製する場合. 小さなチャンクで何度も拡張させる
+    MemArena *arena = MemArena_new(64);
+    UNITTEST_CHECK(NULL != arena);
+    scanner = SidfPraScanner_new(arena);
+    UNITTEST_CHECK(NULL != scanner);
+    Test_fixedCases(scanner, arena);
+    Test_randomHeaders(scanner, arena);
+    SidfPraScanner_free(scanner);
+    MemArena_free(arena);
+    return UNITTEST_RESULT();
+}   // end function : main
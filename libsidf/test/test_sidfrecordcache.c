@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * SidfRecordCache のキーの正規化, スコープの区別, 有効期限と LRU による追い出しを確かめる.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "unittest.h"
+#include "dnsresolv.h"
+#include "sidf.h"
+#include "sidfpolicy.h"
+#include "sidfrequest.h"
+#include "sidfrecord.h"
+#include "sidfincludetree.h"
+#include "sidfrecordcache.h"
+
+static SidfPolicy *test_policy = NULL;
+static DnsResolver *test_resolver = NULL;
+static SidfRequest *test_request = NULL;
+
+static SidfRecord *
+Test_buildRecord(const char *record)
+{
+    SidfRecord *recordobj = NULL;
+    UNITTEST_CHECK(SIDF_STAT_OK ==
+                   SidfRecord_build(test_request, SIDF_RECORD_SCOPE_SPF1, record,
+                                    record + strlen(record), &recordobj));
+    return recordobj;
+}   // end function : Test_buildRecord
+
+/*
+ * ヒットするか調べ, ヒットした場合はそのレコードが expected であるかも確かめる.
+ */
+static bool
+Test_isCached(SidfRecordCache *cache, const char *domain, SidfRecordScope scope,
+              const SidfRecord *expected)
+{
+    unsigned long ttl = 0;
+    SidfRecord *record = SidfRecordCache_lookup(cache, domain, scope, &ttl);
+    if (NULL == record) {
+        return false;
+    }   // end if
+    UNITTEST_CHECK(expected == record);
+    UNITTEST_CHECK(0 < ttl);
+    SidfRecord_free(record);
+    return true;
+}   // end function : Test_isCached
+
+static void
+Test_lookup(void)
+{
+    SidfRecordCache *cache = SidfRecordCache_new(16);
+    UNITTEST_CHECK(NULL != cache);
+    SidfRecord *record = Test_buildRecord("ip4:192.0.2.0/24 -all");
+
+    SidfRecordCache_store(cache, "Example.COM.", SIDF_RECORD_SCOPE_SPF1, record, 300);
+    // キャッシュも参照を保持する
+    UNITTEST_CHECK(2 == record->refcount);
+    // 大文字小文字と末尾の '.' は区別しない
+    UNITTEST_CHECK(Test_isCached(cache, "example.com", SIDF_RECORD_SCOPE_SPF1, record));
+    UNITTEST_CHECK(Test_isCached(cache, "EXAMPLE.com.", SIDF_RECORD_SCOPE_SPF1, record));
+    // スコープ毎に別のエントリ
+    UNITTEST_CHECK(!Test_isCached(cache, "example.com", SIDF_RECORD_SCOPE_SPF2_MFROM, NULL));
+    UNITTEST_CHECK(!Test_isCached(cache, "example.net", SIDF_RECORD_SCOPE_SPF1, NULL));
+
+    unsigned long ttl = 0;
+    SidfRecord *hit = SidfRecordCache_lookup(cache, "example.com", SIDF_RECORD_SCOPE_SPF1, &ttl);
+    UNITTEST_CHECK(record == hit);
+    UNITTEST_CHECK(0 < ttl && ttl <= 300);
+    SidfRecord_free(hit);
+
+    // 同じキーで格納すると置き換わり, 古いレコードの参照は手放される
+    SidfRecord *newrecord = Test_buildRecord("ip4:198.51.100.0/24 -all");
+    SidfRecordCache_store(cache, "example.com", SIDF_RECORD_SCOPE_SPF1, newrecord, 300);
+    UNITTEST_CHECK(1 == record->refcount);
+    UNITTEST_CHECK(Test_isCached(cache, "example.com", SIDF_RECORD_SCOPE_SPF1, newrecord));
+
+    // TTL が 0 の場合は格納しない
+    SidfRecordCache_store(cache, "zero.example.com", SIDF_RECORD_SCOPE_SPF1, record, 0);
+    UNITTEST_CHECK(!Test_isCached(cache, "zero.example.com", SIDF_RECORD_SCOPE_SPF1, NULL));
+    UNITTEST_CHECK(1 == record->refcount);
+
+    SidfRecordCache_free(cache);
+    UNITTEST_CHECK(1 == newrecord->refcount);
+    SidfRecord_free(newrecord);
+    SidfRecord_free(record);
+}   // end function : Test_lookup
+
+static void
+Test_eviction(void)
+{
+    SidfRecordCache *cache = SidfRecordCache_new(3);
+    UNITTEST_CHECK(NULL != cache);
+    SidfRecord *record = Test_buildRecord("-all");
+    SidfRecordCache_store(cache, "a.example.com", SIDF_RECORD_SCOPE_SPF1, record, 300);
+    SidfRecordCache_store(cache, "b.example.com", SIDF_RECORD_SCOPE_SPF1, record, 300);
+    SidfRecordCache_store(cache, "c.example.com", SIDF_RECORD_SCOPE_SPF1, record, 300);
+    // 参照した a は最近使われたものになり, 次に追い出されるのは b
+    UNITTEST_CHECK(Test_isCached(cache, "a.example.com", SIDF_RECORD_SCOPE_SPF1, record));
+    SidfRecordCache_store(cache, "d.example.com", SIDF_RECORD_SCOPE_SPF1, record, 300);
+    UNITTEST_CHECK(Test_isCached(cache, "a.example.com", SIDF_RECORD_SCOPE_SPF1, record));
+    UNITTEST_CHECK(!Test_isCached(cache, "b.example.com", SIDF_RECORD_SCOPE_SPF1, NULL));
+    UNITTEST_CHECK(Test_isCached(cache, "c.example.com", SIDF_RECORD_SCOPE_SPF1, record));
+    UNITTEST_CHECK(Test_isCached(cache, "d.example.com", SIDF_RECORD_SCOPE_SPF1, record));
+    UNITTEST_CHECK(4 == record->refcount);
+
+    // 置き換えではエントリ数は増えないので, 何も追い出されない
+    SidfRecordCache_store(cache, "d.example.com", SIDF_RECORD_SCOPE_SPF1, record, 300);
+    UNITTEST_CHECK(Test_isCached(cache, "a.example.com", SIDF_RECORD_SCOPE_SPF1, record));
+    UNITTEST_CHECK(Test_isCached(cache, "c.example.com", SIDF_RECORD_SCOPE_SPF1, record));
+    UNITTEST_CHECK(4 == record->refcount);
+
+    SidfRecordCache_free(cache);
+    UNITTEST_CHECK(1 == record->refcount);
+    SidfRecord_free(record);
+
+    // 上限が 0 の場合は何も格納しない
+    cache = SidfRecordCache_new(0);
+    UNITTEST_CHECK(NULL != cache);
+    record = Test_buildRecord("-all");
+    SidfRecordCache_store(cache, "a.example.com", SIDF_RECORD_SCOPE_SPF1, record, 300);
+    UNITTEST_CHECK(!Test_isCached(cache, "a.example.com", SIDF_RECORD_SCOPE_SPF1, NULL));
+    SidfRecordCache_free(cache);
+    SidfRecord_free(record);
+}   // end function : Test_eviction
+
+/*
+ * 有効期限は秒単位なので, 期限切れを確かめるには 2 秒待つ.
+ */
+static void
+Test_expiry(void)
+{
+    SidfRecordCache *cache = SidfRecordCache_new(16);
+    UNITTEST_CHECK(NULL != cache);
+    SidfRecord *record = Test_buildRecord("include:_spf.example.net -all");
+    SidfRecordCache_store(cache, "short.example.com", SIDF_RECORD_SCOPE_SPF1, record, 1);
+    SidfRecordCache_store(cache, "long.example.com", SIDF_RECORD_SCOPE_SPF1, record, 300);
+
+    // 根のレコードのエントリがない場合, 木は格納されない
+    SidfIncludeTree *tree = SidfIncludeTree_new();
+    UNITTEST_CHECK(NULL != tree);
+    UNITTEST_CHECK(NULL != SidfIncludeTree_addNode(tree, "long.example.com", record));
+    tree->ttl = 1;
+    SidfRecordCache_storeTree(cache, "none.example.com", SIDF_RECORD_SCOPE_SPF1, tree);
+    UNITTEST_CHECK(NULL ==
+                   SidfRecordCache_lookupTree(cache, "none.example.com", SIDF_RECORD_SCOPE_SPF1,
+                                              NULL));
+    SidfRecordCache_storeTree(cache, "long.example.com", SIDF_RECORD_SCOPE_SPF1, tree);
+    SidfIncludeTree *hit =
+        SidfRecordCache_lookupTree(cache, "long.example.com", SIDF_RECORD_SCOPE_SPF1, NULL);
+    UNITTEST_CHECK(tree == hit);
+    if (NULL != hit) {
+        SidfIncludeTree_free(hit);
+    }   // end if
+
+    sleep(2);
+
+    UNITTEST_CHECK(!Test_isCached(cache, "short.example.com", SIDF_RECORD_SCOPE_SPF1, NULL));
+    // 木の期限が切れても, 根のレコードは自身の期限まで残る
+    UNITTEST_CHECK(NULL ==
+                   SidfRecordCache_lookupTree(cache, "long.example.com", SIDF_RECORD_SCOPE_SPF1,
+                                              NULL));
+    UNITTEST_CHECK(Test_isCached(cache, "long.example.com", SIDF_RECORD_SCOPE_SPF1, record));
+
+    SidfRecordCache_free(cache);
+    SidfIncludeTree_free(tree);
+    SidfRecord_free(record);
+}   // end function : Test_expiry
+
+int
+main(void)
+{
+    test_policy = SidfPolicy_new();
+    test_resolver = DnsResolver_new();
+    UNITTEST_CHECK(NULL != test_policy && NULL != test_resolver);
+    test_request = SidfRequest_new(test_policy, test_resolver);
+    UNITTEST_CHECK(NULL != test_request);
+
+    Test_lookup();
+    Test_eviction();
+    Test_expiry();
+
+    SidfRequest_free(test_request);
+    DnsResolver_free(test_resolver);
+    SidfPolicy_free(test_policy);
+    return UNITTEST_RESULT();
+}   // end function : main
@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * SidfRequest_start() / SidfRequest_resume() による中断可能な評価が,
+ * SidfRequest_eval() による同期的な評価と同じ結果になることを確かめる.
+ * 一時的な DNS エラーを無視して得た評価結果をキャッシュしないことも確かめる.
+ * DNS の応答はネットワークに問い合わせずに, 下の zone から組み立てる.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <resolv.h>
+
+#include "unittest.h"
+#include "strlcpy.h"
+#include "inetmailbox.h"
+#include "dnsresolv.h"
+#include "dnscache.h"
+#include "sidf.h"
+#include "sidfenum.h"
+#include "sidfpolicy.h"
+#include "sidfrequest.h"
+#include "sidfresultcache.h"
+
+#define TEST_TTL 300
+#define TEST_QUERY_MAXNUM 256
+
+typedef struct ZoneEntry {
+    const char *domain;
+    int rrtype;
+    const char *data;           // MX は "preference exchange"
+} ZoneEntry;
+
+static const ZoneEntry zone[] = {
+    {"example.com", ns_t_txt,
+     "v=spf1 ip4:192.0.2.0/24 include:_spf.example.net mx a:mail.example.com -all"},
+    {"example.com", ns_t_mx, "10 mx1.example.com"},
+    {"example.com", ns_t_mx, "20 mx2.example.com"},
+    {"_spf.example.net", ns_t_txt,
+     "v=spf1 ip4:198.51.100.0/24 ip6:2001:db8::/32 include:_spf2.example.net ~all"},
+    {"_spf2.example.net", ns_t_txt, "v=spf1 ip4:203.0.113.5 ?all"},
+    {"mx1.example.com", ns_t_a, "10.0.0.1"},
+    {"mx1.example.com", ns_t_aaaa, "2001:db8:1::1"},
+    {"mx2.example.com", ns_t_a, "10.0.0.2"},
+    {"mail.example.com", ns_t_a, "10.0.0.3"},
+    {"macro.example.org", ns_t_txt, "v=spf1 exists:%{i}._ip.example.org redirect=example.com"},
+    {"10.0.0.9._ip.example.org", ns_t_a, "127.0.0.2"},
+    {"ptr.example.org", ns_t_txt, "v=spf1 ptr -all"},
+    {"9.0.0.10.in-addr.arpa", ns_t_ptr, "host.ptr.example.org"},
+    {"host.ptr.example.org", ns_t_a, "10.0.0.9"},
+    {"ptrfail.example.org", ns_t_txt, "v=spf1 ptr -all"},
+    {"8.0.0.10.in-addr.arpa", ns_t_ptr, "host.ptrfail.example.org"},
+    {"host.ptrfail.example.org", ns_t_a, "10.0.0.8"},
+    {"redir.example.org", ns_t_txt, "v=spf1 redirect=_spf.example.net"},
+    {"loop.example.org", ns_t_txt, "v=spf1 include:loop2.example.org -all"},
+    {"loop2.example.org", ns_t_txt, "v=spf1 include:loop.example.org ?all"},
+    {"incnx.example.org", ns_t_txt, "v=spf1 include:nothere.example.org -all"},
+    {"cidr.example.org", ns_t_txt, "v=spf1 a:mail.example.com/24 mx:example.com/16 -all"},
+    {"syntax.example.org", ns_t_txt, "v=spf1 foo:bar -all"},
+    {"sidf.example.org", ns_t_txt, "spf2.0/mfrom,pra ip4:10.0.0.0/8 -all"},
+};
+
+typedef struct TestCase {
+    const char *sender_domain;
+    int af;
+    const char *ipaddr;
+    SidfRecordScope scope;
+    SidfScore expected;
+} TestCase;
+
+static const TestCase testcase[] = {
+    {"example.com", AF_INET, "192.0.2.1", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"example.com", AF_INET, "198.51.100.7", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"example.com", AF_INET, "203.0.113.5", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"example.com", AF_INET, "10.0.0.2", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"example.com", AF_INET, "10.0.0.3", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"example.com", AF_INET, "172.16.0.1", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_HARDFAIL},
+    {"example.com", AF_INET6, "2001:db8:1::1", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"macro.example.org", AF_INET, "10.0.0.9", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"macro.example.org", AF_INET, "10.0.0.1", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"ptr.example.org", AF_INET, "10.0.0.9", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"redir.example.org", AF_INET, "198.51.100.1", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"loop.example.org", AF_INET, "10.0.0.1", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PERMERROR},
+    {"incnx.example.org", AF_INET, "10.0.0.1", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PERMERROR},
+    {"cidr.example.org", AF_INET, "10.0.0.200", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS},
+    {"syntax.example.org", AF_INET, "10.0.0.1", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PERMERROR},
+    {"nothere.example.org", AF_INET, "10.0.0.1", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_NONE},
+    {"sidf.example.org", AF_INET, "10.0.0.1", SIDF_RECORD_SCOPE_SPF2_MFROM, SIDF_SCORE_PASS},
+};
+
+// 中断可能な評価の途中で問い合わせのあったもの. 同期的な評価の前にキャッシュに載せる.
+typedef struct Query {
+    char domain[NS_MAXDNAME];
+    int rrtype;
+} Query;
+
+static Query queried[TEST_QUERY_MAXNUM];
+static size_t queried_num = 0;
+
+static bool
+Test_isSameName(const char *name1, const char *name2)
+{
+    size_t len1 = strlen(name1);
+    size_t len2 = strlen(name2);
+    if (0 < len1 && '.' == name1[len1 - 1]) {
+        --len1;
+    }   // end if
+    if (0 < len2 && '.' == name2[len2 - 1]) {
+        --len2;
+    }   // end if
+    return len1 == len2 && 0 == strncasecmp(name1, name2, len1);
+}   // end function : Test_isSameName
+
+static unsigned char *
+Test_putName(const char *name, unsigned char *p, const unsigned char *tail,
+             const unsigned char **dnptrs, const unsigned char **lastdnptr)
+{
+    int len = dn_comp(name, p, (int) (tail - p), (unsigned char **) dnptrs,
+                      (unsigned char **) lastdnptr);
+    return (0 > len) ? NULL : p + len;
+}   // end function : Test_putName
+
+/*
+ * domain, rrtype の問い合わせに対する応答メッセージを zone から組み立てる.
+ * 該当するものがなければ, ドメイン名があれば NODATA, なければ NXDOMAIN を SOA 付きで返す.
+ */
+static int
+Test_buildResponse(const char *domain, int rrtype, unsigned char *buf, size_t buflen)
+{
+    int msglen = res_mkquery(ns_o_query, domain, ns_c_in, rrtype, NULL, 0, NULL, buf, buflen);
+    if (0 > msglen) {
+        return -1;
+    }   // end if
+    HEADER *header = (HEADER *) buf;
+    header->qr = 1;
+    header->aa = 1;
+    header->ra = 1;
+
+    const unsigned char *dnptrs[32] = { buf, NULL };
+    const unsigned char **lastdnptr = dnptrs + sizeof(dnptrs) / sizeof(dnptrs[0]);
+    unsigned char *p = buf + msglen;
+    const unsigned char *tail = buf + buflen;
+    unsigned int ancount = 0;
+    bool domain_exists = false;
+    for (size_t n = 0; n < sizeof(zone) / sizeof(zone[0]); ++n) {
+        if (!Test_isSameName(zone[n].domain, domain)) {
+            continue;
+        }   // end if
+        domain_exists = true;
+        if (zone[n].rrtype != rrtype) {
+            continue;
+        }   // end if
+        p = Test_putName(domain, p, tail, dnptrs, lastdnptr);
+        if (NULL == p || tail < p + 10) {
+            return -1;
+        }   // end if
+        ns_put16(rrtype, p);
+        ns_put16(ns_c_in, p + 2);
+        ns_put32(TEST_TTL, p + 4);
+        unsigned char *rdlen = p + 8;
+        p += 10;
+        switch (rrtype) {
+        case ns_t_a:
+            if (tail < p + NS_INADDRSZ || 1 != inet_pton(AF_INET, zone[n].data, p)) {
+                return -1;
+            }   // end if
+            p += NS_INADDRSZ;
+            break;
+        case ns_t_aaaa:
+            if (tail < p + NS_IN6ADDRSZ || 1 != inet_pton(AF_INET6, zone[n].data, p)) {
+                return -1;
+            }   // end if
+            p += NS_IN6ADDRSZ;
+            break;
+        case ns_t_txt:;
+            size_t datalen = strlen(zone[n].data);
+            if (255 < datalen || tail < p + 1 + datalen) {
+                return -1;
+            }   // end if
+            *p = (unsigned char) datalen;
+            memcpy(p + 1, zone[n].data, datalen);
+            p += 1 + datalen;
+            break;
+        case ns_t_mx:
+            if (tail < p + NS_INT16SZ) {
+                return -1;
+            }   // end if
+            ns_put16((unsigned int) strtoul(zone[n].data, NULL, 10), p);
+            p = Test_putName(strchr(zone[n].data, ' ') + 1, p + NS_INT16SZ, tail, dnptrs,
+                             lastdnptr);
+            break;
+        case ns_t_ptr:
+            p = Test_putName(zone[n].data, p, tail, dnptrs, lastdnptr);
+            break;
+        default:
+            return -1;
+        }   // end switch
+        if (NULL == p) {
+            return -1;
+        }   // end if
+        ns_put16((unsigned int) (p - rdlen - NS_INT16SZ), rdlen);
+        ++ancount;
+    }   // end for
+
+    header->ancount = htons(ancount);
+    if (0 == ancount) {
+        // 否定応答には SOA を付ける
+        if (!domain_exists) {
+            header->rcode = ns_r_nxdomain;
+        }   // end if
+        p = Test_putName("example.org", p, tail, dnptrs, lastdnptr);
+        if (NULL == p || tail < p + 10) {
+            return -1;
+        }   // end if
+        ns_put16(ns_t_soa, p);
+        ns_put16(ns_c_in, p + 2);
+        ns_put32(TEST_TTL, p + 4);
+        unsigned char *rdlen = p + 8;
+        p = Test_putName("ns.example.org", p + 10, tail, dnptrs, lastdnptr);
+        if (NULL != p) {
+            p = Test_putName("root.example.org", p, tail, dnptrs, lastdnptr);
+        }   // end if
+        if (NULL == p || tail < p + 5 * NS_INT32SZ) {
+            return -1;
+        }   // end if
+        ns_put32(1, p);
+        ns_put32(3600, p + 4);
+        ns_put32(600, p + 8);
+        ns_put32(86400, p + 12);
+        ns_put32(TEST_TTL, p + 16);
+        p += 5 * NS_INT32SZ;
+        ns_put16((unsigned int) (p - rdlen - NS_INT16SZ), rdlen);
+        header->nscount = htons(1);
+    }   // end if
+    return (int) (p - buf);
+}   // end function : Test_buildResponse
+
+static void
+Test_recordQuery(const char *domain, int rrtype)
+{
+    for (size_t n = 0; n < queried_num; ++n) {
+        if (queried[n].rrtype == rrtype && Test_isSameName(queried[n].domain, domain)) {
+            return;
+        }   // end if
+    }   // end for
+    if (queried_num < TEST_QUERY_MAXNUM) {
+        strlcpy(queried[queried_num].domain, domain, sizeof(queried[queried_num].domain));
+        queried[queried_num].rrtype = rrtype;
+        ++queried_num;
+    }   // end if
+}   // end function : Test_recordQuery
+
+static SidfRequest *
+Test_buildRequest(const SidfPolicy *policy, DnsResolver *resolver, const TestCase *tc)
+{
+    SidfRequest *request = SidfRequest_new(policy, resolver);
+    UNITTEST_CHECK(NULL != request);
+    InetMailbox *sender = InetMailbox_build("user", tc->sender_domain);
+    UNITTEST_CHECK(NULL != sender);
+    UNITTEST_CHECK(SidfRequest_setSender(request, sender));
+    UNITTEST_CHECK(SidfRequest_setHeloDomain(request, "mail.example.jp"));
+    UNITTEST_CHECK(SidfRequest_setIpAddrString(request, tc->af, tc->ipaddr));
+    InetMailbox_free(sender);
+    return request;
+}   // end function : Test_buildRequest
+
+/*
+ * 遅延モードのリゾルバで評価を中断させ, 応答待ちの問い合わせに zone から応答を与えて再開する.
+ */
+static SidfScore
+Test_evalDeferred(const SidfPolicy *policy, const TestCase *tc, unsigned long *pending_num)
+{
+    DnsResolver *resolver = DnsResolver_new();
+    UNITTEST_CHECK(NULL != resolver);
+    DnsResolver_setDeferred(resolver, true);
+    SidfRequest *request = Test_buildRequest(policy, resolver, tc);
+
+    *pending_num = 0;
+    SidfScore score = SIDF_SCORE_NULL;
+    SidfStat stat = SidfRequest_start(request, tc->scope, &score);
+    while (SIDF_STAT_DNS_PENDING == stat) {
+        ++(*pending_num);
+        const char *pending_domain;
+        int pending_rrtype;
+        bool fed = false;
+        while (DnsResolver_takePendingQuery(resolver, &pending_domain, &pending_rrtype)) {
+            char domain[NS_MAXDNAME];
+            strlcpy(domain, pending_domain, sizeof(domain));
+            unsigned char msg[NS_PACKETSZ];
+            int msglen = Test_buildResponse(domain, pending_rrtype, msg, sizeof(msg));
+            UNITTEST_CHECK(0 < msglen);
+            UNITTEST_CHECK(NETDB_SUCCESS ==
+                           DnsResolver_feedAnswer(resolver, domain, pending_rrtype,
+                                                  NETDB_SUCCESS, msg, msglen));
+            Test_recordQuery(domain, pending_rrtype);
+            fed = true;
+        }   // end while
+        UNITTEST_CHECK(fed);
+        if (!fed) {
+            break;
+        }   // end if
+        stat = SidfRequest_resume(request, &score);
+    }   // end while
+    UNITTEST_CHECK(SIDF_STAT_OK == stat);
+
+    SidfRequest_free(request);
+    DnsResolver_free(resolver);
+    return score;
+}   // end function : Test_evalDeferred
+
+/*
+ * 中断可能な評価で問い合わせのあった応答を全てキャッシュに載せ, SidfRequest_eval() で評価する.
+ * キャッシュにない問い合わせが生じた場合は結果が食い違うように, ネットワークには問い合わせない.
+ */
+static SidfScore
+Test_evalSync(const SidfPolicy *policy, const TestCase *tc)
+{
+    DnsCache *cache = DnsCache_new(1024 * 1024);
+    UNITTEST_CHECK(NULL != cache);
+    for (size_t n = 0; n < queried_num; ++n) {
+        unsigned char msg[NS_PACKETSZ];
+        int msglen = Test_buildResponse(queried[n].domain, queried[n].rrtype, msg, sizeof(msg));
+        UNITTEST_CHECK(0 < msglen);
+        DnsCache_store(cache, queried[n].domain, queried[n].rrtype, msg, msglen, TEST_TTL);
+    }   // end for
+    DnsResolver *resolver = DnsResolver_new();
+    UNITTEST_CHECK(NULL != resolver);
+    resolver->resolver.nscount = 0;
+    DnsResolver_setCache(resolver, cache);
+    SidfRequest *request = Test_buildRequest(policy, resolver, tc);
+
+    SidfScore score = SidfRequest_eval(request, tc->scope);
+
+    SidfRequest_free(request);
+    DnsResolver_free(resolver);
+    DnsCache_free(cache);
+    return score;
+}   // end function : Test_evalSync
+
+/*
+ * 遅延モードのリゾルバで評価し, fail_domain の問い合わせだけを fail_stat で失敗させる.
+ * NO_RECOVERY の場合は, 応答としては成功しているが問い合わせた RR を含まないものを与える.
+ * 評価結果が result_cache に格納されたかを返す.
+ */
+static bool
+Test_evalWithFailure(SidfPolicy *policy, const TestCase *tc, const char *fail_domain,
+                     int fail_stat, SidfScore *score)
+{
+    SidfResultCache *result_cache = SidfResultCache_new(16);
+    UNITTEST_CHECK(NULL != result_cache);
+    policy->result_cache = result_cache;
+    DnsResolver *resolver = DnsResolver_new();
+    UNITTEST_CHECK(NULL != resolver);
+    DnsResolver_setDeferred(resolver, true);
+    SidfRequest *request = Test_buildRequest(policy, resolver, tc);
+
+    *score = SIDF_SCORE_NULL;
+    SidfStat stat = SidfRequest_start(request, tc->scope, score);
+    while (SIDF_STAT_DNS_PENDING == stat) {
+        const char *pending_domain;
+        int pending_rrtype;
+        while (DnsResolver_takePendingQuery(resolver, &pending_domain, &pending_rrtype)) {
+            char domain[NS_MAXDNAME];
+            strlcpy(domain, pending_domain, sizeof(domain));
+            if (Test_isSameName(fail_domain, domain) && TRY_AGAIN == fail_stat) {
+                (void) DnsResolver_feedAnswer(resolver, domain, pending_rrtype, TRY_AGAIN,
+                                              NULL, 0);
+                continue;
+            }   // end if
+            unsigned char msg[NS_PACKETSZ];
+            int msglen = Test_isSameName(fail_domain, domain)
+                ? Test_buildResponse(tc->sender_domain, ns_t_txt, msg, sizeof(msg))
+                : Test_buildResponse(domain, pending_rrtype, msg, sizeof(msg));
+            UNITTEST_CHECK(0 < msglen);
+            (void) DnsResolver_feedAnswer(resolver, domain, pending_rrtype, NETDB_SUCCESS, msg,
+                                          msglen);
+        }   // end while
+        stat = SidfRequest_resume(request, score);
+    }   // end while
+    UNITTEST_CHECK(SIDF_STAT_OK == stat);
+
+    struct in_addr addr;
+    UNITTEST_CHECK(1 == inet_pton(AF_INET, tc->ipaddr, &addr));
+    SidfScore cached_score;
+    char *explanation = NULL;
+    bool cached = SidfResultCache_lookup(result_cache, tc->scope, AF_INET, &addr,
+                                         tc->sender_domain, "mail.example.jp", &cached_score,
+                                         &explanation);
+    free(explanation);
+
+    SidfRequest_free(request);
+    DnsResolver_free(resolver);
+    policy->result_cache = NULL;
+    SidfResultCache_free(result_cache);
+    return cached;
+}   // end function : Test_evalWithFailure
+
+/*
+ * "ptr" メカニズムの検証で A RR の問い合わせが一時的に失敗した場合,
+ * そのドメイン名は飛ばして評価を続けるが, 結果はキャッシュしない.
+ */
+static void
+Test_transientFailure(SidfPolicy *policy)
+{
+    const TestCase pass_case =
+        { "ptrfail.example.org", AF_INET, "10.0.0.8", SIDF_RECORD_SCOPE_SPF1, SIDF_SCORE_PASS };
+    SidfScore score;
+    // 失敗しなければキャッシュされる
+    UNITTEST_CHECK(Test_evalWithFailure(policy, &pass_case, "nothere.example.org", TRY_AGAIN,
+                                        &score));
+    UNITTEST_CHECK(SIDF_SCORE_PASS == score);
+    // 検証できなかったので -all にマッチするが, キャッシュはされない
+    const int fail_stat[] = { TRY_AGAIN, NO_RECOVERY };
+    for (size_t n = 0; n < sizeof(fail_stat) / sizeof(fail_stat[0]); ++n) {
+        UNITTEST_CHECK(!Test_evalWithFailure(policy, &pass_case, "host.ptrfail.example.org",
+                                             fail_stat[n], &score));
+        UNITTEST_CHECK(SIDF_SCORE_HARDFAIL == score);
+    }   // end for
+}   // end function : Test_transientFailure
+
+int
+main(void)
+{
+    SidfPolicy *policy = SidfPolicy_new();
+    UNITTEST_CHECK(NULL != policy);
+    UNITTEST_CHECK(SIDF_STAT_OK == SidfPolicy_setCheckingDomain(policy, "mx.example.jp"));
+
+    // 先読みしない場合と, 後続の directive をまとめて問い合わせる場合の両方を確かめる
+    const unsigned int prefetch[] = { 0, 4 };
+    for (size_t i = 0; i < sizeof(prefetch) / sizeof(prefetch[0]); ++i) {
+        policy->prefetch_directives = prefetch[i];
+        for (size_t n = 0; n < sizeof(testcase) / sizeof(testcase[0]); ++n) {
+            const TestCase *tc = &testcase[n];
+            queried_num = 0;
+            unsigned long pending_num;
+            SidfScore deferred_score = Test_evalDeferred(policy, tc, &pending_num);
+            SidfScore sync_score = Test_evalSync(policy, tc);
+            if (deferred_score != sync_score || tc->expected != sync_score || 0 == pending_num) {
+                fprintf(stderr, "mismatch: domain=%s, ip=%s, prefetch=%u, "
+                        "deferred=%s, sync=%s, pending=%lu\n", tc->sender_domain, tc->ipaddr,
+                        prefetch[i], SidfEnum_lookupScoreByValue(deferred_score),
+                        SidfEnum_lookupScoreByValue(sync_score), pending_num);
+            }   // end if
+            UNITTEST_CHECK(deferred_score == sync_score);
+            UNITTEST_CHECK(tc->expected == sync_score);
+            UNITTEST_CHECK(0 < pending_num);
+        }   // end for
+    }   // end for
+
+    Test_transientFailure(policy);
+
+    SidfPolicy_free(policy);
+    return UNITTEST_RESULT();
+}   // end function : main
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * SidfResultCache のキーの区別, explanation の複製, 有効期限と LRU による追い出しを確かめる.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "unittest.h"
+#include "sidf.h"
+#include "sidfresultcache.h"
+
+static struct in_addr test_addr4;
+static struct in6_addr test_addr6;
+
+/*
+ * ヒットするか調べ, ヒットした場合はスコアと explanation が期待通りかも確かめる.
+ */
+static bool
+Test_isCached(SidfResultCache *cache, SidfRecordScope scope, int af, const void *addr,
+              const char *domain, const char *helo, SidfScore expected_score,
+              const char *expected_explanation)
+{
+    SidfScore score = SIDF_SCORE_NULL;
+    char *explanation = NULL;
+    if (!SidfResultCache_lookup(cache, scope, af, addr, domain, helo, &score, &explanation)) {
+        return false;
+    }   // end if
+    UNITTEST_CHECK(expected_score == score);
+    if (NULL == expected_explanation) {
+        UNITTEST_CHECK(NULL == explanation);
+    } else {
+        UNITTEST_CHECK(NULL != explanation && 0 == strcmp(expected_explanation, explanation));
+    }   // end if
+    free(explanation);
+    return true;
+}   // end function : Test_isCached
+
+static void
+Test_lookup(void)
+{
+    SidfResultCache *cache = SidfResultCache_new(16);
+    UNITTEST_CHECK(NULL != cache);
+
+    char explanation[] = "see http://example.com/why";
+    SidfResultCache_store(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4, "example.com",
+                          "mx.example.com", SIDF_SCORE_HARDFAIL, explanation, 300);
+    // キャッシュは explanation の複製を保持する
+    explanation[0] = 'X';
+    UNITTEST_CHECK(Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                 "example.com", "mx.example.com", SIDF_SCORE_HARDFAIL,
+                                 "see http://example.com/why"));
+
+    // キーのどの要素が異なってもヒットしない
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF2_MFROM, AF_INET, &test_addr4,
+                                  "example.com", "mx.example.com", SIDF_SCORE_NULL, NULL));
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET6, &test_addr6,
+                                  "example.com", "mx.example.com", SIDF_SCORE_NULL, NULL));
+    struct in_addr other_addr4;
+    UNITTEST_CHECK(1 == inet_pton(AF_INET, "192.0.2.2", &other_addr4));
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &other_addr4,
+                                  "example.com", "mx.example.com", SIDF_SCORE_NULL, NULL));
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                  "example.net", "mx.example.com", SIDF_SCORE_NULL, NULL));
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                  "example.com", "mx2.example.com", SIDF_SCORE_NULL, NULL));
+    // explanation の展開結果が変わり得るので, 大文字小文字も区別する
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                  "Example.com", "mx.example.com", SIDF_SCORE_NULL, NULL));
+    // HELO で評価した場合 (送信者のドメインなし) とは区別する
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4, NULL,
+                                  "mx.example.com", SIDF_SCORE_NULL, NULL));
+
+    // explanation なし, 送信者のドメインなし
+    SidfResultCache_store(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET6, &test_addr6, NULL,
+                          "mx.example.com", SIDF_SCORE_PASS, NULL, 300);
+    UNITTEST_CHECK(Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET6, &test_addr6, NULL,
+                                 "mx.example.com", SIDF_SCORE_PASS, NULL));
+
+    // 同じキーで格納すると置き換わる
+    SidfResultCache_store(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4, "example.com",
+                          "mx.example.com", SIDF_SCORE_SOFTFAIL, NULL, 300);
+    UNITTEST_CHECK(Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                 "example.com", "mx.example.com", SIDF_SCORE_SOFTFAIL, NULL));
+
+    // TTL が 0 の場合は格納しない
+    SidfResultCache_store(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &other_addr4, "example.com",
+                          "mx.example.com", SIDF_SCORE_PASS, NULL, 0);
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &other_addr4,
+                                  "example.com", "mx.example.com", SIDF_SCORE_NULL, NULL));
+    SidfResultCache_free(cache);
+}   // end function : Test_lookup
+
+static void
+Test_eviction(void)
+{
+    static const char *domains[] = {
+        "a.example.com", "b.example.com", "c.example.com", "d.example.com",
+    };
+    SidfResultCache *cache = SidfResultCache_new(3);
+    UNITTEST_CHECK(NULL != cache);
+    for (size_t n = 0; n < 3; ++n) {
+        SidfResultCache_store(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4, domains[n],
+                              "mx.example.com", SIDF_SCORE_PASS, domains[n], 300);
+    }   // end for
+    // 参照した a は最近使われたものになり, 次に追い出されるのは b
+    UNITTEST_CHECK(Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                 domains[0], "mx.example.com", SIDF_SCORE_PASS, domains[0]));
+    SidfResultCache_store(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4, domains[3],
+                          "mx.example.com", SIDF_SCORE_PASS, domains[3], 300);
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                  domains[1], "mx.example.com", SIDF_SCORE_NULL, NULL));
+    for (size_t n = 0; n < 4; ++n) {
+        if (1 != n) {
+            UNITTEST_CHECK(Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                         domains[n], "mx.example.com", SIDF_SCORE_PASS,
+                                         domains[n]));
+        }   // end if
+    }   // end for
+    SidfResultCache_free(cache);
+
+    // 上限が 0 の場合は何も格納しない
+    cache = SidfResultCache_new(0);
+    UNITTEST_CHECK(NULL != cache);
+    SidfResultCache_store(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4, domains[0],
+                          "mx.example.com", SIDF_SCORE_PASS, NULL, 300);
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                  domains[0], "mx.example.com", SIDF_SCORE_NULL, NULL));
+    SidfResultCache_free(cache);
+}   // end function : Test_eviction
+
+/*
+ * 有効期限は秒単位なので, 期限切れを確かめるには 2 秒待つ.
+ */
+static void
+Test_expiry(void)
+{
+    SidfResultCache *cache = SidfResultCache_new(16);
+    UNITTEST_CHECK(NULL != cache);
+    SidfResultCache_store(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                          "short.example.com", "mx.example.com", SIDF_SCORE_PASS, NULL, 1);
+    SidfResultCache_store(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                          "long.example.com", "mx.example.com", SIDF_SCORE_HARDFAIL, "long", 300);
+    sleep(2);
+    UNITTEST_CHECK(!Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                  "short.example.com", "mx.example.com", SIDF_SCORE_NULL,
+                                  NULL));
+    UNITTEST_CHECK(Test_isCached(cache, SIDF_RECORD_SCOPE_SPF1, AF_INET, &test_addr4,
+                                 "long.example.com", "mx.example.com", SIDF_SCORE_HARDFAIL,
+                                 "long"));
+    SidfResultCache_free(cache);
+}   // end function : Test_expiry
+
+int
+main(void)
+{
+    UNITTEST_CHECK(1 == inet_pton(AF_INET, "192.0.2.1", &test_addr4));
+    UNITTEST_CHECK(1 == inet_pton(AF_INET6, "2001:db8::1", &test_addr6));
+    Test_lookup();
+    Test_eviction();
+    Test_expiry();
+    return UNITTEST_RESULT();
+}   // end function : main
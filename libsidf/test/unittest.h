@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2008 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * libsidf のテストプログラムが共通に使う検査用のマクロ.
+ * 検査に失敗しても中断せずに続け, main() の最後に UNITTEST_RESULT() で終了ステータスを返す.
+ */
+
+#ifndef __UNITTEST_H__
+#define __UNITTEST_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned int unittest_failure_num = 0;
+
+#define UNITTEST_CHECK(expr) \
+	do { \
+		if (!(expr)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+			++unittest_failure_num; \
+		} \
+	} while (0)
+
+#define UNITTEST_RESULT() \
+	((0 == unittest_failure_num) ? EXIT_SUCCESS : EXIT_FAILURE)
+
+#endif /* __UNITTEST_H__ */